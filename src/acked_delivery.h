@@ -0,0 +1,260 @@
+#ifndef _ACKED_DELIVERY_H_
+#define _ACKED_DELIVERY_H_
+
+#include <stdio.h>
+#include <string.h>
+#include "hal.h"
+#include "config.h"
+#include "binary_payload.h"
+
+/**
+ * @brief The acknowledged delivery protocol between a node and the base station.
+ *
+ * The "+OK" after AT+SEND only means the packet left the radio. With acked delivery,
+ * the data of each AT+SEND is one or more segments:
+ *
+ *   '^'  seq (2 hex digits)  length of data (2 hex digits)  data (text or binary payload)
+ *
+ *   "^0719Garden%FL-SW%0.0%33%15%5^0819Garden%Wtr lvl%16.2%0%1%1"
+ *
+ * and the base station answers every packet it receives with an AT+SEND back to the node,
+ * listing the sequence numbers it got: "!0708". The node listens for it for
+ * LORA_ACK_WINDOW_MS after the +OK.
+ *
+ * Segments with an auto-fill / float switch event or an alarm in them are kept in RTC
+ * memory until they're acked, and go out again - piggybacked on the next packet, or on
+ * their own if nothing else is being sent - with a backoff that doubles after each try.
+ * Plain readings aren't kept: the next reading replaces them anyway.
+ */
+
+const char kSegmentMarker = '^';
+const char kAckMarker = '!';
+const uint8_t kSegmentHeaderBytes = 5;     // '^', seq, length
+const uint8_t kRetransmitQueueLength = 4;
+const uint8_t kMaxRetainedSegmentBytes = 64; // longest segment data that can be kept for retransmitting
+const uint8_t kMaxRetransmits = 8;         // tries after the first, before a segment is dropped
+const uint8_t kMaxSegmentsPerPacket = kRetransmitQueueLength + 2;
+
+// One unacked segment, waiting to be sent again
+struct PendingSegment {
+  uint8_t seq;
+  uint8_t length;
+  uint8_t retransmits;
+  uint32_t retry_at_s;  // hal::rtc_seconds() when it's due
+  uint8_t data[kMaxRetainedSegmentBytes];
+};
+
+struct RetransmitQueue {
+  PendingSegment segments[kRetransmitQueueLength];
+  uint8_t count;
+  uint8_t next_seq;
+  uint32_t acked;          // segments acked by the base station, since power on
+  uint32_t retransmitted;  // segments sent again
+  uint32_t dropped;        // segments given up on (kMaxRetransmits, or the queue was full)
+};
+
+/**
+ * @brief The unacked segments, kept in RTC memory so they survive deep sleep.
+ * A power-on or reset loses them.
+ */
+
+RTC_DATA_ATTR static RetransmitQueue retransmit_queue;
+
+/**
+ * @brief AckedDelivery builds the segments of each packet, matches the base station's
+ * acks to them, and keeps the retransmit queue.
+ *
+ * For each packet: begin_packet() (which piggybacks any segments that are due), then
+ * add_segment() for the new data, send packet() / length(), pass every "+RCV=" line that
+ * arrives to handle_receive() until all_acked() or the receive window closes, then
+ * end_packet().
+ */
+
+class AckedDelivery {
+private:
+    RetransmitQueue& queue_;
+    uint8_t packet_[kMaxLoRaPayloadBytes];
+    uint8_t length_ = 0;
+    uint8_t escaped_length_ = 0;                // on air (see escape_payload())
+    // The segments in packet_
+    uint8_t seq_[kMaxSegmentsPerPacket];
+    int8_t queue_index_[kMaxSegmentsPerPacket]; // index in queue_, or -1 for a new segment
+    bool retain_[kMaxSegmentsPerPacket];        // keep a new segment until it's acked
+    uint8_t offset_[kMaxSegmentsPerPacket];     // where its data starts in packet_
+    bool acked_[kMaxSegmentsPerPacket];
+    uint8_t segments_ = 0;
+
+    static uint32_t backoff_s(uint8_t retransmits) {
+        uint32_t backoff = LORA_RETRY_BACKOFF_SECONDS;
+        for (uint8_t i = 0; i < retransmits && backoff < LORA_RETRY_MAX_BACKOFF_SECONDS; i++) {
+            backoff *= 2;
+        }
+        return backoff < LORA_RETRY_MAX_BACKOFF_SECONDS ? backoff : LORA_RETRY_MAX_BACKOFF_SECONDS;
+    }
+
+    static int hex_value(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        return -1;
+    }
+
+    bool append(uint8_t seq, const uint8_t* data, uint8_t length, int8_t queue_index, bool retain) {
+        size_t escaped = kSegmentHeaderBytes + escaped_payload_length(data, length); // (the header is all text)
+        if (segments_ == kMaxSegmentsPerPacket || escaped_length_ + escaped > kMaxLoRaPayloadBytes) {
+            return false;
+        }
+        escaped_length_ += escaped;
+        const char* kHex = "0123456789ABCDEF";
+        packet_[length_++] = kSegmentMarker;
+        packet_[length_++] = kHex[seq >> 4];
+        packet_[length_++] = kHex[seq & 0x0F];
+        packet_[length_++] = kHex[length >> 4];
+        packet_[length_++] = kHex[length & 0x0F];
+        seq_[segments_] = seq;
+        queue_index_[segments_] = queue_index;
+        retain_[segments_] = retain;
+        offset_[segments_] = length_;
+        acked_[segments_] = false;
+        segments_++;
+        memcpy(&packet_[length_], data, length);
+        length_ += length;
+        return true;
+    }
+
+    void remove_from_queue(uint8_t index) {
+        queue_.count--;
+        for (uint8_t i = index; i < queue_.count; i++) {
+            queue_.segments[i] = queue_.segments[i + 1];
+        }
+    }
+
+public:
+    AckedDelivery(RetransmitQueue& queue = retransmit_queue) : queue_(queue) {}
+
+    /**
+     * @brief Starts a new packet with the queued segments that are due to be sent again,
+     * as many as fit.
+     */
+
+    void begin_packet() {
+        length_ = 0;
+        escaped_length_ = 0;
+        segments_ = 0;
+        uint32_t now_s = hal::rtc_seconds();
+        for (uint8_t i = 0; i < queue_.count; i++) {
+            PendingSegment& pending = queue_.segments[i];
+            if ((int32_t)(now_s - pending.retry_at_s) >= 0) {
+                append(pending.seq, pending.data, pending.length, i, true);
+            }
+        }
+    }
+
+    /**
+     * @brief Adds new data to the packet, with the next sequence number.
+     *
+     * @param data Unescaped: the whole packet is escaped when it's sent
+     * @param retain Keep it, and send it again on later wakes, until it's acked
+     * @return false if it doesn't fit
+     */
+
+    bool add_segment(const uint8_t* data, uint8_t length, bool retain) {
+        if (!append(queue_.next_seq, data, length, -1, retain && length <= kMaxRetainedSegmentBytes)) {
+            return false;
+        }
+        queue_.next_seq++;
+        return true;
+    }
+
+    const uint8_t* packet() const { return packet_; }
+    uint8_t length() const { return length_; }
+    uint8_t segment_count() const { return segments_; }
+
+    /**
+     * @brief Takes a line from the radio. If it's an ack from the base station
+     * ("+RCV=2200,5,!0708,-40,11"), marks the segments it lists as acked.
+     */
+
+    void handle_receive(const char* line) {
+        unsigned int address, length;
+        int data_start = 0;
+        if (sscanf(line, "+RCV=%u,%u,%n", &address, &length, &data_start) != 2 || !data_start
+            || address != LORA_BASE_STATION_ADDRESS || line[data_start] != kAckMarker) {
+            return;
+        }
+        const char* seqs = line + data_start + 1;
+        for (unsigned int i = 0; i + 3 <= length && hex_value(seqs[i]) >= 0 && hex_value(seqs[i + 1]) >= 0; i += 2) {
+            uint8_t seq = (hex_value(seqs[i]) << 4) | hex_value(seqs[i + 1]);
+            for (uint8_t s = 0; s < segments_; s++) {
+                if (seq_[s] == seq) acked_[s] = true;
+            }
+        }
+    }
+
+    bool all_acked() const {
+        for (uint8_t s = 0; s < segments_; s++) {
+            if (!acked_[s]) return false;
+        }
+        return true;
+    }
+
+    uint8_t acked_count() const {
+        uint8_t n = 0;
+        for (uint8_t s = 0; s < segments_; s++) {
+            if (acked_[s]) n++;
+        }
+        return n;
+    }
+
+    /**
+     * @brief Call after the receive window. Acked segments leave the queue; unacked ones
+     * that are worth keeping are (re)scheduled with backoff, or dropped after kMaxRetransmits.
+     */
+
+    void end_packet() {
+        uint32_t now_s = hal::rtc_seconds();
+        // Walk backwards, so removing from the queue doesn't move the segments still to be checked
+        for (int8_t s = segments_ - 1; s >= 0; s--) {
+            int8_t index = queue_index_[s];
+            if (index >= 0) {
+                queue_.retransmitted++;
+                if (acked_[s]) {
+                    queue_.acked++;
+                    remove_from_queue(index);
+                }
+                else if (++queue_.segments[index].retransmits >= kMaxRetransmits) {
+                    queue_.dropped++;
+                    remove_from_queue(index);
+                }
+                else {
+                    queue_.segments[index].retry_at_s = now_s + backoff_s(queue_.segments[index].retransmits);
+                }
+            }
+        }
+        for (uint8_t s = 0; s < segments_; s++) {
+            if (queue_index_[s] >= 0) continue;
+            if (acked_[s]) {
+                queue_.acked++;
+                continue;
+            }
+            if (!retain_[s]) continue;
+            if (queue_.count == kRetransmitQueueLength) { // make room by giving up on the oldest
+                queue_.dropped++;
+                remove_from_queue(0);
+            }
+            PendingSegment& pending = queue_.segments[queue_.count++];
+            pending.seq = seq_[s];
+            pending.length = (s + 1 < segments_ ? offset_[s + 1] - kSegmentHeaderBytes : length_) - offset_[s];
+            pending.retransmits = 0;
+            pending.retry_at_s = now_s + backoff_s(0);
+            memcpy(pending.data, &packet_[offset_[s]], pending.length);
+        }
+        segments_ = 0;
+        length_ = 0;
+        escaped_length_ = 0;
+    }
+
+    const RetransmitQueue& queue() const { return queue_; }
+};
+
+#endif // _ACKED_DELIVERY_H_
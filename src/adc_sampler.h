@@ -0,0 +1,105 @@
+#ifndef _ADC_SAMPLER_H_
+#define _ADC_SAMPLER_H_
+
+#include "hal.h"
+
+const uint8_t kAdcSamplerMaxChannels = 8;  // ADC1 has 8 channels (GPIO 32 - 39)
+const uint32_t kAdcSampleRateHz = 20000;   // the lowest rate the ESP32's continuous mode supports
+const uint32_t kAdcSampleWindowMs = 100;   // a whole number of 50 Hz and 60 Hz mains cycles
+const uint8_t kAdcSampleBlocks = 5;        // 20 ms each: a whole 50 Hz mains cycle
+
+/**
+ * @brief AdcSampler samples every ADC1 channel that has been added to it at the same
+ * time, using the ADC's continuous (DMA) mode, and keeps the calibrated average mV of
+ * each channel until it's taken.
+ *
+ * One sample() takes kAdcSampleWindowMs, however many channels there are, and averages
+ * kAdcSampleRateHz * kAdcSampleWindowMs / 1000 / (number of channels) samples per channel.
+ * Reading each channel on its own with delay()s between samples took seconds. It also keeps
+ * the means of kAdcSampleBlocks consecutive blocks of the window, for a median of means.
+ *
+ * It's meant to be the backend of ESP32AnalogReader: give it to the reader's constructor,
+ * and read_avg_mV() takes the result from here. The first channel to be read triggers a
+ * sample() of all of them; the other channels then use that same sample, and the next
+ * read of a channel that has already been taken triggers a new one.
+ */
+
+class AdcSampler {
+private:
+    uint8_t pins_[kAdcSamplerMaxChannels];
+    uint8_t channels_[kAdcSamplerMaxChannels];
+    float avg_mV_[kAdcSamplerMaxChannels];
+    float variance_mV2_[kAdcSamplerMaxChannels];
+    float block_means_mV_[kAdcSamplerMaxChannels * kAdcSampleBlocks];
+    bool fresh_[kAdcSamplerMaxChannels];
+    uint8_t count_ = 0;
+
+    int8_t index_of(uint8_t pin) {
+        for (uint8_t i = 0; i < count_; i++) {
+            if (pins_[i] == pin) return i;
+        }
+        return -1;
+    }
+
+public:
+    /**
+     * @brief Adds an ADC1 pin (and its channel) to the ones sampled together.
+     * Returns false if there's no room for it.
+     */
+
+    bool add_pin(uint8_t pin, uint8_t adc1_channel) {
+        if (index_of(pin) >= 0) return true;
+        if (count_ == kAdcSamplerMaxChannels) return false;
+        pins_[count_] = pin;
+        channels_[count_] = adc1_channel;
+        fresh_[count_] = false;
+        count_++;
+        return true;
+    }
+
+    /**
+     * @brief Samples all the channels at once. Returns false if the ADC couldn't be set up
+     * in continuous mode, or didn't deliver samples for every channel.
+     */
+
+    bool sample() {
+        if (!count_) return false;
+        uint32_t conversions = kAdcSampleRateHz * kAdcSampleWindowMs / 1000;
+        bool ok = hal::adc1_sample_continuous(channels_, count_, kAdcSampleRateHz, conversions,
+                                              avg_mV_, variance_mV2_, kAdcSampleBlocks, block_means_mV_);
+        for (uint8_t i = 0; i < count_; i++) {
+            fresh_[i] = ok;
+        }
+        return ok;
+    }
+
+    /**
+     * @brief Gets the average mV of pin, sampling all the channels first if pin's last
+     * result has already been taken.
+     *
+     * @param variance_mV2 If not nullptr, gets the variance of the samples, in mV^2
+     * @param block_means_mV If not nullptr, gets the kAdcSampleBlocks block means, in the
+     *                       order they were sampled
+     * @return false if pin hasn't been added, or sampling failed.
+     */
+
+    bool take_avg_mV(uint8_t pin, float* avg_mV, float* variance_mV2 = nullptr, float* block_means_mV = nullptr) {
+        int8_t i = index_of(pin);
+        if (i < 0) return false;
+        if (!fresh_[i] && !sample()) return false;
+        fresh_[i] = false;
+        *avg_mV = avg_mV_[i];
+        if (variance_mV2) *variance_mV2 = variance_mV2_[i];
+        for (uint8_t b = 0; block_means_mV && b < kAdcSampleBlocks; b++) {
+            block_means_mV[b] = block_means_mV_[i * kAdcSampleBlocks + b];
+        }
+        return true;
+    }
+
+    // Samples per channel in each sample()
+    uint16_t samples_per_channel() {
+        return count_ ? kAdcSampleRateHz * kAdcSampleWindowMs / 1000 / count_ : 0;
+    }
+};
+
+#endif // _ADC_SAMPLER_H_
@@ -0,0 +1,216 @@
+#ifndef _ALARM_RULES_H_
+#define _ALARM_RULES_H_
+
+#include <stddef.h>
+#include <string.h>
+#include "hal.h"
+#include "config.h"
+#include "binary_payload.h"
+#include "runtime_config.h"
+
+enum class AlarmBound : uint8_t {
+  kBelow,  // in alarm when the reading is below the threshold
+  kAbove,  // in alarm when the reading is above it
+  kEvent   // every time the event is sent (auto-fill, float switch): no state to track
+};
+
+/**
+ * @brief One alarm: what raises it, what clears it, and what the base station is told
+ * when it's raised.
+ *
+ * A reading past threshold raises it once debounce readings in a row have been; it clears
+ * once debounce readings in a row have come back inside threshold by at least hysteresis.
+ * A reading in the hysteresis band changes nothing, so a value hovering around the
+ * threshold is one alarm, not one every wake.
+ */
+
+struct AlarmRule {
+  PayloadField field;
+  AlarmBound bound;
+  float threshold;
+  float hysteresis;
+  uint8_t debounce;               // readings in a row, to raise and to clear (1 = at once)
+  uint16_t code;                  // the alarm code sent to the base station (its severity), < kAlarmClearedCode
+  uint8_t email_interval_offset;  // of the email interval (minutes) in RuntimeConfig
+  uint16_t max_emails;
+};
+
+constexpr AlarmRule kAlarmRules[] = {
+  {PayloadField::kVoltage, AlarmBound::kBelow, LOW_VOLTAGE_ALARM_VALUE, LOW_VOLTAGE_ALARM_HYSTERESIS,
+   LOW_VOLTAGE_ALARM_DEBOUNCE, LOW_VOLTAGE_ALARM_CODE, offsetof(RuntimeConfig, low_voltage_email_interval),
+   LOW_VOLTAGE_MAX_EMAILS},
+  {PayloadField::kVoltage, AlarmBound::kAbove, HIGH_VOLTAGE_ALARM_VALUE, HIGH_VOLTAGE_ALARM_HYSTERESIS,
+   HIGH_VOLTAGE_ALARM_DEBOUNCE, HIGH_VOLTAGE_ALARM_CODE, offsetof(RuntimeConfig, high_voltage_email_interval),
+   HIGH_VOLTAGE_MAX_EMAILS},
+  {PayloadField::kpH, AlarmBound::kBelow, LOW_PH_ALARM_VALUE, PH_ALARM_HYSTERESIS, PH_ALARM_DEBOUNCE,
+   PH_ALARM_CODE, offsetof(RuntimeConfig, ph_email_interval), PH_MAX_EMAILS},
+  {PayloadField::kpH, AlarmBound::kAbove, HIGH_PH_ALARM_VALUE, PH_ALARM_HYSTERESIS, PH_ALARM_DEBOUNCE,
+   PH_ALARM_CODE, offsetof(RuntimeConfig, ph_email_interval), PH_MAX_EMAILS},
+  {PayloadField::kWaterVolume, AlarmBound::kBelow, LOW_WATER_ALARM_VALUE, LOW_WATER_ALARM_HYSTERESIS,
+   LOW_WATER_ALARM_DEBOUNCE, LOW_WATER_ALARM_CODE, offsetof(RuntimeConfig, low_water_email_interval),
+   LOW_WATER_MAX_EMAILS},
+  {PayloadField::kWaterVolume, AlarmBound::kAbove, HIGH_WATER_ALARM_VALUE, HIGH_WATER_ALARM_HYSTERESIS,
+   HIGH_WATER_ALARM_DEBOUNCE, HIGH_WATER_ALARM_CODE, offsetof(RuntimeConfig, high_water_email_interval),
+   HIGH_WATER_MAX_EMAILS},
+  {PayloadField::kAutoFill, AlarmBound::kEvent, 0, 0, 1, AUTO_FILL_ALARM_CODE,
+   offsetof(RuntimeConfig, auto_fill_email_interval), AUTO_FILL_MAX_EMAILS},
+  {PayloadField::kFloatSwitch, AlarmBound::kEvent, 0, 0, 1, HIGH_WATER_ALARM_CODE,
+   offsetof(RuntimeConfig, high_water_email_interval), HIGH_WATER_MAX_EMAILS},
+  {PayloadField::kFillTimer, AlarmBound::kEvent, 0, 0, 1, HIGH_WATER_ALARM_CODE,
+   offsetof(RuntimeConfig, high_water_email_interval), HIGH_WATER_MAX_EMAILS},
+};
+
+const uint8_t kAlarmRuleCount = sizeof(kAlarmRules) / sizeof(kAlarmRules[0]);
+
+// True if every rule's code fits the binary payload's alarm byte, below kAlarmClearedCode
+constexpr bool alarm_codes_fit(const AlarmRule* rules, size_t count) {
+  return count == 0 || (rules[0].code < kAlarmClearedCode && alarm_codes_fit(rules + 1, count - 1));
+}
+
+static_assert(alarm_codes_fit(kAlarmRules, kAlarmRuleCount),
+              "the *_ALARM_CODEs in config.h must be below 255 (kAlarmClearedCode)");
+
+// Where one rule is: raised or not, and how many readings in a row have said otherwise
+struct AlarmRuleState {
+  bool raised;
+  uint8_t count;
+};
+
+struct AlarmCounters {
+  uint32_t raised;
+  uint32_t cleared;
+};
+
+struct AlarmState {
+  AlarmRuleState rules[kAlarmRuleCount];
+  AlarmCounters counters;
+};
+
+/**
+ * @brief Which alarms are raised, kept in RTC memory so it survives deep sleep. A power-on
+ * or reset clears it, so an alarm that's still there is raised again on the first wake
+ * after one.
+ */
+
+RTC_DATA_ATTR static AlarmState alarm_state;
+
+enum class AlarmTransition : uint8_t {
+  kNone,     // no change: the reading is sent without alarm info
+  kRaised,   // sent with the alarm's code, email interval and max emails
+  kCleared   // sent with kAlarmClearedCode
+};
+
+/**
+ * @brief What to send with one reading.
+ */
+
+struct AlarmReport {
+  AlarmTransition transition = AlarmTransition::kNone;
+  uint16_t raised_code = 0;    // the field's raised alarm after this reading, 0 if none (for ReportPolicy)
+  uint16_t code = 0;           // sent with the reading: see AlarmTransition
+  uint16_t email_interval = 1; // minutes
+  uint16_t max_emails = 1;
+};
+
+/**
+ * @brief AlarmRules runs each reading through the kAlarmRules for its field, and says
+ * which alarm, if any, it raised or cleared.
+ *
+ * The base station is only told about the changes: a reading that raises an alarm is sent
+ * with its code, email interval and max emails, and the base station sends the emails
+ * from then on until a reading comes with kAlarmClearedCode. The readings in between
+ * carry no alarm info. With acked delivery, the readings that carry a change are kept
+ * until they're acked, like the fill events.
+ *
+ *   AlarmReport alarm = alarm_rules.evaluate(PayloadField::kVoltage, 13.05);
+ */
+
+class AlarmRules {
+private:
+    AlarmState& state_;
+
+    static bool past(const AlarmRule& rule, float value) {
+        return rule.bound == AlarmBound::kBelow ? value < rule.threshold : value > rule.threshold;
+    }
+
+    static bool clear_of(const AlarmRule& rule, float value) {
+        return rule.bound == AlarmBound::kBelow ? value >= rule.threshold + rule.hysteresis
+                                                : value <= rule.threshold - rule.hysteresis;
+    }
+
+    static uint16_t email_interval(const AlarmRule& rule) {
+        uint16_t minutes;
+        memcpy(&minutes, (const uint8_t*)&runtime_config() + rule.email_interval_offset, sizeof(minutes));
+        return minutes;
+    }
+
+    static void set_raised(AlarmReport* report, const AlarmRule& rule) {
+        report->transition = AlarmTransition::kRaised;
+        report->code = rule.code;
+        report->email_interval = email_interval(rule);
+        report->max_emails = rule.max_emails;
+    }
+
+public:
+    AlarmRules(AlarmState& state = alarm_state) : state_(state) {}
+
+    /**
+     * @brief Moves each of the field's rules on by one reading. If one rule clears and
+     * another raises on the same reading (low to high in one go), the raise is reported:
+     * the base station replaces the field's alarm with it.
+     */
+
+    AlarmReport evaluate(PayloadField field, float value) {
+        AlarmReport report;
+        for (uint8_t i = 0; i < kAlarmRuleCount; i++) {
+            const AlarmRule& rule = kAlarmRules[i];
+            if (rule.field != field || rule.bound == AlarmBound::kEvent) {
+                continue;
+            }
+            AlarmRuleState& s = state_.rules[i];
+            bool changing = s.raised ? clear_of(rule, value) : past(rule, value);
+            s.count = changing ? s.count + 1 : 0;
+            if (changing && s.count >= rule.debounce) {
+                s.raised = !s.raised;
+                s.count = 0;
+                if (s.raised) {
+                    state_.counters.raised++;
+                    set_raised(&report, rule);
+                }
+                else {
+                    state_.counters.cleared++;
+                    if (report.transition == AlarmTransition::kNone) {
+                        report.transition = AlarmTransition::kCleared;
+                        report.code = kAlarmClearedCode;
+                    }
+                }
+            }
+            if (s.raised) {
+                report.raised_code = rule.code;
+            }
+        }
+        return report;
+    }
+
+    /**
+     * @brief The alarm that goes with an event (an auto-fill, the float switch): every one
+     * is sent with its alarm, since each one is something new. Events without a rule (the
+     * fill's +/-) get none.
+     */
+
+    AlarmReport event(PayloadField field) const {
+        AlarmReport report;
+        for (uint8_t i = 0; i < kAlarmRuleCount; i++) {
+            if (kAlarmRules[i].field == field && kAlarmRules[i].bound == AlarmBound::kEvent) {
+                set_raised(&report, kAlarmRules[i]);
+            }
+        }
+        return report;
+    }
+
+    bool raised(uint8_t rule) const { return state_.rules[rule].raised; }
+
+    const AlarmCounters& counters() const { return state_.counters; }
+};
+
+#endif // _ALARM_RULES_H_
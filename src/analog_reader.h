@@ -1,9 +1,145 @@
 #ifndef _analog_reader_H_
 #define _analog_reader_H_
 
-#include <Arduino.h>
+#include <math.h>
+#include "hal.h"
 #include "config.h"
-#include "esp_adc_cal.h"
+#include "adc_sampler.h"
+#include "calibration_curve.h"
+
+const float kConfidenceZ = 1.96;       // 95% confidence interval
+const uint8_t kMomGroupSize = 5;       // samples per group, for SampleEstimator::kMedianOfMeans
+const uint8_t kMomMaxGroups = 50;      // enough for 250 samples
+
+/**
+ * @brief RunningStats keeps the mean and variance of a stream of samples with Welford's
+ * algorithm: one pass, no stored samples, and no loss of precision from summing squares.
+ */
+
+class RunningStats {
+ private:
+  uint16_t count_ = 0;
+  double mean_ = 0;
+  double m2_ = 0; // sum of squared differences from the mean
+
+ public:
+  void add(float x) {
+    count_++;
+    double delta = x - mean_;
+    mean_ += delta / count_;
+    m2_ += delta * (x - mean_);
+  }
+
+  uint16_t count() const { return count_; }
+  float mean() const { return mean_; }
+
+  // Sample variance (n - 1), in the samples' units squared
+  float variance() const { return count_ > 1 ? m2_ / (count_ - 1) : 0; }
+
+  // Half-width of the confidence interval of the mean: z standard errors
+  float ci_half_width(float z) const {
+    return count_ > 1 ? z * sqrt(variance() / count_) : INFINITY;
+  }
+};
+
+// The median of count values (at most kMomMaxGroups)
+inline float median_of(const float* values, uint8_t count) {
+  float sorted[kMomMaxGroups];
+  for (uint8_t i = 0; i < count; i++) { // insertion sort: there are at most kMomMaxGroups
+    float v = values[i];
+    int8_t j = i - 1;
+    while (j >= 0 && sorted[j] > v) {
+      sorted[j + 1] = sorted[j];
+      j--;
+    }
+    sorted[j + 1] = v;
+  }
+  return count % 2 ? sorted[count / 2] : (sorted[count / 2 - 1] + sorted[count / 2]) / 2;
+}
+
+/**
+ * @brief MedianOfMeans splits a stream of samples into groups of kMomGroupSize, and
+ * returns the median of the group means. A spike in one group moves the result much
+ * less than it moves a plain mean.
+ */
+
+class MedianOfMeans {
+ private:
+  float group_means_[kMomMaxGroups];
+  uint8_t groups_ = 0;
+  float group_sum_ = 0;
+  uint8_t in_group_ = 0;
+
+ public:
+  void add(float x) {
+    group_sum_ += x;
+    if (++in_group_ == kMomGroupSize) {
+      if (groups_ < kMomMaxGroups) {
+        group_means_[groups_++] = group_sum_ / kMomGroupSize;
+      }
+      group_sum_ = 0;
+      in_group_ = 0;
+    }
+  }
+
+  // Returns fallback if there isn't a complete group yet.
+  float median(float fallback) {
+    return groups_ ? median_of(group_means_, groups_) : fallback;
+  }
+};
+
+enum class SampleEstimator : uint8_t {
+  kMean,
+  kMedianOfMeans
+};
+
+/**
+ * @brief How ESP32AnalogReader::read_adaptive_mV() samples a pin. Sampling stops once
+ * min_samples have been read and the 95% confidence interval of the mean is within
+ * +/- tolerance_mV, or when max_samples have been read.
+ *
+ * The stop rule only applies to pins read sample by sample: ADC2 pins, and ADC1 pins
+ * whose AdcSampler failed. A pin read by an AdcSampler always gets its fixed window, and
+ * only the estimator applies (over the window's block means).
+ */
+
+struct SamplingPolicy {
+  uint16_t min_samples;
+  uint16_t max_samples;
+  uint16_t ms_delay;        // between samples
+  float tolerance_mV;
+  SampleEstimator estimator;
+};
+
+/**
+ * @brief What a reading was made of, for tuning each sensor's SamplingPolicy.
+ */
+
+struct ReadingStats {
+  float value_mV = 0;
+  uint16_t samples = 0;
+  float variance_mV2 = 0;
+};
+
+/**
+ * @brief A GPIO used as an analog input, with its ADC unit and channel worked out at
+ * compile time: a pin that isn't on either ADC doesn't compile.
+ *
+ *   VoltageSensor voltage_sensor(AdcPin<13>{}); // ADC2 channel 4
+ */
+
+template <uint8_t kPin>
+struct AdcPin {
+  static_assert(hal::adc1_channel(kPin) >= 0 || hal::adc2_channel(kPin) >= 0,
+                "not an ADC pin: use GPIO 32 - 39 (ADC1), or 0, 2, 4, 12 - 15, 25 - 27 (ADC2)");
+
+  static constexpr hal::AdcUnit unit() {
+    return hal::adc1_channel(kPin) >= 0 ? hal::AdcUnit::kAdc1 : hal::AdcUnit::kAdc2;
+  }
+  static constexpr uint8_t channel() {
+    return hal::adc1_channel(kPin) >= 0 ? hal::adc1_channel(kPin) : hal::adc2_channel(kPin);
+  }
+};
 
 /**
  * @brief ESP32AnalogReader does all of the calibration of the ESP32's ADC, using the
@@ -22,71 +158,61 @@
  * ADC2, and WiFi also uses ADC2. Other pins on ADC2 have various other jobs and are
  * likely to cause problems if you use them.
  * 
+ * The pin is given as an AdcPin<gpio> (see above), so a pin that isn't on an ADC is a
+ * compile error instead of a reader on a channel nobody chose.
+ * 
+ * ADC1 pins can be given an AdcSampler, which then does the reading for read_avg_mV():
+ * all the pins that share the sampler are sampled at the same time, in continuous (DMA)
+ * mode, in a fraction of the time it takes to read one pin sample by sample.
+ * 
  * Based on code from SensESP - thanks, @mairas!
  */
 
 class ESP32AnalogReader {
  private:
   uint8_t analog_read_pin_;
-  adc_atten_t attenuation_ = ADC_ATTEN_DB_11;
-  adc_bits_width_t bit_width_ = ADC_WIDTH_BIT_12;
-  // maximum voltage readout for 3.3V VDDA when attenuation_ is set to 11 dB
-  const float kVmax_ = 3300;
-  adc_channel_t adc_channel_;
-  esp_adc_cal_characteristics_t adc_characteristics_;
-  const int kVref_ = 1100;  // voltage reference, in mV
-  adc_unit_t unit; // ADC1 or ADC2
-  bool calibration_successful = false;
-  bool adc1_config_width_failed = false;
-  bool adc1_config_channel_atten_failed = false;
-  bool adc2_config_channel_atten_failed = false;
+  hal::AdcUnit unit_; // ADC1 or ADC2
+  uint8_t adc_channel_;
+  hal::AdcStatus status_;
+  AdcSampler* sampler_ = nullptr;
 
  public:
-  ESP32AnalogReader(uint8_t pin) : analog_read_pin_{pin} {
-    if (32 <= analog_read_pin_ && analog_read_pin_ <= 39) {
-      unit = ADC_UNIT_1;
-      adc_channel_ = (adc_channel_t)digitalPinToAnalogChannel(analog_read_pin_);
-    }
-    else {
-      unit = ADC_UNIT_2;
-      if (analog_read_pin_ == 13) adc_channel_ = ADC_CHANNEL_4;
-      else if (analog_read_pin_ == 25) adc_channel_ = ADC_CHANNEL_8;
-      else if (analog_read_pin_ == 26) adc_channel_ = ADC_CHANNEL_9;
-      else if (analog_read_pin_ == 27) adc_channel_ = ADC_CHANNEL_7;
-    }
-    
-    if (!calibrate()) {
-      calibration_successful = false;
+  /**
+   * @brief A reader for the GPIO in pin - AdcPin<32>() - with its unit and channel
+   * already worked out at compile time.
+   *
+   * @param sampler For an ADC1 pin, an AdcSampler to read it with (ignored for ADC2)
+   */
+
+  template <uint8_t kPin>
+  explicit ESP32AnalogReader(AdcPin<kPin> pin, AdcSampler* sampler = nullptr)
+      : analog_read_pin_{kPin}, unit_{pin.unit()}, adc_channel_{pin.channel()} {
+    calibrate();
+    // Only ADC1 supports continuous mode
+    if (sampler && unit_ == hal::AdcUnit::kAdc1 && sampler->add_pin(analog_read_pin_, adc_channel_)) {
+      sampler_ = sampler;
     }
   }
 
   /**
-   * @brief Calibrate the ADC for this specific ESP32
+   * @brief Sets the channel up for 0 - 3.3V. The calibration for this specific ESP32 is
+   * shared by every channel of the unit, and only worked out once after a power-on or
+   * reset (see hal::adc_calibration()).
    * 
    * @return false if any of the configuration functions fail, otherwise true
    */
 
   bool calibrate() {
-    if (unit == ADC_UNIT_1) {
-        if (adc1_config_width(bit_width_) != ESP_OK) {
-          adc1_config_width_failed = true;
-          return false;
-        }
-        if (adc1_config_channel_atten((adc1_channel_t)adc_channel_, attenuation_) != ESP_OK) {
-          adc1_config_channel_atten_failed = true;
-          return false;
-        }
-    } else {
-        if (adc2_config_channel_atten((adc2_channel_t)adc_channel_, attenuation_) != ESP_OK) {
-          adc2_config_channel_atten_failed = true;
-          return false;
-        }
+    status_ = hal::adc_configure(unit_, adc_channel_);
+    if (status_ == hal::AdcStatus::kOk) {
+      hal::adc_calibration(unit_);
     }
-    esp_adc_cal_characterize(unit, attenuation_, bit_width_, kVref_,
-                             &adc_characteristics_);
-    return true;
+    return status_ == hal::AdcStatus::kOk;
   }
 
+  // Which step of calibrate() failed, if any
+  hal::AdcStatus status() const { return status_; }
+
   /**
    * @brief Reads the voltage on the analog_read_pin_, in mV, one time only. 
    * 
@@ -94,26 +220,16 @@ class ESP32AnalogReader {
    */
   
   int read_mV() {
-    uint32_t volts_mV;
-    if (unit == ADC_UNIT_1) {
-      // returns the raw value of an adc1_channel_t and assigns it to volts_mV
-      esp_adc_cal_get_voltage(adc_channel_, &adc_characteristics_,
-                            &volts_mV);
-      return volts_mV;
-    } 
-    else { // ADC_UNIT_2
-      int raw;
-      // puts the raw value of an adc2_channel_t into raw
-      adc2_get_raw((adc2_channel_t)adc_channel_, bit_width_, &raw);
-      // Convert raw adc reading to mV
-      volts_mV = esp_adc_cal_raw_to_voltage(raw, &adc_characteristics_);
-      return volts_mV; // 
-    }
+    return hal::adc_read_mV(unit_, adc_channel_);
   }
 
   /**
    * @brief Returns an average of read_analog_raw_value() measurements.
    * 
+   * If this reader has an AdcSampler, the average comes from it instead, and num_samples
+   * and ms_delay are ignored (see AdcSampler for how many samples it averages). If the
+   * sampler fails, this falls back to reading the pin sample by sample.
+   * 
    * @param num_samples Number of samples to read and average.
    * 
    * @param ms_delay Milliseconds to delay between the samples.
@@ -121,13 +237,63 @@ class ESP32AnalogReader {
 
   float read_avg_mV(uint16_t num_samples = 30, uint16_t ms_delay = 50) {
     float avg_mV = 0;
+    if (sampler_ && sampler_->take_avg_mV(analog_read_pin_, &avg_mV)) {
+      return avg_mV;
+    }
     for (uint16_t x = 0; x < num_samples; x++) {
       avg_mV += read_mV();
-      delay(ms_delay);
+      hal::delay_ms(ms_delay);
     }
     return avg_mV / num_samples;
   }
 
+  /**
+   * @brief Reads the pin until the mean is known to within policy.tolerance_mV (see
+   * SamplingPolicy), so a quiet signal is done in a few samples and a noisy one still
+   * gets up to policy.max_samples.
+   * 
+   * If this reader has an AdcSampler, the reading comes from it instead (see read_avg_mV()):
+   * policy.estimator still applies, as the median of the sampler's block means, but the
+   * stop rule doesn't.
+   * 
+   * @param stats If not nullptr, gets the value, the number of samples and their variance.
+   * @return The mean, or the median of means, of the samples, in mV.
+   */
+
+  float read_adaptive_mV(const SamplingPolicy& policy, ReadingStats* stats = nullptr) {
+    ReadingStats result;
+    float block_means_mV[kAdcSampleBlocks];
+    if (sampler_ && sampler_->take_avg_mV(analog_read_pin_, &result.value_mV, &result.variance_mV2, block_means_mV)) {
+      result.samples = sampler_->samples_per_channel();
+      if (policy.estimator == SampleEstimator::kMedianOfMeans) {
+        result.value_mV = median_of(block_means_mV, kAdcSampleBlocks);
+      }
+    }
+    else {
+      RunningStats running;
+      MedianOfMeans median_of_means;
+      while (true) {
+        float mV = read_mV();
+        running.add(mV);
+        median_of_means.add(mV);
+        if (running.count() >= policy.max_samples
+            || (running.count() >= policy.min_samples
+                && running.ci_half_width(kConfidenceZ) <= policy.tolerance_mV)) {
+          break;
+        }
+        hal::delay_ms(policy.ms_delay);
+      }
+      result.samples = running.count();
+      result.variance_mV2 = running.variance();
+      result.value_mV = policy.estimator == SampleEstimator::kMedianOfMeans
+                        ? median_of_means.median(running.mean()) : running.mean();
+    }
+    if (stats) {
+      *stats = result;
+    }
+    return result.value_mV;
+  }
+
   /**
  * @brief - voltage_multiplier() - reverses the effect of a physical voltage divider.
  * 
@@ -145,31 +311,37 @@ class ESP32AnalogReader {
   };
 
 
+constexpr CalibrationPoint kBatteryCalibration[] = {BATTERY_CALIBRATION_POINTS};
+static_assert(calibration_is_valid(kBatteryCalibration),
+              "BATTERY_CALIBRATION_POINTS must be in increasing mV order, with volts increasing too");
+constexpr CalibrationCurve<sizeof(kBatteryCalibration) / sizeof(CalibrationPoint)> kBatteryCurve(kBatteryCalibration);
+
 class VoltageSensor {
  private:
   ESP32AnalogReader analog_reader_;
+  ReadingStats last_reading_;
   
 
  public:
-  VoltageSensor(uint8_t pin) : analog_reader_(pin) {
-    //analog_reader_ = ESP32AnalogReader(pin);
-    //analog_reader_(pin);
-  }
+  template <uint8_t kPin>
+  explicit VoltageSensor(AdcPin<kPin> pin) : analog_reader_(pin) {}
 
   /**
    * @brief returns the voltage to be reported to the base station, after any and
-   * all manipulations necessary. R1_VALUE, R2_VALUE, AND VOLTAGE_CALIBRATION all
-   * come from config.h. 
+   * all manipulations necessary: BATTERY_CALIBRATION_POINTS in config.h (built from
+   * R1_VALUE, R2_VALUE and VOLTAGE_CALIBRATION) calibrates the value and reverses the
+   * effect of the physical voltage divider.
    */
 
   float reported_voltage() {
-    float final_voltage = analog_reader_.read_avg_mV(); // a value from 0 - 3300 (representing 0.0V - 3.3V)
-    final_voltage = final_voltage / 1000; // convert mV to volts (0.0V to 3.3V)
-    final_voltage = final_voltage * VOLTAGE_CALIBRATION; // calibrate the value
-    // reverse effect of physical voltage divider, to output the actual voltage of the battery
-    return analog_reader_.voltage_multiplier(final_voltage, R1_VALUE, R2_VALUE);
+    const SamplingPolicy kPolicy = {5, 30, 50, VOLTAGE_SAMPLE_TOLERANCE_MV, SampleEstimator::kMean};
+    float measured_mV = analog_reader_.read_adaptive_mV(kPolicy, &last_reading_); // a value from 0 - 3300 (representing 0.0V - 3.3V)
+    return kBatteryCurve.convert(measured_mV);
   }
 
+  // Samples and variance of the last reported_voltage()
+  const ReadingStats& last_reading_stats() const { return last_reading_; }
+
 };
 
 #endif // _analog_reader_H_
\ No newline at end of file
@@ -0,0 +1,285 @@
+#ifndef _AT_COMMAND_H_
+#define _AT_COMMAND_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include "hal.h"
+#include "log.h"
+
+/**
+ * @brief The +ERR=n codes from the Reyax RYLR896 / RYLR998 AT command guide, plus
+ * kNoReply for a command that got no answer before its timeout.
+ */
+
+enum class AtError : uint8_t {
+  kNone = 0,
+  kMissingCrLf = 1,       // no "\r\n" at the end of the command
+  kNotAtCommand = 2,      // command doesn't start with "AT"
+  kMissingEquals = 3,     // no "=" in a command that needs one
+  kUnknownCommand = 4,
+  kLengthMismatch = 5,    // AT+SEND's <Payload Length> isn't the length of its data (RYLR998)
+  kTxTimeout = 10,
+  kRxTimeout = 11,
+  kCrcError = 12,
+  kTxTooLong = 13,        // more than 240 bytes of data in AT+SEND
+  kFlashWriteFailed = 14, // (RYLR998)
+  kUnknownError = 15,
+  kTxBusy = 17,           // the last AT+SEND hasn't finished transmitting (RYLR998)
+  kNoReply = 255
+};
+
+inline const char* at_error_name(AtError error) {
+  switch (error) {
+    case AtError::kNone: return "OK";
+    case AtError::kMissingCrLf: return "missing CR/LF";
+    case AtError::kNotAtCommand: return "not an AT command";
+    case AtError::kMissingEquals: return "missing '='";
+    case AtError::kUnknownCommand: return "unknown command";
+    case AtError::kLengthMismatch: return "length mismatch";
+    case AtError::kTxTimeout: return "TX timeout";
+    case AtError::kRxTimeout: return "RX timeout";
+    case AtError::kCrcError: return "CRC error";
+    case AtError::kTxTooLong: return "data too long";
+    case AtError::kFlashWriteFailed: return "flash write failed";
+    case AtError::kUnknownError: return "unknown error";
+    case AtError::kTxBusy: return "TX busy";
+    case AtError::kNoReply: return "no reply";
+  }
+  return "?";
+}
+
+// Errors worth sending the same command again for. The rest mean the command is wrong.
+inline bool at_error_is_retryable(AtError error) {
+  return error == AtError::kNoReply || error == AtError::kTxTimeout || error == AtError::kRxTimeout
+         || error == AtError::kCrcError || error == AtError::kUnknownError || error == AtError::kTxBusy;
+}
+
+const uint8_t kAtMaxLineLength = 255;   // longest line from the radio: "+RCV=" with 240 bytes of data
+const uint8_t kAtMaxReplyLength = 64;   // how much of the reply AtResponse keeps
+const uint8_t kAtMaxCommandLength = 48; // longest command that can be queued
+const uint32_t kAtReplyTimeoutMs = 100;  // the radio answers most commands in a few ms
+const uint8_t kAtMaxAttempts = 3;
+const uint32_t kAtBackoffMs = 20;        // doubles after each failed attempt...
+const uint32_t kAtMaxBackoffMs = 200;    // ...up to this
+const uint8_t kAtQueueLength = 8;
+
+/**
+ * @brief The outcome of one AT command.
+ */
+
+struct AtResponse {
+  AtError error = AtError::kNoReply;
+  char reply[kAtMaxReplyLength] = {}; // the line that finished the command: "+OK", "+VER=...", "+ERR=4"
+  uint8_t attempts = 0;
+  uint32_t elapsed_ms = 0;           // from the first attempt to the reply, including retries
+
+  bool ok() const { return error == AtError::kNone; }
+};
+
+/**
+ * @brief Sends AT commands to the Reyax radio on hal::lora_uart() and parses the replies
+ * as they arrive, instead of waiting a fixed time and hoping the reply is there.
+ *
+ * A command is finished by the first line that answers it: "+OK", "+ERR=n", or, for a
+ * query like "AT+VER?", the "+VER=..." reply. "+RCV=..." lines are packets received from
+ * another radio, not replies - they go to the receive handler, if there is one. A command
+ * that fails with a retryable error (see at_error_is_retryable()) is sent again, after a
+ * backoff that doubles each time, up to kAtMaxAttempts in all. Whatever the radio sent in
+ * the backoff (a late reply to the last attempt) is read and dropped first, so it can't be
+ * taken for the answer to the next one. An AT+SEND that goes unanswered isn't sent again:
+ * the packet may have gone on air, and the reply been lost or late.
+ *
+ * Several commands can be queued and then sent back to back with run_queue().
+ */
+
+class AtCommandEngine {
+public:
+  typedef void (*LineHandler)(const char* line, void* context);
+
+private:
+  char line_[kAtMaxLineLength];
+  uint8_t line_length_ = 0;
+  bool echo_ = true;
+  LineHandler receive_handler_ = nullptr;
+  void* receive_context_ = nullptr;
+  char queue_[kAtQueueLength][kAtMaxCommandLength];
+  uint8_t queue_count_ = 0;
+
+  static bool starts_with(const char* s, const char* prefix) {
+    return strncmp(s, prefix, strlen(prefix)) == 0;
+  }
+
+  static bool is_text(const uint8_t* data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+      if (data[i] < ' ' || data[i] > '~') return false;
+    }
+    return true;
+  }
+
+  // One attempt: send the command, then read lines until one answers it, or timeout_ms passes.
+  AtError attempt(const char* command, const uint8_t* data, size_t data_length,
+                  uint32_t timeout_ms, AtResponse* response) {
+    hal::lora_uart().print(command);
+    if (data_length) {
+      hal::lora_uart().write(data, data_length);
+    }
+    hal::lora_uart().print("\r\n");
+    uint32_t start_ms = hal::millis();
+    while ((uint32_t)(hal::millis() - start_ms) < timeout_ms) {
+      const char* line = poll();
+      if (!line) {
+        continue;
+      }
+      if (starts_with(line, "+RCV=") || starts_with(line, "+READY")) {
+        continue; // not a reply (poll() has already passed +RCV to the receive handler)
+      }
+      strncpy(response->reply, line, kAtMaxReplyLength - 1);
+      response->reply[kAtMaxReplyLength - 1] = '\0';
+      if (starts_with(line, "+ERR=")) {
+        return (AtError)atoi(line + 5);
+      }
+      if (line[0] == '+') {
+        return AtError::kNone;
+      }
+    }
+    response->reply[0] = '\0';
+    return AtError::kNoReply;
+  }
+
+  static bool retryable(const char* command, AtError error) {
+    return at_error_is_retryable(error) && !(error == AtError::kNoReply && starts_with(command, "AT+SEND="));
+  }
+
+  // Reads and drops the lines the radio has sent, passing +RCV on as poll() does
+  void drain() {
+    while (hal::lora_uart().available()) {
+      poll();
+    }
+  }
+
+public:
+  /**
+   * @brief echo: log each command and its reply (at LOG_LEVEL_DEBUG). Errors are logged either way.
+   */
+
+  void set_echo(bool echo) { echo_ = echo; }
+
+  /**
+   * @brief Sets a function to be called with each "+RCV=..." line that arrives
+   * from the radio, while a command is waiting for its reply or during poll().
+   */
+
+  void set_receive_handler(LineHandler handler, void* context) {
+    receive_handler_ = handler;
+    receive_context_ = context;
+  }
+
+  /**
+   * @brief Reads whatever bytes the radio has sent, without waiting.
+   *
+   * @return A complete line (without the "\r\n") if one has arrived, otherwise nullptr.
+   * The line is only valid until the next call.
+   */
+
+  const char* poll() {
+    while (hal::lora_uart().available()) {
+      char c = (char)hal::lora_uart().read();
+      if (c == '\r') {
+        continue;
+      }
+      if (c != '\n') {
+        if (line_length_ < kAtMaxLineLength - 1) {
+          line_[line_length_++] = c;
+        }
+        continue;
+      }
+      line_[line_length_] = '\0';
+      line_length_ = 0;
+      if (line_[0] == '\0') {
+        continue;
+      }
+      if (LOG_ENABLED(LOG_LEVEL_DEBUG) && echo_) {
+        LOG_DEBUG(line_);
+      }
+      if (receive_handler_ && starts_with(line_, "+RCV=")) {
+        receive_handler_(line_, receive_context_);
+      }
+      return line_;
+    }
+    return nullptr;
+  }
+
+  /**
+   * @brief Sends one AT command and waits for the line that answers it, retrying
+   * retryable errors with backoff.
+   *
+   * @param command The command, without "\r\n"
+   * @param data Raw bytes to send after the command (the data of a binary AT+SEND), or nullptr
+   * @param timeout_ms How long to wait for the reply to each attempt
+   */
+
+  AtResponse send(const char* command, const uint8_t* data = nullptr, size_t data_length = 0,
+                  uint32_t timeout_ms = kAtReplyTimeoutMs) {
+    AtResponse response;
+    uint32_t start_ms = hal::millis();
+    uint32_t backoff_ms = kAtBackoffMs;
+    if (LOG_ENABLED(LOG_LEVEL_DEBUG) && echo_) {
+      log_sink().print("Sending: ");
+      log_sink().print(command);
+      if (is_text(data, data_length)) { // binary data is shown by the caller, in hex
+        log_sink().write(data, data_length);
+      }
+      log_sink().println();
+    }
+    for (response.attempts = 1; ; response.attempts++) {
+      response.error = attempt(command, data, data_length, timeout_ms, &response);
+      if (response.ok() || !retryable(command, response.error) || response.attempts == kAtMaxAttempts) {
+        break;
+      }
+      hal::delay_ms(backoff_ms);
+      drain();
+      backoff_ms = backoff_ms * 2 > kAtMaxBackoffMs ? kAtMaxBackoffMs : backoff_ms * 2;
+    }
+    response.elapsed_ms = hal::millis() - start_ms;
+    if (LOG_ENABLED(LOG_LEVEL_ERROR) && !response.ok()) {
+      log_sink().print("AT error: ");
+      LOG_ERROR(at_error_name(response.error));
+    }
+    return response;
+  }
+
+  /**
+   * @brief Adds a command to the queue, to be sent by run_queue(). Returns false if the
+   * queue is full or the command is too long.
+   */
+
+  bool queue(const char* command) {
+    if (queue_count_ == kAtQueueLength || strlen(command) >= kAtMaxCommandLength) {
+      return false;
+    }
+    strcpy(queue_[queue_count_++], command);
+    return true;
+  }
+
+  /**
+   * @brief Sends the queued commands back to back - each one as soon as the previous one
+   * is answered - and empties the queue. Stops at the first command that fails.
+   *
+   * @return The response to the last command sent: ok() if they all succeeded.
+   */
+
+  AtResponse run_queue() {
+    AtResponse response;
+    response.error = AtError::kNone;
+    for (uint8_t i = 0; i < queue_count_; i++) {
+      response = send(queue_[i]);
+      if (!response.ok()) {
+        break;
+      }
+    }
+    queue_count_ = 0;
+    return response;
+  }
+};
+
+#endif // _AT_COMMAND_H_
@@ -0,0 +1,253 @@
+#ifndef _BINARY_PAYLOAD_H_
+#define _BINARY_PAYLOAD_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/**
+ * @brief The compact binary alternative to the "Garden%Wtr lvl%16.2%0%1%1" text payload.
+ *
+ * Frame layout (all multi-byte values little-endian):
+ *
+ *   byte 0     kBinaryFrameMarker. Text payloads start with a printable character, so the
+ *              high bit tells the base station which format it's looking at.
+ *   byte 1     Node ID: LORA_NODE_ADDRESS - LORA_BASE_STATION_ADDRESS (Garden 2205 = 5)
+ *   then one or more fields:
+ *     byte 0   (PayloadField << 1) | alarm flag
+ *     byte 1-2 value as a signed fixed-point int16 (see field_scale())
+ *     if the alarm flag is set:
+ *     byte 3   alarm code
+ *     byte 4-5 (email interval in minutes << 4) | max emails
+ *
+ * Fields with alarm code 0 leave out the three alarm bytes: the base station only uses
+ * the email interval and max emails when there's an alarm. A reading only has an alarm
+ * code when it raises or clears an alarm (kAlarmClearedCode); see alarm_rules.h.
+ *
+ * A single reading is 5 bytes without an alarm, 8 with one, compared to 20 - 30 bytes as text.
+ */
+
+const uint8_t kBinaryFrameMarker = 0xB1; // 0xB0 | format version 1
+const uint8_t kBinaryFrameHeaderBytes = 2;
+const uint8_t kBinaryFieldBytes = 3;
+const uint8_t kBinaryAlarmBytes = 3;
+const uint8_t kMaxLoRaPayloadBytes = 240; // largest <Data> the Reyax AT+SEND accepts
+const uint8_t kAlarmClearedCode = 0xFF;    // the alarm code of a reading that cleared its field's alarm
+
+/**
+ * @brief The Reyax module takes an AT+SEND's data up to the "\r\n" that ends the command,
+ * and the base station splits the "+RCV=" line it gets at each ','. So a CR, LF or ',' in
+ * a frame goes on air as kPayloadEscape and the byte XOR kPayloadEscapeXor (as HDLC does),
+ * and so does kPayloadEscape itself. ReyaxLoRa escapes every packet it sends, and the base
+ * station unescapes every packet it gets; text payloads have none of these bytes, so they
+ * go out as they are. Frames that can fill a packet are sized by escaped_payload_length().
+ */
+
+const uint8_t kPayloadEscape = 0x1B;
+const uint8_t kPayloadEscapeXor = 0x20;
+
+inline bool payload_byte_escaped(uint8_t b) {
+  return b == '\r' || b == '\n' || b == ',' || b == kPayloadEscape;
+}
+
+// The number of bytes data takes on air
+inline size_t escaped_payload_length(const uint8_t* data, size_t length) {
+  size_t escaped = length;
+  for (size_t i = 0; i < length; i++) {
+    escaped += payload_byte_escaped(data[i]);
+  }
+  return escaped;
+}
+
+// Writes data to out as it goes on air; out has room for escaped_payload_length(). Returns its length.
+inline size_t escape_payload(const uint8_t* data, size_t length, uint8_t* out) {
+  size_t n = 0;
+  for (size_t i = 0; i < length; i++) {
+    if (payload_byte_escaped(data[i])) {
+      out[n++] = kPayloadEscape;
+      out[n++] = data[i] ^ kPayloadEscapeXor;
+    }
+    else {
+      out[n++] = data[i];
+    }
+  }
+  return n;
+}
+
+// Undoes escape_payload() (out can be data). Returns the length, or -1 if data ends in an escape.
+inline int unescape_payload(const uint8_t* data, size_t length, uint8_t* out) {
+  size_t n = 0;
+  for (size_t i = 0; i < length; i++) {
+    if (data[i] == kPayloadEscape) {
+      if (++i == length) {
+        return -1;
+      }
+      out[n++] = data[i] ^ kPayloadEscapeXor;
+    }
+    else {
+      out[n++] = data[i];
+    }
+  }
+  return (int)n;
+}
+
+enum class PayloadField : uint8_t {
+  kVoltage = 1,
+  kpH = 2,
+  kWaterVolume = 3,
+  kAutoFill = 4,     // auto-fill that stopped normally
+  kFloatSwitch = 5,  // auto-fill stopped by the float switch (or the float switch is up)
+  kFillTimer = 6,    // auto-fill stopped by AUTO_FILL_CUT_OFF_SECONDS
+  kFillConfidence = 7  // +/- gallons (95%) of the auto-fill volume sent with it
+};
+
+// Auto-fill and float switch fields report something that happened, not a reading
+inline bool field_is_event(PayloadField field) {
+  return field == PayloadField::kAutoFill || field == PayloadField::kFloatSwitch
+         || field == PayloadField::kFillTimer || field == PayloadField::kFillConfidence;
+}
+
+/**
+ * @brief The value name used for this field in the text payload, so the base station
+ * can report a binary field exactly the way it reports the text one.
+ */
+
+inline const char* field_name(PayloadField field) {
+  switch (field) {
+    case PayloadField::kVoltage: return "Voltage";
+    case PayloadField::kpH: return "pH";
+    case PayloadField::kWaterVolume: return "Wtr lvl";
+    case PayloadField::kAutoFill: return "Fill";
+    case PayloadField::kFloatSwitch: return "FL-SW";
+    case PayloadField::kFillTimer: return "TIMER";
+    case PayloadField::kFillConfidence: return "Fill +/-";
+  }
+  return "?";
+}
+
+// Fixed-point scale of each field: voltage is sent in 1/100 V, everything else in 1/10ths.
+inline float field_scale(PayloadField field) {
+  return field == PayloadField::kVoltage ? 100.0f : 10.0f;
+}
+
+/**
+ * @brief Builds a binary frame, one field at a time, in a fixed buffer.
+ */
+
+class BinaryPayload {
+private:
+    uint8_t buffer_[kMaxLoRaPayloadBytes];
+    uint8_t length_ = 0;
+    uint8_t escaped_length_ = 0; // on air (see escape_payload())
+
+public:
+    BinaryPayload(uint8_t node_id) {
+        buffer_[0] = kBinaryFrameMarker;
+        buffer_[1] = node_id;
+        clear();
+    }
+
+    /**
+     * @brief Appends one field. Returns false (and appends nothing) if it doesn't fit in
+     * one packet, escaped.
+     */
+
+    bool add(PayloadField field, float value, uint16_t alarm_code, uint16_t email_interval, uint16_t max_emails) {
+        uint8_t bytes[kBinaryFieldBytes + kBinaryAlarmBytes];
+        uint8_t length = 0;
+        float scaled = value * field_scale(field);
+        int32_t fixed = (int32_t)(scaled < 0 ? scaled - 0.5f : scaled + 0.5f);
+        if (fixed > INT16_MAX) fixed = INT16_MAX;
+        if (fixed < INT16_MIN) fixed = INT16_MIN;
+        bytes[length++] = ((uint8_t)field << 1) | (alarm_code ? 1 : 0);
+        bytes[length++] = (uint16_t)fixed & 0xFF;
+        bytes[length++] = (uint16_t)fixed >> 8;
+        if (alarm_code) {
+            if (email_interval > 0x0FFF) email_interval = 0x0FFF;
+            if (max_emails > 0x0F) max_emails = 0x0F;
+            uint16_t email = (email_interval << 4) | max_emails;
+            bytes[length++] = (uint8_t)alarm_code; // kAlarmRules' codes are checked to fit (alarm_rules.h)
+            bytes[length++] = email & 0xFF;
+            bytes[length++] = email >> 8;
+        }
+        size_t escaped = escaped_payload_length(bytes, length);
+        if (escaped_length_ + escaped > kMaxLoRaPayloadBytes) {
+            return false;
+        }
+        memcpy(&buffer_[length_], bytes, length);
+        length_ += length;
+        escaped_length_ += escaped;
+        return true;
+    }
+
+    // Removes all the fields, keeping the header.
+    void clear() {
+        length_ = kBinaryFrameHeaderBytes;
+        escaped_length_ = escaped_payload_length(buffer_, kBinaryFrameHeaderBytes);
+    }
+
+    bool empty() const { return length_ == kBinaryFrameHeaderBytes; }
+    const uint8_t* data() const { return buffer_; }
+    uint8_t length() const { return length_; }
+    uint8_t escaped_length() const { return escaped_length_; }
+};
+
+/**
+ * @brief One field of a decoded binary frame.
+ */
+
+struct DecodedField {
+  PayloadField field;
+  float value;
+  uint8_t alarm_code;
+  uint16_t email_interval; // 0 if there's no alarm
+  uint8_t max_emails;      // 0 if there's no alarm
+};
+
+/**
+ * @brief Decodes a binary frame (for the base station, or the host tools).
+ *
+ * @param node_address Gets the sender's LoRa address.
+ * @return The number of fields written to fields[], or -1 if the frame is malformed.
+ */
+
+inline int decode_binary_payload(const uint8_t* data, size_t length, uint16_t base_station_address,
+                                 uint16_t* node_address, DecodedField* fields, size_t max_fields) {
+  if (length < kBinaryFrameHeaderBytes || data[0] != kBinaryFrameMarker) {
+    return -1;
+  }
+  *node_address = base_station_address + data[1];
+  size_t pos = kBinaryFrameHeaderBytes;
+  size_t count = 0;
+  while (pos < length) {
+    if (pos + kBinaryFieldBytes > length || count == max_fields) {
+      return -1;
+    }
+    PayloadField field = (PayloadField)(data[pos] >> 1);
+    bool has_alarm = data[pos] & 1;
+    if (field < PayloadField::kVoltage || field > PayloadField::kFillConfidence) {
+      return -1;
+    }
+    int16_t fixed = (int16_t)(data[pos + 1] | (data[pos + 2] << 8));
+    DecodedField& out = fields[count++];
+    out.field = field;
+    out.value = fixed / field_scale(field);
+    out.alarm_code = 0;
+    out.email_interval = 0;
+    out.max_emails = 0;
+    pos += kBinaryFieldBytes;
+    if (has_alarm) {
+      if (pos + kBinaryAlarmBytes > length) {
+        return -1;
+      }
+      uint16_t email = data[pos + 1] | (data[pos + 2] << 8);
+      out.alarm_code = data[pos];
+      out.email_interval = email >> 4;
+      out.max_emails = email & 0x0F;
+      pos += kBinaryAlarmBytes;
+    }
+  }
+  return (int)count;
+}
+
+#endif // _BINARY_PAYLOAD_H_
@@ -0,0 +1,116 @@
+#ifndef _CALIBRATION_CURVE_H_
+#define _CALIBRATION_CURVE_H_
+
+#include <stddef.h>
+
+/**
+ * @brief One calibration point: a measured value (x, usually mV at the pin) and what it
+ * means (y: gallons, pH, volts...).
+ */
+
+struct CalibrationPoint {
+  float x;
+  float y;
+};
+
+// One straight piece of a CalibrationCurve: y = y0 + (x - x0) * slope
+struct CurveSegment {
+  float x0;
+  float y0;
+  float slope;
+};
+
+// Compile-time list of the indexes 0 .. N-1 (std::index_sequence is C++14)
+template <size_t... I> struct IndexList {};
+template <size_t N, size_t... I> struct MakeIndexList : MakeIndexList<N - 1, N - 1, I...> {};
+template <size_t... I> struct MakeIndexList<0, I...> { typedef IndexList<I...> type; };
+
+/**
+ * @brief True if the points can be used for a CalibrationCurve: x strictly increasing, and
+ * y either increasing or decreasing all the way (so every y has only one x).
+ * Use it in a static_assert where the table is defined.
+ */
+
+constexpr bool calibration_is_monotonic(const CalibrationPoint* points, size_t count, int direction = 0) {
+  return count < 2 ? true
+         : !(points[1].x > points[0].x) ? false
+         : direction == 0 ? (points[1].y == points[0].y ? false
+                             : calibration_is_monotonic(points + 1, count - 1, points[1].y > points[0].y ? 1 : -1))
+         : (direction > 0 ? points[1].y > points[0].y : points[1].y < points[0].y)
+           && calibration_is_monotonic(points + 1, count - 1, direction);
+}
+
+template <size_t N>
+constexpr bool calibration_is_valid(const CalibrationPoint (&points)[N]) {
+  return N >= 2 && calibration_is_monotonic(points, N);
+}
+
+/**
+ * @brief CalibrationCurve converts a measurement with a table of N calibration points,
+ * interpolating linearly between neighbouring points, and extending the first and last
+ * segments beyond the ends of the table.
+ *
+ * The slope of every segment is worked out when the curve is built - at compile time, for
+ * a constexpr curve - so a lookup is a compare per segment, a subtraction and a multiply.
+ * No division at run time.
+ *
+ * Define the points in config.h, then build the curve where it's used:
+ *
+ *   constexpr CalibrationPoint kPoints[] = {PH_CALIBRATION_POINTS};
+ *   static_assert(calibration_is_valid(kPoints), "PH_CALIBRATION_POINTS must be monotonic");
+ *   constexpr CalibrationCurve<3> kCurve(kPoints);
+ *   float pH = kCurve.convert(measured_mV);
+ */
+
+template <size_t N>
+class CalibrationCurve {
+  static_assert(N >= 2, "a calibration curve needs at least two points");
+
+private:
+    CurveSegment segments_[N - 1];
+    float x_max_;
+
+    template <size_t... I>
+    constexpr CalibrationCurve(const CalibrationPoint (&points)[N], IndexList<I...>)
+        : segments_{{points[I].x, points[I].y,
+                     (points[I + 1].y - points[I].y) / (points[I + 1].x - points[I].x)}...},
+          x_max_{points[N - 1].x} {}
+
+    constexpr float convert_from(float x, size_t i) const {
+        return (i + 2 >= N || x < segments_[i + 1].x0)
+               ? segments_[i].y0 + (x - segments_[i].x0) * segments_[i].slope
+               : convert_from(x, i + 1);
+    }
+
+    constexpr float invert_from(float y, size_t i) const {
+        return (i + 2 >= N || (segments_[i].slope > 0 ? y < segments_[i + 1].y0 : y > segments_[i + 1].y0))
+               ? segments_[i].x0 + (y - segments_[i].y0) / segments_[i].slope
+               : invert_from(y, i + 1);
+    }
+
+public:
+    constexpr CalibrationCurve(const CalibrationPoint (&points)[N])
+        : CalibrationCurve(points, typename MakeIndexList<N - 1>::type()) {}
+
+    // The calibrated value of x (can be evaluated at compile time)
+    constexpr float convert(float x) const {
+        return convert_from(x, 0);
+    }
+
+    /**
+     * @brief The x that convert() turns into y: for a threshold set in calibrated units
+     * (gallons) that's checked against raw measurements. This one divides, so work it out
+     * at compile time, or once.
+     */
+
+    constexpr float invert(float y) const {
+        return invert_from(y, 0);
+    }
+
+    // False if x is outside the table, where convert() can only extrapolate
+    constexpr bool in_range(float x) const {
+        return x >= segments_[0].x0 && x <= x_max_;
+    }
+};
+
+#endif // _CALIBRATION_CURVE_H_
@@ -14,10 +14,79 @@
 // Un-comment and change the baud rate below to change it.
 // #define LORA_BAUD_RATE 115200ULL     // default 115200
 
+// Radio settings sent with AT+PARAMETER in ReyaxLoRa::initialize(). All units must match.
+#define LORA_SPREAD_FACTOR 9  // 7 - 12
+#define LORA_BANDWIDTH 7      // 7 = 125 KHz (see ReyaxLoRa::set_bandwidth())
+#define LORA_CODING_RATE 1    // 1 = 4/5
+#define LORA_PREAMBLE 4       // 4 - 7
+
+// After a timer wakeup, ReyaxLoRa::initialize() trusts the radio settings it confirmed
+// on an earlier wake (kept in RTC memory) instead of sending them again, except on every
+// LORA_CONFIG_RECHECK_WAKES'th wake, or after any AT command has failed.
+#define LORA_CONFIG_RECHECK_WAKES 12 // 12 = once an hour at TIME_TO_SLEEP 300
+
+// Un-comment to send readings as compact binary frames (see binary_payload.h) instead
+// of "Garden%Wtr lvl%16.2%0%1%1" text. The base station must be able to decode them.
+// #define LORA_BINARY_PAYLOAD
+
+// Un-comment to have the base station ack every packet (see acked_delivery.h). Auto-fill
+// events and alarms that aren't acked are sent again on later wakes, with backoff.
+// The base station must support it.
+// #define LORA_ACKED_DELIVERY
+#define LORA_ACK_WINDOW_MS 1000               // how long to listen for the ack after each AT+SEND
+#define LORA_RETRY_BACKOFF_SECONDS 240        // wait before the first retry; doubles after each one...
+#define LORA_RETRY_MAX_BACKOFF_SECONDS 3600   // ...up to this
+
+// The base station can change TIME_TO_SLEEP, CIRC_PUMP_RUN_SECONDS, CIRC_PUMP_MAX_OFF_SECONDS,
+// the refill volumes, the email intervals and the radio settings with signed downlink commands
+// (see downlink.h and runtime_config.h). After a wake that sends a packet, the node listens for
+// one for that packet's time on air plus DOWNLINK_WINDOW_MS - but only once every
+// DOWNLINK_LISTEN_INTERVAL_SECONDS, since the window keeps the ESP32 awake. A command that
+// arrives while listening for an ack is taken too. DOWNLINK_WINDOW_MS 0 never listens.
+#define DOWNLINK_WINDOW_MS 500                // the base station's turnaround + the command's time on air
+#define DOWNLINK_LISTEN_INTERVAL_SECONDS 900  // so a change reaches the node within 15 minutes
+// New radio settings from a downlink command are on trial until the base station is heard on
+// them (an ack, or a command). After this many wakes that send on them without hearing it, the
+// node goes back to the settings it had before (see ConfigDownlink).
+#define DOWNLINK_RADIO_TRIAL_WAKES 4
+// The 16-byte key commands are signed with. The base station must have the same one, and anyone
+// who has it can reconfigure the node, so there's no default: put your own random key in
+// src/downlink_key.h (which git ignores), or pass it as a build flag, as
+//   #define DOWNLINK_KEY {0x3A, 0x91, ... 16 bytes ...}
+// The native programs use a fixed test key, since their node and base station are simulated.
+#if !defined(DOWNLINK_KEY) && defined(__has_include)
+#if __has_include("downlink_key.h")
+#include "downlink_key.h"
+#endif
+#endif
+#ifndef DOWNLINK_KEY
+#ifdef NATIVE_BUILD
+#define DOWNLINK_KEY {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, \
+                      0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F}
+#else
+#error "DOWNLINK_KEY isn't set: define it in src/downlink_key.h (see config.h)"
+#endif
+#endif
+
+// Logging (see log.h): LOG_LEVEL_NONE, _ERROR, _INFO or _DEBUG. Everything below the level is
+// compiled out; env:esp32doit-devkit-v1-release builds with LOG_LEVEL_NONE.
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+// LOG_SINK_BUFFER keeps the log in a RAM ring buffer instead of writing each line to the Serial
+// Monitor, and prints the last LOG_BUFFER_BYTES of it after a reset. LOG_SINK_SERIAL shows
+// each line as it's logged, to watch a wake on the bench.
+#ifndef LOG_SINK
+#define LOG_SINK LOG_SINK_BUFFER
+#endif
+#define LOG_BUFFER_BYTES 2048
+
 // Configure each of the variables below for each transmitter
 
-String TRANSMITTER_NAME = "Garden";
-#define TIME_TO_SLEEP 300 // 300 is 5 minutes
+#define TRANSMITTER_NAME "Garden"
+#define TIME_TO_SLEEP 300 // 300 is 5 minutes; only used until there are readings to schedule by (see below)
+#define CIRC_PUMP_RUN_SECONDS 180 // circulation pump runs this long every wake, while the ESP32 sleeps
+#define CIRC_PUMP_MAX_OFF_SECONDS 300 // and is never off longer than this, however long the sleep (see main.cpp)
 #define LORA_NODE_ADDRESS 2205UL // Bessie=2201, Boat=2202, Test=2203, Pool=2204, Garden=2205
 #define R1_VALUE 100500.0 // actual measured value
 #define R2_VALUE 22040.0  // ditto
@@ -25,13 +94,87 @@ String TRANSMITTER_NAME = "Garden";
 // measurements taken of the source voltage, to get the final voltage correct. Calibrate
 // at normal battery voltage for known input voltage.
 #define VOLTAGE_CALIBRATION 0.98  // Calculated 2/8/2023
+// mV at the voltage pin -> battery volts (see calibration_curve.h). The two points are the
+// straight line from VOLTAGE_CALIBRATION and the divider; add points measured at known
+// battery voltages (in increasing mV order) to correct the ADC's non-linearity.
+#define BATTERY_CALIBRATION_POINTS {0.0, 0.0}, \
+        {3300.0, 3.3 * VOLTAGE_CALIBRATION * (R1_VALUE + R2_VALUE) / R2_VALUE}
+
+// Each sensor reads samples until the mean is known to within +/- this many mV (95% confidence),
+// instead of always reading a fixed number of them. See SamplingPolicy in analog_reader.h. Only
+// the ADC2 voltage pin reads this way: the ADC1 pins use the AdcSampler's fixed window, unless
+// it fails.
+#define VOLTAGE_SAMPLE_TOLERANCE_MV 2.0      // about 0.01V at the battery
+#define WATER_VOLUME_SAMPLE_TOLERANCE_MV 3.0 // about 0.05 gallons
+#define PH_SAMPLE_TOLERANCE_MV 5.0           // about 0.03 pH
 
-#define LOWEST_MEASURED_GALLONS 5.5 // where the eTape starts to give valid readings
-#define LOWEST_MEASURED_VOLTAGE 1.73 // volts measured at 1.5" (5.5 gallons)
-#define VOLTS_PER_GALLON 0.065 // in the range from 8 gallons to 17.4 gallons (the relevant range)
+// Adaptive sleep (see sleep_scheduler.h): the sleep after each circulation pump run is picked
+// from the readings, between SLEEP_MIN_SECONDS and SLEEP_MAX_SECONDS. (It's only how often the
+// node reports: the circulation pump still runs every CIRC_PUMP_MAX_OFF_SECONDS during it.) It's SLEEP_MAX_SECONDS
+// while the water volume and pH are steady (changing less than the *_STEADY_* rates),
+// comes down towards SLEEP_MIN_SECONDS as they change faster (SLEEP_MIN_SECONDS at the
+// *_FAST_* rates or more), and is short enough to catch the water reaching
+// REFILL_START_VOLUME on time. Changes count for less as the battery gets low: at
+// LOW_VOLTAGE_ALARM_VALUE and below, only SLEEP_LOW_BATTERY_WEIGHT as much.
+#define SLEEP_MIN_SECONDS 120
+#define SLEEP_MAX_SECONDS 1800
+#define SLEEP_WATER_STEADY_GALLONS_PER_HOUR 0.5
+#define SLEEP_WATER_FAST_GALLONS_PER_HOUR 3.0
+#define SLEEP_PH_STEADY_PER_HOUR 0.05
+#define SLEEP_PH_FAST_PER_HOUR 0.5
+#define SLEEP_RATE_WINDOW_SECONDS 7200   // rates are fitted to the readings of the last 2 hours
+#define SLEEP_BATTERY_OK_VOLTS 13.3      // at or above this, changes count in full
+#define SLEEP_LOW_BATTERY_WEIGHT 0.25
+
+// Report by exception: a reading is only sent when it has moved at least its deadband since
+// it was last sent, when it raises or clears an alarm, or when it hasn't been sent for
+// REPORT_HEARTBEAT_SECONDS. See report_policy.h.
+#define VOLTAGE_REPORT_DEADBAND 0.05      // volts
+#define WATER_VOLUME_REPORT_DEADBAND 0.2  // gallons
+#define PH_REPORT_DEADBAND 0.1
+#define REPORT_HEARTBEAT_SECONDS 3600     // every reading goes out at least once an hour
+
+// The firmware times each phase of a wake (see phase_profiler.h) and sends the min / mean /
+// max of each as a diagnostic packet every PROFILE_REPORT_WAKES wakes (the wakes that only
+// turn the circulation pump off, and the sample wakes, count too).
+#define PROFILE_REPORT_WAKES 240 // 240 = about every 6 hours at TIME_TO_SLEEP 300, with sample wakes
+
+// Sample history (see sample_history.h): the sleep between full wakes is cut into sample wakes
+// HISTORY_SAMPLE_SECONDS apart, which only read the water volume and pH - no radio - and keep the
+// readings in RTC memory. Once the oldest is HISTORY_UPLOAD_SECONDS old, or HISTORY_MAX_SAMPLES
+// are kept, they go to the base station in one delta-encoded frame, so it sees the excursions
+// between the reported readings. HISTORY_SAMPLE_SECONDS 0 keeps only the full wakes' readings.
+#define HISTORY_SAMPLE_SECONDS 120
+#define HISTORY_UPLOAD_SECONDS 7200  // about 70 samples: what fits in one frame
+#define HISTORY_MAX_SAMPLES 96       // 8 bytes of RTC memory each
+
+// mV from the eTape -> gallons in the tub, in increasing mV order (see calibration_curve.h).
+// The eTape starts to give valid readings at 1.5" (5.5 gallons, 1730 mV). These points
+// are the single 65 mV-per-gallon slope that was measured from 8 to 17.4 gallons; replace
+// them with points measured over the whole range - as many as you like.
+#define WATER_VOLUME_CALIBRATION_POINTS {1730.0, 5.5}, {1892.5, 8.0}, {2503.5, 17.4}
 #define REFILL_START_VOLUME 15.0 // start refilling when it's less than this
 #define REFILL_STOP_VOLUME 17.0 // stop refilling when it's this full
 #define AUTO_FILL_CUT_OFF_SECONDS 180.0 // s/b 180 (3 minutes)
+#define FILL_STOP_LEAD_SECONDS 1.0 // stop the fill pump this many seconds of flow early: sensor lag + water in the pipe
+
+// The water volume estimator (see water_volume_estimator.h). It learns the use rate and the
+// fill pump's flow as it goes; these say how sure it is to start with, how much each can
+// change that the model doesn't know about, and how noisy an eTape reading is however many
+// samples it averages (ripple, temperature).
+#define FILL_PUMP_GALLONS_PER_MINUTE 1.0          // the fill pump's flow, to start with
+#define FILL_PUMP_START_SIGMA_GPM 0.3
+#define FILL_PUMP_FLOW_SIGMA_GPM 0.02             // per minute of pumping
+#define WATER_VOLUME_START_RATE_SIGMA_GPH 0.5
+#define WATER_VOLUME_RATE_SIGMA_GPH 0.05          // per hour: the plants, the weather
+#define WATER_VOLUME_PROCESS_SIGMA_GALLONS 0.03   // per hour
+#define WATER_VOLUME_READING_SIGMA_GALLONS 0.05
+#define WATER_VOLUME_OUTLIER_SIGMAS 5.0           // a reading this far off restarts the estimate: a hand fill, say
+#define WATER_VOLUME_MAX_TOLERANCE_MV 15.0        // the most sample_tolerance_mV() lets a reading's samples spread
+// Alarms (see alarm_rules.h): each *_ALARM_VALUE raises its alarm after *_DEBOUNCE readings
+// in a row past it, and clears it after *_DEBOUNCE readings in a row back inside it by
+// *_HYSTERESIS. Only the raise and the clear are sent with an alarm code; the base station
+// repeats the emails every *_EMAIL_INTERVAL, up to *_MAX_EMAILS, until the clear.
 #define AUTO_FILL_ALARM_CODE 1
 #define AUTO_FILL_EMAIL_INTERVAL 1
 #define AUTO_FILL_MAX_EMAILS 1
@@ -40,29 +183,51 @@ String TRANSMITTER_NAME = "Garden";
 #define HIGH_VOLTAGE_ALARM_CODE 3
 #define HIGH_VOLTAGE_EMAIL_INTERVAL 15 // In MINUTES
 #define HIGH_VOLTAGE_MAX_EMAILS 3
+#define HIGH_VOLTAGE_ALARM_HYSTERESIS 0.15 // the controller's absorption charge can sit just under 14.55
+#define HIGH_VOLTAGE_ALARM_DEBOUNCE 2
 
 #define LOW_VOLTAGE_ALARM_VALUE 13.10 // 13.0 is about 30% for a LiFePO4 (but that's a rough estimate)
 #define LOW_VOLTAGE_ALARM_CODE 1 // Not an urgent alarm
 #define LOW_VOLTAGE_EMAIL_INTERVAL 240 // In MINUTES (4 hours)
 #define LOW_VOLTAGE_MAX_EMAILS 5
+#define LOW_VOLTAGE_ALARM_HYSTERESIS 0.2 // a pump or radio load pulls it down 0.1V or so
+#define LOW_VOLTAGE_ALARM_DEBOUNCE 2
 
 #define LOW_PH_ALARM_VALUE 5.4 // not urgent, per Fran
 #define HIGH_PH_ALARM_VALUE 6.7
 #define PH_ALARM_CODE 1
 #define PH_ALARM_EMAIL_INTERVAL 360 // not urgent, per Fran (6 hours)
 #define PH_MAX_EMAILS 3
+#define PH_ALARM_HYSTERESIS 0.2
+#define PH_ALARM_DEBOUNCE 2
 #define PH_LOW_CAL_VOLTAGE_MV 2030.0 // avg millivolts in 4.00 pH calibration solution (factory default in ph_grav.h = 2030)
 #define PH_MID_CAL_VOLTAGE_MV 1500.0 // avg millivolts in 7.00 pH calibration solution (factory default = 1500)
 #define PH_HI_CAL_VOLTAGE_MV 975.0 // avg millivolts in 10.00 pH calibration solution (factory default = 975)
+// mV from the probe -> pH, in increasing mV order (see calibration_curve.h)
+#define PH_CALIBRATION_POINTS {PH_HI_CAL_VOLTAGE_MV, 10.0}, {PH_MID_CAL_VOLTAGE_MV, 7.0}, {PH_LOW_CAL_VOLTAGE_MV, 4.0}
 
 #define LOW_WATER_ALARM_VALUE 14.0 // not urgent (Auto-refill s/h happened at 15.0)
 #define LOW_WATER_ALARM_CODE 1
 #define LOW_WATER_EMAIL_INTERVAL 360 // in minutes (6 hours)
 #define LOW_WATER_MAX_EMAILS 5
+#define LOW_WATER_ALARM_HYSTERESIS 0.5 // an auto-fill clears it
+#define LOW_WATER_ALARM_DEBOUNCE 2
 
 #define HIGH_WATER_ALARM_VALUE 18.0 // tub c/b overflowing, stuck pump switch
 #define HIGH_WATER_ALARM_CODE 33
 #define HIGH_WATER_EMAIL_INTERVAL 15 // in minutes
 #define HIGH_WATER_MAX_EMAILS 5
+#define HIGH_WATER_ALARM_HYSTERESIS 0.5
+#define HIGH_WATER_ALARM_DEBOUNCE 1 // urgent: no waiting
+
+// During deep sleep the ULP coprocessor samples the float switch and water level every
+// ULP_WATCHDOG_PERIOD_MS, and wakes the ESP32 early if the float switch comes up, or the water
+// goes past one of these levels, for ULP_WATCHDOG_DEBOUNCE_SAMPLES samples in a row.
+// See ulp_watchdog.h.
+#define ULP_WATCHDOG_PERIOD_MS 2000
+#define ULP_WATCHDOG_DEBOUNCE_SAMPLES 3 // rides out splashes and eTape noise
+#define ULP_WAKE_HIGH_WATER_GALLONS HIGH_WATER_ALARM_VALUE
+#define ULP_WAKE_LOW_WATER_GALLONS LOW_WATER_ALARM_VALUE
+#define ULP_WAKE_HYSTERESIS_GALLONS 0.25 // a level must come back this far before it can wake it again
 
 #endif // #ifndef _CONFIG_H_
@@ -0,0 +1,360 @@
+#ifndef _DOWNLINK_H_
+#define _DOWNLINK_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hal.h"
+#include "config.h"
+#include "runtime_config.h"
+#include "siphash.h"
+#include "reyax_lora.h"
+#include "fixed_string.h"
+#include "log.h"
+
+/**
+ * @brief Downlink commands: how the base station changes a node's RuntimeConfig over LoRa.
+ *
+ * A node only listens right after it has sent something (see ConfigDownlink::receive()),
+ * so a base station with a command waiting for a node sends it as soon as it gets a
+ * packet from it (after the ack, with acked delivery):
+ *
+ *   '@' version ';' setting '=' value ';' setting '=' value ... '#' tag
+ *
+ *   "@7;sleep=600;refill_start=14.5#5C0F3A9E17B2D408"
+ *
+ * The settings are the names in kRuntimeSettings. version is a decimal number that has to
+ * be higher than the version of the last command the node applied (it's saved with the
+ * settings), so an old command can't be replayed. tag is 16 hex digits: SipHash-2-4, keyed
+ * with DOWNLINK_KEY, of the node's address (2 bytes, little-endian) followed by everything
+ * between the '@' and the '#'. Nobody without the key can make a command, and a command
+ * for one node can't be used on another.
+ *
+ * The node applies all of the settings, or none of them if any is unknown or out of range,
+ * saves them in NVS, and answers with a packet of its own:
+ *
+ *   "@7:OK"  or  "@7:ERR=setting"  (or =stale, =nvs)
+ *
+ * The base station should send the command again after each packet it gets from the node
+ * until it has the answer. A command with the version that's already applied is answered
+ * OK again without changing anything, so it doesn't matter if an answer is lost. Commands
+ * with the wrong tag, or that can't be parsed, aren't answered.
+ *
+ * New radio settings (sf, bw, cr, preamble) are sent to the radio on the next wake, after
+ * the answer has gone out with the old ones: the base station switches when it gets the OK.
+ * If that OK is lost, the two are on different settings and can't hear each other, so the
+ * new settings are on trial: the node listens after every wake, and keeps them once it hears
+ * the base station on them - an ack, or any command. The base station should send the same
+ * command once more after the first packet it gets on the new settings (it's answered OK
+ * again). If DOWNLINK_RADIO_TRIAL_WAKES wakes go by without hearing it, the node goes back
+ * to the whole config it had before the command, version and all, so the base station's
+ * next try of the command is applied again. A base station that got the OK but then hears
+ * nothing on the new settings should go back to the old ones too.
+ */
+
+const char kDownlinkMarker = '@';
+const char kDownlinkTagSeparator = '#';
+const uint8_t kDownlinkTagDigits = 16;
+const uint8_t kDownlinkKey[16] = DOWNLINK_KEY;
+
+enum class DownlinkResult : uint8_t {
+  kApplied,
+  kAlreadyApplied,  // the version that's in use: nothing to do, but answer OK
+  kBadTag,
+  kMalformed,
+  kStale,           // an older version than the one in use
+  kBadSetting,      // an unknown setting, or a value out of range
+  kSaveFailed       // applied, but couldn't be saved in NVS
+};
+
+// What the answer says after "ERR=", or nullptr if the command isn't answered (or is OK)
+inline const char* downlink_error_name(DownlinkResult result) {
+  switch (result) {
+    case DownlinkResult::kStale: return "stale";
+    case DownlinkResult::kBadSetting: return "setting";
+    case DownlinkResult::kSaveFailed: return "nvs";
+    default: return nullptr;
+  }
+}
+
+// The tag of a command for node_address: body is everything between the '@' and the '#'
+inline uint64_t downlink_tag(uint16_t node_address, const char* body, size_t length) {
+  uint8_t message[kMaxLoRaPayloadBytes + 2];
+  if (length > kMaxLoRaPayloadBytes) {
+    length = kMaxLoRaPayloadBytes;
+  }
+  message[0] = node_address & 0xFF;
+  message[1] = node_address >> 8;
+  memcpy(&message[2], body, length);
+  return siphash24(kDownlinkKey, message, length + 2);
+}
+
+/**
+ * @brief Builds a signed command (for the base station, or a host tool standing in for it).
+ *
+ * @param settings "sleep=600;refill_start=14.5", or "" to send only the version
+ * @return false if it doesn't fit in one packet
+ */
+
+inline bool build_downlink_command(uint32_t version, const char* settings, uint16_t node_address, PayloadText& out) {
+  out.clear();
+  out.append(kDownlinkMarker).append_uint(version);
+  if (settings[0]) {
+    out.append(';').append(settings);
+  }
+  uint64_t tag = downlink_tag(node_address, out.c_str() + 1, out.length() - 1);
+  out.append(kDownlinkTagSeparator);
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    out.append_hex((uint8_t)(tag >> shift));
+  }
+  return !out.truncated();
+}
+
+/**
+ * @brief Checks a command's tag and version, and applies its settings to a copy of current.
+ *
+ * @param updated Gets current with the settings changed, and the command's version (if the
+ * tag is good) - whatever the result
+ */
+
+inline DownlinkResult parse_downlink_command(const char* data, size_t length, uint16_t node_address,
+                                             const RuntimeConfig& current, RuntimeConfig* updated) {
+  *updated = current;
+  if (length < 3 + kDownlinkTagDigits || data[0] != kDownlinkMarker
+      || data[length - kDownlinkTagDigits - 1] != kDownlinkTagSeparator) {
+    return DownlinkResult::kMalformed;
+  }
+  const char* body = data + 1;
+  size_t body_length = length - kDownlinkTagDigits - 2;
+  uint64_t tag = 0;
+  for (const char* p = data + length - kDownlinkTagDigits; p < data + length; p++) {
+    int digit = (*p >= '0' && *p <= '9') ? *p - '0' : (*p >= 'A' && *p <= 'F') ? *p - 'A' + 10
+                : (*p >= 'a' && *p <= 'f') ? *p - 'a' + 10 : -1;
+    if (digit < 0) {
+      return DownlinkResult::kMalformed;
+    }
+    tag = (tag << 4) | (uint64_t)digit;
+  }
+  if (tag != downlink_tag(node_address, body, body_length)) {
+    return DownlinkResult::kBadTag;
+  }
+
+  size_t pos = 0;
+  uint32_t version = 0;
+  while (pos < body_length && body[pos] >= '0' && body[pos] <= '9' && pos < 9) {
+    version = version * 10 + (body[pos++] - '0');
+  }
+  if (pos == 0 || (pos < body_length && body[pos] != ';')) {
+    return DownlinkResult::kMalformed;
+  }
+  updated->version = version;
+  if (version < current.version) {
+    return DownlinkResult::kStale;
+  }
+  if (version == current.version) {
+    return DownlinkResult::kAlreadyApplied;
+  }
+
+  while (pos < body_length) {
+    pos++; // the ';'
+    size_t end = pos;
+    while (end < body_length && body[end] != ';') end++;
+    const char* equals = (const char*)memchr(body + pos, '=', end - pos);
+    char value[16];
+    size_t value_length = equals ? body + end - (equals + 1) : 0;
+    if (!equals || value_length == 0 || value_length >= sizeof(value)) {
+      return DownlinkResult::kBadSetting;
+    }
+    const RuntimeSetting* setting = find_runtime_setting(body + pos, equals - (body + pos));
+    memcpy(value, equals + 1, value_length);
+    value[value_length] = '\0';
+    char* value_end;
+    float number = strtof(value, &value_end);
+    if (!setting || *value_end || !set_runtime_setting(*updated, *setting, number)) {
+      return DownlinkResult::kBadSetting;
+    }
+    pos = end;
+  }
+  return runtime_config_valid(*updated) ? DownlinkResult::kApplied : DownlinkResult::kBadSetting;
+}
+
+/**
+ * @brief A change of radio settings on trial (see above): what to go back to if the base
+ * station isn't heard on the new ones. Saved in NVS as well, so a reset during the trial
+ * doesn't keep settings nobody has heard.
+ */
+
+struct RadioTrial {
+  RuntimeConfig fallback;  // the config in use before the command
+  bool active;
+};
+
+// The NVS key the trial is saved under
+const char* const kRadioTrialNvsKey = "radio_trial";
+
+// When the node last opened a receive window, and the radio trial. Kept in RTC memory, across deep sleep.
+struct DownlinkState {
+  uint32_t last_window_s;  // hal::rtc_seconds()
+  bool listened;           // false until the first window since power on
+  bool trial_loaded;       // trial has been read from NVS since power on
+  RadioTrial trial;
+  uint8_t trial_wakes;     // wakes that sent on the new settings without hearing the base station
+};
+
+RTC_DATA_ATTR static DownlinkState downlink_state;
+
+/**
+ * @brief ConfigDownlink takes the base station's commands on the node side:
+ *
+ *   downlink.begin(lora);   // before sending: a command can come in while waiting for an ack
+ *   ...send the wake's packets...
+ *   downlink.receive(lora); // listen (if it's time to), apply, save and answer
+ */
+
+class ConfigDownlink {
+private:
+    DownlinkState& state_;
+    char command_[kMaxLoRaPayloadBytes + 1];
+    uint8_t command_length_ = 0;
+    bool heard_base_station_ = false;  // anything from it (an ack too) since begin()
+
+    // Keeps the first command from the base station that arrives
+    static bool on_receive(const char* line, void* context) {
+        ConfigDownlink* downlink = (ConfigDownlink*)context;
+        unsigned int address, length;
+        int data_start = 0;
+        int parsed = sscanf(line, "+RCV=%u,%u,%n", &address, &length, &data_start);
+        if (parsed == 2 && address == LORA_BASE_STATION_ADDRESS) {
+            downlink->heard_base_station_ = true;
+        }
+        if (downlink->command_length_ || parsed != 2 || !data_start || address != LORA_BASE_STATION_ADDRESS || line[data_start] != kDownlinkMarker
+            || length > kMaxLoRaPayloadBytes || strlen(line + data_start) < length) {
+            return false;
+        }
+        memcpy(downlink->command_, line + data_start, length);
+        downlink->command_[length] = '\0';
+        downlink->command_length_ = (uint8_t)length;
+        return true;
+    }
+
+    RadioTrial& trial() {
+        if (!state_.trial_loaded) {
+            if (!hal::nvs_read(kRadioTrialNvsKey, &state_.trial, sizeof(state_.trial))
+                || !runtime_config_valid(state_.trial.fallback)) {
+                state_.trial.active = false;
+            }
+            state_.trial_loaded = true;
+            state_.trial_wakes = 0;
+        }
+        return state_.trial;
+    }
+
+    void save_trial(bool active, const RuntimeConfig& fallback) {
+        state_.trial.active = active;
+        state_.trial.fallback = fallback;
+        state_.trial_wakes = 0;
+        hal::nvs_write(kRadioTrialNvsKey, &state_.trial, sizeof(state_.trial));
+    }
+
+    // Ends the radio trial if the base station was heard this wake, or gives up on it
+    void check_trial() {
+        RadioTrial& current = trial();
+        if (!current.active) {
+            return;
+        }
+        if (heard_base_station_) {
+            save_trial(false, current.fallback);
+            LOG_INFO("New radio settings confirmed: the base station was heard on them");
+        }
+        else if (++state_.trial_wakes >= DOWNLINK_RADIO_TRIAL_WAKES) {
+            LOG_ERROR("The base station wasn't heard on the new radio settings: going back to the old ones");
+            save_runtime_config(current.fallback);
+            save_trial(false, current.fallback);
+        }
+    }
+
+    void handle(ReyaxLoRa& lora) {
+        RuntimeConfig updated;
+        const RuntimeConfig current = runtime_config();
+        DownlinkResult result = parse_downlink_command(command_, command_length_, LORA_NODE_ADDRESS,
+                                                       current, &updated);
+        if (result == DownlinkResult::kBadTag || result == DownlinkResult::kMalformed) {
+            LOG_ERROR(result == DownlinkResult::kBadTag ? "Downlink command ignored: bad tag"
+                                                        : "Downlink command ignored: malformed");
+            return;
+        }
+        if (result == DownlinkResult::kApplied && !save_runtime_config(updated)) {
+            result = DownlinkResult::kSaveFailed;
+        }
+        if ((result == DownlinkResult::kApplied || result == DownlinkResult::kSaveFailed)
+            && !same_radio_settings(current, updated)) {
+            save_trial(true, current);
+        }
+        const char* error = downlink_error_name(result);
+        if (LOG_ENABLED(LOG_LEVEL_INFO)) {
+            FixedString<kMaxLoRaPayloadBytes + 48> line("Downlink command ");
+            line.append(command_, command_length_ - kDownlinkTagDigits - 1).append(": ");
+            line.append(error ? error : result == DownlinkResult::kApplied ? "applied" : "already applied");
+            LOG_INFO(line.c_str());
+        }
+        FixedString<24> answer;
+        answer.append(kDownlinkMarker).append_uint(updated.version).append(':');
+        if (error) {
+            answer.append("ERR=").append(error);
+        }
+        else {
+            answer.append("OK");
+        }
+        lora.send_text_payload(answer.c_str());
+    }
+
+public:
+    ConfigDownlink(DownlinkState& state = downlink_state) : state_(state) {}
+
+    // Starts taking commands from lora's packets. Call before the wake sends anything.
+    void begin(ReyaxLoRa& lora) {
+        command_length_ = 0;
+        heard_base_station_ = false;
+        lora.set_packet_handler(on_receive, this);
+    }
+
+    /**
+     * @brief True if a receive window is due: the first wake after power on, every wake
+     * while new radio settings are on trial, and otherwise every DOWNLINK_LISTEN_INTERVAL_SECONDS
+     */
+
+    bool listen_due() {
+        return DOWNLINK_WINDOW_MS > 0
+               && (!state_.listened || radio_on_trial()
+                   || hal::rtc_seconds() - state_.last_window_s >= DOWNLINK_LISTEN_INTERVAL_SECONDS);
+    }
+
+    // True if new radio settings haven't been heard on yet (see above)
+    bool radio_on_trial() { return trial().active; }
+
+    /**
+     * @brief Call after the wake's packets have gone out (the base station only sends a
+     * command in reply to one). If no command came in while they were being sent, and a
+     * window is due, listens for the last packet's time on air plus DOWNLINK_WINDOW_MS.
+     * Then moves the radio trial on, applies the command, if there is one, and answers it.
+     *
+     * @return true if there was a command (good or not)
+     */
+
+    bool receive(ReyaxLoRa& lora) {
+        if (!command_length_ && listen_due()) {
+            state_.listened = true;
+            state_.last_window_s = hal::rtc_seconds();
+            lora.listen((uint32_t)lora.time_on_air_ms(lora.last_send_length()) + DOWNLINK_WINDOW_MS);
+        }
+        check_trial(); // before the command, which may start a new trial
+        if (!command_length_) {
+            return false;
+        }
+        handle(lora);
+        command_length_ = 0;
+        return true;
+    }
+};
+
+#endif // _DOWNLINK_H_
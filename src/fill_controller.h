@@ -0,0 +1,138 @@
+#ifndef _FILL_CONTROLLER_H_
+#define _FILL_CONTROLLER_H_
+
+#include "hal.h"
+#include "config.h"
+#include "water_volume_sensor.h"
+#include "water_volume_estimator.h"
+#include "runtime_config.h"
+
+enum class FillStopReason : uint8_t {
+  kFull,         // reached REFILL_STOP_VOLUME
+  kFloatSwitch,  // the high water float switch came up
+  kTimer         // ran for AUTO_FILL_CUT_OFF_SECONDS
+};
+
+// The "type" send_auto_fill_data() reports for each reason
+inline const char* fill_stop_reason_name(FillStopReason reason) {
+  switch (reason) {
+    case FillStopReason::kFull: return "Fill";
+    case FillStopReason::kFloatSwitch: return "FL-SW";
+    case FillStopReason::kTimer: return "TIMER";
+  }
+  return "?";
+}
+
+struct FillResult {
+  FillStopReason reason;
+  float seconds;          // how long the fill pump ran
+  float end_volume;       // estimated water volume when the pump stopped
+  float fill_rate_gpm;    // estimated fill rate, gallons per minute (learned over all the fills)
+};
+
+/**
+ * @brief FillController runs the auto-fill pump until the tub reaches REFILL_STOP_VOLUME
+ * (or the refill_stop a downlink command set, see runtime_config.h).
+ *
+ * - The float switch interrupt turns the pump off itself, the moment the switch comes up,
+ *   instead of setting a flag for a loop to find up to a couple of seconds later.
+ * - The water volume is read continuously while the pump runs, and goes into the
+ *   WaterVolumeEstimator with the pump's on-time, which also learns the pump's flow.
+ * - The pump is stopped FILL_STOP_LEAD_SECONDS of flow before the estimated volume reaches
+ *   REFILL_STOP_VOLUME, to allow for the sensor's lag and the water still in the pipe, so
+ *   the tub ends up at REFILL_STOP_VOLUME rather than above it.
+ * - AUTO_FILL_CUT_OFF_SECONDS is still the hard limit on how long the pump can run.
+ *
+ * There can only be one FillController, because the interrupt handler has to be static.
+ */
+
+class FillController {
+private:
+    static uint8_t fill_pump_pin_;
+    static volatile bool float_switch_tripped_;
+    uint8_t float_switch_pin_;
+    WaterVolumeSensor& water_volume_sensor_;
+    WaterVolumeEstimator& estimator_;
+
+    static void IRAM_ATTR float_switch_isr() {
+        hal::digital_write(fill_pump_pin_, LOW);
+        float_switch_tripped_ = true;
+    }
+
+public:
+    FillController(uint8_t fill_pump_pin, uint8_t float_switch_pin, WaterVolumeSensor& water_volume_sensor,
+                   WaterVolumeEstimator& estimator)
+        : float_switch_pin_{float_switch_pin}, water_volume_sensor_(water_volume_sensor), estimator_(estimator) {
+        fill_pump_pin_ = fill_pump_pin;
+    }
+
+    /**
+     * @brief Sets up the pins and the float switch interrupt. Call once, in setup().
+     */
+
+    void begin() {
+        hal::pin_mode(fill_pump_pin_, OUTPUT);
+        hal::pin_mode(float_switch_pin_, INPUT);
+        float_switch_tripped_ = (hal::digital_read(float_switch_pin_) == HIGH);
+        hal::attach_interrupt(float_switch_pin_, float_switch_isr, RISING);
+    }
+
+    // True if the float switch is up now, or came up at any time since begin()
+    bool float_switch_tripped() {
+        if (hal::digital_read(float_switch_pin_) == HIGH) {
+            float_switch_tripped_ = true;
+        }
+        return float_switch_tripped_;
+    }
+
+    /**
+     * @brief Runs the fill pump until the tub is full, the float switch comes up, or
+     * AUTO_FILL_CUT_OFF_SECONDS have passed. The estimator should have been updated with a
+     * reading just before.
+     */
+
+    FillResult fill() {
+        FillResult result;
+        result.reason = FillStopReason::kFull;
+        uint64_t start_us = hal::micros();
+        uint64_t last_us = start_us;
+        const float kCutOffUs = AUTO_FILL_CUT_OFF_SECONDS * 1000000.0;
+
+        hal::digital_write(fill_pump_pin_, HIGH);
+        if (float_switch_tripped()) { // in case it came up just before the pump started
+            hal::digital_write(fill_pump_pin_, LOW);
+        }
+        while (true) {
+            if (float_switch_tripped_) { // the ISR has already turned the pump off
+                result.reason = FillStopReason::kFloatSwitch;
+                break;
+            }
+            if (hal::micros() - start_us >= kCutOffUs) {
+                result.reason = FillStopReason::kTimer;
+                break;
+            }
+            float reading = water_volume_sensor_.reported_water_volume(estimator_.sample_tolerance_mV());
+            uint64_t now_us = hal::micros();
+            estimator_.predict((now_us - last_us) / 1000000.0f);
+            estimator_.update(reading, water_volume_sensor_.last_reading_variance());
+            last_us = now_us;
+            float volume = estimator_.volume() + estimator_.fill_rate_gpm() / 60 * FILL_STOP_LEAD_SECONDS;
+            if (volume >= runtime_config().refill_stop_volume) {
+                result.reason = FillStopReason::kFull;
+                break;
+            }
+        }
+        hal::digital_write(fill_pump_pin_, LOW);
+        uint64_t end_us = hal::micros();
+        estimator_.predict((end_us - last_us) / 1000000.0f);
+        result.seconds = (end_us - start_us) / 1000000.0;
+        result.end_volume = estimator_.volume();
+        result.fill_rate_gpm = estimator_.fill_rate_gpm();
+        return result;
+    }
+};
+
+uint8_t FillController::fill_pump_pin_ = 0;
+volatile bool FillController::float_switch_tripped_ = false;
+
+#endif // _FILL_CONTROLLER_H_
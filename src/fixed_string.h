@@ -0,0 +1,114 @@
+#ifndef _FIXED_STRING_H_
+#define _FIXED_STRING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+/**
+ * @brief FixedString is a string in a fixed-size buffer (usually on the stack), for building
+ * payloads, AT commands and Serial Monitor lines without the heap allocations of Arduino's
+ * String - which, on a node that runs for months, fragment the heap.
+ *
+ * Text that doesn't fit is cut off, and truncated() says so. Numbers are formatted here
+ * too, rather than with snprintf(), whose float formatting can allocate.
+ *
+ *   FixedString<32> line("Reported_voltage:");
+ *   line.append_float(voltage, 2);
+ *   LOG_INFO(line.c_str());
+ */
+
+template <size_t N>
+class FixedString {
+private:
+    char buffer_[N + 1];
+    size_t length_ = 0;
+    bool truncated_ = false;
+
+public:
+    FixedString() { buffer_[0] = '\0'; }
+    explicit FixedString(const char* s) : FixedString() { append(s); }
+
+    FixedString& append(const char* s, size_t count) {
+        if (count > N - length_) {
+            count = N - length_;
+            truncated_ = true;
+        }
+        memcpy(&buffer_[length_], s, count);
+        length_ += count;
+        buffer_[length_] = '\0';
+        return *this;
+    }
+
+    FixedString& append(const char* s) { return append(s, strlen(s)); }
+
+    FixedString& append(char c) { return append(&c, 1); }
+
+    FixedString& append_uint(uint32_t value) {
+        char digits[10];
+        uint8_t count = 0;
+        do {
+            digits[count++] = '0' + value % 10;
+            value /= 10;
+        } while (value);
+        while (count) {
+            append(digits[--count]);
+        }
+        return *this;
+    }
+
+    FixedString& append_int(int32_t value) {
+        if (value < 0) {
+            append('-');
+            return append_uint(0 - (uint32_t)value);
+        }
+        return append_uint((uint32_t)value);
+    }
+
+    /**
+     * @brief Appends value with a fixed number of decimal places (0 - 6), rounded half away
+     * from zero: append_float(13.2, 2) appends "13.20". Like Arduino's Print, values too
+     * big for 32 bits appear as "ovf".
+     */
+
+    FixedString& append_float(float value, uint8_t decimals) {
+        static const uint32_t kScale[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+        if (decimals > 6) decimals = 6;
+        if (isnan(value)) return append("nan");
+        if (isinf(value)) return append("inf");
+        double magnitude = fabs((double)value);
+        if (magnitude > 4294967040.0) return append("ovf");
+        uint64_t scaled = (uint64_t)(magnitude * kScale[decimals] + 0.5);
+        if (value < 0) append('-');
+        append_uint((uint32_t)(scaled / kScale[decimals]));
+        if (decimals) {
+            append('.');
+            uint32_t fraction = (uint32_t)(scaled % kScale[decimals]);
+            for (uint32_t place = kScale[decimals] / 10; place; place /= 10) {
+                append((char)('0' + fraction / place % 10));
+            }
+        }
+        return *this;
+    }
+
+    // Two upper-case hex digits
+    FixedString& append_hex(uint8_t value) {
+        const char* kHex = "0123456789ABCDEF";
+        append(kHex[value >> 4]);
+        return append(kHex[value & 0x0F]);
+    }
+
+    void clear() {
+        length_ = 0;
+        truncated_ = false;
+        buffer_[0] = '\0';
+    }
+
+    const char* c_str() const { return buffer_; }
+    size_t length() const { return length_; }
+    static constexpr size_t capacity() { return N; }
+    bool truncated() const { return truncated_; }
+};
+
+#endif // _FIXED_STRING_H_
@@ -0,0 +1,148 @@
+#ifndef _HAL_H_
+#define _HAL_H_
+
+/**
+ * @brief hal.h is the thin hardware abstraction layer that everything else in src/
+ * uses instead of calling Arduino / ESP-IDF directly. It covers everything the wake
+ * cycle touches:
+ *
+ * - Clock: hal::millis(), hal::micros(), hal::delay_ms(), hal::rtc_seconds()
+ * - GPIO:  hal::pin_mode(), hal::digital_write(), hal::digital_read(), hal::attach_interrupt(),
+ *          hal::gpio_hold()
+ * - ADC:   hal::adc_configure(), hal::adc_read_mV(), hal::adc_calibration(), hal::adc1_sample_continuous()
+ * - UART:  hal::console() (USB serial / Serial Monitor) and hal::lora_uart() (Serial2)
+ * - Sleep: hal::deep_sleep(), hal::wake_cause()
+ * - ULP:   hal::ulp_watch_start(), hal::ulp_watch_stop() - the coprocessor that watches the
+ *          float switch and water level during deep sleep
+ * - NVS:   hal::nvs_read(), hal::nvs_write() - small blobs in flash that survive power-off
+ *
+ * On the ESP32 (env:esp32doit-devkit-v1) every function is an inline wrapper around the
+ * Arduino / ESP-IDF call it replaces. On Linux (env:native, which defines NATIVE_BUILD)
+ * the same functions run against a simulated clock, simulated pins and a simulated
+ * Serial2, so the whole of setup() can be run and timed without a board.
+ *
+ * IMPORTANT: on the ESP32, hal::deep_sleep() never returns. On native it DOES return
+ * (the simulated chip "sleeps" by advancing the clock), so always return right after
+ * calling it.
+ */
+
+#include <stdint.h>
+
+namespace hal {
+
+// Result of configuring an ADC channel, so the caller can tell which step failed.
+enum class AdcStatus : uint8_t {
+  kOk,
+  kAdc1WidthFailed,
+  kAdc1AttenFailed,
+  kAdc2AttenFailed
+};
+
+// ADC1 or ADC2. ADC2 can't be used while WiFi is on.
+enum class AdcUnit : uint8_t {
+  kAdc1,
+  kAdc2
+};
+
+// The ADC1 channel of a GPIO (36 - 39 are channels 0 - 3, 32 - 35 are 4 - 7), or -1
+constexpr int8_t adc1_channel(uint8_t gpio) {
+  return gpio >= 36 && gpio <= 39 ? gpio - 36 : gpio >= 32 && gpio <= 35 ? gpio - 28 : -1;
+}
+
+// The ADC2 channel of a GPIO, or -1
+constexpr int8_t adc2_channel(uint8_t gpio) {
+  return gpio == 4 ? 0 : gpio == 0 ? 1 : gpio == 2 ? 2 : gpio == 15 ? 3 : gpio == 13 ? 4
+         : gpio == 12 ? 5 : gpio == 14 ? 6 : gpio == 27 ? 7 : gpio == 25 ? 8 : gpio == 26 ? 9 : -1;
+}
+
+const uint8_t kAdcMaxBlocks = 10; // blocks per channel adc1_sample_continuous() can split into
+
+// The block a channel's sample number n falls in, when its samples_per_channel samples are
+// split into blocks in the order they were taken
+inline uint8_t adc_sample_block(uint32_t n, uint32_t samples_per_channel, uint8_t blocks) {
+  uint32_t block = (uint64_t)n * blocks / samples_per_channel;
+  return block < blocks ? block : blocks - 1;
+}
+
+// Why the chip is running setup(): power-on / reset, or which deep sleep wakeup source.
+enum class WakeCause : uint8_t {
+  kColdBoot,
+  kTimer,
+  kExternal,  // EXT0 / EXT1 / GPIO
+  kUlp,
+  kOther
+};
+
+// Conditions the ULP watches for during deep sleep (bits of UlpWatchState::armed / reason)
+const uint16_t kUlpFloatSwitch = 1;  // float switch pin HIGH
+const uint16_t kUlpHighWater = 2;    // water level at or above UlpWatchConfig::high_raw
+const uint16_t kUlpLowWater = 4;     // water level below UlpWatchConfig::low_raw
+const uint16_t kUlpAllConditions = kUlpFloatSwitch | kUlpHighWater | kUlpLowWater;
+
+// What the ULP program watches. Water levels are raw 12-bit ADC1 counts: the ULP can't
+// apply the ADC calibration, so thresholds are converted with adc1_raw_for_mV() instead.
+struct UlpWatchConfig {
+  uint8_t float_switch_pin;  // an RTC GPIO
+  uint8_t adc1_channel;      // the water level
+  uint16_t high_raw;         // 4096 or more never wakes
+  uint16_t high_clear_raw;   // high water only counts as cleared below this (hysteresis)
+  uint16_t low_raw;          // 0 never wakes
+  uint16_t low_clear_raw;    // low water only counts as cleared at or above this
+  uint8_t debounce_samples;  // consecutive samples a condition must hold for before waking
+  uint32_t period_ms;        // between samples
+};
+
+// What the ULP program leaves in RTC slow memory
+struct UlpWatchState {
+  uint16_t armed;       // conditions seen cleared since the ULP started; only these can wake
+  uint16_t count;       // consecutive samples with an armed condition true
+  uint16_t reason;      // the armed conditions that were true when it woke the chip
+  uint16_t last_raw;    // the last water level sample
+};
+
+/**
+ * @brief One run of the ULP program: takes a sample (the float switch level, and the
+ * average of four water level conversions) and returns true if it should wake the chip.
+ *
+ * A condition can only wake the chip once it has been seen cleared, so a float switch
+ * that was already up when the chip went to sleep (and has been reported) doesn't wake
+ * it again every period - but a water level that then crosses its threshold still does.
+ * The water levels clear with hysteresis, so a level sitting on a threshold, with noise,
+ * doesn't wake the chip every few seconds.
+ *
+ * This is the reference for the ULP program in hal_esp32.h, which does the same steps in
+ * ULP instructions, and is what the native build runs during its simulated deep sleep.
+ */
+
+inline bool ulp_watch_step(const UlpWatchConfig& config, UlpWatchState& state, uint8_t float_level, uint16_t raw) {
+  state.last_raw = raw;
+  uint16_t cleared = 0;
+  if (!float_level) cleared |= kUlpFloatSwitch;
+  if (raw < config.high_clear_raw) cleared |= kUlpHighWater;
+  if (raw >= config.low_clear_raw) cleared |= kUlpLowWater;
+  state.armed |= cleared;
+  uint16_t current = 0;
+  if (float_level) current |= kUlpFloatSwitch;
+  if (raw >= config.high_raw) current |= kUlpHighWater;
+  if (raw < config.low_raw) current |= kUlpLowWater;
+  uint16_t triggered = current & state.armed;
+  if (!triggered) {
+    state.count = 0;
+    return false;
+  }
+  if (++state.count < config.debounce_samples) {
+    return false;
+  }
+  state.reason = triggered;
+  return true;
+}
+
+} // namespace hal
+
+#ifdef NATIVE_BUILD
+#include "hal_native.h"
+#else
+#include "hal_esp32.h"
+#endif
+
+#endif // _HAL_H_
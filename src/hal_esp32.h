@@ -0,0 +1,453 @@
+#ifndef _HAL_ESP32_H_
+#define _HAL_ESP32_H_
+
+/**
+ * @brief ESP32 implementation of the HAL declared in hal.h. Every function here is a
+ * one-line wrapper around the Arduino / ESP-IDF call that src/ used to make directly.
+ * Don't include this file directly - include hal.h.
+ */
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <esp_sleep.h>
+#include <esp_timer.h>
+#include <sys/time.h>
+#include <driver/adc.h>
+#include <driver/gpio.h>
+#include <driver/rtc_io.h>
+#include <esp32/ulp.h>
+#include <soc/rtc_cntl_reg.h>
+#include <soc/rtc_io_reg.h>
+#include <soc/sens_reg.h>
+#include "esp_adc_cal.h"
+#include "elapsedMillis.h"
+
+namespace hal {
+
+// ---------- Clock ----------
+
+inline uint32_t millis() { return ::millis(); }
+
+inline uint64_t micros() { return (uint64_t)esp_timer_get_time(); }
+
+inline void delay_ms(uint32_t ms) { ::delay(ms); }
+
+/**
+ * @brief Seconds since power on. Unlike millis(), it keeps counting through deep sleep
+ * (the system time is kept by the RTC timer), so it can time things across wakes.
+ */
+
+inline uint32_t rtc_seconds() {
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  return (uint32_t)now.tv_sec;
+}
+
+// ---------- GPIO ----------
+
+inline void pin_mode(uint8_t pin, uint8_t mode) { ::pinMode(pin, mode); }
+
+inline void digital_write(uint8_t pin, uint8_t level) { ::digitalWrite(pin, level); }
+
+inline int digital_read(uint8_t pin) { return ::digitalRead(pin); }
+
+inline void attach_interrupt(uint8_t pin, void (*isr)(void), int mode) {
+  ::attachInterrupt(pin, isr, mode);
+}
+
+/**
+ * @brief Latches (hold = true) or releases an output pin's level. A held pin keeps its
+ * level through deep sleep and the reset that follows, until it's released. Works on
+ * any output pin, not only the RTC GPIOs.
+ */
+
+inline void gpio_hold(uint8_t pin, bool hold) {
+  if (hold) {
+    gpio_hold_en((gpio_num_t)pin);
+    gpio_deep_sleep_hold_en();
+  }
+  else {
+    gpio_hold_dis((gpio_num_t)pin);
+  }
+}
+
+// ---------- ADC ----------
+
+// Calibration data for one ADC unit, from adc_calibration().
+typedef esp_adc_cal_characteristics_t AdcCalibration;
+
+/**
+ * @brief Sets the channel to 12 bits and 11 dB attenuation (0 - 3.3V). Read it with
+ * adc_read_mV(), which applies adc_calibration().
+ */
+
+inline AdcStatus adc_configure(AdcUnit unit, uint8_t channel) {
+  if (unit == AdcUnit::kAdc1) {
+    if (adc1_config_width(ADC_WIDTH_BIT_12) != ESP_OK) {
+      return AdcStatus::kAdc1WidthFailed;
+    }
+    if (adc1_config_channel_atten((adc1_channel_t)channel, ADC_ATTEN_DB_11) != ESP_OK) {
+      return AdcStatus::kAdc1AttenFailed;
+    }
+  }
+  else {
+    if (adc2_config_channel_atten((adc2_channel_t)channel, ADC_ATTEN_DB_11) != ESP_OK) {
+      return AdcStatus::kAdc2AttenFailed;
+    }
+  }
+  return AdcStatus::kOk;
+}
+
+/**
+ * @brief The characterization of an ADC unit at 11 dB (the only attenuation used), from
+ * the chip's eFuse Vref. It's worked out on the first call after a power-on or reset, and
+ * kept in RTC memory, so the wakes after that don't redo it. (Its curve pointers point
+ * into flash, which doesn't move while RTC memory lasts.)
+ */
+
+inline const AdcCalibration& adc_calibration(AdcUnit unit) {
+  RTC_DATA_ATTR static AdcCalibration cal[2];
+  RTC_DATA_ATTR static bool characterized[2];
+  uint8_t i = unit == AdcUnit::kAdc1 ? 0 : 1;
+  if (!characterized[i]) {
+    esp_adc_cal_characterize(unit == AdcUnit::kAdc1 ? ADC_UNIT_1 : ADC_UNIT_2,
+                             ADC_ATTEN_DB_11, ADC_WIDTH_BIT_12, 1100, &cal[i]);
+    characterized[i] = true;
+  }
+  return cal[i];
+}
+
+/**
+ * @brief Reads one calibrated sample, in mV, from an ADC channel that has been set up
+ * with adc_configure().
+ */
+
+inline uint32_t adc_read_mV(AdcUnit unit, uint8_t channel) {
+  const AdcCalibration& cal = adc_calibration(unit);
+  uint32_t volts_mV = 0;
+  if (unit == AdcUnit::kAdc1) {
+    esp_adc_cal_get_voltage((adc_channel_t)channel, &cal, &volts_mV);
+  }
+  else {
+    int raw = 0;
+    adc2_get_raw((adc2_channel_t)channel, ADC_WIDTH_BIT_12, &raw);
+    volts_mV = esp_adc_cal_raw_to_voltage(raw, &cal);
+  }
+  return volts_mV;
+}
+
+/**
+ * @brief The uncalibrated 12-bit ADC1 count (what the ULP reads, at 11 dB) that the
+ * calibration turns into mV: the lowest count that reads as at least mV. 4096 if none does.
+ */
+
+inline uint16_t adc1_raw_for_mV(uint32_t mV) {
+  const AdcCalibration& cal = adc_calibration(AdcUnit::kAdc1);
+  uint16_t low = 0;
+  uint16_t high = 4096;
+  while (low < high) { // the calibration only goes from raw to mV, so search it
+    uint16_t mid = (low + high) / 2;
+    if (esp_adc_cal_raw_to_voltage(mid, &cal) < mV) low = mid + 1;
+    else high = mid;
+  }
+  return low;
+}
+
+/**
+ * @brief Samples several ADC1 channels together in continuous (DMA) mode, and averages
+ * the calibrated mV of each one.
+ *
+ * @param channels ADC1 channel numbers (not GPIO numbers)
+ * @param sample_rate_hz Conversions per second, for all channels together (20000 - 2000000)
+ * @param conversions Total conversions to average, shared evenly between the channels
+ * @param avg_mV Gets the average of each channel, in the same order as channels
+ * @param variance_mV2 If not nullptr, gets the sample variance of each channel, in mV^2
+ * @param blocks Splits each channel's samples into this many blocks (up to kAdcMaxBlocks),
+ *               in the order they were taken
+ * @param block_means_mV If not nullptr, gets the mean of each block: blocks per channel,
+ *                       channel after channel
+ * @return false if continuous mode couldn't be started, or a channel got no samples
+ */
+
+inline bool adc1_sample_continuous(const uint8_t* channels, uint8_t count, uint32_t sample_rate_hz,
+                                   uint32_t conversions, float* avg_mV, float* variance_mV2,
+                                   uint8_t blocks = 0, float* block_means_mV = nullptr) {
+  if (block_means_mV && (!blocks || blocks > kAdcMaxBlocks)) {
+    return false;
+  }
+  const AdcCalibration& cal = adc_calibration(AdcUnit::kAdc1);
+
+  adc_digi_init_config_t init_config = {};
+  init_config.max_store_buf_size = 1024;
+  init_config.conv_num_each_intr = 256;
+  for (uint8_t i = 0; i < count; i++) {
+    init_config.adc1_chan_mask |= 1 << channels[i];
+  }
+  if (adc_digi_initialize(&init_config) != ESP_OK) {
+    return false;
+  }
+  adc_digi_pattern_config_t pattern[SOC_ADC_PATT_LEN_MAX] = {};
+  for (uint8_t i = 0; i < count; i++) {
+    pattern[i].atten = ADC_ATTEN_DB_11;
+    pattern[i].channel = channels[i];
+    pattern[i].unit = 0; // ADC1
+    pattern[i].bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+  }
+  adc_digi_configuration_t config = {};
+  config.conv_limit_en = 1;
+  config.conv_limit_num = 250;
+  config.pattern_num = count;
+  config.adc_pattern = pattern;
+  config.sample_freq_hz = sample_rate_hz;
+  config.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+  config.format = ADC_DIGI_OUTPUT_FORMAT_TYPE1;
+  if (adc_digi_controller_configure(&config) != ESP_OK || adc_digi_start() != ESP_OK) {
+    adc_digi_deinitialize();
+    return false;
+  }
+
+  uint32_t sum_mV[SOC_ADC_PATT_LEN_MAX] = {};
+  uint64_t sum_squares[SOC_ADC_PATT_LEN_MAX] = {};
+  uint32_t samples[SOC_ADC_PATT_LEN_MAX] = {};
+  uint32_t block_sum_mV[SOC_ADC_PATT_LEN_MAX][kAdcMaxBlocks] = {};
+  uint16_t block_samples[SOC_ADC_PATT_LEN_MAX][kAdcMaxBlocks] = {};
+  uint8_t buffer[256];
+  uint32_t total = 0;
+  while (total < conversions) {
+    uint32_t length = 0;
+    esp_err_t result = adc_digi_read_bytes(buffer, sizeof(buffer), &length, 100);
+    if (result == ESP_ERR_TIMEOUT) {
+      break;
+    }
+    // ESP_ERR_INVALID_STATE only means the driver's buffer overflowed; the data is still good
+    for (uint32_t b = 0; b + SOC_ADC_DIGI_RESULT_BYTES <= length; b += SOC_ADC_DIGI_RESULT_BYTES) {
+      adc_digi_output_data_t* p = (adc_digi_output_data_t*)&buffer[b];
+      for (uint8_t i = 0; i < count; i++) {
+        if (p->type1.channel == channels[i]) {
+          uint32_t mV = esp_adc_cal_raw_to_voltage(p->type1.data, &cal);
+          if (block_means_mV) {
+            uint8_t block = adc_sample_block(samples[i], conversions / count, blocks);
+            block_sum_mV[i][block] += mV;
+            block_samples[i][block]++;
+          }
+          sum_mV[i] += mV;
+          sum_squares[i] += (uint64_t)mV * mV;
+          samples[i]++;
+          total++;
+          break;
+        }
+      }
+    }
+  }
+  adc_digi_stop();
+  adc_digi_deinitialize();
+
+  bool ok = true;
+  for (uint8_t i = 0; i < count; i++) {
+    ok = ok && samples[i];
+    avg_mV[i] = samples[i] ? (float)sum_mV[i] / samples[i] : 0;
+    if (variance_mV2) {
+      variance_mV2[i] = samples[i] > 1
+          ? (float)(sum_squares[i] - (double)sum_mV[i] * sum_mV[i] / samples[i]) / (samples[i] - 1) : 0;
+    }
+    // A block that got no samples (the read timed out early) takes the channel's average
+    for (uint8_t b = 0; block_means_mV && b < blocks; b++) {
+      block_means_mV[i * blocks + b] = block_samples[i][b] ? (float)block_sum_mV[i][b] / block_samples[i][b]
+                                                           : avg_mV[i];
+    }
+  }
+  return ok;
+}
+
+// ---------- UART ----------
+
+typedef HardwareSerial Uart;
+
+// USB serial, for the Serial Monitor
+inline Uart& console() { return Serial; }
+
+// Serial2 is defined in HardwareSerial.cpp as txPin = 17 and rxPin = 16
+inline Uart& lora_uart() { return Serial2; }
+
+// ---------- Sleep ----------
+
+// Never returns: the ESP32 resets and starts over at setup() when the timer expires.
+inline void deep_sleep(uint64_t sleep_us) {
+  esp_sleep_enable_timer_wakeup(sleep_us);
+  esp_deep_sleep_start();
+}
+
+// Anything other than a deep sleep wakeup (power on, reset button, brownout) is a cold boot.
+inline WakeCause wake_cause() {
+  switch (esp_sleep_get_wakeup_cause()) {
+    case ESP_SLEEP_WAKEUP_UNDEFINED: return WakeCause::kColdBoot;
+    case ESP_SLEEP_WAKEUP_TIMER: return WakeCause::kTimer;
+    case ESP_SLEEP_WAKEUP_EXT0:
+    case ESP_SLEEP_WAKEUP_EXT1:
+    case ESP_SLEEP_WAKEUP_GPIO: return WakeCause::kExternal;
+    case ESP_SLEEP_WAKEUP_ULP: return WakeCause::kUlp;
+    default: return WakeCause::kOther;
+  }
+}
+
+// ---------- ULP ----------
+
+// Where the ULP program keeps its variables: words of RTC slow memory after the program,
+// inside the CONFIG_ULP_COPROC_RESERVE_MEM (512 bytes) that Arduino-ESP32 sets aside for it.
+const uint32_t kUlpVarBase = 100;
+const uint32_t kUlpVarArmed = 0;
+const uint32_t kUlpVarCount = 1;
+const uint32_t kUlpVarReason = 2;
+const uint32_t kUlpVarLastRaw = 3;
+
+/**
+ * @brief Loads the ULP program that watches the float switch and water level, and starts
+ * it, with a ULP wakeup, for the next deep sleep. The program does the steps of
+ * ulp_watch_step() (hal.h), instruction by instruction. Call it just before deep_sleep().
+ *
+ * @return false if the pin isn't an RTC GPIO, or the program couldn't be loaded
+ */
+
+inline bool ulp_watch_start(const UlpWatchConfig& config) {
+  gpio_num_t float_gpio = (gpio_num_t)config.float_switch_pin;
+  if (!rtc_gpio_is_valid_gpio(float_gpio) || config.adc1_channel > 7) {
+    return false;
+  }
+  uint32_t float_bit = RTC_GPIO_IN_NEXT_S + rtc_io_number_get(float_gpio);
+  rtc_gpio_init(float_gpio);
+  rtc_gpio_set_direction(float_gpio, RTC_GPIO_MODE_INPUT_ONLY);
+  adc1_config_width(ADC_WIDTH_BIT_12);
+  adc1_config_channel_atten((adc1_channel_t)config.adc1_channel, ADC_ATTEN_DB_11);
+  adc1_ulp_enable();
+
+  enum { kFloatUp, kHighNotCleared, kLowNotCleared, kNoFloat, kNoHigh, kNoLow, kTriggered, kWaitForSleep, kDone };
+  uint32_t pad = config.adc1_channel + 1; // the ULP ADC instruction numbers ADC1 pads from 1
+  const ulp_insn_t program[] = {
+    I_MOVI(R1, kUlpVarBase),
+    // R2 = the average of four conversions of the water level
+    I_ADC(R2, 0, pad),
+    I_ADC(R0, 0, pad),
+    I_ADDR(R2, R2, R0),
+    I_ADC(R0, 0, pad),
+    I_ADDR(R2, R2, R0),
+    I_ADC(R0, 0, pad),
+    I_ADDR(R2, R2, R0),
+    I_RSHI(R2, R2, 2),
+    I_ST(R2, R1, kUlpVarLastRaw),
+    // armed |= the conditions that are cleared now
+    I_MOVI(R3, 0),
+    I_RD_REG(RTC_GPIO_IN_REG, float_bit, float_bit),
+    M_BGE(kFloatUp, 1),
+    I_ORI(R3, R3, kUlpFloatSwitch),
+    M_LABEL(kFloatUp),
+    I_MOVR(R0, R2),
+    M_BGE(kHighNotCleared, config.high_clear_raw),
+    I_ORI(R3, R3, kUlpHighWater),
+    M_LABEL(kHighNotCleared),
+    M_BL(kLowNotCleared, config.low_clear_raw),
+    I_ORI(R3, R3, kUlpLowWater),
+    M_LABEL(kLowNotCleared),
+    I_LD(R0, R1, kUlpVarArmed),
+    I_ORR(R0, R0, R3),
+    I_ST(R0, R1, kUlpVarArmed),
+    // R3 = the conditions that are true now
+    I_MOVI(R3, 0),
+    I_RD_REG(RTC_GPIO_IN_REG, float_bit, float_bit),
+    M_BL(kNoFloat, 1),
+    I_ORI(R3, R3, kUlpFloatSwitch),
+    M_LABEL(kNoFloat),
+    I_MOVR(R0, R2),
+    M_BL(kNoHigh, config.high_raw),
+    I_ORI(R3, R3, kUlpHighWater),
+    M_LABEL(kNoHigh),
+    M_BGE(kNoLow, config.low_raw),
+    I_ORI(R3, R3, kUlpLowWater),
+    M_LABEL(kNoLow),
+    // R3 = the armed conditions that are true
+    I_LD(R0, R1, kUlpVarArmed),
+    I_ANDR(R3, R3, R0),
+    I_MOVR(R0, R3),
+    M_BGE(kTriggered, 1),
+    I_MOVI(R0, 0),
+    I_ST(R0, R1, kUlpVarCount),
+    I_HALT(),
+    M_LABEL(kTriggered),
+    I_LD(R0, R1, kUlpVarCount),
+    I_ADDI(R0, R0, 1),
+    I_ST(R0, R1, kUlpVarCount),
+    M_BL(kDone, config.debounce_samples),
+    I_ST(R3, R1, kUlpVarReason),
+    // The chip can only be woken once it has finished going to sleep
+    M_LABEL(kWaitForSleep),
+    I_RD_REG(RTC_CNTL_LOW_POWER_ST_REG, RTC_CNTL_RDY_FOR_WAKEUP_S, RTC_CNTL_RDY_FOR_WAKEUP_S),
+    M_BL(kWaitForSleep, 1),
+    I_WAKE(),
+    I_END(), // stops the ULP timer, until ulp_watch_start() before the next sleep
+    M_LABEL(kDone),
+    I_HALT(),
+  };
+  for (uint32_t i = kUlpVarArmed; i <= kUlpVarLastRaw; i++) {
+    RTC_SLOW_MEM[kUlpVarBase + i] = 0;
+  }
+  size_t size = sizeof(program) / sizeof(ulp_insn_t);
+  if (ulp_process_macros_and_load(0, program, &size) != ESP_OK || size > kUlpVarBase) {
+    return false;
+  }
+  ulp_set_wakeup_period(0, config.period_ms * 1000);
+  esp_sleep_enable_ulp_wakeup();
+  return ulp_run(0) == ESP_OK;
+}
+
+/**
+ * @brief Stops the ULP (after a timer wakeup it's still running), gives the float switch
+ * pin back to the digital GPIO, and returns what the program left in RTC memory.
+ */
+
+inline UlpWatchState ulp_watch_stop(const UlpWatchConfig& config) {
+  CLEAR_PERI_REG_MASK(RTC_CNTL_STATE0_REG, RTC_CNTL_ULP_CP_SLP_TIMER_EN);
+  if (rtc_gpio_is_valid_gpio((gpio_num_t)config.float_switch_pin)) {
+    rtc_gpio_deinit((gpio_num_t)config.float_switch_pin);
+  }
+  UlpWatchState state;
+  state.armed = RTC_SLOW_MEM[kUlpVarBase + kUlpVarArmed] & 0xFFFF;
+  state.count = RTC_SLOW_MEM[kUlpVarBase + kUlpVarCount] & 0xFFFF;
+  state.reason = RTC_SLOW_MEM[kUlpVarBase + kUlpVarReason] & 0xFFFF;
+  state.last_raw = RTC_SLOW_MEM[kUlpVarBase + kUlpVarLastRaw] & 0xFFFF;
+  return state;
+}
+
+// ---------- NVS ----------
+
+// The NVS namespace everything the firmware saves goes in
+const char* const kNvsNamespace = "garden";
+
+/**
+ * @brief Reads the blob saved under key into data.
+ *
+ * @return false if there's nothing saved under key, or it isn't exactly length bytes
+ */
+
+inline bool nvs_read(const char* key, void* data, size_t length) {
+  Preferences prefs;
+  if (!prefs.begin(kNvsNamespace, true)) { // read-only; fails if nothing was ever saved
+    return false;
+  }
+  bool ok = prefs.getBytesLength(key) == length && prefs.getBytes(key, data, length) == length;
+  prefs.end();
+  return ok;
+}
+
+// Saves length bytes under key, replacing whatever was there. Returns false if it couldn't.
+inline bool nvs_write(const char* key, const void* data, size_t length) {
+  Preferences prefs;
+  if (!prefs.begin(kNvsNamespace, false)) {
+    return false;
+  }
+  bool ok = prefs.putBytes(key, data, length) == length;
+  prefs.end();
+  return ok;
+}
+
+} // namespace hal
+
+#endif // _HAL_ESP32_H_
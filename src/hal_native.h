@@ -0,0 +1,642 @@
+#ifndef _HAL_NATIVE_H_
+#define _HAL_NATIVE_H_
+
+/**
+ * @brief Linux implementation of the HAL declared in hal.h, used by env:native.
+ *
+ * Nothing here touches real hardware. Time is a simulated microsecond counter that only
+ * moves when the firmware waits for something (delay_ms(), a UART read timeout, a
+ * transmission at the UART's baud rate, an ADC conversion), or when the firmware reads
+ * the clock (clock_read_cost_us per read, so that busy-wait loops still terminate).
+ * Pins, ADC voltages and the radio on Serial2 are driven by whatever is running the
+ * firmware (see src/host/native_main.cpp) through hal::native::sim().
+ *
+ * Also provides the handful of Arduino names the firmware uses (String, HIGH, OUTPUT,
+ * RTC_DATA_ATTR, elapsedMillis, ...) so the firmware headers compile unchanged.
+ * Don't include this file directly - include hal.h.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <functional>
+#include <map>
+#include <new>
+#include <string>
+#include <utility>
+
+// ---------- Arduino names used by the firmware ----------
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define RISING 0x01
+#define FALLING 0x02
+#define CHANGE 0x03
+#define IRAM_ATTR
+#define RTC_DATA_ATTR
+#define RTC_NOINIT_ATTR
+
+/**
+ * @brief Minimal stand-in for the Arduino String class: only the constructors and
+ * operators the firmware actually uses.
+ */
+
+class String {
+ private:
+  std::string s_;
+
+  static std::string from_float(double value, unsigned char decimals) {
+    char buf[48];
+    snprintf(buf, sizeof(buf), "%.*f", (int)decimals, value);
+    return buf;
+  }
+
+ public:
+  String() {}
+  String(const char* s) : s_{s ? s : ""} {}
+  String(const std::string& s) : s_{s} {}
+  explicit String(char c) : s_(1, c) {}
+  explicit String(unsigned char value) : s_{std::to_string(value)} {}
+  explicit String(int value) : s_{std::to_string(value)} {}
+  explicit String(unsigned int value) : s_{std::to_string(value)} {}
+  explicit String(long value) : s_{std::to_string(value)} {}
+  explicit String(unsigned long value) : s_{std::to_string(value)} {}
+  explicit String(long long value) : s_{std::to_string(value)} {}
+  explicit String(unsigned long long value) : s_{std::to_string(value)} {}
+  explicit String(float value, unsigned char decimals = 2) : s_{from_float(value, decimals)} {}
+  explicit String(double value, unsigned char decimals = 2) : s_{from_float(value, decimals)} {}
+
+  unsigned int length() const { return s_.length(); }
+  const char* c_str() const { return s_.c_str(); }
+
+  String& operator+=(const String& rhs) { s_ += rhs.s_; return *this; }
+  String& operator+=(const char* rhs) { s_ += rhs; return *this; }
+
+  friend String operator+(const String& lhs, const String& rhs) { return String(lhs.s_ + rhs.s_); }
+  friend String operator+(const String& lhs, const char* rhs) { return String(lhs.s_ + rhs); }
+  friend String operator+(const char* lhs, const String& rhs) { return String(lhs + rhs.s_); }
+  template <typename T>
+  friend String operator+(const String& lhs, T rhs) { return lhs + String(rhs); }
+
+  bool operator==(const String& rhs) const { return s_ == rhs.s_; }
+  bool operator==(const char* rhs) const { return s_ == rhs; }
+  bool operator!=(const String& rhs) const { return s_ != rhs.s_; }
+  bool operator!=(const char* rhs) const { return s_ != rhs; }
+};
+
+namespace hal {
+
+// ---------- Simulation state ----------
+
+namespace native {
+
+const uint32_t kStreamTimeoutMs = 1000;   // Arduino Stream default for readStringUntil()
+const uint8_t kNumPins = 40;
+
+/**
+ * @brief Everything the simulated ESP32 knows about the outside world. There is one
+ * instance, returned by sim(). The program running the firmware sets the inputs
+ * (analog_mV, pin_level, radio) and reads the outputs (pin_level of OUTPUT pins,
+ * the wake-cycle counters).
+ */
+
+struct Sim {
+  uint64_t now_us = 0;
+
+  // What reading the clock and one ADC1 conversion (incl. calibration lookup) cost. A busy
+  // loop reading the clock still moves time. A simulation of months can make these coarser,
+  // so busy loops (and fills, which read the water level all the way) take fewer steps.
+  uint32_t clock_read_cost_us = 1;
+  uint32_t adc_read_cost_us = 20;
+
+  // GPIO
+  uint8_t pin_mode[kNumPins] = {};
+  uint8_t pin_level[kNumPins] = {};
+  void (*isr[kNumPins])(void) = {};
+  int isr_mode[kNumPins] = {};
+  bool pin_held[kNumPins] = {};
+  uint8_t pin_register[kNumPins] = {};  // last level written; reaches the pin when it isn't held
+  uint64_t pin_high_since_us[kNumPins] = {};
+  uint64_t pin_high_total_us[kNumPins] = {};  // how long each pin has been HIGH, in all
+
+  // ADC: the voltage on each pin, in mV. If analog_source is set, it's used instead.
+  float analog_mV[kNumPins] = {};
+  std::function<float(uint8_t pin, uint64_t now_us)> analog_source;
+  // What adc_calibration() keeps in RTC memory for each unit, and how many times it has had
+  // to characterize one (once per unit, until a power-on or reset clears these)
+  bool adc_characterized[2] = {};
+  uint32_t adc_characterizations = 0;
+
+  // Called with every complete line (without the "\r\n") written to Serial2. The
+  // radio replies by calling lora_uart().inject() with a delay.
+  std::function<void(const std::string& line)> radio;
+
+  // Console output goes to stdout unless this is false.
+  bool echo_console = true;
+
+  // Wake-cycle accounting
+  uint64_t wake_start_us = 0;
+  uint64_t last_awake_us = 0;
+  uint64_t last_sleep_us = 0;
+  uint64_t delay_us_this_wake = 0;
+  bool sleep_requested = false;
+  uint32_t wake_count = 0;
+  WakeCause wake_cause = WakeCause::kColdBoot;
+
+  // ULP: while ulp_running, deep_sleep() runs ulp_watch_step() every ulp_config.period_ms
+  bool ulp_running = false;
+  UlpWatchConfig ulp_config = {};
+  UlpWatchState ulp_state = {};
+  bool ulp_woke = false;  // the last deep sleep was ended by the ULP
+  uint32_t ulp_samples = 0;
+
+  // NVS: key -> saved blob. Survives everything the simulated chip does, like flash.
+  std::map<std::string, std::string> nvs;
+  uint32_t nvs_writes = 0;
+};
+
+inline Sim& sim() {
+  static Sim s;
+  return s;
+}
+
+/**
+ * @brief Called by whatever runs the firmware, just before each call to setup(). The
+ * first wake is a cold boot, the rest are timer wakeups (or ULP wakeups, if the ULP
+ * ended the sleep) unless the caller sets sim().wake_cause after calling this.
+ */
+
+inline void begin_wake() {
+  Sim& s = sim();
+  // Waking from deep sleep is a reset: every pin that isn't held goes back to an input.
+  for (uint8_t pin = 0; pin < kNumPins; pin++) {
+    s.isr[pin] = nullptr;
+    if (s.pin_mode[pin] == OUTPUT && !s.pin_held[pin]) {
+      if (s.pin_level[pin] == HIGH) {
+        s.pin_high_total_us[pin] += s.now_us - s.pin_high_since_us[pin];
+      }
+      s.pin_level[pin] = LOW;
+      s.pin_mode[pin] = 0;
+    }
+    if (!s.pin_held[pin]) {
+      s.pin_register[pin] = LOW;
+    }
+  }
+  s.wake_cause = s.ulp_woke ? WakeCause::kUlp : s.wake_count ? WakeCause::kTimer : WakeCause::kColdBoot;
+  s.ulp_woke = false;
+  s.wake_start_us = s.now_us;
+  s.delay_us_this_wake = 0;
+  s.sleep_requested = false;
+  s.wake_count++;
+}
+
+// Constructs object again in place, the way a boot constructs the firmware's globals: the
+// native programs do this to them before each setup() (see construct_globals() in main.cpp).
+template <typename T, typename... Args>
+void reconstruct(T& object, Args&&... args) {
+  object.~T();
+  new (&object) T(std::forward<Args>(args)...);
+}
+
+// Moves simulated time forward while the firmware waits.
+inline void advance_us(uint64_t us) { sim().now_us += us; }
+
+// Total time a pin has been HIGH, up to now.
+inline uint64_t pin_high_us(uint8_t pin) {
+  Sim& s = sim();
+  return s.pin_high_total_us[pin] + (s.pin_level[pin] == HIGH ? s.now_us - s.pin_high_since_us[pin] : 0);
+}
+
+/**
+ * @brief Sets an input pin to a level, and runs its interrupt handler if the change
+ * matches the mode given to attach_interrupt().
+ */
+
+inline void set_input_level(uint8_t pin, uint8_t level) {
+  Sim& s = sim();
+  uint8_t old = s.pin_level[pin];
+  s.pin_level[pin] = level;
+  if (s.isr[pin] && old != level) {
+    bool rising = (level == HIGH);
+    if (s.isr_mode[pin] == CHANGE || (s.isr_mode[pin] == RISING && rising)
+        || (s.isr_mode[pin] == FALLING && !rising)) {
+      s.isr[pin]();
+    }
+  }
+}
+
+} // namespace native
+
+// ---------- Clock ----------
+
+// Like esp_timer on the ESP32, counts from the start of this wake (the reset).
+inline uint64_t micros() {
+  native::advance_us(native::sim().clock_read_cost_us);
+  return native::sim().now_us - native::sim().wake_start_us;
+}
+
+inline uint32_t millis() { return (uint32_t)(micros() / 1000); }
+
+inline void delay_ms(uint32_t ms) {
+  native::sim().delay_us_this_wake += (uint64_t)ms * 1000;
+  native::advance_us((uint64_t)ms * 1000);
+}
+
+// The simulated chip never loses power, so this is simply the simulated time.
+inline uint32_t rtc_seconds() { return (uint32_t)(native::sim().now_us / 1000000); }
+
+// ---------- GPIO ----------
+
+inline void pin_mode(uint8_t pin, uint8_t mode) { native::sim().pin_mode[pin] = mode; }
+
+namespace native {
+
+// Drives a pin to its output register's level, unless the pin is held.
+inline void update_output(uint8_t pin) {
+  Sim& s = sim();
+  uint8_t level = s.pin_register[pin];
+  if (s.pin_held[pin] || s.pin_level[pin] == level) {
+    return;
+  }
+  if (level == HIGH) {
+    s.pin_high_since_us[pin] = s.now_us;
+  }
+  else {
+    s.pin_high_total_us[pin] += s.now_us - s.pin_high_since_us[pin];
+  }
+  s.pin_level[pin] = level;
+}
+
+} // namespace native
+
+inline void digital_write(uint8_t pin, uint8_t level) {
+  native::sim().pin_register[pin] = level;
+  native::update_output(pin);
+}
+
+inline int digital_read(uint8_t pin) { return native::sim().pin_level[pin]; }
+
+inline void attach_interrupt(uint8_t pin, void (*isr)(void), int mode) {
+  native::sim().isr[pin] = isr;
+  native::sim().isr_mode[pin] = mode;
+}
+
+// A held pin keeps its level, whatever is written to it, until it's released.
+inline void gpio_hold(uint8_t pin, bool hold) {
+  native::sim().pin_held[pin] = hold;
+  native::update_output(pin);
+}
+
+// ---------- ADC ----------
+
+struct AdcCalibration {
+  int vref_mV = 0;
+};
+
+// GPIO number for each ADC channel, so a reading can be looked up by pin.
+const uint8_t kAdc1ChannelPins[] = {36, 37, 38, 39, 32, 33, 34, 35};
+const uint8_t kAdc2ChannelPins[] = {4, 0, 2, 15, 13, 12, 14, 27, 25, 26};
+
+inline AdcStatus adc_configure(AdcUnit unit, uint8_t channel) {
+  if (unit == AdcUnit::kAdc1 && channel >= sizeof(kAdc1ChannelPins)) {
+    return AdcStatus::kAdc1AttenFailed;
+  }
+  if (unit == AdcUnit::kAdc2 && channel >= sizeof(kAdc2ChannelPins)) {
+    return AdcStatus::kAdc2AttenFailed;
+  }
+  return AdcStatus::kOk;
+}
+
+inline const AdcCalibration& adc_calibration(AdcUnit unit) {
+  static AdcCalibration cal[2];
+  native::Sim& s = native::sim();
+  uint8_t i = unit == AdcUnit::kAdc1 ? 0 : 1;
+  if (!s.adc_characterized[i]) {
+    cal[i].vref_mV = 1100;
+    s.adc_characterized[i] = true;
+    s.adc_characterizations++;
+  }
+  return cal[i];
+}
+
+inline uint32_t adc_read_mV(AdcUnit unit, uint8_t channel) {
+  adc_calibration(unit);
+  uint8_t pin = (unit == AdcUnit::kAdc1) ? kAdc1ChannelPins[channel] : kAdc2ChannelPins[channel];
+  native::Sim& s = native::sim();
+  native::advance_us(s.adc_read_cost_us);
+  float mV = s.analog_source ? s.analog_source(pin, s.now_us) : s.analog_mV[pin];
+  if (mV < 0) mV = 0;
+  if (mV > 3300) mV = 3300;
+  return (uint32_t)(mV + 0.5f);
+}
+
+// Uncalibrated 12-bit ADC1 count (what the ULP reads) for mV at the pin: linear in the simulation
+inline uint16_t adc1_raw_for_mV(uint32_t mV) {
+  adc_calibration(AdcUnit::kAdc1);
+  return (uint16_t)((mV * 4095 + 1650) / 3300);
+}
+
+/**
+ * @brief Simulated continuous mode: the channels are converted in turn, one every
+ * 1 / sample_rate_hz seconds, as the real DMA pattern table does.
+ */
+
+inline bool adc1_sample_continuous(const uint8_t* channels, uint8_t count, uint32_t sample_rate_hz,
+                                   uint32_t conversions, float* avg_mV, float* variance_mV2,
+                                   uint8_t blocks = 0, float* block_means_mV = nullptr) {
+  if (block_means_mV && (!blocks || blocks > kAdcMaxBlocks)) {
+    return false;
+  }
+  adc_calibration(AdcUnit::kAdc1);
+  native::Sim& s = native::sim();
+  double sum_mV[sizeof(kAdc1ChannelPins)] = {};
+  double sum_squares[sizeof(kAdc1ChannelPins)] = {};
+  uint32_t samples[sizeof(kAdc1ChannelPins)] = {};
+  double block_sum_mV[sizeof(kAdc1ChannelPins)][kAdcMaxBlocks] = {};
+  uint32_t block_samples[sizeof(kAdc1ChannelPins)][kAdcMaxBlocks] = {};
+  for (uint32_t n = 0; n < conversions; n++) {
+    uint8_t i = n % count;
+    uint8_t pin = kAdc1ChannelPins[channels[i]];
+    native::advance_us(1000000 / sample_rate_hz);
+    float mV = s.analog_source ? s.analog_source(pin, s.now_us) : s.analog_mV[pin];
+    mV = (float)(uint32_t)(mV < 0 ? 0 : (mV > 3300 ? 3300 : mV + 0.5f)); // whole mV, like the real one
+    if (block_means_mV) {
+      uint8_t block = adc_sample_block(samples[i], conversions / count, blocks);
+      block_sum_mV[i][block] += mV;
+      block_samples[i][block]++;
+    }
+    sum_mV[i] += mV;
+    sum_squares[i] += (double)mV * mV;
+    samples[i]++;
+  }
+  bool ok = true;
+  for (uint8_t i = 0; i < count; i++) {
+    ok = ok && samples[i];
+    avg_mV[i] = samples[i] ? sum_mV[i] / samples[i] : 0;
+    if (variance_mV2) {
+      variance_mV2[i] = samples[i] > 1
+          ? (sum_squares[i] - sum_mV[i] * sum_mV[i] / samples[i]) / (samples[i] - 1) : 0;
+    }
+    for (uint8_t b = 0; block_means_mV && b < blocks; b++) {
+      block_means_mV[i * blocks + b] = block_samples[i][b] ? block_sum_mV[i][b] / block_samples[i][b] : avg_mV[i];
+    }
+  }
+  return ok;
+}
+
+// ---------- UART ----------
+
+/**
+ * @brief Simulated UART. Writing costs the time it takes to clock the bytes out at the
+ * configured baud rate. Received bytes are queued with the simulated time they arrive,
+ * and reads wait (advance the clock) for them, up to the Stream timeout, just like
+ * the Arduino Stream class does.
+ *
+ * Sending, receiving and reading don't touch the heap (the buffers are fixed), so a
+ * host tool can count the firmware's own allocations (see src/host/alloc_check.cpp).
+ */
+
+class Uart {
+ private:
+  struct RxByte {
+    uint64_t ready_us;
+    char c;
+  };
+
+  // Received bytes not read yet: a fixed ring buffer, used like a deque
+  class RxQueue {
+   private:
+    static const size_t kCapacity = 4096;
+    RxByte bytes_[kCapacity];
+    size_t head_ = 0;
+    size_t count_ = 0;
+
+   public:
+    bool empty() const { return count_ == 0; }
+    size_t size() const { return count_; }
+    const RxByte& operator[](size_t i) const { return bytes_[(head_ + i) % kCapacity]; }
+    const RxByte& front() const { return (*this)[0]; }
+    const RxByte& back() const { return (*this)[count_ - 1]; }
+    void pop_front() { head_ = (head_ + 1) % kCapacity; count_--; }
+    void push_back(const RxByte& b) {
+      if (count_ == kCapacity) pop_front(); // overflow: the oldest byte is lost, as on a real UART
+      bytes_[(head_ + count_++) % kCapacity] = b;
+    }
+  };
+
+  bool is_console_;
+  uint32_t baud_ = 115200;
+  uint32_t timeout_ms_ = native::kStreamTimeoutMs;
+  std::string tx_line_;
+  RxQueue rx_;
+
+  void transmit(const char* s, size_t len) {
+    native::advance_us((uint64_t)len * 10 * 1000000 / baud_);
+    if (is_console_) {
+      if (native::sim().echo_console) {
+        fwrite(s, 1, len, stdout);
+      }
+      return;
+    }
+    for (size_t i = 0; i < len; i++) {
+      if (s[i] == '\n') {
+        if (!tx_line_.empty() && tx_line_.back() == '\r') {
+          tx_line_.pop_back();
+        }
+        if (native::sim().radio) {
+          native::sim().radio(tx_line_);
+        }
+        tx_line_.clear(); // keeps its capacity
+      }
+      else {
+        tx_line_ += s[i];
+      }
+    }
+  }
+
+ public:
+  explicit Uart(bool is_console) : is_console_{is_console} { tx_line_.reserve(512); }
+
+  void begin(uint32_t baud) { baud_ = baud; }
+  void setTimeout(uint32_t timeout_ms) { timeout_ms_ = timeout_ms; }
+
+  size_t print(const String& s) { transmit(s.c_str(), s.length()); return s.length(); }
+  size_t print(const char* s) { transmit(s, strlen(s)); return strlen(s); }
+  size_t println(const String& s) { return print(s) + print("\r\n"); }
+  size_t println(const char* s) { return print(s) + print("\r\n"); }
+  size_t println() { return print("\r\n"); }
+  size_t write(const uint8_t* buf, size_t len) { transmit((const char*)buf, len); return len; }
+  void flush() {} // transmit() has already taken the time
+
+  // Queues bytes that will arrive delay_us after the last byte already queued (or after now).
+  void inject(const char* bytes, size_t length, uint64_t delay_us = 0) {
+    uint64_t t = native::sim().now_us + delay_us;
+    if (!rx_.empty() && rx_.back().ready_us > t) {
+      t = rx_.back().ready_us;
+    }
+    for (size_t i = 0; i < length; i++) {
+      t += 10 * 1000000ULL / baud_;
+      rx_.push_back({t, bytes[i]});
+    }
+  }
+  void inject(const std::string& bytes, uint64_t delay_us = 0) { inject(bytes.data(), bytes.size(), delay_us); }
+
+  int available() {
+    int n = 0;
+    while ((size_t)n < rx_.size() && rx_[n].ready_us <= native::sim().now_us) {
+      n++;
+    }
+    return n;
+  }
+
+  int read() {
+    if (!available()) return -1;
+    char c = rx_.front().c;
+    rx_.pop_front();
+    return (uint8_t)c;
+  }
+
+  String readStringUntil(char terminator) {
+    std::string out;
+    uint64_t deadline = native::sim().now_us + (uint64_t)timeout_ms_ * 1000;
+    while (true) {
+      if (rx_.empty() || rx_.front().ready_us > deadline) {
+        if (native::sim().now_us < deadline) {
+          native::advance_us(deadline - native::sim().now_us);
+        }
+        return String(out);
+      }
+      if (rx_.front().ready_us > native::sim().now_us) {
+        native::advance_us(rx_.front().ready_us - native::sim().now_us);
+      }
+      char c = rx_.front().c;
+      rx_.pop_front();
+      if (c == terminator) {
+        return String(out);
+      }
+      out += c;
+      deadline = native::sim().now_us + (uint64_t)timeout_ms_ * 1000;
+    }
+  }
+};
+
+inline Uart& console() {
+  static Uart uart(true);
+  return uart;
+}
+
+inline Uart& lora_uart() {
+  static Uart uart(false);
+  return uart;
+}
+
+// ---------- Sleep ----------
+
+inline WakeCause wake_cause() { return native::sim().wake_cause; }
+
+/**
+ * @brief Starts the ULP for the next deep sleep. Here that's ulp_watch_step() - the
+ * logic of the real ULP program - run by deep_sleep() on the simulated pins and ADC.
+ */
+
+inline bool ulp_watch_start(const UlpWatchConfig& config) {
+  native::Sim& s = native::sim();
+  if (config.adc1_channel >= sizeof(kAdc1ChannelPins) || config.float_switch_pin >= native::kNumPins) {
+    return false;
+  }
+  s.ulp_config = config;
+  s.ulp_state = UlpWatchState();
+  s.ulp_running = true;
+  return true;
+}
+
+// Stops the ULP, and returns what it left in RTC memory.
+inline UlpWatchState ulp_watch_stop(const UlpWatchConfig& config) {
+  (void)config;
+  native::sim().ulp_running = false;
+  return native::sim().ulp_state;
+}
+
+namespace native {
+
+// One ULP sample: the average of four water level conversions, then the float switch
+// (in that order, so an analog_source that also moves the float switch is up to date).
+inline bool ulp_sample() {
+  Sim& s = sim();
+  uint8_t pin = kAdc1ChannelPins[s.ulp_config.adc1_channel];
+  uint32_t sum = 0;
+  for (uint8_t i = 0; i < 4; i++) {
+    float mV = s.analog_source ? s.analog_source(pin, s.now_us) : s.analog_mV[pin];
+    sum += adc1_raw_for_mV(mV < 0 ? 0 : (mV > 3300 ? 3300 : (uint32_t)(mV + 0.5f)));
+  }
+  s.ulp_samples++;
+  return ulp_watch_step(s.ulp_config, s.ulp_state, s.pin_level[s.ulp_config.float_switch_pin], sum / 4);
+}
+
+} // namespace native
+
+/**
+ * @brief Ends the simulated wake: records how long the chip was awake, then advances
+ * the clock by sleep_us - or, if the ULP is running and wakes the chip, up to then.
+ * Unlike the real thing, this returns.
+ */
+
+inline void deep_sleep(uint64_t sleep_us) {
+  native::Sim& s = native::sim();
+  s.last_awake_us = s.now_us - s.wake_start_us;
+  s.sleep_requested = true;
+  uint64_t slept_us = 0;
+  uint64_t period_us = (uint64_t)s.ulp_config.period_ms * 1000;
+  while (s.ulp_running && period_us && slept_us + period_us < sleep_us) {
+    native::advance_us(period_us);
+    slept_us += period_us;
+    if (native::ulp_sample()) {
+      s.ulp_running = false; // the program stops its own timer after waking the chip
+      s.ulp_woke = true;
+    }
+  }
+  if (!s.ulp_woke) {
+    native::advance_us(sleep_us - slept_us);
+    slept_us = sleep_us;
+  }
+  s.last_sleep_us = slept_us;
+}
+
+// ---------- NVS ----------
+
+inline bool nvs_read(const char* key, void* data, size_t length) {
+  auto it = native::sim().nvs.find(key);
+  if (it == native::sim().nvs.end() || it->second.size() != length) {
+    return false;
+  }
+  memcpy(data, it->second.data(), length);
+  return true;
+}
+
+inline bool nvs_write(const char* key, const void* data, size_t length) {
+  native::sim().nvs[key] = std::string((const char*)data, length);
+  native::sim().nvs_writes++;
+  return true;
+}
+
+} // namespace hal
+
+/**
+ * @brief Same as the elapsedMillis library used on the ESP32: reads as the number of
+ * milliseconds since it was created or last assigned.
+ */
+
+class elapsedMillis {
+ private:
+  uint32_t ms_;
+
+ public:
+  elapsedMillis() : ms_{hal::millis()} {}
+  elapsedMillis(uint32_t val) : ms_{hal::millis() - val} {}
+  operator uint32_t() const { return hal::millis() - ms_; }
+  elapsedMillis& operator=(uint32_t val) { ms_ = hal::millis() - val; return *this; }
+};
+
+#endif // _HAL_NATIVE_H_
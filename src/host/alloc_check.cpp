@@ -0,0 +1,124 @@
+/*
+Checks that sending readings doesn't allocate: counts the heap allocations made by each
+kind of ReyaxLoRa send (text / binary, one value / batched, with and without acked
+delivery) against the simulated radio in hal_native.h, and checks FixedString's number
+formatting on a few values. Exits with 1 if anything allocates or formats wrongly.
+
+Usage: program
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "../hal.h"
+#include "../reyax_lora.h"
+#include "../fixed_string.h"
+#include "check.h"
+
+// ---------- Counting allocations ----------
+
+static bool counting = false;
+static size_t allocations = 0;
+
+void* operator new(size_t size) {
+  if (counting) allocations++;
+  void* p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+// ---------- The radio ----------
+
+const uint64_t kRadioReplyUs = 5000;
+
+/**
+ * @brief Answers +OK to everything, and acks the segments of an acked AT+SEND the way the
+ * base station would - without allocating, so only the firmware's allocations are counted.
+ */
+
+void radio(const std::string& line) {
+  hal::lora_uart().inject("+OK\r\n", 5, kRadioReplyUs);
+  const char* data = strchr(line.c_str(), ',');
+  data = data ? strchr(data + 1, ',') : nullptr;
+  if (!data || data[1] != kSegmentMarker) {
+    return;
+  }
+  static uint8_t packet[kMaxLoRaPayloadBytes]; // unescaped (see escape_payload())
+  size_t data_start = data + 1 - line.c_str();
+  if (line.size() - data_start > sizeof(packet)) {
+    return;
+  }
+  int length = unescape_payload((const uint8_t*)line.data() + data_start, line.size() - data_start, packet);
+  char ack[64] = "!";
+  size_t ack_length = 1;
+  for (int p = 0; p + kSegmentHeaderBytes <= length && packet[p] == kSegmentMarker && ack_length + 2 < sizeof(ack); ) {
+    ack[ack_length++] = packet[p + 1];
+    ack[ack_length++] = packet[p + 2];
+    char length_hex[3] = {(char)packet[p + 3], (char)packet[p + 4], '\0'};
+    p += kSegmentHeaderBytes + strtoul(length_hex, nullptr, 16);
+  }
+  char rcv[96];
+  int n = snprintf(rcv, sizeof(rcv), "+RCV=%lu,%u,%.*s,-45,11\r\n", LORA_BASE_STATION_ADDRESS,
+                   (unsigned)ack_length, (int)ack_length, ack);
+  hal::lora_uart().inject(rcv, n, 200000);
+}
+
+// ---------- Checks ----------
+
+void check_sends(ReyaxLoRa& lora, const char* name, bool binary, bool acked, bool batched) {
+  lora.set_binary_payload(binary);
+  lora.set_acked_delivery(acked);
+  const int kRounds = 3;
+  allocations = 0;
+  counting = true;
+  for (int round = 0; round < kRounds; round++) {
+    if (batched) lora.begin_batch();
+    lora.send_water_volume_data(16.2);
+    lora.send_voltage_data(13.21);
+    lora.send_pH_data(6.0);
+    lora.send_auto_fill_data(2.1, "Fill");
+    if (batched) lora.send_batch();
+  }
+  counting = false;
+  printf("%-34s %zu allocations in %d sends\n", name, allocations, kRounds * 4);
+  if (allocations) failures++;
+}
+
+void check_format(const char* expected, float value, uint8_t decimals) {
+  FixedString<24> s;
+  s.append_float(value, decimals);
+  if (strcmp(s.c_str(), expected) != 0) {
+    printf("append_float(%g, %u): got \"%s\", expected \"%s\"\n", value, decimals, s.c_str(), expected);
+    failures++;
+  }
+}
+
+int main() {
+  hal::native::sim().echo_console = false;
+  hal::native::sim().radio = radio;
+  ReyaxLoRa lora(0);
+  lora.initialize();
+
+  check_sends(lora, "text, one value at a time", false, false, false);
+  check_sends(lora, "text, batched", false, false, true);
+  check_sends(lora, "binary, one value at a time", true, false, false);
+  check_sends(lora, "binary, batched", true, false, true);
+  check_sends(lora, "text, batched, acked delivery", false, true, true);
+  check_sends(lora, "binary, batched, acked delivery", true, true, true);
+
+  check_format("13.21", 13.21, 2);
+  check_format("13.20", 13.2, 2);
+  check_format("6.0", 5.96, 1);
+  check_format("-0.5", -0.46, 1);
+  check_format("0", 0.4, 0);
+  check_format("17.400", 17.4, 3);
+  check_format("ovf", 5e9, 1);
+
+  return checks_result();
+}
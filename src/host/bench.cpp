@@ -0,0 +1,379 @@
+/*
+Micro-benchmarks the code that runs on every wake (env:native_bench): building text and
+binary payloads, FixedString number formatting, the calibration curves, the water volume
+estimator, the alarm rules and report policy, reading and averaging ADC samples, parsing
+the radio's lines, an AT round trip and a whole batched send.
+
+Each benchmark prints two costs per call:
+  host_ns  the time on this machine (the best of kRepeats runs). Only comparable between
+           runs on the same machine, and a rough guide to the ESP32's.
+  sim_us   the simulated ESP32 time, from the cost model in hal_native.h: ADC reads, clock
+           reads, delay_ms(), UART bytes at the baud rate and the radio's reply time. It
+           doesn't depend on the machine, so it catches a change that makes a wake longer.
+
+Output is CSV on stdout: benchmark,iterations,host_ns,sim_us. Save it, and pass it back
+with -b after a change: each benchmark is compared with its baseline on stderr, and the
+program exits with 1 if any sim_us went up by more than 1% - or, with -t, any host_ns by
+more than that many percent (host times move 10 - 30% from run to run on a busy machine,
+so they're only shown by default).
+
+Usage: program [-b baseline.csv] [-t percent] [-f name filter]
+
+  .pio/build/native_bench/program > bench.csv
+  (change something)
+  .pio/build/native_bench/program -b bench.csv > /dev/null
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "../hal.h"
+#include "../reyax_lora.h"
+#include "../binary_payload.h"
+#include "../fixed_string.h"
+#include "../analog_reader.h"
+#include "../ph_sensor.h"
+#include "../water_volume_sensor.h"
+#include "../water_volume_estimator.h"
+#include "../alarm_rules.h"
+#include "../report_policy.h"
+#include "../at_command.h"
+#include "../siphash.h"
+
+const double kMinRunNs = 20e6;      // each run is at least this long (on the host)...
+const uint64_t kMaxIterations = 1 << 24;
+const int kRepeats = 5;              // ...and the fastest of this many runs is kept
+const double kSimTolerance = 0.01;   // sim_us is deterministic, give or take the noise below
+
+struct Result {
+  std::string name;
+  uint64_t iterations;
+  double host_ns;
+  double sim_us;
+};
+
+static std::vector<Result> results;
+static const char* filter = nullptr;
+static uint64_t skipped_us = 0;  // simulated time a benchmark moved the clock on by, not spent
+
+// Moves the simulated clock on (to the next wake, say) without counting it as time spent
+void skip_us(uint64_t us) {
+  hal::native::advance_us(us);
+  skipped_us += us;
+}
+
+// Keeps the compiler from optimizing away a result that's never used
+template <typename T>
+inline void keep(const T& value) {
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+/**
+ * @brief Runs f() in a loop, doubling the iterations until a run takes kMinRunNs, then
+ * keeps the fastest of kRepeats runs of that many.
+ */
+
+template <typename F>
+void bench(const char* name, F f) {
+  if (filter && !strstr(name, filter)) {
+    return;
+  }
+  hal::native::Sim& sim = hal::native::sim();
+  uint64_t iterations = 1;
+  Result result = {name, 0, 0, 0};
+  for (int repeat = 0; repeat < kRepeats; ) {
+    uint64_t sim_start_us = sim.now_us;
+    skipped_us = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < iterations; i++) {
+      f();
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    if (ns < kMinRunNs && iterations < kMaxIterations) {
+      iterations *= 2;
+      continue;
+    }
+    double host_ns = ns / iterations;
+    if (repeat == 0 || host_ns < result.host_ns) {
+      result.host_ns = host_ns;
+      result.sim_us = (double)(sim.now_us - sim_start_us - skipped_us) / iterations;
+    }
+    result.iterations = iterations;
+    repeat++;
+  }
+  results.push_back(result);
+  printf("%s,%llu,%.1f,%.2f\n", name, (unsigned long long)result.iterations, result.host_ns, result.sim_us);
+  fflush(stdout);
+}
+
+// ---------- The simulated hardware ----------
+
+static uint32_t noise_state = 1;
+
+// Repeatable noise, -1 to 1 (so sim_us doesn't change from run to run)
+float noise() {
+  noise_state = noise_state * 1664525 + 1013904223;
+  return (noise_state >> 8) / (float)(1 << 23) - 1;
+}
+
+float analog_input(uint8_t pin, uint64_t) {
+  switch (pin) {
+    case 13: return 2400 + 4 * noise(); // voltage: about 13.2V
+    case 32: return 2400 + 4 * noise(); // water volume: about 16 gallons
+    case 33: return 1600 + 6 * noise(); // pH: about 6.5
+  }
+  return 0;
+}
+
+// Answers +OK to every command, after kRadioReplyUs
+const uint64_t kRadioReplyUs = 5000;
+
+void radio(const std::string&) {
+  hal::lora_uart().inject("+OK\r\n", 5, kRadioReplyUs);
+}
+
+// ---------- Benchmarks ----------
+
+void bench_payloads() {
+  bench("text_payload", [] {
+    PayloadText text;
+    ReyaxLoRa::append_text_payload(text, "Wtr lvl", 16.2f, 1, 0, 1, 1);
+    keep(text);
+  });
+  bench("text_batch_4", [] {
+    PayloadText text;
+    ReyaxLoRa::append_text_payload(text, "Wtr lvl", 16.2f, 1, 0, 1, 1);
+    ReyaxLoRa::append_text_payload(text.append(kBatchSeparator), "Voltage", 13.21f, 2, 0, 1, 1);
+    ReyaxLoRa::append_text_payload(text.append(kBatchSeparator), "pH", 6.5f, 1, PH_ALARM_CODE, 360, 3);
+    ReyaxLoRa::append_text_payload(text.append(kBatchSeparator), "Fill", 2.1f, 1, 1, 1, 1);
+    keep(text);
+  });
+  bench("binary_batch_4", [] {
+    static float value = 0;
+    BinaryPayload frame(5);
+    frame.add(PayloadField::kWaterVolume, 16.2f + value, 0, 1, 1);
+    frame.add(PayloadField::kVoltage, 13.21f + value, 0, 1, 1);
+    frame.add(PayloadField::kpH, 6.5f + value, PH_ALARM_CODE, 360, 3);
+    frame.add(PayloadField::kAutoFill, 2.1f + value, 1, 1, 1);
+    value = value < 1 ? value + 0.01f : 0;
+    keep(frame);
+  });
+  static BinaryPayload frame(5);
+  frame.add(PayloadField::kWaterVolume, 16.2f, 0, 1, 1);
+  frame.add(PayloadField::kVoltage, 13.21f, 0, 1, 1);
+  frame.add(PayloadField::kpH, 6.5f, PH_ALARM_CODE, 360, 3);
+  frame.add(PayloadField::kAutoFill, 2.1f, 1, 1, 1);
+  bench("binary_decode_4", [] {
+    uint16_t node;
+    DecodedField fields[8];
+    int count = decode_binary_payload(frame.data(), frame.length(), LORA_BASE_STATION_ADDRESS, &node, fields, 8);
+    keep(count);
+    keep(fields);
+  });
+  bench("format_float", [] {
+    static float value = 13.21f;
+    FixedString<16> s;
+    s.append_float(value, 2);
+    value += 0.01f;
+    keep(s);
+  });
+  bench("format_uint", [] {
+    static uint32_t value = 2205;
+    FixedString<16> s;
+    s.append_uint(value++);
+    keep(s);
+  });
+}
+
+void bench_conversions() {
+  bench("pH_curve", [] {
+    static float mV = 900;
+    float pH = kpHCurve.convert(mV);
+    mV = mV < 2100 ? mV + 0.7f : 900;
+    keep(pH);
+  });
+  bench("water_volume_curve", [] {
+    static float mV = 1700;
+    float gallons = kWaterVolumeCurve.convert(mV);
+    mV = mV < 2600 ? mV + 0.7f : 1700;
+    keep(gallons);
+  });
+  bench("water_volume_curve_invert", [] {
+    static float gallons = 5;
+    float mV = kWaterVolumeCurve.invert(gallons);
+    gallons = gallons < 18 ? gallons + 0.01f : 5;
+    keep(mV);
+  });
+  bench("battery_curve", [] {
+    static float mV = 2300;
+    float volts = kBatteryCurve.convert(mV);
+    mV = mV < 2700 ? mV + 0.7f : 2300;
+    keep(volts);
+  });
+  bench("estimator_predict_update", [] {
+    static WaterVolumeEstimatorState state;
+    WaterVolumeEstimator estimator(state);
+    skip_us(300 * 1000000ULL);
+    estimator.predict(0);
+    bool ok = estimator.update(16 + 0.05f * noise(), 0.0025f);
+    keep(ok);
+  });
+  bench("alarm_rules", [] {
+    static AlarmState state;
+    static float volts = 13.0f;
+    AlarmRules rules(state);
+    AlarmReport report = rules.evaluate(PayloadField::kVoltage, volts);
+    volts = volts < 13.4f ? volts + 0.01f : 13.0f;
+    keep(report);
+  });
+  bench("report_policy", [] {
+    static ReportState state;
+    ReportPolicy policy(state);
+    skip_us(300 * 1000000ULL);
+    ReportReason reason = policy.evaluate(PayloadField::kWaterVolume, 16 + 0.3f * noise(), false);
+    keep(reason);
+  });
+  bench("siphash_32_bytes", [] {
+    static const uint8_t key[16] = DOWNLINK_KEY;
+    static uint8_t data[32] = "@7;sleep=600;refill_start=14.5";
+    uint64_t tag = siphash24(key, data, sizeof(data));
+    data[0]++;
+    keep(tag);
+  });
+}
+
+void bench_sensors() {
+  // Sample by sample: the loop in read_avg_mV(), and the adaptive reads the sensors do
+  static ESP32AnalogReader reader(AdcPin<32>{});
+  bench("read_mV", [] { keep(reader.read_mV()); });
+  bench("read_avg_mV_30", [] { keep(reader.read_avg_mV()); });
+  bench("read_avg_mV_30_no_delay", [] { keep(reader.read_avg_mV(30, 0)); });
+  static VoltageSensor voltage_sensor(AdcPin<13>{});
+  bench("voltage_sensor", [] { keep(voltage_sensor.reported_voltage()); });
+  static WaterVolumeSensor water_volume_sensor(AdcPin<32>{});
+  bench("water_volume_sensor", [] { keep(water_volume_sensor.reported_water_volume()); });
+  static pHSensor pH_sensor(AdcPin<33>{});
+  bench("pH_sensor", [] { keep(pH_sensor.reported_pH()); });
+  // Both ADC1 sensors through the continuous sampler, as main.cpp reads them
+  static AdcSampler sampler;
+  static WaterVolumeSensor sampled_water_volume(AdcPin<32>{}, &sampler);
+  static pHSensor sampled_pH(AdcPin<33>{}, &sampler);
+  bench("adc1_sampler_2_pins", [] {
+    keep(sampled_water_volume.reported_water_volume());
+    keep(sampled_pH.reported_pH());
+  });
+}
+
+void bench_radio() {
+  static AtCommandEngine at;
+  at.set_echo(false);
+  bench("at_poll_rcv", [] {
+    static const char kLine[] = "+RCV=2200,5,!0203,-45,11\r\n";
+    hal::lora_uart().inject(kLine, sizeof(kLine) - 1);
+    hal::native::advance_us((sizeof(kLine) - 1) * 10 * 1000000ULL / 115200);
+    keep(at.poll());
+  });
+  bench("at_send_ok", [] { keep(at.send("AT").ok()); });
+  static ReyaxLoRa lora(0);
+  lora.initialize();
+  lora.set_binary_payload(false);
+  bench("send_batch_text_4", [] {
+    lora.begin_batch();
+    lora.send_water_volume_data(16.2f);
+    lora.send_voltage_data(13.21f);
+    lora.send_pH_data(6.5f);
+    lora.send_auto_fill_data(2.1f, "Fill");
+    lora.send_batch();
+  });
+  bench("send_batch_binary_4", [] {
+    lora.set_binary_payload(true);
+    lora.begin_batch();
+    lora.send_water_volume_data(16.2f);
+    lora.send_voltage_data(13.21f);
+    lora.send_pH_data(6.5f);
+    lora.send_auto_fill_data(2.1f, "Fill");
+    lora.send_batch();
+    lora.set_binary_payload(false);
+  });
+}
+
+// ---------- Comparing with a baseline ----------
+
+/**
+ * @brief Compares each result with the one of the same name in a CSV this program wrote
+ * before, on stderr. Returns the number of regressions.
+ *
+ * @param host_tolerance How much slower host_ns may get (0.25 = 25%), or < 0 not to check it
+ */
+
+int compare(const char* path, double host_tolerance) {
+  FILE* f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "can't read %s\n", path);
+    return 1;
+  }
+  std::vector<Result> baseline;
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    char name[64];
+    unsigned long long iterations;
+    double host_ns, sim_us;
+    if (sscanf(line, "%63[^,],%llu,%lf,%lf", name, &iterations, &host_ns, &sim_us) == 4) {
+      baseline.push_back({name, iterations, host_ns, sim_us});
+    }
+  }
+  fclose(f);
+  int regressions = 0;
+  fprintf(stderr, "%-28s %10s %10s %7s %12s %12s %7s\n", "benchmark", "host_ns", "was", "change",
+          "sim_us", "was", "change");
+  for (const Result& r : results) {
+    const Result* old = nullptr;
+    for (const Result& b : baseline) {
+      if (b.name == r.name) old = &b;
+    }
+    if (!old) {
+      fprintf(stderr, "%-28s %10.1f %10s %7s %12.2f %12s %7s  new\n", r.name.c_str(), r.host_ns, "-", "-",
+              r.sim_us, "-", "-");
+      continue;
+    }
+    double host_change = old->host_ns > 0 ? r.host_ns / old->host_ns - 1 : 0;
+    double sim_change = old->sim_us > 0 ? r.sim_us / old->sim_us - 1 : (r.sim_us > 0 ? 1 : 0);
+    bool slower = (host_tolerance >= 0 && host_change > host_tolerance) || sim_change > kSimTolerance;
+    regressions += slower;
+    fprintf(stderr, "%-28s %10.1f %10.1f %+6.0f%% %12.2f %12.2f %+6.1f%%%s\n", r.name.c_str(), r.host_ns,
+            old->host_ns, 100 * host_change, r.sim_us, old->sim_us, 100 * sim_change, slower ? "  SLOWER" : "");
+  }
+  fprintf(stderr, regressions ? "%d regressions\n" : "no regressions\n", regressions);
+  return regressions;
+}
+
+int main(int argc, char** argv) {
+  const char* baseline = nullptr;
+  double host_tolerance = -1; // host_ns isn't checked
+  int opt;
+  while ((opt = getopt(argc, argv, "b:t:f:")) != -1) {
+    switch (opt) {
+      case 'b': baseline = optarg; break;
+      case 't': host_tolerance = atof(optarg) / 100; break;
+      case 'f': filter = optarg; break;
+      default:
+        fprintf(stderr, "usage: %s [-b baseline.csv] [-t percent] [-f name filter]\n", argv[0]);
+        return 2;
+    }
+  }
+  hal::native::Sim& sim = hal::native::sim();
+  sim.echo_console = false;
+  sim.analog_source = analog_input;
+  sim.radio = radio;
+
+  printf("benchmark,iterations,host_ns,sim_us\n");
+  bench_payloads();
+  bench_conversions();
+  bench_sensors();
+  bench_radio();
+  return baseline && compare(baseline, host_tolerance) ? 1 : 0;
+}
@@ -0,0 +1,24 @@
+#ifndef _CHECK_H_
+#define _CHECK_H_
+
+#include <stdio.h>
+
+/**
+ * @brief What the host check programs share: check() prints one line per check and counts
+ * the failures, and main() ends with `return checks_result();`, which prints OK or FAILED
+ * and gives the exit code (1 if any check failed).
+ */
+
+static int failures = 0;
+
+inline void check(const char* name, bool ok) {
+  printf("%-62s %s\n", name, ok ? "ok" : "FAILED");
+  if (!ok) failures++;
+}
+
+inline int checks_result() {
+  printf(failures ? "FAILED\n" : "OK\n");
+  return failures ? 1 : 0;
+}
+
+#endif // _CHECK_H_
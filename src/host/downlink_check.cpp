@@ -0,0 +1,167 @@
+/*
+Checks downlink commands (downlink.h) on Linux: SipHash against its published test
+vectors, then plays the base station to a ReyaxLoRa / ConfigDownlink on the simulated
+radio - good commands, repeats, forged and replayed ones, bad settings - and checks what
+the node answers, what it applies, and what it saves in (simulated) NVS. Then loses the
+answer to a change of radio settings, and checks the node finds its way back to the base
+station. Exits with 1 if any check fails.
+
+Usage: program
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "../hal.h"
+#include "../downlink.h"
+#include "reyax_emulator.h"
+#include "check.h"
+
+// The base station's time to handle a packet and start its AT+SEND
+const uint64_t kBaseStationTurnaroundUs = 30000;
+
+static std::string command_to_send;  // sent by the "base station" after the node's next packet
+static std::string last_answer;      // the last packet the node sent
+static bool lose_answers = false;    // the base station doesn't get the node's answers
+
+// The base station's AT+PARAMETER settings: the two only hear each other if the node's match
+static RuntimeConfig base_radio = default_runtime_config();
+
+ReyaxEmulator radio;
+
+void base_station(uint16_t, const std::string& data, uint64_t arrived_us) {
+  if (radio.spread_factor != base_radio.spread_factor || radio.bandwidth != base_radio.bandwidth
+      || radio.coding_rate != base_radio.coding_rate || radio.preamble != base_radio.preamble) {
+    return;
+  }
+  if (lose_answers && data[0] == kDownlinkMarker) {
+    return;
+  }
+  last_answer = unescaped_payload(data);
+  if (!command_to_send.empty()) {
+    radio.deliver(LORA_BASE_STATION_ADDRESS, command_to_send,
+                  arrived_us + kBaseStationTurnaroundUs + radio.time_on_air_us(command_to_send.size()));
+    command_to_send.clear();
+  }
+}
+
+std::string signed_command(uint32_t version, const char* settings, uint16_t node_address = LORA_NODE_ADDRESS) {
+  PayloadText text;
+  build_downlink_command(version, settings, node_address, text);
+  return text.c_str();
+}
+
+/**
+ * @brief One wake of the node: sends a reading, gets command (if not ""), and listens.
+ *
+ * @return What the node answered, or "" if it didn't
+ */
+
+std::string wake_with(const std::string& command) {
+  static ReyaxLoRa lora(0);
+  hal::native::advance_us(DOWNLINK_LISTEN_INTERVAL_SECONDS * 1000000ULL); // a window is due every wake
+  hal::native::begin_wake();
+  lora.initialize();
+  ConfigDownlink downlink;
+  downlink.begin(lora);
+  command_to_send = command;
+  last_answer.clear();
+  lora.send_text_payload("Garden%Wtr lvl%16.2%0%1%1");
+  last_answer.clear();
+  downlink.receive(lora);
+  return last_answer;
+}
+
+// A power-on or reset: RTC memory is lost, NVS isn't
+void reset() {
+  runtime_config_cache().hash = 0;
+  downlink_state = DownlinkState();
+  hal::native::sim().wake_count = 0;
+}
+
+int main() {
+  hal::native::Sim& sim = hal::native::sim();
+  sim.echo_console = false;
+  radio.peer = base_station;
+  radio.attach();
+
+  uint8_t key[16], message[15];
+  for (uint8_t i = 0; i < 16; i++) key[i] = i;
+  for (uint8_t i = 0; i < 15; i++) message[i] = i;
+  check("SipHash-2-4, empty message", siphash24(key, message, 0) == 0x726fdb47dd0e0e31ULL);
+  check("SipHash-2-4, 15 bytes", siphash24(key, message, 15) == 0xa129ca6149be45e5ULL);
+
+  const RuntimeConfig defaults = default_runtime_config();
+  check("config.h settings are valid", runtime_config_valid(defaults));
+  check("no command: config.h settings", runtime_config().version == 0
+        && runtime_config().sleep_seconds == TIME_TO_SLEEP);
+
+  uint32_t writes = sim.nvs_writes;
+  check("command 1 is answered OK",
+        wake_with(signed_command(1, "sleep=600;refill_start=14.5;lw_email=60")) == "@1:OK");
+  check("  and applied", runtime_config().version == 1 && runtime_config().sleep_seconds == 600
+        && runtime_config().refill_start_volume == 14.5f && runtime_config().low_water_email_interval == 60
+        && runtime_config().circ_pump_seconds == CIRC_PUMP_RUN_SECONDS);
+  check("  and saved", sim.nvs_writes == writes + 1);
+
+  writes = sim.nvs_writes;
+  check("command 1 again is answered OK", wake_with(signed_command(1, "sleep=600;refill_start=14.5")) == "@1:OK");
+  check("  and not saved again", sim.nvs_writes == writes);
+
+  std::string forged = signed_command(2, "sleep=3600");
+  forged[forged.size() - 1] = forged[forged.size() - 1] == '0' ? '1' : '0';
+  check("a command with a bad tag isn't answered", wake_with(forged) == "");
+  check("a command for another node isn't answered", wake_with(signed_command(2, "sleep=3600", 2204)) == "");
+  check("a command with no tag isn't answered", wake_with("@2;sleep=3600") == "");
+  check("  and none of them applied", runtime_config().version == 1 && runtime_config().sleep_seconds == 600);
+
+  check("an old version is answered ERR=stale", wake_with(signed_command(0, "sleep=3600")) == "@0:ERR=stale");
+  check("an out-of-range value is answered ERR=setting",
+        wake_with(signed_command(2, "circ=240;sleep=5")) == "@2:ERR=setting");
+  check("an unknown setting is answered ERR=setting",
+        wake_with(signed_command(2, "circ=240;sleeep=900")) == "@2:ERR=setting");
+  check("a fraction for a whole-number setting is answered ERR=setting",
+        wake_with(signed_command(2, "sleep=600.5")) == "@2:ERR=setting");
+  check("refill_start above refill_stop is answered ERR=setting",
+        wake_with(signed_command(2, "refill_start=17.5")) == "@2:ERR=setting");
+  check("  and none of them applied (not even circ)", runtime_config().version == 1
+        && runtime_config().circ_pump_seconds == CIRC_PUMP_RUN_SECONDS);
+
+  check("new radio settings are answered OK", wake_with(signed_command(2, "sf=10;preamble=6")) == "@2:OK");
+  base_radio = runtime_config(); // the base station switches on the OK
+  check("  and on trial until the base station is heard on them", ConfigDownlink().radio_on_trial());
+  check("  and sent to the radio on the next wake", wake_with(signed_command(2, "sf=10;preamble=6")) == "@2:OK"
+        && radio.spread_factor == 10 && radio.preamble == 6);
+  check("  where the base station's command confirms them", !ConfigDownlink().radio_on_trial());
+  for (int i = 0; i < DOWNLINK_RADIO_TRIAL_WAKES; i++) wake_with("");
+  check("  so they're kept", runtime_config().spread_factor == 10);
+
+  reset();
+  check("after a reset, the saved settings are loaded", runtime_config().version == 2
+        && runtime_config().sleep_seconds == 600 && runtime_config().spread_factor == 10);
+  check("  and new commands are still taken", wake_with(signed_command(3, "circ=240")) == "@3:OK");
+
+  // The OK to new radio settings is lost: the base station stays on the old ones
+  lose_answers = true;
+  wake_with(signed_command(4, "sf=11"));
+  lose_answers = false;
+  check("lost OK: the node goes to the new radio settings", wake_with("") == "" && radio.spread_factor == 11);
+  for (int i = 1; i < DOWNLINK_RADIO_TRIAL_WAKES - 1; i++) wake_with("");
+  reset();
+  check("  and a reset doesn't end the trial", ConfigDownlink().radio_on_trial() && runtime_config().spread_factor == 11);
+  for (int i = 0; i < DOWNLINK_RADIO_TRIAL_WAKES; i++) wake_with("");
+  check("  not hearing the base station, it goes back to the old ones", !ConfigDownlink().radio_on_trial()
+        && runtime_config().version == 3 && runtime_config().spread_factor == 10);
+  check("  and the base station's command gets through again", wake_with(signed_command(4, "sf=11")) == "@4:OK"
+        && radio.spread_factor == 10);
+  base_radio = runtime_config();
+  check("  and this time the change is confirmed", wake_with(signed_command(4, "sf=11")) == "@4:OK"
+        && radio.spread_factor == 11 && !ConfigDownlink().radio_on_trial());
+
+  sim.nvs[kRuntimeConfigNvsKey][5] ^= 0x7F; // sleep_seconds' high byte: out of range
+  reset();
+  check("after a reset with bad saved settings, config.h settings",
+        runtime_config().version == 0 && runtime_config().sleep_seconds == TIME_TO_SLEEP);
+
+  return checks_result();
+}
@@ -0,0 +1,585 @@
+/*
+A discrete-event simulation of a Tower Garden, its solar battery and the base station,
+run against the firmware's setup() (env:native_sim) for months or years of wake cycles,
+in seconds. It prints the energy each load used, the auto-fills, the alarms the base
+station got and the packets it took to send them.
+
+The firmware's wakes and sleeps move the clock (see hal_native.h). Between them, the
+garden is brought up to date whenever the firmware (or the ULP) reads a sensor, and at
+each wake: the tub loses water to evaporation and the plants, the fill pump adds to it,
+the pH drifts, the sun charges the battery and the pumps and the ESP32 drain it. Things
+that happen at a moment - a new day's weather, a harvest, the gardener fixing the pH -
+are events in a queue, handled in time order as the garden catches up to the clock.
+
+Usage: program [days] [-s seed] [-p panel_watts] [-a amp_hours] [-j start_day] [-d]
+  days  how long to simulate (default 365)
+  -s    seed for the weather, the sensor noise and the gardener (default 1)
+  -p    solar panel size, in watts (default 50)
+  -a    battery capacity, in amp-hours (default 30)
+  -j    day of the year it starts on, 0 = Jan 1 (default 80, the spring equinox)
+  -d    also print one CSV line per day
+
+Not modelled: when the battery is empty the pumps don't run and the time is reported,
+but the firmware keeps waking (a real ESP32 would be off until the sun came back).
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+#include "../hal.h"
+#include "../binary_payload.h"
+#include "../sample_history.h"
+#include "../analog_reader.h"
+#include "../ph_sensor.h"
+#include "../water_volume_sensor.h"
+#include "../log.h"
+#include "reyax_emulator.h"
+
+void setup();
+void construct_globals();
+
+// The same pins main.cpp uses
+const uint8_t kVoltagePin = 13;
+const uint8_t kWaterVolumePin = 32;
+const uint8_t kpHPin = 33;
+const uint8_t kCircPumpPin = 23;
+const uint8_t kFillPumpPin = 22;
+const uint8_t kFloatSwitchPin = 34;
+
+// Coarser than hal_native.h's defaults, so a year of busy loops and fills runs in seconds
+const uint32_t kClockReadCostUs = 100;
+const uint32_t kAdcReadCostUs = 500;
+
+const uint64_t kSecondUs = 1000000ULL;
+const uint64_t kDayUs = 86400 * kSecondUs;
+// Evaporation, the sun and the battery are brought up to date in steps of at most this
+const uint64_t kStepUs = 60 * kSecondUs;
+// and the pumps and the float switch every this often (a fill reads the ADC thousands of times a second)
+const uint64_t kPumpStepUs = 10000;
+
+// ---------- The tub ----------
+const float kTubStartGallons = 16.0;
+const float kFloatSwitchGallons = 17.4;
+const float kFillPumpGallonsPerMinute = 1.0;
+const float kEvaporationGallonsPerDay = 0.4;   // from the tub itself, mostly in the sun
+const float kPlantUseGallonsPerDay = 2.5;      // mature plants, on a sunny day
+const float kSeedlingUse = 0.2;                // seedlings drink this fraction of it
+const int kPlantGrowDays = 60;                 // seedling to mature
+const int kHarvestDays = 90;                   // then everything is harvested and replanted
+const float kWaterVolumeNoiseMv = 8;           // one sigma, on the eTape
+const float kEtapeMvPerDegree = 0.6;           // the eTape reads higher as it warms up
+
+// ---------- pH ----------
+const float kStartpH = 5.8;
+const float kpHRisePerDay = 0.08;              // as the plants take up nutrients (mature plants)
+const float kTappH = 7.2;                      // the fill water
+const float kpHNoiseMv = 4;
+const float kGardenerTargetpH = 5.8;
+const float kGardenerToleratespH = 0.4;        // a weekly visit fixes the pH if it's further off than this
+const int kGardenerVisitDays = 7;
+const float kGardenerAlarmResponseHours = 20;  // after a pH or water level alarm reaches the base station
+
+// ---------- The battery and the loads ----------
+const float kBatteryNominalVolts = 12.8;       // LiFePO4
+const float kChargeEfficiency = 0.8;           // panel to battery, through the charge controller
+const float kSleepAmps = 0.004;                // ESP32 in deep sleep, regulator, sensors, radio idle
+const float kAwakeAmps = 0.045;                // more, while the ESP32 is awake
+const float kRadioTxAmps = 0.015;              // more, while the radio transmits
+const float kCircPumpAmps = 1.2;
+const float kFillPumpAmps = 1.6;
+const float kVoltageNoiseMv = 3;
+
+// Open-circuit voltage of a LiFePO4 battery at each state of charge (0..1)
+const CalibrationPoint kBatteryOcv[] = {{0.0, 12.0}, {0.1, 12.8}, {0.3, 13.0}, {0.7, 13.2}, {0.9, 13.3}, {1.0, 13.4}};
+constexpr CalibrationCurve<sizeof(kBatteryOcv) / sizeof(CalibrationPoint)> kBatteryOcvCurve(kBatteryOcv);
+
+struct Options {
+  int days = 365;
+  unsigned int seed = 1;
+  float panel_watts = 50;
+  float amp_hours = 30;
+  int start_day = 80;
+  bool daily = false;
+};
+
+// The totals the summary prints
+struct Totals {
+  uint32_t wakes = 0;
+  uint32_t ulp_wakes = 0;
+  double awake_s = 0;
+  double sleep_Ah = 0, awake_Ah = 0, radio_Ah = 0, circ_Ah = 0, fill_Ah = 0, solar_Ah = 0, spilled_Ah = 0;
+  double empty_s = 0;
+  double min_soc = 1;
+  double min_gallons = 100, max_gallons = 0;
+  double gallons_added = 0;
+  double gallons_used = 0;
+  uint32_t packets = 0;
+  uint64_t packet_bytes = 0;
+  uint64_t on_air_us = 0;
+  uint32_t history_frames = 0;
+  uint32_t history_samples = 0;
+  uint32_t bad_history_frames = 0;
+  uint32_t fills[3] = {};      // reported: Fill, FL-SW, TIMER
+  uint32_t alarms[6] = {};     // records with an alarm code (raised or cleared), by field (see kFieldNames)
+  uint32_t episodes[6] = {};   // times a field went into alarm
+  bool in_alarm[6] = {};       // raised, and not cleared since
+  uint32_t harvests = 0;
+  uint32_t pH_fixes = 0;
+  uint32_t hand_fills = 0;
+  double dry_s = 0;
+  uint32_t cloudy_days = 0;
+};
+
+// The value names in the text payload, in the order of Totals::alarms: readings, then fill events
+const char* const kFieldNames[] = {"Wtr lvl", "pH", "Voltage", "Fill", "FL-SW", "TIMER"};
+const uint8_t kFieldCount = sizeof(kFieldNames) / sizeof(kFieldNames[0]);
+
+/**
+ * @brief Everything outside the ESP32: the tub, the plants, the pH, the weather and the
+ * battery, and the queue of things that happen to them at a moment.
+ */
+
+class Garden {
+public:
+    enum class EventType : uint8_t {
+        kNewDay,        // the day's weather; a CSV line for the day before
+        kHarvest,       // everything is harvested and replanted
+        kGardenerVisit  // the pH is fixed, and the tub filled by hand, if they need to be
+    };
+
+private:
+    struct Event {
+        uint64_t at_us;
+        EventType type;
+        bool operator>(const Event& other) const { return at_us > other.at_us; }
+    };
+
+    const Options& options_;
+    Totals& totals_;
+    std::mt19937 rng_;
+    // Sensor noise is drawn from a table of normal samples: the ADC is read millions of times a day
+    static const size_t kNoiseTableSize = 4096;
+    float noise_table_[kNoiseTableSize];
+    uint32_t noise_state_ = 1;
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events_;
+
+    uint64_t now_us_ = 0;          // the garden is up to date to here
+    uint64_t pumps_us_ = 0;        // and the pumps to here
+    uint64_t fill_high_us_ = 0;    // pin_high_us() of the pumps when it was
+    uint64_t circ_high_us_ = 0;
+    // (doubles: a fill adds a millionth of a gallon between two ADC reads)
+    double gallons_ = kTubStartGallons;
+    double pH_ = kStartpH;
+    double soc_ = 0.8;             // battery state of charge, 0..1
+    float net_amps_ = 0;           // into the battery, in the last step
+    float clouds_ = 1;             // fraction of clear-sky sun getting through today
+    float degrees_ = 20;           // air temperature
+    uint64_t planted_us_ = 0;
+    uint64_t gardener_due_us_ = 0;
+    bool pH_alarm_seen_ = false;   // since the gardener's last visit
+    float water_volume_mV_ = 0;    // what the sensors put out now, without the noise
+    float pH_mV_ = 0;
+    float battery_mV_ = 0;
+    double pending_Ah_ = 0;        // awake time and transmissions, not taken from the battery yet
+
+    // The day's row, for -d
+    struct Day {
+        double min_gallons, max_gallons, min_soc;
+        uint32_t wakes, packets, fills, alarms;
+        double solar_Ah, load_Ah;
+    } day_;
+
+    void reset_day() {
+        day_ = Day{gallons_, gallons_, soc_, totals_.wakes, totals_.packets, fills(), alarms(), 0, 0};
+    }
+
+    uint32_t fills() const { return totals_.fills[0] + totals_.fills[1] + totals_.fills[2]; }
+    uint32_t alarms() const {
+        uint32_t n = 0;
+        for (uint8_t i = 0; i < 3; i++) n += totals_.alarms[i]; // the readings' alarms, not the fills'
+        return n;
+    }
+
+    double day_of_year(uint64_t t_us) const { return options_.start_day + (double)t_us / kDayUs; }
+
+    // Clear-sky sun, 0..1 of what a summer noon gets (northern mid-latitudes)
+    float clear_sky_sun(uint64_t t_us) const {
+        double day = day_of_year(t_us);
+        double season = cos(2 * M_PI * (day - 172) / 365);  // 1 at midsummer, -1 at midwinter
+        double day_hours = 12 + 3 * season;
+        double hour = fmod(day, 1.0) * 24 - (12 - day_hours / 2);
+        if (hour <= 0 || hour >= day_hours) {
+            return 0;
+        }
+        return (float)((0.65 + 0.35 * season) * sin(M_PI * hour / day_hours));
+    }
+
+    // How much the plants drink, as a fraction of mature plants
+    float plant_size(uint64_t t_us) const {
+        double days = (double)(t_us - planted_us_) / kDayUs;
+        return days >= kPlantGrowDays ? 1.0f : (float)(kSeedlingUse + (1 - kSeedlingUse) * days / kPlantGrowDays);
+    }
+
+    // One sigma of normal noise (xorshift32 into the table)
+    float noise() {
+        noise_state_ ^= noise_state_ << 13;
+        noise_state_ ^= noise_state_ >> 17;
+        noise_state_ ^= noise_state_ << 5;
+        return noise_table_[noise_state_ >> 20];
+    }
+
+    void schedule(uint64_t at_us, EventType type) { events_.push(Event{at_us, type}); }
+
+    void handle(const Event& event) {
+        switch (event.type) {
+            case EventType::kNewDay: {
+                if (options_.daily && event.at_us) {
+                    print_day(event.at_us);
+                }
+                reset_day();
+                // Tomorrow's weather is a lot like today's
+                std::uniform_real_distribution<float> uniform(0, 1);
+                if (uniform(rng_) > 0.6f) {
+                    float r = uniform(rng_);
+                    clouds_ = r < 0.5f ? 1.0f : r < 0.8f ? 0.6f : 0.15f;
+                }
+                totals_.cloudy_days += clouds_ < 0.5f;
+                schedule(event.at_us + kDayUs, EventType::kNewDay);
+                break;
+            }
+            case EventType::kHarvest:
+                planted_us_ = event.at_us;
+                totals_.harvests++;
+                schedule(event.at_us + (uint64_t)kHarvestDays * kDayUs, EventType::kHarvest);
+                break;
+            case EventType::kGardenerVisit:
+                if (event.at_us != gardener_due_us_) {
+                    break; // moved up by an alarm, and already done
+                }
+                if (gallons_ < LOW_WATER_ALARM_VALUE) { // the auto-fill has given up (or the battery is flat)
+                    double added = REFILL_STOP_VOLUME - gallons_;
+                    pH_ = (pH_ * gallons_ + kTappH * added) / REFILL_STOP_VOLUME;
+                    gallons_ = REFILL_STOP_VOLUME;
+                    totals_.hand_fills++;
+                }
+                if (fabs(pH_ - kGardenerTargetpH) > kGardenerToleratespH || pH_alarm_seen_) {
+                    pH_ = kGardenerTargetpH;
+                    totals_.pH_fixes++;
+                }
+                pH_alarm_seen_ = false;
+                gardener_due_us_ = event.at_us + (uint64_t)kGardenerVisitDays * kDayUs;
+                schedule(gardener_due_us_, EventType::kGardenerVisit);
+                break;
+        }
+    }
+
+    // Evaporation, the plants, pH drift, the sun and the steady loads, from now_us_ to t_us
+    void step(uint64_t t_us) {
+        double hours = (double)(t_us - now_us_) / 3.6e9;
+        float sun = clear_sky_sun(now_us_);
+        float plants = plant_size(now_us_);
+        double day = day_of_year(now_us_);
+        degrees_ = (float)(14 - 10 * cos(2 * M_PI * (day - 15) / 365) - 6 * cos(2 * M_PI * (fmod(day, 1.0) - 0.125)));
+
+        // Water: the plants drink in proportion to the sun, and a little at night
+        float weather_sun = sun * clouds_;
+        float use_gph = (kEvaporationGallonsPerDay + kPlantUseGallonsPerDay * plants) / 24
+                        * (0.3f + 2.1f * weather_sun);
+        double used = use_gph * hours;
+        if (used >= gallons_) { // the plants are out of water
+            used = gallons_;
+            totals_.dry_s += hours * 3600;
+        }
+        gallons_ -= used;
+        totals_.gallons_used += used;
+        pH_ += kpHRisePerDay * plants * hours / 24;
+
+        // Battery: the sun in, the steady draw out; the charge controller throws away what doesn't fit
+        float solar_amps = options_.panel_watts * weather_sun * kChargeEfficiency / kBatteryNominalVolts;
+        double in_Ah = solar_amps * hours;
+        double out_Ah = kSleepAmps * hours + pending_Ah_;
+        pending_Ah_ = 0;
+        totals_.solar_Ah += in_Ah;
+        totals_.sleep_Ah += kSleepAmps * hours;
+        day_.solar_Ah += in_Ah;
+        day_.load_Ah += out_Ah;
+        net_amps_ = hours > 0 ? (float)((in_Ah - out_Ah) / hours) : 0;
+        charge(in_Ah - out_Ah, hours);
+    }
+
+    void charge(double Ah, double hours) {
+        double soc = soc_ + Ah / options_.amp_hours;
+        if (soc > 1) {
+            totals_.spilled_Ah += (soc - 1) * options_.amp_hours;
+            soc = 1;
+        }
+        if (soc <= 0) {
+            soc = 0;
+            totals_.empty_s += hours * 3600;
+        }
+        soc_ = soc;
+        if (soc_ < totals_.min_soc) totals_.min_soc = soc_;
+        if (soc_ < day_.min_soc) day_.min_soc = soc_;
+    }
+
+    // The pumps, from pin_high_us(): exact, however long it's been since the last update
+    void run_pumps() {
+        uint64_t fill_us = hal::native::pin_high_us(kFillPumpPin) - fill_high_us_;
+        uint64_t circ_us = hal::native::pin_high_us(kCircPumpPin) - circ_high_us_;
+        fill_high_us_ += fill_us;
+        circ_high_us_ += circ_us;
+        double fill_h = fill_us / 3.6e9, circ_h = circ_us / 3.6e9;
+        totals_.fill_Ah += kFillPumpAmps * fill_h;
+        totals_.circ_Ah += kCircPumpAmps * circ_h;
+        day_.load_Ah += kFillPumpAmps * fill_h + kCircPumpAmps * circ_h;
+        if (soc_ > 0) { // an empty battery runs nothing
+            double added = kFillPumpGallonsPerMinute * fill_us / 6e7;
+            if (added > 0) {
+                // the fill water is mixed in: good enough for the small changes a fill makes
+                pH_ = (pH_ * gallons_ + kTappH * added) / (gallons_ + added);
+                gallons_ += added;
+                totals_.gallons_added += added;
+            }
+        }
+        charge(-(kFillPumpAmps * fill_h + kCircPumpAmps * circ_h), fill_h + circ_h);
+        if (gallons_ < totals_.min_gallons) totals_.min_gallons = gallons_;
+        if (gallons_ > totals_.max_gallons) totals_.max_gallons = gallons_;
+        if (gallons_ < day_.min_gallons) day_.min_gallons = gallons_;
+        if (gallons_ > day_.max_gallons) day_.max_gallons = gallons_;
+        hal::native::set_input_level(kFloatSwitchPin, gallons_ >= kFloatSwitchGallons ? HIGH : LOW);
+    }
+
+    // The sensor outputs, in mV, for the firmware's calibration curves (which divide: once per update)
+    void update_sensors() {
+        water_volume_mV_ = kWaterVolumeCurve.invert((float)gallons_) + kEtapeMvPerDegree * (degrees_ - 20);
+        pH_mV_ = kpHCurve.invert((float)pH_);
+        // a charging battery sits above its resting voltage, up to the controller's absorption voltage
+        float volts = kBatteryOcvCurve.convert((float)soc_);
+        if (net_amps_ > 0) volts += net_amps_ * 0.2f;
+        if (volts > 14.4f) volts = 14.4f;
+        if (soc_ <= 0) volts = 11.0f;
+        battery_mV_ = kBatteryCurve.invert(volts);
+    }
+
+    // Evaporation, the plants, the sun and the battery, up to t_us
+    void catch_up_to(uint64_t t_us) {
+        while (now_us_ + kStepUs <= t_us) {
+            step(now_us_ + kStepUs);
+            now_us_ += kStepUs;
+        }
+    }
+
+public:
+    Garden(const Options& options, Totals& totals) : options_(options), totals_(totals), rng_(options.seed) {
+        std::normal_distribution<float> normal(0, 1);
+        for (size_t i = 0; i < kNoiseTableSize; i++) noise_table_[i] = normal(rng_);
+        reset_day();
+        schedule(0, EventType::kNewDay);
+        schedule((uint64_t)kHarvestDays * kDayUs, EventType::kHarvest);
+        gardener_due_us_ = (uint64_t)kGardenerVisitDays * kDayUs;
+        schedule(gardener_due_us_, EventType::kGardenerVisit);
+        update_sensors();
+    }
+
+    /**
+     * @brief Brings the garden up to t_us (the simulated clock): the pumps exactly, the
+     * slow things in kStepUs steps, and any events due on the way, in time order.
+     */
+
+    void advance_to(uint64_t t_us) {
+        if (t_us - pumps_us_ < kPumpStepUs && t_us < now_us_ + kStepUs) {
+            return;
+        }
+        pumps_us_ = t_us;
+        run_pumps();
+        while (!events_.empty() && events_.top().at_us <= t_us) {
+            Event event = events_.top();
+            events_.pop();
+            catch_up_to(event.at_us);
+            handle(event);
+        }
+        catch_up_to(t_us);
+        update_sensors();
+    }
+
+    // Charge for the loads that are counted when they happen: awake time and transmissions
+    void draw(double Ah) { pending_Ah_ += Ah; }
+
+    // A pH or water level alarm has reached the base station: the gardener comes sooner than planned
+    void alarm(uint64_t t_us, bool pH) {
+        uint64_t at_us = t_us + (uint64_t)(kGardenerAlarmResponseHours * 3.6e9);
+        pH_alarm_seen_ = pH_alarm_seen_ || pH;
+        if (at_us < gardener_due_us_) {
+            gardener_due_us_ = at_us;
+            schedule(at_us, EventType::kGardenerVisit);
+        }
+    }
+
+    // What the sensors put out, in mV, for the firmware's calibration curves
+    float water_volume_mV() { return water_volume_mV_ + kWaterVolumeNoiseMv * noise(); }
+    float pH_mV() { return pH_mV_ + kpHNoiseMv * noise(); }
+    float battery_mV() { return battery_mV_ + kVoltageNoiseMv * noise(); }
+
+    double gallons() const { return gallons_; }
+    double pH() const { return pH_; }
+    double soc() const { return soc_; }
+    float battery_volts() const { return kBatteryOcvCurve.convert((float)soc_); }
+
+    void print_day(uint64_t t_us) {
+        printf("%d,%.2f,%.2f,%.2f,%.0f,%.2f,%.1f,%.1f,%u,%u,%u,%u\n", (int)(t_us / kDayUs) - 1, day_.min_gallons,
+               day_.max_gallons, pH_, 100 * day_.min_soc, battery_volts(), day_.solar_Ah, day_.load_Ah,
+               totals_.wakes - day_.wakes, totals_.packets - day_.packets, fills() - day_.fills, alarms() - day_.alarms);
+    }
+};
+
+static Options options;
+static Totals totals;
+static Garden* garden;
+
+float garden_input(uint8_t pin, uint64_t now_us) {
+  garden->advance_to(now_us);
+  if (pin == kWaterVolumePin) return garden->water_volume_mV();
+  if (pin == kpHPin) return garden->pH_mV();
+  if (pin == kVoltagePin) return garden->battery_mV();
+  return 0;
+}
+
+/**
+ * @brief The base station's side of a packet: counts each record ("Garden%pH%6.8%1%360%3",
+ * separated by '|') by value name, and the ones with an alarm code. A reading's alarm is
+ * raised by a record with its code, and lasts until one with kAlarmClearedCode. A sample
+ * history frame is decoded, and its samples counted.
+ */
+
+void base_station_receive(const std::string& data) {
+  if (!data.empty() && (uint8_t)data[0] == kHistoryFrameMarker) {
+    DecodedHistorySample samples[255];
+    uint16_t node_address;
+    int count = decode_history_frame((const uint8_t*)data.data(), data.size(), LORA_BASE_STATION_ADDRESS,
+                                     &node_address, samples, 255);
+    if (count < 0) {
+      totals.bad_history_frames++;
+      return;
+    }
+    totals.history_frames++;
+    totals.history_samples += count;
+    return;
+  }
+  size_t start = 0;
+  while (start < data.size()) {
+    size_t end = data.find('|', start);
+    if (end == std::string::npos) end = data.size();
+    std::string record = data.substr(start, end - start);
+    start = end + 1;
+    size_t name_start = record.find('%');
+    size_t value_start = name_start == std::string::npos ? name_start : record.find('%', name_start + 1);
+    size_t alarm_start = value_start == std::string::npos ? value_start : record.find('%', value_start + 1);
+    if (alarm_start == std::string::npos) continue; // not a text record (a diagnostics frame, say)
+    std::string name = record.substr(name_start + 1, value_start - name_start - 1);
+    int code = atoi(record.c_str() + alarm_start + 1);
+    bool raised = code != 0 && code != kAlarmClearedCode;
+    for (uint8_t i = 0; i < kFieldCount; i++) {
+      if (name != kFieldNames[i]) continue;
+      if (code) totals.alarms[i]++;
+      if (raised && !totals.in_alarm[i]) totals.episodes[i]++;
+      if (code) totals.in_alarm[i] = raised;
+      if (i >= 3) totals.fills[i - 3]++;
+      if (raised && i < 2) garden->alarm(hal::native::sim().now_us, i == 1);
+    }
+  }
+}
+
+/**
+ * @brief The node's radio (see reyax_emulator.h). Each packet goes to the base station,
+ * and its time on air is charged to the battery.
+ */
+
+ReyaxEmulator radio;
+
+void garden_radio_sent(uint16_t, const std::string& data, uint64_t) {
+  uint32_t on_air_us = radio.time_on_air_us(data.size());
+  totals.packets++;
+  totals.packet_bytes += data.size();
+  totals.on_air_us += on_air_us;
+  totals.radio_Ah += kRadioTxAmps * on_air_us / 3.6e9;
+  garden->draw(kRadioTxAmps * on_air_us / 3.6e9);
+  base_station_receive(unescaped_payload(data));
+}
+
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) options.seed = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) options.panel_watts = atof(argv[++i]);
+    else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) options.amp_hours = atof(argv[++i]);
+    else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) options.start_day = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-d") == 0) options.daily = true;
+    else options.days = atoi(argv[i]);
+  }
+
+  hal::native::Sim& sim = hal::native::sim();
+  sim.echo_console = false;
+  sim.clock_read_cost_us = kClockReadCostUs;
+  sim.adc_read_cost_us = kAdcReadCostUs;
+  sim.analog_source = garden_input;
+  radio.peer = garden_radio_sent;
+  radio.attach();
+  Garden the_garden(options, totals);
+  garden = &the_garden;
+
+  if (options.daily) {
+    printf("day,min_gallons,max_gallons,pH,min_soc_pct,battery_v,solar_Ah,load_Ah,wakes,packets,fills,alarm_reports\n");
+  }
+  clock_t started = clock();
+  const uint64_t end_us = (uint64_t)options.days * kDayUs;
+  while (sim.now_us < end_us) {
+    garden->advance_to(sim.now_us);
+    hal::native::begin_wake();
+    construct_globals(); // (a boot constructs them again)
+    totals.ulp_wakes += sim.wake_cause == hal::WakeCause::kUlp;
+    setup();
+    log_sink().flush();
+    if (!sim.sleep_requested) {
+      fprintf(stderr, "wake %u: setup() returned without going to deep sleep\n", totals.wakes);
+      return 1;
+    }
+    totals.wakes++;
+    totals.awake_s += sim.last_awake_us / 1e6;
+    totals.awake_Ah += kAwakeAmps * sim.last_awake_us / 3.6e9;
+    garden->draw(kAwakeAmps * sim.last_awake_us / 3.6e9);
+  }
+  garden->advance_to(sim.now_us);
+  double run_s = (double)(clock() - started) / CLOCKS_PER_SEC;
+
+  double days = sim.now_us / (double)kDayUs;
+  auto Wh = [](double Ah) { return Ah * kBatteryNominalVolts; };
+  printf("simulated %.1f days in %.1f s: %u wakes (%u by the ULP), ESP32 awake %.0f s (%.2f%%)\n", days, run_s,
+         totals.wakes, totals.ulp_wakes, totals.awake_s, 100 * totals.awake_s / (sim.now_us / 1e6));
+  printf("energy, Wh/day: deep sleep %.2f, awake %.2f, radio %.3f, circ pump %.2f, fill pump %.3f\n",
+         Wh(totals.sleep_Ah) / days, Wh(totals.awake_Ah) / days, Wh(totals.radio_Ah) / days,
+         Wh(totals.circ_Ah) / days, Wh(totals.fill_Ah) / days);
+  printf("solar: %.0f W panel, %.1f Wh/day in (%.1f Wh/day spilled when full), %u cloudy days\n", options.panel_watts,
+         Wh(totals.solar_Ah) / days, Wh(totals.spilled_Ah) / days, totals.cloudy_days);
+  printf("battery: %.0f Ah, lowest %.0f%%, empty for %.1f h, ends at %.0f%%\n", options.amp_hours,
+         100 * totals.min_soc, totals.empty_s / 3600, 100 * garden->soc());
+  printf("tub: %.1f gallons used, %.1f added, between %.2f and %.2f gallons, ends at %.2f, pH %.2f\n",
+         totals.gallons_used, totals.gallons_added, totals.min_gallons, totals.max_gallons, garden->gallons(),
+         garden->pH());
+  printf("fills reported: %u full, %u float switch, %u timed out\n", totals.fills[0], totals.fills[1], totals.fills[2]);
+  printf("alarms raised (reports with an alarm code):");
+  for (uint8_t i = 0; i < 3; i++) {
+    printf(" %s %u (%u)%s", kFieldNames[i], totals.episodes[i], totals.alarms[i], i < 2 ? "," : "\n");
+  }
+  printf("packets: %u (%.1f/day), %.0f bytes each, %.1f s on air in all\n", totals.packets, totals.packets / days,
+         totals.packets ? (double)totals.packet_bytes / totals.packets : 0.0, totals.on_air_us / 1e6);
+  printf("sample history: %u samples in %u frames (%.1f/day), %u frames not decoded\n", totals.history_samples,
+         totals.history_frames, totals.history_frames / days, totals.bad_history_frames);
+  printf("gardener: %u harvests, %u pH fixes, %u fills by hand; tub empty for %.1f h\n", totals.harvests,
+         totals.pH_fixes, totals.hand_fills, totals.dry_s / 3600);
+  return 0;
+}
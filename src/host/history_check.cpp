@@ -0,0 +1,250 @@
+/*
+Checks the sample history frame (sample_history.h) on Linux: encodes realistic traces of
+water volume and pH readings - a steady tub, evaporation and a fill, a pH excursion,
+irregular sample times and readings past the int16 range - decodes them again, and checks
+each comes back to within the quantization, in frames of at most 240 bytes. Then prints a
+table of how well each trace compresses, against raw samples and the text payload. Exits
+with 1 if any check fails.
+
+Given hex frames (as the base station logs them), decodes those instead.
+
+Usage: program [frame_hex ...]
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <random>
+#include <vector>
+#include "../hal.h"
+#include "../reyax_lora.h"
+#include "../sample_history.h"
+#include "check.h"
+
+// A raw sample: a uint32_t time and two int16s
+const size_t kRawSampleBytes = 8;
+
+struct Trace {
+  const char* name;
+  std::vector<HistorySample> samples;
+};
+
+HistorySample make_sample(uint32_t time_s, float water_volume, float pH) {
+  HistorySample sample;
+  sample.time_s = time_s;
+  sample.water = quantize_history_value(water_volume, kHistoryWaterScale);
+  sample.pH = quantize_history_value(pH, kHistorypHScale);
+  return sample;
+}
+
+/**
+ * @brief The traces: a day of readings each, HISTORY_SAMPLE_SECONDS apart unless said
+ * otherwise, with the eTape's noise (about 0.05 gallons) and the pH probe's (0.01).
+ */
+
+std::vector<Trace> make_traces() {
+  std::mt19937 rng(7);
+  std::normal_distribution<float> water_noise(0, 0.05f);
+  std::normal_distribution<float> pH_noise(0, 0.01f);
+  const uint32_t kSamples = 24 * 3600 / HISTORY_SAMPLE_SECONDS;
+  const uint32_t kStart_s = 1000;
+  std::vector<Trace> traces;
+
+  Trace steady = {"steady tub", {}};
+  for (uint32_t i = 0; i < kSamples; i++) {
+    steady.samples.push_back(make_sample(kStart_s + i * HISTORY_SAMPLE_SECONDS, 16 + water_noise(rng),
+                                         6.0f + pH_noise(rng)));
+  }
+  traces.push_back(steady);
+
+  Trace fill = {"evaporation, then a fill", {}};
+  float water = 18;
+  for (uint32_t i = 0; i < kSamples; i++) {
+    water -= 0.25f * HISTORY_SAMPLE_SECONDS / 3600; // a quarter gallon an hour
+    if (water < REFILL_START_VOLUME) {
+      water = REFILL_STOP_VOLUME;
+    }
+    fill.samples.push_back(make_sample(kStart_s + i * HISTORY_SAMPLE_SECONDS, water + water_noise(rng),
+                                       6.2f + pH_noise(rng)));
+  }
+  traces.push_back(fill);
+
+  Trace excursion = {"pH excursion", {}};
+  for (uint32_t i = 0; i < kSamples; i++) {
+    float hours = i * HISTORY_SAMPLE_SECONDS / 3600.0f;
+    float pH = 5.8f + 2.0f * expf(-(hours - 12) * (hours - 12) / 4); // nutrient dosed, then pH Down
+    excursion.samples.push_back(make_sample(kStart_s + i * HISTORY_SAMPLE_SECONDS, 15 + water_noise(rng),
+                                            pH + pH_noise(rng)));
+  }
+  traces.push_back(excursion);
+
+  // The full wakes fall between the sample wakes, and the ULP can wake the node early
+  Trace irregular = {"irregular sample times", {}};
+  std::uniform_int_distribution<uint32_t> interval_s(10, 3 * HISTORY_SAMPLE_SECONDS);
+  uint32_t time_s = kStart_s;
+  for (uint32_t i = 0; i < kSamples; i++) {
+    time_s += interval_s(rng);
+    irregular.samples.push_back(make_sample(time_s, 12 + water_noise(rng), 6.5f + pH_noise(rng)));
+  }
+  traces.push_back(irregular);
+
+  // A disconnected probe reads far off, and past what an int16 holds
+  Trace clipped = {"out of range readings", {}};
+  for (uint32_t i = 0; i < kSamples; i++) {
+    bool off = (i / 20) % 2;
+    clipped.samples.push_back(make_sample(kStart_s + i * HISTORY_SAMPLE_SECONDS, off ? -1000 : 20 + water_noise(rng),
+                                          off ? NAN : 7.0f + pH_noise(rng)));
+  }
+  traces.push_back(clipped);
+  return traces;
+}
+
+// The text payload for the same readings: two values per sample
+size_t text_bytes(const Trace& trace) {
+  size_t bytes = 0;
+  for (const HistorySample& sample : trace.samples) {
+    PayloadText text;
+    ReyaxLoRa::append_text_payload(text, field_name(PayloadField::kWaterVolume), sample.water / kHistoryWaterScale,
+                                   2, 0, 1, 1);
+    text.append('|');
+    ReyaxLoRa::append_text_payload(text, field_name(PayloadField::kpH), sample.pH / kHistorypHScale, 2, 0, 1, 1);
+    bytes += text.length() + 1; // and the '|' to the next sample
+  }
+  return bytes;
+}
+
+/**
+ * @brief Sends the whole trace in frames the way SampleHistory does, decoding each and
+ * comparing it with the samples it took.
+ */
+
+void check_trace(const Trace& trace) {
+  const uint8_t kMaxFrameBytes = kMaxLoRaPayloadBytes - kSegmentHeaderBytes;
+  size_t sent = 0, frames = 0, bytes = 0;
+  bool fits = true, same = true, decoded_all = true;
+  while (sent < trace.samples.size()) {
+    uint32_t now_s = trace.samples.back().time_s + 60;
+    uint8_t count = (uint8_t)std::min<size_t>(trace.samples.size() - sent, HISTORY_MAX_SAMPLES);
+    uint8_t frame[kMaxLoRaPayloadBytes];
+    uint8_t encoded;
+    uint8_t length = encode_history_frame([&](uint8_t i) -> const HistorySample& { return trace.samples[sent + i]; },
+                                          count, now_s, frame, kMaxFrameBytes, &encoded);
+    if (!encoded) {
+      decoded_all = false;
+      break;
+    }
+    fits = fits && escaped_payload_length(frame, length) <= kMaxFrameBytes;
+
+    DecodedHistorySample decoded[255];
+    uint16_t node_address;
+    int n = decode_history_frame(frame, length, LORA_BASE_STATION_ADDRESS, &node_address, decoded, 255);
+    decoded_all = decoded_all && n == encoded && node_address == LORA_NODE_ADDRESS;
+    for (int i = 0; i < n && same; i++) {
+      const HistorySample& sample = trace.samples[sent + i];
+      same = decoded[i].age_s == now_s - sample.time_s
+             && fabsf(decoded[i].water_volume - sample.water / kHistoryWaterScale) < 0.001f
+             && fabsf(decoded[i].pH - sample.pH / kHistorypHScale) < 0.001f;
+    }
+    sent += encoded;
+    frames++;
+    bytes += length;
+  }
+  char name[80];
+  snprintf(name, sizeof(name), "%s: decodes to what was encoded", trace.name);
+  check(name, decoded_all && same);
+  snprintf(name, sizeof(name), "%s: every frame fits in an AT+SEND, escaped", trace.name);
+  check(name, fits);
+
+  size_t raw = trace.samples.size() * kRawSampleBytes;
+  size_t text = text_bytes(trace);
+  printf("  %zu samples in %zu frames, %zu bytes: %.2f bytes/sample, %.1fx smaller than raw, %.1fx than text\n",
+         trace.samples.size(), frames, bytes, (double)bytes / trace.samples.size(), (double)raw / bytes,
+         (double)text / bytes);
+}
+
+void check_codec() {
+  const int32_t kValues[] = {0, 1, -1, 63, -64, 64, 8191, -8192, 8192, 32767, -32767, 65534, -65534};
+  bool zigzag = true, varint = true;
+  for (int32_t value : kValues) {
+    zigzag = zigzag && zigzag_decode(zigzag_encode(value)) == value;
+    uint8_t bytes[5];
+    uint8_t length = put_varint(bytes, zigzag_encode(value));
+    size_t pos = 0;
+    uint32_t decoded;
+    varint = varint && get_varint(bytes, length, &pos, &decoded) && pos == length && decoded == zigzag_encode(value);
+  }
+  check("zig-zag round trips", zigzag);
+  check("varints round trip", varint);
+  uint8_t bytes[5];
+  check("a change of -64 to 63 takes one byte", put_varint(bytes, zigzag_encode(-64)) == 1
+                                                 && put_varint(bytes, zigzag_encode(63)) == 1);
+
+  HistorySample samples[2] = {make_sample(100, 16, 6), make_sample(220, 16.1f, 6.02f)};
+  uint8_t frame[kMaxLoRaPayloadBytes];
+  uint8_t encoded;
+  uint8_t length = encode_history_frame([&](uint8_t i) -> const HistorySample& { return samples[i]; }, 2, 300,
+                                        frame, sizeof(frame), &encoded);
+  DecodedHistorySample decoded[2];
+  uint16_t node_address;
+  bool truncated_rejected = true;
+  for (uint8_t cut = 0; cut < length; cut++) {
+    truncated_rejected = truncated_rejected
+                         && decode_history_frame(frame, cut, LORA_BASE_STATION_ADDRESS, &node_address, decoded, 2) < 0;
+  }
+  check("a truncated frame is rejected", truncated_rejected);
+  frame[2] = 3;
+  check("a frame with more samples than room is rejected",
+        decode_history_frame(frame, length, LORA_BASE_STATION_ADDRESS, &node_address, decoded, 2) < 0);
+  check("a frame with too little room for one sample is not built",
+        encode_history_frame([&](uint8_t i) -> const HistorySample& { return samples[i]; }, 2, 300, frame, 10,
+                             &encoded) == 0 && encoded == 0);
+}
+
+// Parses hex into data; returns its length, or -1 if it isn't hex
+int parse_hex(const char* hex, uint8_t* data, size_t max_length) {
+  size_t length = strlen(hex);
+  if (length % 2 || length / 2 > max_length) {
+    return -1;
+  }
+  for (size_t i = 0; i < length / 2; i++) {
+    unsigned int byte;
+    if (sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+      return -1;
+    }
+    data[i] = (uint8_t)byte;
+  }
+  return (int)(length / 2);
+}
+
+int decode_frames(int argc, char** argv) {
+  for (int arg = 1; arg < argc; arg++) {
+    uint8_t frame[kMaxLoRaPayloadBytes];
+    int length = parse_hex(argv[arg], frame, sizeof(frame));
+    DecodedHistorySample samples[255];
+    uint16_t node_address;
+    int count = length < 0 ? -1
+                           : decode_history_frame(frame, length, LORA_BASE_STATION_ADDRESS, &node_address, samples, 255);
+    if (count < 0) {
+      fprintf(stderr, "not a history frame: %s\n", argv[arg]);
+      return 1;
+    }
+    printf("node %u, %d samples\nage_s,water_volume,pH\n", node_address, count);
+    for (int i = 0; i < count; i++) {
+      printf("%u,%.2f,%.2f\n", samples[i].age_s, samples[i].water_volume, samples[i].pH);
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  hal::native::sim().echo_console = false;
+  if (argc > 1) {
+    return decode_frames(argc, argv);
+  }
+  check_codec();
+  for (const Trace& trace : make_traces()) {
+    check_trace(trace);
+  }
+  return checks_result();
+}
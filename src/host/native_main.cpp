@@ -0,0 +1,248 @@
+/*
+Runs the firmware's setup() on Linux (env:native) for a number of wake cycles, against
+the simulated hardware in hal_native.h, and prints how long the chip was awake in each
+cycle, and in all. Awake time is what drains the battery, so this is the number to watch.
+
+Usage: program [cycles] [-q] [-l loss] [-v volts] [-i minute] [-c minute:settings]...
+  cycles  number of wake cycles to run (default 4)
+  -q      don't echo the firmware's Serial Monitor output
+  -l      percentage of packets to the base station that are lost (default 0)
+  -v      battery voltage (default 13.2), to watch a low battery lengthen the sleep
+  -i      from this minute on, water leaks into the tub (a stuck valve, say) at
+          kInflowGallonsPerMinute, to watch the ULP wake the chip when it overflows
+  -c      from this minute on, the base station has a downlink command for the node
+          (see downlink.h), e.g. -c 30:sleep=600;refill_start=14.5 - quote it in a shell
+
+The radio is emulated (reyax_emulator.h), and the other end of the link plays the base
+station: built with LORA_ACKED_DELIVERY (env:native_ack), it acks every packet it gets,
+so retransmits can be watched. It sends each -c command, signed, after every packet from
+the node until the node answers.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <random>
+#include <string>
+#include <vector>
+#include "../hal.h"
+#include "../analog_reader.h"
+#include "../log.h"
+#include "../downlink.h"
+#include "reyax_emulator.h"
+
+void setup();
+void construct_globals();
+
+// The same pins main.cpp uses
+const uint8_t kVoltagePin = 13;
+const uint8_t kWaterVolumePin = 32;
+const uint8_t kpHPin = 33;
+const uint8_t kCircPumpPin = 23;
+const uint8_t kFillPumpPin = 22;
+const uint8_t kFloatSwitchPin = 34;
+
+// The base station's time to handle a packet and start its AT+SEND of the ack
+const uint64_t kBaseStationTurnaroundUs = 30000;
+
+// A downlink command the base station has for the node, from a minute on
+struct PendingCommand {
+  uint64_t from_us;
+  uint32_t version;
+  std::string settings;
+  int sent = 0;
+  std::string answer;  // the node's "@7:OK", once it has come
+  bool confirmed = false; // sent once more after the answer, to confirm new radio settings
+};
+
+/**
+ * @brief The base station, as far as acked delivery goes (see acked_delivery.h): it acks
+ * every segment in each packet it receives, and counts the ones it had already seen.
+ * It also sends the node its downlink commands (see downlink.h), one at a time, in order,
+ * and each one once more after it's answered, which the node takes as hearing it on any
+ * new radio settings.
+ */
+
+struct BaseStation {
+  bool seen[256] = {};
+  int packets = 0;
+  int segments = 0;
+  int duplicates = 0;
+  std::vector<PendingCommand> commands;
+
+  // The signed command to send after a packet from the node, or "" if there's none due
+  std::string command() {
+    for (PendingCommand& command : commands) {
+      if (command.confirmed) continue;
+      if (hal::native::sim().now_us < command.from_us) return "";
+      command.confirmed = !command.answer.empty();
+      PayloadText text;
+      build_downlink_command(command.version, command.settings.c_str(), LORA_NODE_ADDRESS, text);
+      command.sent++;
+      return text.c_str();
+    }
+    return "";
+  }
+
+  // Returns the ack to send back ("!0708"), or "" if there's nothing to ack.
+  std::string receive(const std::string& data) {
+    packets++;
+    if (!data.empty() && data[0] == kDownlinkMarker) { // the node's answer to a command
+      uint32_t version = strtoul(data.c_str() + 1, nullptr, 10);
+      for (PendingCommand& command : commands) {
+        if (command.version == version) command.answer = data;
+      }
+      return "";
+    }
+    std::string ack;
+    size_t pos = 0;
+    while (pos + 5 <= data.size() && data[pos] == '^') {
+      std::string seq = data.substr(pos + 1, 2);
+      size_t length = strtoul(data.substr(pos + 3, 2).c_str(), nullptr, 16);
+      uint8_t n = (uint8_t)strtoul(seq.c_str(), nullptr, 16);
+      segments++;
+      if (seen[n]) duplicates++;
+      seen[n] = true;
+      ack += seq;
+      pos += 5 + length;
+    }
+    return ack.empty() ? "" : "!" + ack;
+  }
+} base_station;
+
+/**
+ * @brief The node's radio (see reyax_emulator.h). Each packet that gets through goes to
+ * base_station, and its ack and any command come back as "+RCV=" lines.
+ */
+
+ReyaxEmulator radio(2);
+
+void base_station_radio(uint16_t, const std::string& packet_data, uint64_t arrived_us) {
+  std::string data = unescaped_payload(packet_data);
+  if (data.empty()) return;
+  // The ack, then (unless the packet was an answer to one) a command
+  std::string packets[] = {base_station.receive(data), data[0] == kDownlinkMarker ? "" : base_station.command()};
+  for (const std::string& packet : packets) {
+    if (packet.empty()) continue;
+    arrived_us += kBaseStationTurnaroundUs + radio.time_on_air_us(packet.size());
+    radio.deliver(LORA_BASE_STATION_ADDRESS, packet, arrived_us);
+  }
+}
+
+// Noise on each analog input, so adaptive sampling has something to do. One sigma, in mV.
+const float kVoltageNoiseMv = 3;
+const float kWaterVolumeNoiseMv = 8;
+const float kpHNoiseMv = 4;
+
+/**
+ * @brief The tub: it starts a little above REFILL_START_VOLUME, the plants drink from it,
+ * and the fill pump adds to it while its pin is HIGH. The float switch comes up near the top.
+ */
+
+const float kTubStartGallons = 15.2;
+const float kTubUseGallonsPerHour = 1.0;
+const float kFillPumpGallonsPerMinute = 1.0;
+const float kFloatSwitchGallons = 17.4;
+const float kInflowGallonsPerMinute = 0.1;
+uint64_t inflow_start_us = UINT64_MAX;
+
+float tub_gallons(uint64_t now_us) {
+  float inflow = now_us > inflow_start_us ? kInflowGallonsPerMinute * (now_us - inflow_start_us) / 6e7 : 0;
+  return kTubStartGallons - kTubUseGallonsPerHour * now_us / 3.6e9
+         + kFillPumpGallonsPerMinute * hal::native::pin_high_us(kFillPumpPin) / 6e7 + inflow;
+}
+
+// The inverse of WaterVolumeSensor's conversion, in mV, with WATER_VOLUME_CALIBRATION_POINTS from config.h
+// (the straight line its points make)
+float water_volume_mV(float gallons) {
+  return ((gallons - 5.5) * 0.065 + 1.73) * 1000;
+}
+
+float noisy_input(uint8_t pin, uint64_t now_us) {
+  static std::mt19937 rng(1);
+  std::normal_distribution<float> noise(0, 1);
+  hal::native::Sim& sim = hal::native::sim();
+  float gallons = tub_gallons(now_us);
+  hal::native::set_input_level(kFloatSwitchPin, gallons >= kFloatSwitchGallons ? HIGH : LOW);
+  if (pin == kWaterVolumePin) {
+    return water_volume_mV(gallons) + kWaterVolumeNoiseMv * noise(rng);
+  }
+  float sigma = pin == kVoltagePin ? kVoltageNoiseMv : pin == kpHPin ? kpHNoiseMv : 0;
+  return sim.analog_mV[pin] + sigma * noise(rng);
+}
+
+int main(int argc, char** argv) {
+  int cycles = 4;
+  float battery_volts = 13.2;
+  hal::native::Sim& sim = hal::native::sim();
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-q") == 0) sim.echo_console = false;
+    else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) radio.faults.loss_percent = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-v") == 0 && i + 1 < argc) battery_volts = atof(argv[++i]);
+    else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) inflow_start_us = atoi(argv[++i]) * 60000000ULL;
+    else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc && strchr(argv[i + 1], ':')) {
+      PendingCommand command;
+      command.from_us = atoi(argv[++i]) * 60000000ULL;
+      command.version = base_station.commands.size() + 1;
+      command.settings = strchr(argv[i], ':') + 1;
+      base_station.commands.push_back(command);
+    }
+    else cycles = atoi(argv[i]);
+  }
+
+  // pH 6.0 and the battery voltage, run backwards through the conversions in the sensor
+  // classes. The water volume comes from tub_gallons().
+  sim.analog_mV[kpHPin] = 1677;
+  sim.analog_mV[kVoltagePin] = kBatteryCurve.invert(battery_volts);
+  sim.analog_source = noisy_input;
+  radio.peer = base_station_radio;
+  radio.attach();
+
+  uint64_t total_awake_us = 0;
+  uint64_t total_delay_us = 0;
+  int ulp_wakes = 0;
+  if (!sim.echo_console) printf("wake,awake_ms,delay_ms,sleep_s\n");
+  for (int n = 0; n < cycles; n++) {
+    hal::native::begin_wake();
+    construct_globals(); // (a boot constructs them again)
+    ulp_wakes += sim.wake_cause == hal::WakeCause::kUlp;
+    setup();
+    log_sink().flush(); // with LOG_SINK_BUFFER, the wake's log is only printed now
+    if (!sim.sleep_requested) {
+      fprintf(stderr, "wake %d: setup() returned without going to deep sleep\n", n);
+      return 1;
+    }
+    if (!sim.echo_console) {
+      printf("%d,%.1f,%.1f,%.0f\n", n, sim.last_awake_us / 1000.0,
+             sim.delay_us_this_wake / 1000.0, sim.last_sleep_us / 1e6);
+    }
+    else {
+      printf("\nwake %d: awake %.1f ms (%.1f ms in delay()), then sleep %.0f s%s\n", n,
+             sim.last_awake_us / 1000.0, sim.delay_us_this_wake / 1000.0, sim.last_sleep_us / 1e6,
+             sim.ulp_woke ? ", woken by the ULP" : "");
+    }
+    total_awake_us += sim.last_awake_us;
+    total_delay_us += sim.delay_us_this_wake;
+  }
+  if (cycles > 0) {
+    double total_s = sim.now_us / 1e6;
+    printf("mean awake per wake: %.1f ms (%.1f ms in delay())\n",
+           total_awake_us / 1000.0 / cycles, total_delay_us / 1000.0 / cycles);
+    printf("over %.1f min: CPU awake %.1f s (%.2f%%), circ pump on %.1f s (%.1f%%)\n", total_s / 60,
+           total_awake_us / 1e6, 100.0 * total_awake_us / sim.now_us,
+           hal::native::pin_high_us(kCircPumpPin) / 1e6, 100.0 * hal::native::pin_high_us(kCircPumpPin) / sim.now_us);
+    printf("radio: %u packets sent (%u lost), %.1f s on air\n", radio.stats.sends, radio.stats.lost,
+           radio.stats.on_air_us / 1e6);
+    printf("base station: %d packets, %d segments acked (%d duplicates)\n", base_station.packets,
+           base_station.segments, base_station.duplicates);
+    printf("fill pump on %.1f s, tub now %.2f gallons\n", hal::native::pin_high_us(kFillPumpPin) / 1e6,
+           tub_gallons(sim.now_us));
+    printf("ULP: %u samples, %d wakes\n", sim.ulp_samples, ulp_wakes);
+    printf("ADC: characterized %u times in %d wakes\n", sim.adc_characterizations, cycles);
+    for (const PendingCommand& command : base_station.commands) {
+      printf("downlink command %u (%s): sent %d times, answer %s\n", command.version, command.settings.c_str(),
+             command.sent, command.answer.empty() ? "none" : command.answer.c_str());
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,88 @@
+/*
+Host-side tool for the binary payload format in binary_payload.h (env:native_payload).
+
+  program              Compares the text and binary payloads of a typical wake, and
+                       prints bytes and time on air saved at the AT+PARAMETER settings
+                       in config.h.
+  program <hex>        Decodes a binary frame given in hex, e.g. the data part of a
+                       +RCV=2205,5,B105...,-40,12 line from the base station.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../hal.h"
+#include "../config.h"
+#include "../reyax_lora.h"
+
+struct Reading {
+  PayloadField field;
+  float value;
+  uint8_t decimals;
+  uint16_t alarm_code;
+  uint16_t email_interval;
+  uint16_t max_emails;
+};
+
+// What a wake with an auto-fill sends: the send_*_data() calls in main.cpp.
+const Reading kTypicalWake[] = {
+  {PayloadField::kWaterVolume, 14.6, 1, 0, 1, 1},
+  {PayloadField::kVoltage, 13.24, 2, 0, 1, 1},
+  {PayloadField::kpH, 6.8, 1, PH_ALARM_CODE, PH_ALARM_EMAIL_INTERVAL, PH_MAX_EMAILS},
+  {PayloadField::kAutoFill, 2.3, 1, AUTO_FILL_ALARM_CODE, AUTO_FILL_EMAIL_INTERVAL, AUTO_FILL_MAX_EMAILS},
+};
+
+int decode(const char* hex) {
+  uint8_t frame[kMaxLoRaPayloadBytes];
+  size_t length = strlen(hex) / 2;
+  if (length > sizeof(frame)) length = sizeof(frame);
+  for (size_t i = 0; i < length; i++) {
+    char byte[3] = {hex[2 * i], hex[2 * i + 1], 0};
+    frame[i] = (uint8_t)strtoul(byte, nullptr, 16);
+  }
+  uint16_t node_address = 0;
+  DecodedField fields[kMaxLoRaPayloadBytes / kBinaryFieldBytes];
+  int count = decode_binary_payload(frame, length, LORA_BASE_STATION_ADDRESS, &node_address,
+                                    fields, sizeof(fields) / sizeof(fields[0]));
+  if (count < 0) {
+    fprintf(stderr, "not a valid binary frame\n");
+    return 1;
+  }
+  for (int i = 0; i < count; i++) {
+    printf("%u%%%s%%%.2f%%%u%%%u%%%u\n", node_address, field_name(fields[i].field), fields[i].value,
+           fields[i].alarm_code, fields[i].email_interval, fields[i].max_emails);
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  hal::native::sim().echo_console = false;
+  if (argc > 1) {
+    return decode(argv[1]);
+  }
+
+  ReyaxLoRa lora;
+  uint32_t text_bytes = 0;
+  uint32_t binary_bytes = 0;
+  float text_ms = 0;
+  float binary_ms = 0;
+  printf("AT+PARAMETER=%d,%d,%d,%d\n", LORA_SPREAD_FACTOR, LORA_BANDWIDTH, LORA_CODING_RATE, LORA_PREAMBLE);
+  printf("%-8s %10s %9s %10s %9s\n", "field", "text_B", "text_ms", "binary_B", "binary_ms");
+  for (const Reading& r : kTypicalWake) {
+    PayloadText text;
+    ReyaxLoRa::append_text_payload(text, field_name(r.field), r.value, r.decimals, r.alarm_code,
+                                   r.email_interval, r.max_emails);
+    BinaryPayload frame(LORA_NODE_ADDRESS - LORA_BASE_STATION_ADDRESS);
+    frame.add(r.field, r.value, r.alarm_code, r.email_interval, r.max_emails);
+    printf("%-8s %10u %9.1f %10u %9.1f\n", field_name(r.field), (unsigned)text.length(),
+           lora.time_on_air_ms(text.length()), frame.length(), lora.time_on_air_ms(frame.length()));
+    text_bytes += text.length();
+    binary_bytes += frame.length();
+    text_ms += lora.time_on_air_ms(text.length());
+    binary_ms += lora.time_on_air_ms(frame.length());
+  }
+  printf("%-8s %10u %9.1f %10u %9.1f\n", "total", text_bytes, text_ms, binary_bytes, binary_ms);
+  printf("saved: %u bytes, %.1f ms time on air per wake (%.0f%%)\n", text_bytes - binary_bytes,
+         text_ms - binary_ms, 100.0 * (text_ms - binary_ms) / text_ms);
+  return 0;
+}
@@ -0,0 +1,90 @@
+/*
+Decodes the wake profile packets that PhaseProfiler (phase_profiler.h) sends, and prints
+the min / mean / max time of each phase of a wake (env:native_profile).
+
+  program <hex>...     Decodes each packet given in hex, e.g. the data part of a
+                       +RCV=2205,58,D105...,-40,12 line from the base station.
+  program < log        Decodes every profile packet in a Serial Monitor log (or the
+                       output of the native runner): the "Data: D105..." lines.
+
+  .pio/build/native/program 100 | .pio/build/native_profile/program
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../phase_profiler.h"
+#include "../acked_delivery.h"
+
+int hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+// Reads hex digits up to the first non-hex character. Returns the number of bytes.
+size_t parse_hex(const char* hex, uint8_t* data, size_t max_length) {
+  size_t length = 0;
+  while (length < max_length && hex_value(hex[0]) >= 0 && hex_value(hex[1]) >= 0) {
+    data[length++] = (uint8_t)((hex_value(hex[0]) << 4) | hex_value(hex[1]));
+    hex += 2;
+  }
+  return length;
+}
+
+/**
+ * @brief Prints the profile in data, which may be inside an acked delivery segment
+ * ("^" seq length, see acked_delivery.h).
+ *
+ * @return false if it isn't a profile packet
+ */
+
+bool print_report(const uint8_t* data, size_t length) {
+  if (length > kSegmentHeaderBytes && data[0] == (uint8_t)kSegmentMarker) {
+    data += kSegmentHeaderBytes;
+    length -= kSegmentHeaderBytes;
+  }
+  uint16_t wakes = 0;
+  DecodedPhase phases[kPhaseCount];
+  int count = decode_profile_report(data, length, &wakes, phases, kPhaseCount);
+  if (count < 0) {
+    return false;
+  }
+  printf("node %u, %u wakes\n", data[1] + (unsigned)LORA_BASE_STATION_ADDRESS, wakes);
+  printf("%-16s %6s %9s %9s %9s\n", "phase", "count", "min_ms", "mean_ms", "max_ms");
+  for (int i = 0; i < count; i++) {
+    printf("%-16s %6u %9u %9u %9u\n", phase_name(phases[i].phase), phases[i].count,
+           phases[i].min_ms, phases[i].mean_ms, phases[i].max_ms);
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  uint8_t data[kMaxLoRaPayloadBytes];
+  if (argc > 1) {
+    int failures = 0;
+    for (int i = 1; i < argc; i++) {
+      if (!print_report(data, parse_hex(argv[i], data, sizeof(data)))) {
+        fprintf(stderr, "not a wake profile packet: %s\n", argv[i]);
+        failures++;
+      }
+    }
+    return failures ? 1 : 0;
+  }
+
+  char line[1024];
+  int reports = 0;
+  while (fgets(line, sizeof(line), stdin)) {
+    const char* hex = strstr(line, "Data: ");
+    if (hex && print_report(data, parse_hex(hex + 6, data, sizeof(data)))) {
+      reports++;
+      printf("\n");
+    }
+  }
+  if (!reports) {
+    fprintf(stderr, "no wake profile packets found\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,225 @@
+/*
+Checks the emulated Reyax radio (reyax_emulator.h) on Linux, and the firmware's AT code
+against it: the module's answers to good and bad commands, +RCV and what it loses while
+transmitting, then a table of how long an AT+SEND takes at each spreading factor, next to
+the time the model says it should, that ReyaxLoRa's escaped packets get there whole, and
+last the retries of AtCommandEngine and ReyaxLoRa::initialize() with commands going
+unanswered and failing. Exits with 1 if any
+check fails.
+
+Usage: program
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "../hal.h"
+#include "../at_command.h"
+#include "../reyax_lora.h"
+#include "reyax_emulator.h"
+#include "check.h"
+
+static ReyaxEmulator radio(3);
+static AtCommandEngine at;
+
+static std::string last_packet;    // the last packet that got to the other end
+static std::string last_received;  // the last +RCV line the engine passed on
+
+void received(const char* line, void*) {
+  last_received = line;
+}
+
+// Sends command (with data, for an AT+SEND), waiting as long as ReyaxLoRa does for the reply
+AtResponse send_command(const std::string& command, const std::string& data = "") {
+  uint32_t timeout_ms = kAtReplyTimeoutMs + (data.empty() ? 0 : radio.time_on_air_us(data.size()) / 1000);
+  return at.send(command.c_str(), (const uint8_t*)data.data(), data.size(), timeout_ms);
+}
+
+// The line that answered command ("" if none did)
+std::string send(const std::string& command, const std::string& data = "") {
+  return send_command(command, data).reply;
+}
+
+// Reads the radio's lines for ms milliseconds; returns the last one
+std::string listen(uint32_t ms) {
+  std::string last;
+  uint32_t start_ms = hal::millis();
+  while ((uint32_t)(hal::millis() - start_ms) < ms) {
+    const char* line = at.poll();
+    if (line) last = line;
+  }
+  return last;
+}
+
+void check_commands() {
+  check("AT is answered +OK", send("AT") == "+OK");
+  check("AT+VER? is answered with the version", send("AT+VER?") == "+VER=" + radio.version);
+  check("a command without AT is answered +ERR=2", send("HELLO") == "+ERR=2");
+  check("a command without = or ? is answered +ERR=3", send("AT+ADDRESS") == "+ERR=3");
+  check("an unknown command is answered +ERR=4", send("AT+COLOR?") == "+ERR=4");
+  check("a value out of range is answered +ERR=4", send("AT+PARAMETER=13,7,1,4") == "+ERR=4");
+  check("  and not saved", send("AT+PARAMETER?") == "+PARAMETER=12,7,1,4");
+  check("AT+PARAMETER= is answered +OK", send("AT+PARAMETER=9,7,1,4") == "+OK");
+  check("  and saved", send("AT+PARAMETER?") == "+PARAMETER=9,7,1,4");
+  check("AT+ADDRESS= is answered +OK, and saved", send("AT+ADDRESS=2204") == "+OK" && radio.address == 2204);
+  send("AT+ADDRESS=" + std::to_string(LORA_NODE_ADDRESS));
+  check("AT+RESET is answered +RESET", send("AT+RESET") == "+RESET" && listen(50) == "+READY");
+
+  check("AT+SEND is answered +OK", send("AT+SEND=2200,5,", "hello") == "+OK");
+  check("  and the packet gets there", last_packet == "hello");
+  check("data with a LF in it is cut short there: +ERR=5",
+        send("AT+SEND=2200,4,", std::string("a\nb\x01", 4)) == "+ERR=5" && listen(50) == "+ERR=2");
+  check("  and so is data with a CR in it",
+        send("AT+SEND=2200,4,", std::string("a\rb\x01", 4)) == "+ERR=5" && listen(50) == "+ERR=2");
+  check("data with a ',' in it gets there cut short",
+        send("AT+SEND=2200,3,", "a,b") == "+OK" && last_packet == "a");
+  check("more data than the length is answered +ERR=5", send("AT+SEND=2200,2,", "hello") == "+ERR=5");
+  check("more than 240 bytes is answered +ERR=13", send("AT+SEND=2200,241,", std::string(241, 'x')) == "+ERR=13");
+
+  radio.timing.reply_after_tx = false;
+  send("AT+SEND=2200,20,", std::string(20, 'x'));
+  AtResponse busy = send_command("AT+SEND=2200,5,", "hello");
+  check("an AT+SEND while transmitting is answered +ERR=17", busy.error == AtError::kTxBusy);
+  check("  and retried", busy.attempts == kAtMaxAttempts);
+  radio.deliver(LORA_BASE_STATION_ADDRESS, "!01", hal::native::sim().now_us);
+  last_received.clear();
+  listen(50);
+  check("a packet that arrives while transmitting is lost", last_received.empty());
+  radio.timing.reply_after_tx = true;
+  listen(500);
+
+  radio.deliver(LORA_BASE_STATION_ADDRESS, "!0203", hal::native::sim().now_us + 20000);
+  listen(50);
+  check("a packet from the base station is passed on as +RCV", last_received == "+RCV=2200,5,!0203,-45,11");
+  radio.faults.crc_error_percent = 100;
+  radio.deliver(LORA_BASE_STATION_ADDRESS, "!04", hal::native::sim().now_us + 20000);
+  check("  and one with a CRC error as +ERR=12", listen(50) == "+ERR=12");
+  radio.faults.crc_error_percent = 0;
+}
+
+/**
+ * @brief Times an AT+SEND of each size at each spreading factor, from the first byte of
+ * the command to the end of the +OK, and compares it with the model: the command and the
+ * reply at the UART's baud rate, the module's tx_start_us, and the time on air.
+ */
+
+void check_latency() {
+  const uint16_t kSizes[] = {10, 50, 240};
+  const uint32_t kUartByteUs = 10 * 1000000 / 115200;
+  printf("\nsf,bytes,on_air_ms,model_ms,elapsed_ms,timeout_ms\n");
+  bool all_close = true, all_in_time = true;
+  for (unsigned int sf = 7; sf <= 12; sf++) {
+    send("AT+PARAMETER=" + std::to_string(sf) + ",7,1,4");
+    for (uint16_t bytes : kSizes) {
+      std::string command = "AT+SEND=2200," + std::to_string(bytes) + ",";
+      uint32_t on_air_us = radio.time_on_air_us(bytes);
+      uint32_t timeout_ms = on_air_us / 1000 + kAtReplyTimeoutMs;
+      double model_ms = ((command.size() + bytes + 2 + 5) * kUartByteUs + radio.timing.tx_start_us + on_air_us) / 1000.0;
+      uint64_t start_us = hal::native::sim().now_us;
+      AtResponse response = send_command(command, std::string(bytes, 'x'));
+      double elapsed_ms = (hal::native::sim().now_us - start_us) / 1000.0;
+      printf("%u,%u,%.1f,%.1f,%.1f,%u\n", sf, bytes, on_air_us / 1000.0, model_ms, elapsed_ms, timeout_ms);
+      all_close = all_close && response.ok() && elapsed_ms > model_ms - 1 && elapsed_ms < model_ms + 1;
+      all_in_time = all_in_time && response.attempts == 1;
+    }
+  }
+  send("AT+PARAMETER=9,7,1,4");
+  printf("\n");
+  check("each AT+SEND takes the time the model says, to within 1 ms", all_close);
+  check("  and is answered within ReyaxLoRa's timeout", all_in_time);
+}
+
+// ReyaxLoRa's packets get there whole, whatever bytes are in them (see escape_payload())
+void check_escaping() {
+  ReyaxLoRa lora(0);
+  lora.set_acked_delivery(false);
+  std::string bytes;
+  for (int b = 0; b < 120; b++) bytes += (char)b;
+  lora.send_diagnostics((const uint8_t*)bytes.data(), bytes.size());
+  check("ReyaxLoRa escapes CR, LF and ',', so any byte gets there",
+        last_packet.size() == 124 && unescaped_payload(last_packet) == bytes);
+  BinaryPayload frame(5);
+  frame.add(PayloadField::kWaterVolume, 26.6f, 0, 1, 1); // 266 = 0x010A
+  lora.send_binary_payload(frame);
+  check("  a water volume of 26.6 gallons, say",
+        unescaped_payload(last_packet) == std::string((const char*)frame.data(), frame.length()));
+
+  // The sample history is only removed once its frame has been taken
+  bool sent = lora.send_diagnostics((const uint8_t*)bytes.data(), 10);
+  radio.faults.tx_error_percent = 100;
+  bool failed = !lora.send_diagnostics((const uint8_t*)bytes.data(), 10);
+  radio.faults.tx_error_percent = 0;
+  check("send_diagnostics() says whether the radio took the packet", sent && failed);
+}
+
+void check_faults() {
+  radio.faults.tx_error_percent = 10;
+  int ok = 0, retried = 0;
+  for (int i = 0; i < 200; i++) {
+    AtResponse response = send_command("AT+SEND=2200,5,", "hello");
+    ok += response.ok();
+    retried += response.attempts > 1;
+  }
+  printf("200 AT+SENDs with 10%% +ERR=10: %d OK, %d retried\n", ok, retried);
+  check("retries get most AT+SENDs through", ok >= 195 && retried > 0);
+  radio.faults.tx_error_percent = 0;
+
+  radio.faults.no_reply_percent = 20;
+  ok = 0, retried = 0;
+  for (int i = 0; i < 200; i++) {
+    AtResponse response = send_command("AT");
+    ok += response.ok();
+    retried += response.attempts > 1;
+  }
+  printf("200 ATs with 20%% unanswered: %d OK, %d retried\n", ok, retried);
+  check("retries get most commands through", ok >= 190 && retried > 0);
+  ok = 0, retried = 0;
+  for (int i = 0; i < 200; i++) {
+    AtResponse response = send_command("AT+SEND=2200,5,", "hello");
+    ok += response.ok();
+    retried += response.attempts > 1;
+  }
+  printf("200 AT+SENDs with 20%% unanswered: %d OK, %d retried\n", ok, retried);
+  check("an unanswered AT+SEND isn't sent again", retried == 0 && ok < 200);
+  radio.faults.no_reply_percent = 0;
+
+  // The +OK comes after the packet's time on air, here after the timeout: it went out once
+  uint32_t sends = radio.stats.sends;
+  AtResponse late = at.send("AT+SEND=2200,5,", (const uint8_t*)"hello", 5, 50);
+  check("an AT+SEND answered too late isn't sent again",
+        late.error == AtError::kNoReply && late.attempts == 1 && radio.stats.sends == sends + 1);
+  listen(1000);
+  radio.timing.reply_us = (kAtReplyTimeoutMs + kAtBackoffMs / 2) * 1000; // in the backoff after each attempt
+  AtResponse stale = send_command("AT");
+  check("a late reply isn't taken for the answer to the retry", !stale.ok() && stale.attempts == kAtMaxAttempts);
+  listen(1000);
+  radio.timing.reply_us = ReyaxTiming().reply_us;
+
+  radio.faults.no_reply_percent = 20;
+  ReyaxLoRa lora(0);
+  int initialized = 0;
+  for (int i = 0; i < 20; i++) {
+    lora.invalidate_radio_cache();
+    initialized += lora.initialize();
+  }
+  printf("20 ReyaxLoRa::initialize()s with 20%% of commands unanswered: %d OK\n", initialized);
+  check("ReyaxLoRa::initialize() still works", initialized >= 18);
+  radio.faults.no_reply_percent = 0;
+}
+
+int main() {
+  hal::native::Sim& sim = hal::native::sim();
+  sim.echo_console = false;
+  hal::lora_uart().begin(115200);
+  radio.peer = [](uint16_t, const std::string& data, uint64_t) { last_packet = data; };
+  radio.attach();
+  at.set_echo(false);
+  at.set_receive_handler(received, nullptr);
+
+  check_commands();
+  check_latency();
+  check_escaping();
+  check_faults();
+
+  return checks_result();
+}
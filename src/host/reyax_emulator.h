@@ -0,0 +1,304 @@
+#ifndef _REYAX_EMULATOR_H_
+#define _REYAX_EMULATOR_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <functional>
+#include <random>
+#include <string>
+#include "../hal.h"
+#include "../config.h"
+#include "../lora_airtime.h"
+#include "../binary_payload.h"
+
+/**
+ * @brief How long the emulated module takes to answer, and what it reports for a packet it
+ * receives. Time on air comes from the AT+PARAMETER settings (see lora_airtime.h); the
+ * UART time of each command and reply is added by hal_native.h, at the UART's baud rate.
+ * The latencies are rough figures - set them to what a module on the bench does.
+ */
+
+struct ReyaxTiming {
+  uint32_t reply_us = 2000;          // "AT", a query or AT+SEND's checks: from the command's "\r\n" to the reply
+  uint32_t eeprom_write_us = 25000;  // a setting the module saves in its EEPROM (AT+PARAMETER=, AT+ADDRESS=, ...)
+  uint32_t tx_start_us = 4000;       // AT+SEND: from the command's "\r\n" to the start of the preamble
+  bool reply_after_tx = true;        // AT+SEND's +OK comes when the packet has gone out, not when it's taken
+  int rssi = -45;                    // what +RCV reports
+  int snr = 11;
+};
+
+/**
+ * @brief Faults to inject, each a percentage of the packets or commands it applies to.
+ */
+
+struct ReyaxFaults {
+  int loss_percent = 0;          // packets the node sends that never reach the other end (still +OK)
+  int receive_loss_percent = 0;  // packets to the node that never arrive
+  int crc_error_percent = 0;     // packets to the node that arrive as +ERR=12 instead of +RCV
+  int tx_error_percent = 0;      // AT+SENDs answered +ERR=10, with nothing sent
+  int no_reply_percent = 0;      // commands that get no answer at all (a garbled UART line)
+};
+
+struct ReyaxStats {
+  uint32_t commands = 0;
+  uint32_t errors = 0;          // commands answered +ERR=n, injected or not
+  uint32_t no_replies = 0;      // commands ignored by ReyaxFaults::no_reply_percent
+  uint32_t sends = 0;           // packets that went on air
+  uint32_t lost = 0;            // of those, lost on the way
+  uint32_t bytes_sent = 0;
+  uint64_t on_air_us = 0;
+  uint32_t received = 0;        // +RCV lines put out
+  uint32_t receive_lost = 0;    // packets to the node lost (injected, or it was transmitting)
+  uint32_t crc_errors = 0;
+};
+
+/**
+ * @brief An emulated Reyax RYLR896 / RYLR998 on the other end of hal::lora_uart(): the AT
+ * command set ReyaxLoRa uses and a little more (AT, AT+VER?, AT+SEND, AT+PARAMETER,
+ * AT+ADDRESS, AT+NETWORKID, AT+BAND, AT+CRFOP, AT+IPR, AT+MODE, AT+RESET, AT+FACTORY),
+ * with the module's +ERR=n answers to bad commands and values, and +RCV for packets
+ * from other radios.
+ *
+ *   ReyaxEmulator radio;
+ *   radio.peer = [&](uint16_t to, const std::string& data, uint64_t arrived_us) {
+ *     radio.deliver(to, "!01", arrived_us + turnaround_us + radio.time_on_air_us(3)); // an ack
+ *   };
+ *   radio.attach(); // answers everything the firmware writes to Serial2 from now on
+ *
+ * The module is half duplex: a packet that would arrive while it's transmitting is lost,
+ * and an AT+SEND while it's still transmitting is answered +ERR=17. A value out of range
+ * is answered +ERR=4 (the AT command guide doesn't give a code for that).
+ *
+ * Like the module, it takes every command up to its CR or LF, so an AT+SEND with either in
+ * its data is cut short there: +ERR=5, and the rest of the data is a bad command. And peer
+ * gets a packet's data the way the base station reads it out of its "+RCV=" line: up to
+ * the first ','. (ReyaxLoRa escapes all three; see escape_payload().)
+ */
+
+class ReyaxEmulator {
+public:
+    // The other end of the link: called with each packet that gets there, and when its last symbol did
+    typedef std::function<void(uint16_t to_address, const std::string& data, uint64_t arrived_us)> Peer;
+
+    ReyaxTiming timing;
+    ReyaxFaults faults;
+    ReyaxStats stats;
+    Peer peer;
+
+    // The module's settings, as its EEPROM has them
+    std::string version = "RYLR89C_V1.2.7";
+    unsigned int address = LORA_NODE_ADDRESS;
+    unsigned int network_id = LORA_NETWORK_ID;
+    unsigned int spread_factor = 12, bandwidth = 7, coding_rate = 1, preamble = 4; // factory AT+PARAMETER
+    unsigned long band_hz = 915000000;
+    unsigned int output_power = 15;
+    unsigned long baud = 115200;
+    unsigned int mode = 0;
+
+private:
+    std::mt19937 rng_;
+    uint64_t tx_start_us_ = 0;  // the last transmission
+    uint64_t tx_end_us_ = 0;
+    std::string pending_send_;  // the packet of the AT+SEND being answered, for peer
+    uint16_t pending_to_ = 0;
+
+    bool chance(int percent) { return percent > 0 && (int)(rng_() % 100) < percent; }
+
+    static uint64_t now_us() { return hal::native::sim().now_us; }
+
+    // Reads "a,b,c" into up to count unsigned values; returns how many there were, or -1 if anything else is there
+    static int parse_values(const char* s, unsigned long* values, int count) {
+        int n = 0;
+        while (*s && n < count) {
+            char* end;
+            values[n++] = strtoul(s, &end, 10);
+            if (end == s || (*end && *end != ',')) return -1;
+            s = *end ? end + 1 : end;
+        }
+        return *s ? -1 : n;
+    }
+
+    static std::string error(int code) { return "+ERR=" + std::to_string(code); }
+
+    // Runs one setting command ("AT+ADDRESS=2205"): checks the value(s), and saves them
+    std::string set(const std::string& name, const char* args, uint32_t* delay_us) {
+        unsigned long v[4];
+        int n = parse_values(args, v, 4);
+        *delay_us = timing.eeprom_write_us;
+        if (name == "ADDRESS" && n == 1 && v[0] <= 65535) address = v[0];
+        else if (name == "NETWORKID" && n == 1 && v[0] <= 16) network_id = v[0];
+        else if (name == "PARAMETER" && n == 4 && v[0] >= 7 && v[0] <= 12 && v[1] <= 9 && v[2] >= 1 && v[2] <= 4
+                 && v[3] >= 4 && v[3] <= 7) {
+            spread_factor = v[0]; bandwidth = v[1]; coding_rate = v[2]; preamble = v[3];
+        }
+        else if (name == "BAND" && n == 1 && v[0] >= 862000000 && v[0] <= 1020000000) band_hz = v[0];
+        else if (name == "CRFOP" && n == 1 && v[0] <= 15) output_power = v[0];
+        else if (name == "MODE" && n == 1 && v[0] <= 1) mode = v[0];
+        else if (name == "IPR" && n == 1 && (v[0] == 300 || v[0] == 1200 || v[0] == 4800 || v[0] == 9600
+                 || v[0] == 19200 || v[0] == 28800 || v[0] == 38400 || v[0] == 57600 || v[0] == 115200)) {
+            baud = v[0]; // takes effect after AT+RESET; the emulated UART doesn't change
+        }
+        else {
+            *delay_us = timing.reply_us;
+            return error(4);
+        }
+        return "+OK";
+    }
+
+    std::string query(const std::string& name) {
+        if (name == "VER") return "+VER=" + version;
+        if (name == "ADDRESS") return "+ADDRESS=" + std::to_string(address);
+        if (name == "NETWORKID") return "+NETWORKID=" + std::to_string(network_id);
+        if (name == "PARAMETER") {
+            return "+PARAMETER=" + std::to_string(spread_factor) + "," + std::to_string(bandwidth) + ","
+                   + std::to_string(coding_rate) + "," + std::to_string(preamble);
+        }
+        if (name == "BAND") return "+BAND=" + std::to_string(band_hz);
+        if (name == "CRFOP") return "+CRFOP=" + std::to_string(output_power);
+        if (name == "IPR") return "+IPR=" + std::to_string(baud);
+        if (name == "MODE") return "+MODE=" + std::to_string(mode);
+        return error(4);
+    }
+
+    // AT+SEND=<Address>,<Payload Length>,<Data>: puts the packet on air, and gives it to peer
+    std::string send(const std::string& line, uint32_t* delay_us) {
+        unsigned int to, length;
+        int data_start = 0;
+        *delay_us = timing.reply_us;
+        if (sscanf(line.c_str(), "AT+SEND=%u,%u,%n", &to, &length, &data_start) != 2 || !data_start) {
+            return error(4);
+        }
+        if (length > 240) return error(13);
+        if (line.size() - data_start != length) return error(5);
+        if (now_us() < tx_end_us_) return error(17);
+        uint64_t on_air_us = time_on_air_us(length);
+        if (timing.reply_after_tx) {
+            *delay_us = timing.tx_start_us + (uint32_t)on_air_us;
+        }
+        if (chance(faults.tx_error_percent)) {
+            return error(10);
+        }
+        tx_start_us_ = now_us() + timing.tx_start_us;
+        tx_end_us_ = tx_start_us_ + on_air_us;
+        stats.sends++;
+        stats.bytes_sent += length;
+        stats.on_air_us += on_air_us;
+        pending_send_ = line.substr(data_start);
+        pending_to_ = to;
+        return "+OK";
+    }
+
+    std::string execute(const std::string& line, uint32_t* delay_us) {
+        *delay_us = timing.reply_us;
+        if (line.compare(0, 2, "AT") != 0) return error(2);
+        if (line == "AT") return "+OK";
+        if (line.compare(0, 3, "AT+") != 0) return error(4);
+        if (line.compare(0, 8, "AT+SEND=") == 0) return send(line, delay_us);
+        size_t end = line.find_first_of("=?", 3);
+        std::string name = line.substr(3, end == std::string::npos ? std::string::npos : end - 3);
+        if (end == std::string::npos) {
+            if (name == "RESET") return "+RESET\r\n+READY";
+            if (name == "FACTORY") {
+                ReyaxEmulator defaults;
+                address = 0; network_id = 0; band_hz = defaults.band_hz; output_power = defaults.output_power;
+                spread_factor = defaults.spread_factor; bandwidth = defaults.bandwidth;
+                coding_rate = defaults.coding_rate; preamble = defaults.preamble; baud = defaults.baud;
+                *delay_us = timing.eeprom_write_us;
+                return "+FACTORY";
+            }
+            return query(name) == error(4) ? error(4) : error(3);
+        }
+        if (line[end] == '?' && end + 1 == line.size()) return query(name);
+        if (line[end] == '=' && query(name) != error(4)) return set(name, line.c_str() + end + 1, delay_us);
+        return error(4);
+    }
+
+    // Answers one command
+    void handle_command(const std::string& line) {
+        stats.commands++;
+        if (chance(faults.no_reply_percent)) {
+            stats.no_replies++;
+            return;
+        }
+        uint32_t delay_us;
+        pending_send_.clear();
+        std::string reply = execute(line, &delay_us);
+        if (reply.compare(0, 5, "+ERR=") == 0) {
+            stats.errors++;
+        }
+        hal::lora_uart().inject(reply + "\r\n", delay_us);
+        if (!pending_send_.empty()) {
+            if (chance(faults.loss_percent)) {
+                stats.lost++;
+            }
+            else if (peer) {
+                peer(pending_to_, pending_send_.substr(0, pending_send_.find(',')), tx_end_us_);
+            }
+        }
+    }
+
+public:
+    explicit ReyaxEmulator(uint32_t seed = 1) : rng_(seed) {}
+
+    // Makes this the radio on hal::lora_uart()
+    void attach() {
+        hal::native::sim().radio = [this](const std::string& line) { handle(line); };
+    }
+
+    // Time on air of a packet of this many bytes, with the module's AT+PARAMETER settings
+    uint32_t time_on_air_us(size_t bytes) const {
+        return lora_time_on_air_us(bytes, spread_factor, bandwidth, coding_rate, preamble);
+    }
+
+    bool transmitting() const { return now_us() < tx_end_us_; }
+
+    /**
+     * @brief A packet from the radio at from_address, whose last symbol arrives at
+     * arrived_us (in the simulated clock): the module puts "+RCV=..." out then, unless
+     * the packet is lost, arrives with a CRC error, or the module was transmitting.
+     */
+
+    void deliver(uint16_t from_address, const std::string& data, uint64_t arrived_us) {
+        uint64_t started_us = arrived_us - time_on_air_us(data.size());
+        if (chance(faults.receive_loss_percent) || (started_us < tx_end_us_ && arrived_us > tx_start_us_)) {
+            stats.receive_lost++;
+            return;
+        }
+        std::string line;
+        if (chance(faults.crc_error_percent)) {
+            stats.crc_errors++;
+            line = error(12);
+        }
+        else {
+            stats.received++;
+            line = "+RCV=" + std::to_string(from_address) + "," + std::to_string(data.size()) + "," + data + ","
+                   + std::to_string(timing.rssi) + "," + std::to_string(timing.snr);
+        }
+        uint64_t now = now_us();
+        hal::lora_uart().inject(line + "\r\n", arrived_us > now ? arrived_us - now : 0);
+    }
+
+    // Answers one line the firmware wrote to Serial2 (hal_native.h calls this, at each LF)
+    void handle(const std::string& received) {
+        size_t cr = received.find('\r');
+        if (cr != std::string::npos) { // a CR ends the command too
+            handle_command(received.substr(0, cr));
+            if (cr + 1 < received.size()) {
+                handle(received.substr(cr + 1));
+            }
+            return;
+        }
+        handle_command(received);
+    }
+};
+
+// What the base station does to each packet's data before reading it: undoes escape_payload()
+// ("" if the packet can't have been escaped)
+inline std::string unescaped_payload(const std::string& data) {
+  std::string out(data);
+  int length = unescape_payload((const uint8_t*)data.data(), data.size(), (uint8_t*)&out[0]);
+  return length < 0 ? std::string() : out.substr(0, length);
+}
+
+#endif // _REYAX_EMULATOR_H_
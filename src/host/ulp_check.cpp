@@ -0,0 +1,108 @@
+/*
+Checks the ULP watchdog (ulp_watchdog.h) on Linux: prints the wake levels it gets from
+config.h, in gallons, mV and raw ADC counts, then puts it through a few deep sleeps with
+the water level and float switch doing different things, using the ULP emulation in
+hal_native.h, and checks when (and whether) it wakes the chip. Exits with 1 if any
+check fails.
+
+Usage: program
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <random>
+#include "../hal.h"
+#include "../ulp_watchdog.h"
+#include "check.h"
+
+const uint8_t kFloatSwitchPin = 34;
+const uint8_t kWaterVolumePin = 32;
+const uint64_t kSleepUs = 300 * 1000000ULL;
+const float kNoiseMv = 8; // eTape noise, one sigma
+
+// What the tub does during a sleep: gallons at t seconds into it
+typedef float (*Level)(float t);
+static Level level;
+static float float_switch_gallons = 99; // the float switch is up at or above this
+static uint64_t sleep_start_us;
+
+float water_level_mV(uint8_t pin, uint64_t now_us) {
+  static std::mt19937 rng(3);
+  std::normal_distribution<float> noise(0, kNoiseMv);
+  float gallons = level((now_us - sleep_start_us) / 1e6f);
+  hal::native::set_input_level(kFloatSwitchPin, gallons >= float_switch_gallons ? HIGH : LOW);
+  return pin == kWaterVolumePin ? kWaterVolumeCurve.invert(gallons) + noise(rng) : 0;
+}
+
+/**
+ * @brief One deep sleep with the watchdog armed. expect_wake_s < 0 means it must not wake;
+ * otherwise it must wake within a ULP period or two of expect_wake_s, for expect_reason.
+ */
+
+void check_sleep(const char* name, Level tub, bool circ_pump_running, float expect_wake_s, uint16_t expect_reason) {
+  hal::native::Sim& sim = hal::native::sim();
+  UlpWatchdog watchdog(kFloatSwitchPin, kWaterVolumePin);
+  hal::native::begin_wake();
+  watchdog.begin();
+  level = tub;
+  sleep_start_us = sim.now_us;
+  water_level_mV(0, sim.now_us); // the float switch as it is when the chip goes to sleep
+  watchdog.arm(circ_pump_running);
+  hal::deep_sleep(kSleepUs);
+  hal::native::begin_wake();
+  watchdog.begin();
+  float slept_s = sim.last_sleep_us / 1e6f;
+  const float kSlack = 2.0f * ULP_WATCHDOG_PERIOD_MS / 1000;
+  bool ok = expect_wake_s < 0 ? !watchdog.woke()
+            : watchdog.woke() && watchdog.reason() == expect_reason && fabsf(slept_s - expect_wake_s) <= kSlack;
+  printf("%-52s %s after %5.0f s, reason %u  %s\n", name, watchdog.woke() ? "woke " : "slept", slept_s,
+         watchdog.reason(), ok ? "ok" : "FAILED");
+  if (!ok) failures++;
+}
+
+// The debounce: how long after crossing a level the chip should wake
+const float kDebounceS = (ULP_WATCHDOG_DEBOUNCE_SAMPLES - 1) * ULP_WATCHDOG_PERIOD_MS / 1000.0f;
+
+int main() {
+  hal::native::Sim& sim = hal::native::sim();
+  sim.echo_console = false;
+  sim.analog_source = water_level_mV;
+
+  printf("%-12s %8s %8s %5s\n", "level", "gallons", "mV", "raw");
+  struct { const char* name; float gallons; float mV; } levels[] = {
+    {"high", ULP_WAKE_HIGH_WATER_GALLONS, kUlpHighWater_mV},
+    {"high clear", ULP_WAKE_HIGH_WATER_GALLONS - ULP_WAKE_HYSTERESIS_GALLONS, kUlpHighWaterClear_mV},
+    {"low clear", ULP_WAKE_LOW_WATER_GALLONS + ULP_WAKE_HYSTERESIS_GALLONS, kUlpLowWaterClear_mV},
+    {"low", ULP_WAKE_LOW_WATER_GALLONS, kUlpLowWater_mV},
+  };
+  for (const auto& l : levels) {
+    printf("%-12s %8.2f %8.1f %5u\n", l.name, l.gallons, l.mV, hal::adc1_raw_for_mV((uint32_t)l.mV));
+    if (fabsf(kWaterVolumeCurve.convert(l.mV) - l.gallons) > 0.001f) {
+      printf("  converting %.1f mV back gives %.3f gallons\n", l.mV, kWaterVolumeCurve.convert(l.mV));
+      failures++;
+    }
+  }
+  printf("\n");
+
+  float_switch_gallons = 17.4;
+
+  check_sleep("steady, in range", [](float /* t */) { return 16.0f; }, false, -1, 0);
+  check_sleep("filling past the float switch at 100 s",
+              [](float t) { return t < 100 ? 17.0f : 17.4f; }, false, 100 + kDebounceS, hal::kUlpFloatSwitch);
+  check_sleep("float switch already up, filling past high at 150 s",
+              [](float t) { return t < 150 ? 17.6f : 18.0f + (t - 150) * 0.01f; }, false, 150 + kDebounceS,
+              hal::kUlpHighWater);
+  check_sleep("a splash over high, two samples long",
+              [](float t) { return t > 59 && t < 63 ? 18.5f : 16.0f; }, false, -1, 0);
+  check_sleep("sitting on the high level, after waking for it",
+              [](float /* t */) { return 18.0f; }, false, -1, 0);
+  check_sleep("dropping to high clear and back", [](float t) {
+                return t < 100 ? 18.0f : t < 140 ? 17.6f : 18.1f; }, false, 140 + kDebounceS, hal::kUlpHighWater);
+  check_sleep("leaking below low at 200 s",
+              [](float t) { return t < 200 ? 15.0f : 14.0f - (t - 200) * 0.01f; }, false, 200 + kDebounceS,
+              hal::kUlpLowWater);
+  check_sleep("below low while the circ pump runs",
+              [](float /* t */) { return 13.0f; }, true, -1, 0);
+
+  return checks_result();
+}
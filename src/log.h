@@ -0,0 +1,166 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "hal.h"
+#include "config.h"
+#include "fixed_string.h"
+
+/**
+ * @brief Logging, with levels that are fixed at compile time.
+ *
+ *   LOG_INFO("Fill pump starting");
+ *
+ *   if (LOG_ENABLED(LOG_LEVEL_DEBUG)) { // a line that takes some building
+ *     FixedString<64> line("Water volume samples: ");
+ *     line.append_uint(stats.samples);
+ *     LOG_DEBUG(line.c_str());
+ *   }
+ *
+ * A LOG_*() below LOG_LEVEL expands to nothing, and an LOG_ENABLED() block below it is
+ * a constant false, which the compiler drops - strings and all. So a release build
+ * (LOG_LEVEL_NONE, env:esp32doit-devkit-v1-release) has no logging code in it.
+ *
+ * Lines go to log_sink(): straight to the Serial Monitor (LOG_SINK_SERIAL), or into a
+ * RAM ring buffer (LOG_SINK_BUFFER) that costs a memcpy per line and only reaches the
+ * UART when it's flushed.
+ */
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1  // something failed
+#define LOG_LEVEL_INFO 2   // what the wake did: readings, pumps, packets
+#define LOG_LEVEL_DEBUG 3  // AT traffic, sampling details
+
+#define LOG_SINK_SERIAL 0
+#define LOG_SINK_BUFFER 1
+
+#define LOG_ENABLED(level) ((level) <= LOG_LEVEL)
+
+/**
+ * @brief The ring buffer of LOG_SINK_BUFFER. It's kept in RTC memory that isn't cleared
+ * on a reset, so it holds the last LOG_BUFFER_BYTES of log from the wakes before one:
+ * press the reset button with the Serial Monitor open to see them.
+ */
+
+struct LogRing {
+  uint32_t magic;     // kLogRingMagic once initialized (the memory is random after power on)
+  uint16_t start;     // index of the oldest byte
+  uint16_t length;
+  uint32_t lost;      // bytes overwritten since the last flush
+  char data[LOG_BUFFER_BYTES];
+};
+
+const uint32_t kLogRingMagic = 0x4C4F4721;
+
+/**
+ * @brief Where log lines go. Has the print() / println() / write() of a UART, so a line
+ * can be built in pieces.
+ */
+
+class LogSink {
+private:
+    LogRing& ring_;
+
+    bool valid() const {
+        return ring_.magic == kLogRingMagic && ring_.start < LOG_BUFFER_BYTES && ring_.length <= LOG_BUFFER_BYTES;
+    }
+
+    void append(const char* s, size_t length) {
+#if LOG_SINK == LOG_SINK_SERIAL
+        hal::console().write((const uint8_t*)s, length);
+#else
+        if (!valid()) {
+            clear();
+        }
+        for (size_t i = 0; i < length; i++) {
+            if (ring_.length == LOG_BUFFER_BYTES) { // full: overwrite the oldest byte
+                ring_.start = (ring_.start + 1) % LOG_BUFFER_BYTES;
+                ring_.length--;
+                ring_.lost++;
+            }
+            ring_.data[(ring_.start + ring_.length++) % LOG_BUFFER_BYTES] = s[i];
+        }
+#endif
+    }
+
+    void clear() {
+        ring_.magic = kLogRingMagic;
+        ring_.start = 0;
+        ring_.length = 0;
+        ring_.lost = 0;
+    }
+
+public:
+    LogSink(LogRing& ring) : ring_(ring) {}
+
+    void print(const char* s) { append(s, strlen(s)); }
+    void println(const char* s = "") { append(s, strlen(s)); append("\r\n", 2); }
+    void write(const uint8_t* data, size_t length) { append((const char*)data, length); }
+
+    /**
+     * @brief Writes what's in the ring buffer to the Serial Monitor, empties it, and waits
+     * for the UART to send it. If the buffer has wrapped, the partly overwritten line at the
+     * start is skipped. Does nothing with LOG_SINK_SERIAL.
+     */
+
+    void flush() {
+#if LOG_SINK == LOG_SINK_BUFFER
+        if (!valid()) {
+            clear();
+            return;
+        }
+        uint16_t skip = 0;
+        if (ring_.lost) {
+            while (skip < ring_.length && ring_.data[(ring_.start + skip) % LOG_BUFFER_BYTES] != '\n') {
+                skip++;
+            }
+            skip = skip < ring_.length ? skip + 1 : 0;
+            FixedString<48> line("(log: ");
+            line.append_uint(ring_.lost + skip).append(" bytes lost)\r\n");
+            hal::console().print(line.c_str());
+        }
+        uint16_t first = (ring_.start + skip) % LOG_BUFFER_BYTES;
+        uint16_t length = ring_.length - skip;
+        uint16_t to_end = LOG_BUFFER_BYTES - first;
+        if (length <= to_end) {
+            hal::console().write((const uint8_t*)&ring_.data[first], length);
+        }
+        else {
+            hal::console().write((const uint8_t*)&ring_.data[first], to_end);
+            hal::console().write((const uint8_t*)ring_.data, length - to_end);
+        }
+        clear();
+        hal::console().flush();
+#endif
+    }
+};
+
+// One log for the whole program (a function-local static, so every translation unit
+// that logs - and the native runner - shares it)
+inline LogSink& log_sink() {
+  RTC_NOINIT_ATTR static LogRing ring;
+  static LogSink sink(ring);
+  return sink;
+}
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(s) log_sink().println(s)
+#else
+#define LOG_ERROR(s) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(s) log_sink().println(s)
+#else
+#define LOG_INFO(s) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(s) log_sink().println(s)
+#else
+#define LOG_DEBUG(s) do {} while (0)
+#endif
+
+#endif // _LOG_H_
@@ -0,0 +1,46 @@
+#ifndef _LORA_AIRTIME_H_
+#define _LORA_AIRTIME_H_
+
+#include <stdint.h>
+
+/**
+ * @brief Converts the Reyax bandwidth setting (the second value in AT+PARAMETER, 0 - 9)
+ * to Hz. See ReyaxLoRa::set_bandwidth() for the table.
+ */
+
+inline uint32_t lora_bandwidth_hz(uint8_t bandwidth) {
+  static const uint32_t kBandwidthHz[] = {7800, 10400, 15600, 20800, 31250,
+                                          41700, 62500, 125000, 250000, 500000};
+  return bandwidth <= 9 ? kBandwidthHz[bandwidth] : 125000;
+}
+
+/**
+ * @brief Time on air, in microseconds, of one LoRa packet, from the formula in Semtech's
+ * SX1276 datasheet (explicit header, CRC on, which is what the Reyax modules use).
+ * Low data rate optimization is assumed on when a symbol lasts longer than 16 ms, as the
+ * SX1276 requires.
+ *
+ * @param payload_bytes Bytes in the packet (the <Data> part of AT+SEND)
+ * @param spread_factor 7 - 12 (first value in AT+PARAMETER)
+ * @param bandwidth 0 - 9 (second value in AT+PARAMETER)
+ * @param coding_rate 1 - 4, for 4/5 - 4/8 (third value in AT+PARAMETER)
+ * @param preamble Programmed preamble length (fourth value in AT+PARAMETER)
+ */
+
+inline uint32_t lora_time_on_air_us(uint16_t payload_bytes, uint8_t spread_factor,
+                                    uint8_t bandwidth, uint8_t coding_rate, uint8_t preamble) {
+  uint32_t bw_hz = lora_bandwidth_hz(bandwidth);
+  // symbol time in us, kept in 1/4 us so the 4.25 symbols of sync word stay exact
+  uint64_t symbol_qus = ((uint64_t)4000000 << spread_factor) / bw_hz;
+  int32_t low_data_rate = (symbol_qus > 16000 * 4) ? 1 : 0;
+  int32_t numerator = 8 * payload_bytes - 4 * spread_factor + 28 + 16; // +16 for the CRC
+  int32_t denominator = 4 * (spread_factor - 2 * low_data_rate);
+  int32_t payload_symbols = 8;
+  if (numerator > 0) {
+    payload_symbols += ((numerator + denominator - 1) / denominator) * (coding_rate + 4);
+  }
+  uint64_t total_qus = symbol_qus * (4 * (uint64_t)preamble + 17) / 4 + symbol_qus * payload_symbols;
+  return (uint32_t)(total_qus / 4);
+}
+
+#endif // _LORA_AIRTIME_H_
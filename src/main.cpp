@@ -6,13 +6,22 @@ Data sent: Water level, pH level, battery voltage, info about last auto-fill
 Tower Garden functions: operates the circulation pump and fill pump
 */
 
-#include <Arduino.h>
-#include "functions.h"
+#include "hal.h"
 #include "reyax_lora.h"
 #include "analog_reader.h"
 #include "ph_sensor.h"
 #include "water_volume_sensor.h"
-#include "elapsedMillis.h"
+#include "water_volume_estimator.h"
+#include "fill_controller.h"
+#include "report_policy.h"
+#include "fixed_string.h"
+#include "phase_profiler.h"
+#include "ulp_watchdog.h"
+#include "runtime_config.h"
+#include "downlink.h"
+#include "sleep_scheduler.h"
+#include "sample_history.h"
+#include "log.h"
 
 /**
  * Before building, look at all of the #define options in config.h. At the very least,
@@ -26,20 +35,13 @@ Tower Garden functions: operates the circulation pump and fill pump
  */
 // #define LORA_SETUP_REQUIRED
 
-uint8_t voltage_measurement_pin = 13;
-uint8_t fill_pump_pin = 22;
-uint8_t circ_pump_pin = 23;
-uint8_t water_volume_pin = 32;
-uint8_t pH_pin = 33;
-uint8_t hi_water_float_pin = 34;
-//uint8_t low_water_float_pin = 35; // c/b used to monitor a physical button that would wake up ESP32, and start an auto-fill (for Fran)
-bool float_sw_activated = false;
-
-// To stop the auto-fill with the float switch, as a fail-safe
-// Stored in IRAM (Internal RAM) for maximum speed of loading and execution
-void IRAM_ATTR float_switch_isr() {
-  float_sw_activated = true;
-}
+const uint8_t voltage_measurement_pin = 13;
+const uint8_t fill_pump_pin = 22;
+const uint8_t circ_pump_pin = 23;
+const uint8_t water_volume_pin = 32;
+const uint8_t pH_pin = 33;
+const uint8_t hi_water_float_pin = 34;
+//const uint8_t low_water_float_pin = 35; // c/b used to monitor a physical button that would wake up ESP32, and start an auto-fill (for Fran)
 
 /* Variable to determine what to do / not do during this run.
  * It's stored in RTC memory using RTC_DATA_ATTR and
@@ -53,22 +55,161 @@ RTC_DATA_ATTR static bool measure_things_this_run = false;
  */
 RTC_DATA_ATTR static bool auto_fill_timed_out = false;
 
+/** True while the circulation pump is running and the ESP32 is in deep sleep, holding
+ * circ_pump_pin HIGH. The next wake just turns the pump off.
+ */
+RTC_DATA_ATTR static bool circ_pump_running = false;
+
+/** When the circulation pump last stopped (hal::rtc_seconds()). However long the node sleeps
+ * between full wakes, the pump is off for at most circ_pump_max_off_seconds: a wake in the
+ * sleep starts it again.
+ */
+RTC_DATA_ATTR static uint32_t circ_pump_off_s = 0;
+
+// Logs how many samples a reading took, and how noisy they were, to help tune the
+// *_SAMPLE_TOLERANCE_MV values in config.h
+void print_reading_stats(const char* name, const ReadingStats& stats) {
+  if (!LOG_ENABLED(LOG_LEVEL_DEBUG)) return;
+  FixedString<64> line(name);
+  line.append(" samples: ").append_uint(stats.samples).append(", variance (mV^2): ").append_float(stats.variance_mV2, 1);
+  LOG_DEBUG(line.c_str());
+}
+
+// Logs "label" followed by value, without building a String
+void print_value(const char* label, float value, uint8_t decimals = 2) {
+  if (!LOG_ENABLED(LOG_LEVEL_INFO)) return;
+  FixedString<64> line(label);
+  LOG_INFO(line.append_float(value, decimals).c_str());
+}
+
 ReyaxLoRa lora(0);
-VoltageSensor voltage_sensor(voltage_measurement_pin);
-pHSensor pH_sensor(pH_pin);
-WaterVolumeSensor water_volume_sensor(water_volume_pin);
+// Decides which readings have changed enough to be sent (state is kept in RTC memory)
+ReportPolicy report_policy;
+// Samples the water volume and pH pins (both on ADC1) together
+AdcSampler adc1_sampler;
+VoltageSensor voltage_sensor(AdcPin<voltage_measurement_pin>{});
+pHSensor pH_sensor(AdcPin<pH_pin>{}, &adc1_sampler);
+WaterVolumeSensor water_volume_sensor(AdcPin<water_volume_pin>{}, &adc1_sampler);
+// Tracks the water volume across wakes from the readings and the fill pump's on-time (state is kept in RTC memory)
+WaterVolumeEstimator water_volume_estimator;
+// Runs the auto-fill. Its float switch interrupt turns the fill pump off, as a fail-safe.
+FillController fill_controller(fill_pump_pin, hi_water_float_pin, water_volume_sensor, water_volume_estimator);
+// Times each phase of the wake, and sends the min / mean / max every PROFILE_REPORT_WAKES wakes
+PhaseProfiler profiler;
+// Watches the float switch and water level while the ESP32 sleeps, and wakes it if they go out of range
+UlpWatchdog ulp_watchdog(hi_water_float_pin, water_volume_pin);
+// Takes the base station's commands that change the settings in runtime_config.h
+ConfigDownlink downlink;
+// Picks the sleep after each circulation pump run from the readings
+SleepScheduler sleep_scheduler;
+// Keeps water volume and pH readings from the sample wakes between full wakes, and uploads them in one frame
+SampleHistory history;
+
+// Turns the circulation pump on, and holds the pin HIGH through the deep sleep that follows
+void start_circ_pump() {
+  LOG_INFO("Circ pump starting");
+  hal::pin_mode(circ_pump_pin, OUTPUT);
+  hal::digital_write(circ_pump_pin, HIGH);
+  hal::gpio_hold(circ_pump_pin, true);
+  circ_pump_running = true;
+}
+
+// Seconds until the circulation pump has been off for circ_pump_max_off_seconds; 0 once it has
+uint32_t circ_pump_due_in_s() {
+  uint32_t off_s = hal::rtc_seconds() - circ_pump_off_s;
+  uint32_t max_off_s = runtime_config().circ_pump_max_off_seconds;
+  return off_s + 1 >= max_off_s ? 0 : max_off_s - off_s; // (a timer wake can come a little early)
+}
+
+#ifdef NATIVE_BUILD
+/**
+ * @brief Every wake from deep sleep is a boot, which constructs the globals above again
+ * (only what's in RTC memory lasts). The native programs call this before each setup() to
+ * do the same, so nothing from the last wake is left in them.
+ */
+
+void construct_globals() {
+  using hal::native::reconstruct;
+  reconstruct(lora, 0);
+  reconstruct(report_policy);
+  reconstruct(adc1_sampler);
+  reconstruct(voltage_sensor, AdcPin<voltage_measurement_pin>{});
+  reconstruct(pH_sensor, AdcPin<pH_pin>{}, &adc1_sampler);
+  reconstruct(water_volume_sensor, AdcPin<water_volume_pin>{}, &adc1_sampler);
+  reconstruct(water_volume_estimator);
+  reconstruct(fill_controller, fill_pump_pin, hi_water_float_pin, water_volume_sensor, water_volume_estimator);
+  reconstruct(profiler);
+  reconstruct(ulp_watchdog, hi_water_float_pin, water_volume_pin);
+  reconstruct(downlink);
+  reconstruct(sleep_scheduler);
+  reconstruct(history);
+}
+#endif
 
 void setup() {  
-  Serial.begin(115200);
+  profiler.begin_wake();
+  hal::console().begin(115200);
+  if (hal::wake_cause() == hal::WakeCause::kColdBoot) {
+    log_sink().flush(); // the log of the wakes before a reset (see log.h)
+  }
+  ulp_watchdog.begin(); // stops the ULP, and says if it woke us
+
+  if (circ_pump_running) { // the circulation pump ran while the ESP32 slept: turn it off
+    hal::pin_mode(circ_pump_pin, OUTPUT);
+    hal::digital_write(circ_pump_pin, LOW); // takes effect when the hold is released
+    hal::gpio_hold(circ_pump_pin, false);
+    circ_pump_running = false;
+    circ_pump_off_s = hal::rtc_seconds();
+    LOG_INFO("Circ pump stopped");
+    if (!ulp_watchdog.woke()) { // this wake is only to turn the circulation pump off
+      uint32_t max_off_s = runtime_config().circ_pump_max_off_seconds;
+      // after a full wake, the sleep sleep_scheduler picked starts; after a run in that sleep, it goes on
+      uint32_t sleep_s = history.sample_wake() ? history.next_sleep_s(max_off_s)
+                                               : history.begin_sleep(sleep_scheduler.sleep_seconds(), max_off_s);
+      profiler.end_wake(Phase::kPumpOffWake);
+      ulp_watchdog.arm(circ_pump_running);
+      hal::deep_sleep(sleep_s * uS_TO_S_FACTOR);
+      return; // (only reached in the native build - see hal.h)
+    }
+    history.end_sleep(); // the ULP saw something: do the full wake now
+  }
+  else if (history.sample_wake()) {
+    uint32_t circ_pump_due_s = circ_pump_due_in_s();
+    if (ulp_watchdog.woke() || (!circ_pump_due_s && history.sleep_left_s() <= runtime_config().circ_pump_seconds)) {
+      history.end_sleep(); // the ULP saw something, or the full wake (and its pump run) is nearly due: do it now
+    }
+    else { // this wake only adds a reading to the history, and may start the circulation pump: no radio
+      if (HISTORY_SAMPLE_SECONDS > 0) {
+        hal::pin_mode(water_volume_pin, INPUT);
+        hal::pin_mode(pH_pin, INPUT);
+        history.add(water_volume_sensor.reported_water_volume(), pH_sensor.reported_pH());
+      }
+      uint32_t sleep_s;
+      if (circ_pump_due_s) {
+        sleep_s = history.next_sleep_s(circ_pump_due_s);
+      }
+      else {
+        start_circ_pump(); // the pump-off wake goes on with the sleep
+        sleep_s = runtime_config().circ_pump_seconds;
+        history.count_sleep_s(sleep_s);
+      }
+      profiler.end_wake(Phase::kSampleWake);
+      ulp_watchdog.arm(circ_pump_running);
+      hal::deep_sleep(sleep_s * uS_TO_S_FACTOR);
+      return;
+    }
+  }
+
+  profiler.begin(Phase::kLoRaInit);
   lora.initialize();
-  delay(1000); // cuts off Serial Monitor output w/o this
-  pinMode(voltage_measurement_pin, INPUT);
-  pinMode(fill_pump_pin, OUTPUT);
-  pinMode(circ_pump_pin, OUTPUT);
-  pinMode(water_volume_pin, INPUT);
-  pinMode(pH_pin, INPUT);
-  pinMode(hi_water_float_pin, INPUT);
-  attachInterrupt(hi_water_float_pin, float_switch_isr, RISING);
+  profiler.end(Phase::kLoRaInit);
+  lora.set_report_policy(&report_policy);
+  downlink.begin(lora);
+  hal::pin_mode(voltage_measurement_pin, INPUT);
+  hal::pin_mode(circ_pump_pin, OUTPUT);
+  hal::pin_mode(water_volume_pin, INPUT);
+  hal::pin_mode(pH_pin, INPUT);
+  fill_controller.begin(); // fill pump and float switch pins
 
 #ifdef LORA_SETUP_REQUIRED
   lora.one_time_setup();
@@ -81,86 +222,149 @@ void setup() {
   //          lora->send_and_reply("AT+CRFOP?");;
 
   measure_things_this_run = !measure_things_this_run; // to make it different each time it wakes up
-  delay(1000); // Serial.monitor needs a few seconds to get ready
-  Serial.println("measure_things_this_run = " + (String)measure_things_this_run);
+  if (ulp_watchdog.woke()) {
+    measure_things_this_run = true; // measure and report whatever the ULP saw, now
+  }
+  LOG_DEBUG(measure_things_this_run ? "measure_things_this_run = 1" : "measure_things_this_run = 0");
 
-  if (digitalRead(hi_water_float_pin) == HIGH) { // water is getting into the tub w/o the fill pump running
-    float_sw_activated = true; // the pin is HIGH, so the variable s/b true
+  // Everything sent during this wake goes out in one packet, when send_batch() is called below
+  lora.begin_batch();
+
+  if (fill_controller.float_switch_tripped()) { // water is getting into the tub w/o the fill pump running
     lora.send_auto_fill_data(0.00, "FL-SW");     // or the last auto-fill stopped w/ the float switch, and it has not been investigated
   }
-  else {
-    float_sw_activated = false; // the pin is LOW, so the variable s/b false
-  }
 
   if (measure_things_this_run) { // measure all the things
 
-    // Send the water level
-    float water_volume = water_volume_sensor.reported_water_volume();
-    Serial.println("Reported_water_volume:" + (String)water_volume);
+    // Send the water level: the estimate, corrected with a new reading
+    profiler.begin(Phase::kWaterVolume);
+    water_volume_estimator.predict(0);
+    float reading = water_volume_sensor.reported_water_volume(water_volume_estimator.sample_tolerance_mV());
+    if (!water_volume_estimator.update(reading, water_volume_sensor.last_reading_variance())) {
+      LOG_INFO("Water volume reading is far from the estimate - starting again from it");
+    }
+    float water_volume = water_volume_estimator.volume();
+    profiler.end(Phase::kWaterVolume);
+    print_value("Water volume reading:", reading);
+    print_value("Reported_water_volume:", water_volume);
+    print_reading_stats("Water volume", water_volume_sensor.last_reading_stats());
     lora.send_water_volume_data(water_volume);
     
     // Send the battery voltage
+    profiler.begin(Phase::kVoltage);
     float voltage = voltage_sensor.reported_voltage();
-    Serial.println("Reported_voltage:" + (String)voltage);
+    profiler.end(Phase::kVoltage);
+    print_value("Reported_voltage:", voltage);
+    print_reading_stats("Voltage", voltage_sensor.last_reading_stats());
     lora.send_voltage_data(voltage);
-    delay(1000); // may not be necessary, but it can't hurt
 
     // Send the pH level from the pH sensor
     // pH_sensor.pH_calibration(); // BAS: run only when you need to calibrate the pH sensor
+    profiler.begin(Phase::kpH);
     float pH = pH_sensor.reported_pH();
-    Serial.println("Reported_pH: " + String(pH, 1));
+    profiler.end(Phase::kpH);
+    print_value("Reported_pH: ", pH, 1);
+    print_reading_stats("pH", pH_sensor.last_reading_stats());
     lora.send_pH_data(pH);
-    delay(500);
+    history.add(reading, pH);
 
         // fill tub if necessary, then send a packet about that
     if (!auto_fill_timed_out) {
-      if (water_volume <= REFILL_START_VOLUME && !float_sw_activated) {
-        float stop_time_secs = 0.0;
-        String stop_reason;
-        elapsedMillis fill_timer_ms = 0;
-        Serial.println("Fill pump starting");
-        digitalWrite(fill_pump_pin, HIGH);
-        while (!float_sw_activated && water_volume_sensor.reported_water_volume() < REFILL_STOP_VOLUME
-               && fill_timer_ms < (AUTO_FILL_CUT_OFF_SECONDS * 1000.0)) {
-              delay(1000); // fill a second, then check again
-        }
-        digitalWrite(fill_pump_pin, LOW);
-        stop_time_secs = (float)fill_timer_ms / 1000.0;
-        if (stop_time_secs >= AUTO_FILL_CUT_OFF_SECONDS) {
+      if (water_volume <= runtime_config().refill_start_volume && !fill_controller.float_switch_tripped()) {
+        LOG_INFO("Fill pump starting");
+        float start_sigma = water_volume_estimator.volume_sigma();
+        profiler.begin(Phase::kFill);
+        FillResult fill = fill_controller.fill();
+        profiler.end(Phase::kFill);
+        sleep_scheduler.fill_ended();
+        if (fill.reason == FillStopReason::kTimer) {
           auto_fill_timed_out = true;
-          stop_reason = "TIMER";
         }
-        else {
-          if (float_sw_activated) {
-            stop_reason = "FL-SW";
-          }
-          else {
-            stop_reason = "Fill";
-          }
+        const char* stop_reason = fill_stop_reason_name(fill.reason);
+        if (LOG_ENABLED(LOG_LEVEL_INFO)) {
+          log_sink().print("Fill pump stopped: ");
+          LOG_INFO(stop_reason);
         }
-        Serial.println("Fill pump stopped: " + stop_reason);
-        Serial.println("Auto-fill timer (sec): " + (String)stop_time_secs);
-        float fill_volume = water_volume_sensor.reported_water_volume() - water_volume;
-        Serial.println("Auto-fill volume: " + (String)fill_volume);
+        print_value("Auto-fill timer (sec): ", fill.seconds);
+        print_value("Auto-fill rate (gal/min): ", fill.fill_rate_gpm);
+        water_volume_estimator.predict(0);
+        water_volume_estimator.update(water_volume_sensor.reported_water_volume(water_volume_estimator.sample_tolerance_mV()),
+                                      water_volume_sensor.last_reading_variance());
+        float fill_volume = water_volume_estimator.volume() - water_volume;
+        // (the two estimates are correlated, so this is on the safe side)
+        float end_sigma = water_volume_estimator.volume_sigma();
+        float fill_confidence = 1.96f * sqrtf(start_sigma * start_sigma + end_sigma * end_sigma);
+        print_value("Auto-fill volume: ", fill_volume);
+        print_value("Auto-fill volume +/- (95%): ", fill_confidence);
         lora.send_auto_fill_data(fill_volume, stop_reason);
+        lora.send_auto_fill_confidence(fill_confidence);
       }
     }
+
+    SleepPlan plan = sleep_scheduler.plan(report_policy, !auto_fill_timed_out && !fill_controller.float_switch_tripped());
+    if (LOG_ENABLED(LOG_LEVEL_INFO)) {
+      FixedString<64> line("Next sleep: ");
+      line.append_uint(sleep_scheduler.sleep_seconds()).append(" s, activity ").append_float(plan.activity, 2);
+      LOG_INFO(line.append(plan.fill_due ? ", fill due" : "").c_str());
+    }
   }
+  profiler.begin(Phase::kLoRaSend);
+  lora.send_batch();
+  profiler.end(Phase::kLoRaSend);
+  if (LOG_ENABLED(LOG_LEVEL_INFO)) {
+    const ReportCounters& counters = report_policy.counters();
+    FixedString<80> line("Values sent/suppressed: ");
+    line.append_uint(counters.values_sent).append('/').append_uint(counters.values_suppressed);
+    line.append(", packets sent/suppressed: ").append_uint(counters.packets_sent).append('/').append_uint(counters.packets_suppressed);
+    LOG_INFO(line.c_str());
+  }
+
+  // (the diagnostic frames leave room for the segment header, with acked delivery)
+  if (profiler.report_due()) {
+    uint8_t report[kMaxLoRaPayloadBytes];
+    uint8_t length = profiler.build_report(report, kMaxLoRaPayloadBytes - kSegmentHeaderBytes);
+    LOG_INFO("Sending the wake profile");
+    lora.send_diagnostics(report, length);
+    profiler.reset();
+  }
+
+  if (history.upload_due()) {
+    uint8_t frame[kMaxLoRaPayloadBytes];
+    uint8_t samples;
+    uint8_t length = history.build_frame(frame, kMaxLoRaPayloadBytes - kSegmentHeaderBytes, &samples);
+    if (LOG_ENABLED(LOG_LEVEL_INFO)) {
+      FixedString<64> line("Sending the sample history: ");
+      LOG_INFO(line.append_uint(samples).append(" samples in ").append_uint(length).append(" bytes").c_str());
+    }
+    if (lora.send_diagnostics(frame, length)) {
+      history.remove_oldest(samples);
+    }
+    else {
+      LOG_ERROR("The sample history wasn't sent: keeping it for the next wake");
+    }
+  }
+
+  if (lora.packets_sent()) { // the base station only sends a command in reply to a packet
+    profiler.begin(Phase::kDownlink);
+    downlink.receive(lora);
+    profiler.end(Phase::kDownlink);
+  }
+
+  // Run the circulation pump for CIRC_PUMP_RUN_SECONDS: turn it on, hold the pin HIGH
+  // through deep sleep, and wake up to turn it off (at the top of setup()). Then
+  // deep sleep for as long as sleep_scheduler says, with a pump run every
+  // circ_pump_max_off_seconds in it.
+  profiler.begin(Phase::kCircPumpStart);
+  start_circ_pump();
 
-  // Run the circulation pump
-  elapsedMillis circ_timer_ms = 0;
-  Serial.println("Circ pump starting");
-  digitalWrite(circ_pump_pin, HIGH);
-  // while (timer_ms < (3 * 1000)) {} // BAS: testing only
-  while (circ_timer_ms < (3 * 60 * 1000)) {} // run the circulation pump for 3 minutes
-  Serial.println("Circ pump stopping");
-  digitalWrite(circ_pump_pin, LOW);
-
-  // Go to deep sleep for 5 minutes
-  delay(2000);
-  Serial.println("Going to sleep now");
-  esp_sleep_enable_timer_wakeup(TIME_TO_SLEEP * uS_TO_S_FACTOR);
-  esp_deep_sleep_start();
+  LOG_INFO("Going to sleep now");
+#if LOG_SINK == LOG_SINK_SERIAL
+  hal::console().flush(); // let the last lines out of the UART before it powers down
+#endif
+  profiler.end(Phase::kCircPumpStart);
+  profiler.end_wake(Phase::kAwake);
+  ulp_watchdog.arm(circ_pump_running);
+  hal::deep_sleep(runtime_config().circ_pump_seconds * uS_TO_S_FACTOR);
 
 } // setup()
 
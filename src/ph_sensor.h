@@ -1,18 +1,27 @@
 #ifndef _PH_SENSOR_H_
 #define _PH_SENSOR_H_
 
-#include "Arduino.h"
+#include "hal.h"
 #include "config.h"
 #include "analog_reader.h"
+#include "calibration_curve.h"
+#include "fixed_string.h"
+#include "log.h"
+
+constexpr CalibrationPoint kpHCalibration[] = {PH_CALIBRATION_POINTS};
+static_assert(calibration_is_valid(kpHCalibration),
+              "PH_CALIBRATION_POINTS must be in increasing mV order, with pH decreasing");
+constexpr CalibrationCurve<sizeof(kpHCalibration) / sizeof(CalibrationPoint)> kpHCurve(kpHCalibration);
 
 class pHSensor {
 private:
-    uint8_t data_pin_;
     ESP32AnalogReader analog_reader_;
+    ReadingStats last_reading_;
 
 public:
-    // Constructor for the pH sensor instance. 
-    pHSensor(uint8_t pin) : data_pin_{pin}, analog_reader_(data_pin_) {}
+    // Constructor for the pH sensor instance. Give it an AdcSampler to sample it together with other ADC1 pins.
+    template <uint8_t kPin>
+    explicit pHSensor(AdcPin<kPin> pin, AdcSampler* sampler = nullptr) : analog_reader_(pin, sampler) {}
 
 
     /**
@@ -20,22 +29,26 @@ public:
      * the calibration values, to output the final value. This is from Atlas Scientific's
      * calibration software for Arduino, in the ph_gravity.cpp file. (They do 1,000 samples
      * with no delay between them. I'm doing far fewer, but the results are the same.)
+     * The calibration values are PH_CALIBRATION_POINTS in config.h.
      */
 
     float reported_pH() {
-      float measured_mV = analog_reader_.read_avg_mV(250, 5);
-      float pH;
-      if (measured_mV > PH_MID_CAL_VOLTAGE_MV) {  // high voltage == low ph
-        pH = 7.0 - 3.0 / (PH_LOW_CAL_VOLTAGE_MV - PH_MID_CAL_VOLTAGE_MV) * (measured_mV - PH_MID_CAL_VOLTAGE_MV);
-      }
-      else {
-        pH = 7.0 - 3.0 / (PH_MID_CAL_VOLTAGE_MV - PH_HI_CAL_VOLTAGE_MV) * (measured_mV - PH_MID_CAL_VOLTAGE_MV);
+      const SamplingPolicy kPolicy = {10, 250, 5, PH_SAMPLE_TOLERANCE_MV, SampleEstimator::kMedianOfMeans};
+      float measured_mV = analog_reader_.read_adaptive_mV(kPolicy, &last_reading_);
+      float pH = kpHCurve.convert(measured_mV); // high voltage == low pH
+      if (LOG_ENABLED(LOG_LEVEL_DEBUG)) {
+        FixedString<32> line("mV: ");
+        line.append_float(measured_mV, 1).append("\t pH = ").append_float(pH, 1);
+        LOG_DEBUG(line.c_str());
       }
-      Serial.print("mV: " + String(measured_mV, 1) + "\t pH = " + String(pH, 1));
       return pH;
     }
 
 
+    // Samples and variance of the last reported_pH()
+    const ReadingStats& last_reading_stats() const { return last_reading_; }
+
+
     /**
      * @brief Measures the millivolts from the pH sensor multiple times and outputs the values to the serial monitor.
      * Used only to calibrate the pH sensor. It's normally commented out in main.cpp.
@@ -44,7 +57,7 @@ public:
    void pH_calibration() {
       for(uint8_t n = 0; n < 100; n++) {  
         reported_pH();
-        delay(5000);
+        hal::delay_ms(5000);
       }
    }   
   
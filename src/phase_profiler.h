@@ -0,0 +1,253 @@
+#ifndef _PHASE_PROFILER_H_
+#define _PHASE_PROFILER_H_
+
+#include <stddef.h>
+#include "hal.h"
+#include "config.h"
+#include "binary_payload.h"
+
+/**
+ * @brief The parts of a wake that PhaseProfiler times.
+ */
+
+enum class Phase : uint8_t {
+  kBoot,          // reset to the start of setup()
+  kLoRaInit,      // lora.initialize()
+  kWaterVolume,   // reading each sensor
+  kVoltage,
+  kpH,
+  kFill,          // the auto-fill, when there is one
+  kLoRaSend,      // send_batch(): the AT+SEND(s), and the ack window with acked delivery
+  kCircPumpStart, // starting the circulation pump, to going to sleep
+  kPumpOffWake,   // the whole of a wake that only turns the circulation pump off
+  kAwake,         // the whole of every other wake
+  kDownlink,      // the receive window for a downlink command, and handling it
+  kSampleWake,    // the whole of a wake that only adds to the sample history
+  kCount
+};
+
+inline const char* phase_name(Phase phase) {
+  switch (phase) {
+    case Phase::kBoot: return "boot";
+    case Phase::kLoRaInit: return "lora init";
+    case Phase::kWaterVolume: return "water volume";
+    case Phase::kVoltage: return "voltage";
+    case Phase::kpH: return "pH";
+    case Phase::kFill: return "fill";
+    case Phase::kLoRaSend: return "lora send";
+    case Phase::kCircPumpStart: return "circ pump start";
+    case Phase::kPumpOffWake: return "pump-off wake";
+    case Phase::kAwake: return "awake";
+    case Phase::kDownlink: return "downlink";
+    case Phase::kSampleWake: return "sample wake";
+    case Phase::kCount: break;
+  }
+  return "?";
+}
+
+const uint8_t kPhaseCount = (uint8_t)Phase::kCount;
+
+/**
+ * @brief The diagnostic packet PhaseProfiler sends every PROFILE_REPORT_WAKES wakes.
+ * All multi-byte values are little-endian.
+ *
+ *   byte 0     kProfileFrameMarker
+ *   byte 1     Node ID: LORA_NODE_ADDRESS - LORA_BASE_STATION_ADDRESS
+ *   byte 2-3   wakes the report covers
+ *   then, for each phase that ran at least once:
+ *     byte 0   Phase
+ *     byte 1-2 times it ran
+ *     byte 3-8 min, mean and max duration, each a ProfileDuration
+ *
+ * A ProfileDuration is a uint16: milliseconds below 0x8000, otherwise 0x8000 | whole
+ * seconds (so an auto-fill of a couple of minutes still fits).
+ */
+
+const uint8_t kProfileFrameMarker = 0xD1;
+const uint8_t kProfileHeaderBytes = 4;
+const uint8_t kProfilePhaseBytes = 9;
+
+inline uint16_t encode_profile_duration(uint64_t us) {
+  uint64_t ms = us / 1000;
+  if (ms < 0x8000) return (uint16_t)ms;
+  uint64_t s = us / 1000000;
+  return 0x8000 | (uint16_t)(s < 0x7FFF ? s : 0x7FFF);
+}
+
+inline uint32_t decode_profile_duration_ms(uint16_t duration) {
+  return duration & 0x8000 ? (uint32_t)(duration & 0x7FFF) * 1000 : duration;
+}
+
+// Min / mean / max of one phase, across the wakes since the last report
+struct PhaseStats {
+  uint32_t count;
+  uint32_t min_us;
+  uint32_t max_us;
+  uint64_t total_us;
+};
+
+struct ProfileState {
+  PhaseStats phases[kPhaseCount];
+  uint16_t wakes;  // since the last report
+};
+
+/**
+ * @brief The profile, kept in RTC memory so it adds up across deep sleeps.
+ * A power-on or reset clears it.
+ */
+
+RTC_DATA_ATTR static ProfileState profile_state;
+
+/**
+ * @brief PhaseProfiler times the phases of a wake with hal::micros() (esp_timer on the
+ * ESP32, which starts counting early in the boot of each wake - the ROM and bootloader
+ * time before that isn't seen), and keeps min / mean / max per phase in RTC memory.
+ * Timing a phase is two clock reads and a few adds, so it can stay in the firmware.
+ *
+ *   profiler.begin(Phase::kpH);
+ *   float pH = pH_sensor.reported_pH();
+ *   profiler.end(Phase::kpH);
+ *
+ * Every PROFILE_REPORT_WAKES wakes, report_due() says it's time to build_report() and
+ * send it; then reset() starts the next period.
+ */
+
+class PhaseProfiler {
+private:
+    ProfileState& state_;
+    uint64_t start_us_[kPhaseCount] = {};
+
+public:
+    PhaseProfiler(ProfileState& state = profile_state) : state_(state) {}
+
+    /**
+     * @brief Call at the very start of setup(): records the boot time (the clock has been
+     * running since the wake started) and counts the wake.
+     */
+
+    void begin_wake() {
+        record(Phase::kBoot, hal::micros());
+        state_.wakes++;
+    }
+
+    void begin(Phase phase) {
+        start_us_[(uint8_t)phase] = hal::micros();
+    }
+
+    void end(Phase phase) {
+        record(phase, hal::micros() - start_us_[(uint8_t)phase]);
+    }
+
+    // Records a phase that has been timed some other way
+    void record(Phase phase, uint64_t duration_us) {
+        PhaseStats& stats = state_.phases[(uint8_t)phase];
+        uint32_t us = duration_us < 0xFFFFFFFFULL ? (uint32_t)duration_us : 0xFFFFFFFFUL;
+        if (stats.count == 0 || us < stats.min_us) stats.min_us = us;
+        if (us > stats.max_us) stats.max_us = us;
+        stats.total_us += us;
+        stats.count++;
+    }
+
+    // Records the whole of this wake (from its start to now) as phase. Call just before sleeping.
+    void end_wake(Phase phase) {
+        record(phase, hal::micros());
+    }
+
+    const PhaseStats& stats(Phase phase) const {
+        return state_.phases[(uint8_t)phase];
+    }
+
+    bool report_due() const {
+        return state_.wakes >= PROFILE_REPORT_WAKES;
+    }
+
+    /**
+     * @brief Builds the diagnostic packet described above kProfileFrameMarker. Once it's
+     * escaped for the air (see escape_payload()), it has to fit in max_length: a phase that
+     * would take it past that is left out.
+     *
+     * @return Its length, or 0 if max_length can't hold every phase unescaped
+     */
+
+    uint8_t build_report(uint8_t* frame, uint8_t max_length) const {
+        if (max_length < kProfileHeaderBytes + kPhaseCount * kProfilePhaseBytes) {
+            return 0;
+        }
+        uint8_t length = 0;
+        frame[length++] = kProfileFrameMarker;
+        frame[length++] = LORA_NODE_ADDRESS - LORA_BASE_STATION_ADDRESS;
+        frame[length++] = state_.wakes & 0xFF;
+        frame[length++] = state_.wakes >> 8;
+        size_t escaped = escaped_payload_length(frame, length);
+        for (uint8_t p = 0; p < kPhaseCount; p++) {
+            const PhaseStats& stats = state_.phases[p];
+            if (!stats.count) continue;
+            uint16_t count = stats.count < 0xFFFF ? stats.count : 0xFFFF;
+            uint16_t durations[] = {encode_profile_duration(stats.min_us),
+                                    encode_profile_duration(stats.total_us / stats.count),
+                                    encode_profile_duration(stats.max_us)};
+            uint8_t* phase = frame + length;
+            phase[0] = p;
+            phase[1] = count & 0xFF;
+            phase[2] = count >> 8;
+            for (uint8_t d = 0; d < 3; d++) {
+                phase[3 + 2 * d] = durations[d] & 0xFF;
+                phase[4 + 2 * d] = durations[d] >> 8;
+            }
+            size_t phase_escaped = escaped_payload_length(phase, kProfilePhaseBytes);
+            if (escaped + phase_escaped <= max_length) {
+                length += kProfilePhaseBytes;
+                escaped += phase_escaped;
+            }
+        }
+        return length;
+    }
+
+    // Starts a new reporting period
+    void reset() {
+        state_ = ProfileState();
+    }
+};
+
+/**
+ * @brief One phase of a decoded diagnostic packet.
+ */
+
+struct DecodedPhase {
+  Phase phase;
+  uint16_t count;
+  uint32_t min_ms;
+  uint32_t mean_ms;
+  uint32_t max_ms;
+};
+
+/**
+ * @brief Decodes a diagnostic packet (for the base station, or the host tools).
+ *
+ * @param wakes Gets the number of wakes the report covers
+ * @return The number of phases written to phases[], or -1 if the packet is malformed.
+ */
+
+inline int decode_profile_report(const uint8_t* data, size_t length, uint16_t* wakes,
+                                 DecodedPhase* phases, size_t max_phases) {
+  if (length < kProfileHeaderBytes || data[0] != kProfileFrameMarker
+      || (length - kProfileHeaderBytes) % kProfilePhaseBytes) {
+    return -1;
+  }
+  *wakes = data[2] | (data[3] << 8);
+  size_t count = 0;
+  for (size_t pos = kProfileHeaderBytes; pos < length; pos += kProfilePhaseBytes) {
+    if (count == max_phases || data[pos] >= kPhaseCount) {
+      return -1;
+    }
+    DecodedPhase& out = phases[count++];
+    out.phase = (Phase)data[pos];
+    out.count = data[pos + 1] | (data[pos + 2] << 8);
+    out.min_ms = decode_profile_duration_ms(data[pos + 3] | (data[pos + 4] << 8));
+    out.mean_ms = decode_profile_duration_ms(data[pos + 5] | (data[pos + 6] << 8));
+    out.max_ms = decode_profile_duration_ms(data[pos + 7] | (data[pos + 8] << 8));
+  }
+  return (int)count;
+}
+
+#endif // _PHASE_PROFILER_H_
@@ -0,0 +1,164 @@
+#ifndef _REPORT_POLICY_H_
+#define _REPORT_POLICY_H_
+
+#include "hal.h"
+#include "config.h"
+#include "binary_payload.h"
+
+const uint8_t kReportedFieldCount = 6;     // PayloadField values 1 - 6
+const uint8_t kReadingHistoryLength = 8;   // readings kept for each field
+
+/**
+ * @brief The last kReadingHistoryLength readings of one field, oldest overwritten first.
+ */
+
+struct ReadingHistory {
+  float value[kReadingHistoryLength];
+  uint32_t time_s[kReadingHistoryLength];  // hal::rtc_seconds() when it was read
+  uint8_t next;                            // where the next reading goes
+  uint8_t count;
+
+  void add(float reading, uint32_t now_s) {
+    value[next] = reading;
+    time_s[next] = now_s;
+    next = (next + 1) % kReadingHistoryLength;
+    if (count < kReadingHistoryLength) count++;
+  }
+
+  // i = 0 is the newest reading, i = count - 1 the oldest
+  float newest(uint8_t i) const {
+    return value[(next + kReadingHistoryLength - 1 - i) % kReadingHistoryLength];
+  }
+  uint32_t newest_time_s(uint8_t i) const {
+    return time_s[(next + kReadingHistoryLength - 1 - i) % kReadingHistoryLength];
+  }
+};
+
+// What was last sent for one field, and its recent readings
+struct FieldReportState {
+  ReadingHistory history;
+  float sent_value;
+  uint32_t sent_time_s;
+  bool sent;  // false until the field has been sent once since power on
+};
+
+struct ReportCounters {
+  uint32_t values_sent;
+  uint32_t values_suppressed;
+  uint32_t packets_sent;
+  uint32_t packets_suppressed;  // packets that weren't sent because every value in them was suppressed
+};
+
+struct ReportState {
+  FieldReportState fields[kReportedFieldCount];
+  ReportCounters counters;
+};
+
+/**
+ * @brief Everything ReportPolicy knows, kept in RTC memory so it survives deep sleep.
+ * A power-on or reset clears it, so every value is sent on the first wake after one.
+ */
+
+RTC_DATA_ATTR static ReportState report_state;
+
+enum class ReportReason : uint8_t {
+  kSuppressed,   // not sent: nothing has changed enough
+  kFirst,        // never sent since power on
+  kDeadband,     // moved at least its deadband since it was last sent
+  kAlarmChange,  // it raised or cleared an alarm (see alarm_rules.h)
+  kHeartbeat,    // not sent for REPORT_HEARTBEAT_SECONDS
+  kEvent         // an auto-fill / float switch event: always sent
+};
+
+inline const char* report_reason_name(ReportReason reason) {
+  switch (reason) {
+    case ReportReason::kSuppressed: return "suppressed";
+    case ReportReason::kFirst: return "first";
+    case ReportReason::kDeadband: return "deadband";
+    case ReportReason::kAlarmChange: return "alarm change";
+    case ReportReason::kHeartbeat: return "heartbeat";
+    case ReportReason::kEvent: return "event";
+  }
+  return "?";
+}
+
+// How far a reading has to move from the value last sent before it's sent again.
+// 0 means the field is an event, not a reading, and is always sent.
+inline float report_deadband(PayloadField field) {
+  switch (field) {
+    case PayloadField::kVoltage: return VOLTAGE_REPORT_DEADBAND;
+    case PayloadField::kpH: return PH_REPORT_DEADBAND;
+    case PayloadField::kWaterVolume: return WATER_VOLUME_REPORT_DEADBAND;
+    default: return 0;
+  }
+}
+
+/**
+ * @brief ReportPolicy decides which readings are worth a LoRa packet (report by exception).
+ *
+ * A reading is sent when it's the first since power on, when it has moved at least its
+ * report_deadband() from the value last sent, when it raises or clears an alarm, or when it
+ * hasn't been sent for REPORT_HEARTBEAT_SECONDS. (The base station repeats an alarm's emails
+ * itself, so a value in alarm doesn't have to be sent any more often.) Auto-fill and float
+ * switch events are always sent.
+ *
+ * Every reading is added to its field's ReadingHistory, whether it's sent or not.
+ */
+
+class ReportPolicy {
+private:
+    ReportState& state_;
+
+public:
+    ReportPolicy(ReportState& state = report_state) : state_(state) {}
+
+    /**
+     * @brief Records a reading, and decides whether to send it. If the answer is anything
+     * but kSuppressed, the reading is remembered as sent.
+     *
+     * @param alarm_changed The reading raised or cleared an alarm (AlarmRules::evaluate())
+     */
+
+    ReportReason evaluate(PayloadField field, float value, bool alarm_changed) {
+        uint8_t index = (uint8_t)field - 1;
+        if (index >= kReportedFieldCount) {
+            return ReportReason::kEvent;
+        }
+        FieldReportState& f = state_.fields[index];
+        uint32_t now_s = hal::rtc_seconds();
+        f.history.add(value, now_s);
+
+        float deadband = report_deadband(field);
+        float change = value - f.sent_value;
+        ReportReason reason = ReportReason::kSuppressed;
+        if (deadband == 0) reason = ReportReason::kEvent;
+        else if (!f.sent) reason = ReportReason::kFirst;
+        else if (alarm_changed) reason = ReportReason::kAlarmChange;
+        else if (change >= deadband || -change >= deadband) reason = ReportReason::kDeadband;
+        else if (now_s - f.sent_time_s >= REPORT_HEARTBEAT_SECONDS) reason = ReportReason::kHeartbeat;
+
+        if (reason == ReportReason::kSuppressed) {
+            state_.counters.values_suppressed++;
+            return reason;
+        }
+        f.sent = true;
+        f.sent_value = value;
+        f.sent_time_s = now_s;
+        state_.counters.values_sent++;
+        return reason;
+    }
+
+    // Counts a packet that was sent, or one that wasn't because all its values were suppressed
+    void count_packet(bool sent) {
+        if (sent) state_.counters.packets_sent++;
+        else state_.counters.packets_suppressed++;
+    }
+
+    const ReportCounters& counters() const { return state_.counters; }
+
+    const ReadingHistory& history(PayloadField field) const {
+        return state_.fields[(uint8_t)field - 1].history;
+    }
+};
+
+#endif // _REPORT_POLICY_H_
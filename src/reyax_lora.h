@@ -1,8 +1,75 @@
 #ifndef _REYAX_LORA_H_
 #define _REYAX_LORA_H_
 
-#include "Arduino.h"
+#include <stdio.h>
+#include "hal.h"
 #include "config.h"
+#include "at_command.h"
+#include "binary_payload.h"
+#include "lora_airtime.h"
+#include "report_policy.h"
+#include "alarm_rules.h"
+#include "acked_delivery.h"
+#include "runtime_config.h"
+#include "fixed_string.h"
+#include "log.h"
+
+// Separates the values in a batched text payload. See ReyaxLoRa::add_to_batch().
+const char kBatchSeparator = '|';
+
+// A text payload: one value, or a batch of them
+typedef FixedString<kMaxLoRaPayloadBytes> PayloadText;
+
+// "AT+SEND=2200,240," - the data is written straight after it, from where it already is
+typedef FixedString<24> AtSendPrefix;
+
+// Takes a "+RCV=" line from the radio. Returns true if it was a packet it was listening for.
+typedef bool (*PacketHandler)(const char* line, void* context);
+
+/**
+ * @brief The radio settings that initialize() sets and confirms.
+ */
+
+struct LoRaRadioConfig {
+  uint8_t spread_factor;
+  uint8_t bandwidth;
+  uint8_t coding_rate;
+  uint8_t preamble;
+  uint8_t network_id;
+  uint16_t address;
+
+  bool operator==(const LoRaRadioConfig& other) const {
+    return spread_factor == other.spread_factor && bandwidth == other.bandwidth
+           && coding_rate == other.coding_rate && preamble == other.preamble
+           && network_id == other.network_id && address == other.address;
+  }
+  bool operator!=(const LoRaRadioConfig& other) const { return !(*this == other); }
+
+  // FNV-1a of the settings, used to check that the copy in RTC memory is intact.
+  uint32_t hash() const {
+    const uint8_t bytes[] = {spread_factor, bandwidth, coding_rate, preamble, network_id,
+                             (uint8_t)(address & 0xFF), (uint8_t)(address >> 8)};
+    uint32_t h = 2166136261UL;
+    for (uint8_t b : bytes) {
+      h = (h ^ b) * 16777619UL;
+    }
+    return h;
+  }
+};
+
+/**
+ * @brief The last radio settings initialize() confirmed with the radio itself.
+ * Kept in RTC memory, so it survives deep sleep (but not a power-on or reset).
+ * hash == 0 means "nothing confirmed": initialize() has to talk to the radio.
+ */
+
+struct LoRaRadioCache {
+  LoRaRadioConfig config;
+  uint32_t hash;
+  uint16_t wakes_since_check;
+};
+
+RTC_DATA_ATTR static LoRaRadioCache lora_radio_cache;
 
 class ReyaxLoRa {
 private:
@@ -16,6 +83,219 @@ private:
     int8_t bandwidth_ = 7;
     int8_t coding_rate_ = 1;
     int8_t preamble_ = 4;
+#ifdef LORA_BINARY_PAYLOAD
+    bool binary_payload_ = true;
+#else
+    bool binary_payload_ = false;
+#endif
+#ifdef LORA_ACKED_DELIVERY
+    bool acked_delivery_ = true;
+#else
+    bool acked_delivery_ = false;
+#endif
+    // Values collected between begin_batch() and send_batch(). With acked delivery, [1]
+    // holds the events and alarms, which are kept until they're acked; otherwise only [0] is used.
+    bool batching_ = false;
+    BinaryPayload batch_frame_[2] = {BinaryPayload(LORA_NODE_ADDRESS - LORA_BASE_STATION_ADDRESS),
+                                     BinaryPayload(LORA_NODE_ADDRESS - LORA_BASE_STATION_ADDRESS)};
+    PayloadText batch_text_[2];
+    AckedDelivery acked_;
+    uint8_t batch_values_checked_ = 0;  // values given to report_policy_ since begin_batch()
+    ReportPolicy* report_policy_ = nullptr;
+    AlarmRules alarm_rules_;
+    AtCommandEngine at_;
+    PacketHandler packet_handler_ = nullptr;
+    void* packet_context_ = nullptr;
+    bool packet_taken_ = false;       // packet_handler_ took a packet since listen() started
+    uint16_t packets_sent_ = 0;       // AT+SENDs the radio has accepted since power on (or the wake)
+    uint8_t last_send_length_ = 0;
+
+    // The settings in config.h, or the ones a downlink command changed them to (runtime_config.h)
+    static LoRaRadioConfig configured_radio() {
+        const RuntimeConfig& runtime = runtime_config();
+        LoRaRadioConfig config;
+        config.spread_factor = runtime.spread_factor;
+        config.bandwidth = runtime.bandwidth;
+        config.coding_rate = runtime.coding_rate;
+        config.preamble = runtime.preamble;
+        config.network_id = LORA_NETWORK_ID;
+        config.address = LORA_NODE_ADDRESS;
+        return config;
+    }
+
+    /**
+     * @brief Asks the radio for its network ID, address and AT+PARAMETER settings.
+     * Returns false if any of the queries fails.
+     */
+
+    bool query_radio_config(LoRaRadioConfig* config) {
+        unsigned int network_id, address, sf, bw, cr, preamble;
+        AtResponse response = send_and_read_reply("AT+NETWORKID?");
+        if (!response.ok() || sscanf(response.reply, "+NETWORKID=%u", &network_id) != 1) {
+            return false;
+        }
+        response = send_and_read_reply("AT+ADDRESS?");
+        if (!response.ok() || sscanf(response.reply, "+ADDRESS=%u", &address) != 1) {
+            return false;
+        }
+        response = send_and_read_reply("AT+PARAMETER?");
+        if (!response.ok() || sscanf(response.reply, "+PARAMETER=%u,%u,%u,%u", &sf, &bw, &cr, &preamble) != 4) {
+            return false;
+        }
+        config->network_id = network_id;
+        config->address = address;
+        config->spread_factor = sf;
+        config->bandwidth = bw;
+        config->coding_rate = cr;
+        config->preamble = preamble;
+        return true;
+    }
+
+    /**
+     * @brief True if this is a wake from deep sleep (not a power-on or reset), an earlier
+     * wake confirmed the radio has the configured settings, nothing has failed since,
+     * and it's not time for the every-LORA_CONFIG_RECHECK_WAKES check.
+     */
+
+    bool can_skip_radio_setup() {
+        return hal::wake_cause() != hal::WakeCause::kColdBoot
+               && lora_radio_cache.hash != 0
+               && lora_radio_cache.hash == lora_radio_cache.config.hash()
+               && lora_radio_cache.config == configured_radio()
+               && lora_radio_cache.wakes_since_check < LORA_CONFIG_RECHECK_WAKES;
+    }
+
+    // Passes packets from the base station to acked_ (acks) and to the packet handler
+    static void on_receive(const char* line, void* context) {
+        ReyaxLoRa* lora = (ReyaxLoRa*)context;
+        lora->acked_.handle_receive(line);
+        if (lora->packet_handler_ && lora->packet_handler_(line, lora->packet_context_)) {
+            lora->packet_taken_ = true;
+        }
+    }
+
+    // Logs binary AT+SEND data, in hex. (Text data is logged with the command.)
+    static void print_hex_data(const uint8_t* data, uint8_t length) {
+        if (!LOG_ENABLED(LOG_LEVEL_DEBUG)) return;
+        log_sink().print("Data: ");
+        for (uint8_t i = 0; i < length; i++) {
+            FixedString<2> hex;
+            log_sink().print(hex.append_hex(data[i]).c_str());
+        }
+        log_sink().println();
+    }
+
+    static AtSendPrefix at_send_prefix(uint8_t data_length) {
+        AtSendPrefix prefix("AT+SEND=");
+        prefix.append_uint(LORA_BASE_STATION_ADDRESS).append(',').append_uint(data_length).append(',');
+        return prefix;
+    }
+
+    // The data of batch [b], or nullptr if it's empty
+    const uint8_t* batch_data(uint8_t b, uint8_t* length) {
+        if (binary_payload_) {
+            *length = batch_frame_[b].length();
+            return batch_frame_[b].empty() ? nullptr : batch_frame_[b].data();
+        }
+        *length = (uint8_t)batch_text_[b].length();
+        return *length ? (const uint8_t*)batch_text_[b].c_str() : nullptr;
+    }
+
+    // How many bytes the batch will take in one AT+SEND, escaped, including segment headers
+    uint16_t batch_length() {
+        uint16_t total = 0;
+        for (uint8_t b = 0; b < 2; b++) {
+            uint8_t length;
+            const uint8_t* data = batch_data(b, &length);
+            if (data) {
+                total += (binary_payload_ ? batch_frame_[b].escaped_length() : length)
+                         + (acked_delivery_ ? kSegmentHeaderBytes : 0);
+            }
+        }
+        return total;
+    }
+
+    /**
+     * @brief Sends acked_'s packet (shown in hex if binary), listens for the ack for up to LORA_ACK_WINDOW_MS, and
+     * updates the retransmit queue. Returns false if the radio didn't take the packet.
+     */
+
+    bool send_acked_packet(bool binary) {
+        if (binary) {
+            print_hex_data(acked_.packet(), acked_.length());
+        }
+        AtResponse response = send_data(acked_.packet(), acked_.length());
+        if (response.ok()) {
+            uint32_t start_ms = hal::millis();
+            while (!acked_.all_acked() && (uint32_t)(hal::millis() - start_ms) < LORA_ACK_WINDOW_MS) {
+                at_.poll();
+            }
+        }
+        uint8_t segments = acked_.segment_count();
+        uint8_t acked = acked_.acked_count();
+        acked_.end_packet();
+        if (LOG_ENABLED(LOG_LEVEL_INFO)) {
+            FixedString<64> line("Acked ");
+            line.append_uint(acked).append(" of ").append_uint(segments).append(" segments, ");
+            line.append_uint(acked_.queue().count).append(" waiting to be sent again");
+            LOG_INFO(line.c_str());
+        }
+        return response.ok();
+    }
+
+    /**
+     * @brief Sends the batch as segments, piggybacked on any retransmits that are due,
+     * in as few packets as they fit in.
+     */
+
+    void send_acked_batch() {
+        acked_.begin_packet();
+        for (uint8_t b = 0; b < 2; b++) {
+            uint8_t length;
+            const uint8_t* data = batch_data(b, &length);
+            if (!data) continue;
+            if (!acked_.add_segment(data, length, b == 1)) {
+                send_acked_packet(binary_payload_);
+                acked_.begin_packet();
+                acked_.add_segment(data, length, b == 1);
+            }
+        }
+        if (acked_.segment_count()) {
+            send_acked_packet(binary_payload_);
+        }
+    }
+
+    // AT+SENDs data to the base station, escaped (see escape_payload())
+    AtResponse send_data(const uint8_t* data, uint8_t length) {
+        uint8_t escaped[kMaxLoRaPayloadBytes];
+        size_t escaped_length = escaped_payload_length(data, length);
+        if (escaped_length > kMaxLoRaPayloadBytes) { // the frames are built to fit, so this is a bug
+            LOG_ERROR("Packet too long to send, escaped");
+            AtResponse response;
+            response.error = AtError::kTxTooLong;
+            return response;
+        }
+        if (escaped_length != length) {
+            escape_payload(data, length, escaped);
+            data = escaped;
+            length = (uint8_t)escaped_length;
+        }
+        AtResponse response = check_response(at_.send(at_send_prefix(length).c_str(), data, length,
+                                                      send_timeout_ms(length)));
+        if (response.ok()) {
+            packets_sent_++;
+            last_send_length_ = length;
+        }
+        return response;
+    }
+
+    // After any AT error, the next initialize() talks to the radio again.
+    AtResponse check_response(const AtResponse& response) {
+        if (!response.ok()) {
+            invalidate_radio_cache();
+        }
+        return response;
+    }
 
 public:
 
@@ -30,7 +310,9 @@ public:
      * @param pin Pin number that will be used to turn the LoRa on / off (if applicable).
      */
     ReyaxLoRa(uint8_t pin) : pin_{pin}
-    {}
+    {
+        at_.set_receive_handler(on_receive, this);
+    }
 
     // Constructor for the receiver (no pin to turn it on/off - it's always powered on)
     ReyaxLoRa() : ReyaxLoRa(0)
@@ -40,28 +322,64 @@ public:
      * @brief - initialize() sends power to the LoRa radio if pin_ has been set
      * to something other than 0 in the constructor, then it
      * starts Serial2, then it wakes up the radio.
+     *
+     * On a timer wakeup, if the settings were confirmed on an earlier wake (see
+     * can_skip_radio_setup()), the radio is left alone: its settings are in its own
+     * EEPROM, so there's nothing to send.
+     *
+     * @return false if the radio didn't answer, rejected one of the commands, or doesn't
+     * have the configured settings (config.h, or runtime_config())
      */
 
-    void initialize() {
+    bool initialize() {
         if (pin_) {
-            pinMode(pin_, OUTPUT);
+            hal::pin_mode(pin_, OUTPUT);
             // Turn on the LoRa radio via transistor
-            digitalWrite(pin_, HIGH);
-            delay(200);
+            hal::digital_write(pin_, HIGH);
+            hal::delay_ms(200);
+        }
+
+        hal::lora_uart().begin(115200);
+
+        if (can_skip_radio_setup()) {
+            lora_radio_cache.wakes_since_check++;
+            LOG_INFO("LoRa settings confirmed on an earlier wake - skipping setup");
+            return true;
+        }
+
+        // Wake up the LoRa and show the responses in the Serial Monitor. Each command goes
+        // out as soon as the previous one is answered; if the radio isn't ready yet, the
+        // "AT" is retried (see AtCommandEngine::send()).
+        at_.queue("AT");
+        at_.queue("AT+VER?");
+        LoRaRadioConfig configured = configured_radio();
+        FixedString<kAtMaxCommandLength> parameter("AT+PARAMETER="); // SF, BW, CR, Preamble
+        parameter.append_uint(configured.spread_factor).append(',').append_uint(configured.bandwidth).append(',');
+        parameter.append_uint(configured.coding_rate).append(',').append_uint(configured.preamble);
+        at_.queue(parameter.c_str());
+        if (!check_response(at_.run_queue()).ok()) {
+            return false;
+        }
+
+        // Confirm what the radio actually has, and remember it for the next wakes
+        LoRaRadioConfig confirmed;
+        if (!query_radio_config(&confirmed) || confirmed != configured) {
+            invalidate_radio_cache();
+            return false;
         }
+        lora_radio_cache.config = confirmed;
+        lora_radio_cache.hash = confirmed.hash();
+        lora_radio_cache.wakes_since_check = 0;
+        return true;
+    }
 
-        // Serial2 is defined in HardwareSerial.cpp as txPin = 17 and rxPin = 16
-        Serial2.begin(115200);
-        read_reply(); // the reply comes from Serial2.begin()
-        delay(500);
+    /**
+     * @brief Forgets the confirmed radio settings, so the next initialize() sends them
+     * all again.
+     */
 
-        // Wake up the LoRa and show the responses in the Serial Monitor
-        send_and_read_reply("AT");
-        send_and_read_reply("AT+VER?");
-        send_and_read_reply("AT+PARAMETER=9,7,1,4"); // SF, BW, CR, Preamble
-        send_and_read_reply("AT+NETWORKID?");
-        send_and_read_reply("AT+ADDRESS?");
-        send_and_read_reply("AT+PARAMETER?");
+    void invalidate_radio_cache() {
+        lora_radio_cache.hash = 0;
     }
 
     
@@ -74,18 +392,16 @@ public:
      */
 
     void one_time_setup() {
-        uint8_t id = LORA_NETWORK_ID;
-        String network_string = "AT+NETWORKID=" + String(id);
-        send_and_read_reply(network_string);
+        FixedString<kAtMaxCommandLength> network_string("AT+NETWORKID=");
+        send_and_read_reply(network_string.append_uint(LORA_NETWORK_ID).c_str());
 
-        uint16_t address = LORA_NODE_ADDRESS;
-        String address_string = "AT+ADDRESS=" + String(address);
-        send_and_read_reply(address_string);
+        FixedString<kAtMaxCommandLength> address_string("AT+ADDRESS=");
+        send_and_read_reply(address_string.append_uint(LORA_NODE_ADDRESS).c_str());
     #ifdef LORA_BAUD_RATE
-        uint32_t baud = LORA_BAUD_RATE;
-        String baud_rate_string = "AT+IPR=" + String(baud);
-        send_and_read_reply(baud_rate_string);
+        FixedString<kAtMaxCommandLength> baud_rate_string("AT+IPR=");
+        send_and_read_reply(baud_rate_string.append_uint(LORA_BAUD_RATE).c_str());
     #endif        
+        invalidate_radio_cache();
     }
 
     /**
@@ -157,72 +473,296 @@ public:
     }
 
     /**
-     * @brief - If delay_ms is > 0, does a delay(delay_ms), then reads whatever is in the
-     * Serial2 buffer (typically, it's a reply from an AT command that was just sent), then displays
-     * it on Serial. Some of the AT commands seem to need the delay before reading the reply.
-     * (AT+SEND is one of them.)
+     * @brief set_binary_payload() chooses between the compact binary frames in
+     * binary_payload.h (true) and the "Garden%Wtr lvl%16.2%0%1%1" text payload (false).
+     * The default comes from LORA_BINARY_PAYLOAD in config.h.
      */
 
-    void read_reply(int delay_ms = 0) {
-        if (delay_ms)
-            delay(delay_ms);
-        Serial.println(Serial2.readStringUntil('\n'));
+    void set_binary_payload(bool binary) {
+        binary_payload_ = binary;
+    }
+
+    /**
+     * @brief set_acked_delivery() turns the ack protocol in acked_delivery.h on or off.
+     * The default comes from LORA_ACKED_DELIVERY in config.h. Don't change it between
+     * begin_batch() and send_batch().
+     */
+
+    void set_acked_delivery(bool acked) {
+        acked_delivery_ = acked;
+    }
+
+    // Segments acked, retransmitted and dropped since power on, and how many are waiting
+    const RetransmitQueue& retransmit_stats() const {
+        return acked_.queue();
+    }
+
+    /**
+     * @brief Time on air, in ms, of a packet with payload_bytes of data, at the
+     * configured AT+PARAMETER settings.
+     */
+
+    float time_on_air_ms(uint16_t payload_bytes) {
+        const RuntimeConfig& runtime = runtime_config();
+        return lora_time_on_air_us(payload_bytes, runtime.spread_factor, runtime.bandwidth,
+                                   runtime.coding_rate, runtime.preamble) / 1000.0;
+    }
+
+    // AT+SENDs the radio has accepted, and the length of the data of the last one
+    uint16_t packets_sent() const { return packets_sent_; }
+    uint8_t last_send_length() const { return last_send_length_; }
+
+    /**
+     * @brief Every "+RCV=" line that arrives from now on (while sending, or in listen())
+     * is passed to handler too - after acked delivery has seen it.
+     */
+
+    void set_packet_handler(PacketHandler handler, void* context) {
+        packet_handler_ = handler;
+        packet_context_ = context;
     }
 
-    
     /**
-     * @brief Sends an AT command to the LoRa, then reads the reply from the LoRa
-     * and displays it in the serial monitor.
+     * @brief Keeps the radio's UART open for up to window_ms, passing what arrives to the
+     * packet handler, and returns as soon as the handler takes a packet.
+     *
+     * @return true if it took one
+     */
+
+    bool listen(uint32_t window_ms) {
+        packet_taken_ = false;
+        uint32_t start_ms = hal::millis();
+        while (!packet_taken_ && (uint32_t)(hal::millis() - start_ms) < window_ms) {
+            at_.poll();
+        }
+        return packet_taken_;
+    }
+
+    /**
+     * @brief Sends an AT command to the LoRa, then waits for the reply from the LoRa
+     * (displaying both in the serial monitor). Returns as soon as the reply arrives.
+     * See AtCommandEngine::send() for the retries and timeouts.
      * 
-     * @param send_string The AT command string you want to send to the LoRa
-     * @param delay_ms Delay between sending the AT command and trying to read the reply.
-     * See read_reply(), above.
+     * @param send_string The AT command string you want to send to the LoRa, without "\r\n"
+     */
+
+    AtResponse send_and_read_reply(const char* send_string) {
+        return check_response(at_.send(send_string));
+    }
+
+    /**
+     * @brief How long to wait for the +OK after an AT+SEND: the time on air of the data,
+     * plus the usual reply time.
+     */
+
+    uint32_t send_timeout_ms(uint16_t payload_bytes) {
+        return (uint32_t)time_on_air_ms(payload_bytes) + kAtReplyTimeoutMs;
+    }
+
+    /**
+     * @brief Appends the text payload for one value to out: "Garden%Wtr lvl%16.2%0%1%1"
+     *
+     * @param decimals Decimal places of the value
      */
 
-    void send_and_read_reply(String send_string, int delay_ms = 0) {
-        String command = send_string + "\r\n";
-        String sending = "Sending: " + command;
-        // Display it on the serial monitor
-        Serial.println(sending);
-        // Now send it to the LoRa
-        Serial2.print(command);
-        read_reply(delay_ms);
+    static void append_text_payload(PayloadText& out, const char* value_name, float value, uint8_t decimals,
+                                    uint16_t alarm_code, uint16_t email_threshold, uint16_t max_emails) {
+        out.append(TRANSMITTER_NAME).append('%').append(value_name).append('%').append_float(value, decimals);
+        out.append('%').append_uint(alarm_code).append('%').append_uint(email_threshold).append('%').append_uint(max_emails);
     }
 
     /**
      * @brief Generate a data payload and send it from a transmitter to the base station
      */
 
-    void generate_and_send_payload(String value_name, String value_str, uint16_t alarm_code, uint16_t email_threshold, uint16_t max_emails) {
-        String data_str = String(TRANSMITTER_NAME + "%" + value_name + "%" + value_str + "%" + alarm_code
-                          + "%" + email_threshold + "%" + max_emails);
-        uint8_t data_length = data_str.length();
-        String payload = "AT+SEND=" + String(LORA_BASE_STATION_ADDRESS) + "," + String(data_length) + "," + data_str;
-        send_and_read_reply(payload, 500);
+    void generate_and_send_payload(const char* value_name, float value, uint8_t decimals, uint16_t alarm_code, uint16_t email_threshold, uint16_t max_emails) {
+        PayloadText payload;
+        append_text_payload(payload, value_name, value, decimals, alarm_code, email_threshold, max_emails);
+        send_text_payload(payload.c_str());
     }
 
-     /**
-     * @brief Sends voltage data from a transmitter to the base station
-     * 
-     * @param voltage 
+    /**
+     * @brief Sends an already-built text payload (one value, or a batch of them) to the base
+     * station. Only the "AT+SEND=2200,25," in front of it is built here (on the stack); the
+     * data is written from where it is.
      */
 
-    void send_voltage_data(float value) {
-        String value_str = String(value, 2); // makes voltage always have two decimal places
-        uint16_t alarm_code = 0;
-        uint16_t email_interval = 1;
-        uint16_t max_emails = 1;
-        if (value < LOW_VOLTAGE_ALARM_VALUE) {
-            alarm_code = (uint16_t)LOW_VOLTAGE_ALARM_CODE;
-            email_interval = (uint16_t)LOW_VOLTAGE_EMAIL_INTERVAL;
-            max_emails = (uint16_t)LOW_VOLTAGE_MAX_EMAILS;
+    AtResponse send_text_payload(const char* data) {
+        return send_data((const uint8_t*)data, (uint8_t)strlen(data));
+    }
+
+    /**
+     * @brief Sends a binary frame (see binary_payload.h) to the base station. The frame
+     * can contain any byte, so it's escaped (see escape_payload()), and shown in the Serial
+     * Monitor in hex, as it was before escaping.
+     */
+
+    AtResponse send_binary_payload(const BinaryPayload& frame) {
+        print_hex_data(frame.data(), frame.length());
+        return send_data(frame.data(), frame.length());
+    }
+
+    /**
+     * @brief Sends a diagnostic packet (such as PhaseProfiler's report) on its own, shown in
+     * hex. With acked delivery it goes as a segment - piggybacked on any retransmits that
+     * are due - but isn't kept for retransmitting: the next report replaces it.
+     *
+     * @return true if the radio took the packet (AT+SEND got +OK). It says nothing about
+     * whether the base station got it.
+     */
+
+    bool send_diagnostics(const uint8_t* data, uint8_t length) {
+        if (acked_delivery_) {
+            acked_.begin_packet();
+            if (!acked_.add_segment(data, length, false)) { // the retransmits go first
+                send_acked_packet(binary_payload_);
+                acked_.begin_packet();
+                if (!acked_.add_segment(data, length, false)) {
+                    return false;
+                }
+            }
+            return send_acked_packet(true);
         }
-        else if (value > HIGH_VOLTAGE_ALARM_VALUE) {
-            alarm_code = (uint16_t)HIGH_VOLTAGE_ALARM_CODE;
-            email_interval = (uint16_t)HIGH_VOLTAGE_EMAIL_INTERVAL;
-            max_emails = (uint16_t)HIGH_VOLTAGE_MAX_EMAILS;
+        print_hex_data(data, length);
+        return send_data(data, length).ok();
+    }
+
+    /**
+     * @brief Sends one value in whichever format set_binary_payload() selected.
+     *
+     * @param decimals Decimal places of the value in the text format
+     * @param alarm From alarm_rules_: the alarm info to send with it, if it raised or cleared one
+     */
+
+    void send_value(PayloadField field, float value, uint8_t decimals, const AlarmReport& alarm) {
+        if (LOG_ENABLED(LOG_LEVEL_INFO) && alarm.transition != AlarmTransition::kNone && !field_is_event(field)) {
+            FixedString<48> line(alarm.transition == AlarmTransition::kRaised ? "Alarm raised: " : "Alarm cleared: ");
+            LOG_INFO(line.append(field_name(field)).append(' ').append_float(value, decimals).c_str());
+        }
+        if (report_policy_) {
+            ReportReason reason = report_policy_->evaluate(field, value, alarm.transition != AlarmTransition::kNone);
+            if (batching_) {
+                batch_values_checked_++;
+            }
+            else {
+                report_policy_->count_packet(reason != ReportReason::kSuppressed);
+            }
+            if (reason == ReportReason::kSuppressed) {
+                if (LOG_ENABLED(LOG_LEVEL_INFO)) {
+                    FixedString<48> line("Not sending ");
+                    line.append(field_name(field)).append(' ').append_float(value, decimals).append(": no change");
+                    LOG_INFO(line.c_str());
+                }
+                return;
+            }
+        }
+        add_to_batch(field, value, decimals, alarm.code, alarm.email_interval, alarm.max_emails);
+        if (!batching_) {
+            flush_batch();
+        }
+    }
+
+    /**
+     * @brief begin_batch() starts collecting values instead of sending each one as it's
+     * measured. Every send_*_data() call after this adds its value (and alarm info) to one
+     * frame, which goes out with a single AT+SEND when send_batch() is called. Each
+     * AT+SEND costs a LoRa preamble, the AT round trip and the wait for the reply, so
+     * one packet per wake keeps the radio - and the ESP32 - on for much less time.
+     */
+
+    void begin_batch() {
+        for (uint8_t b = 0; b < 2; b++) {
+            batch_frame_[b].clear();
+            batch_text_[b].clear();
         }
-        generate_and_send_payload("Voltage", value_str, alarm_code, email_interval, max_emails);
+        batch_values_checked_ = 0;
+        batching_ = true;
+    }
+
+    /**
+     * @brief Sends whatever has been collected since begin_batch() (if anything), and goes
+     * back to sending each value as it's measured.
+     */
+
+    void send_batch() {
+        if (report_policy_ && batch_values_checked_) {
+            report_policy_->count_packet(batch_length() > 0);
+        }
+        flush_batch();
+        batching_ = false;
+    }
+
+    // Which alarms are raised (see alarm_rules.h)
+    const AlarmRules& alarm_rules() const { return alarm_rules_; }
+
+    /**
+     * @brief With a ReportPolicy, send_*_data() only sends the values the policy says have
+     * changed enough (see report_policy.h). nullptr (the default) sends every value.
+     */
+
+    void set_report_policy(ReportPolicy* policy) {
+        report_policy_ = policy;
+    }
+
+    /**
+     * @brief Adds one value to the batch. If it doesn't fit in the kMaxLoRaPayloadBytes of
+     * one AT+SEND, what's already in the batch is sent first. In text format, the values
+     * are separated by kBatchSeparator:
+     * "Garden%Wtr lvl%16.2%0%1%1|Garden%Voltage%13.20%0%1%1"
+     */
+
+    void add_to_batch(PayloadField field, float value, uint8_t decimals, uint16_t alarm_code, uint16_t email_interval, uint16_t max_emails) {
+        uint8_t b = (acked_delivery_ && (alarm_code || field_is_event(field))) ? 1 : 0;
+        uint8_t length;
+        bool empty = !batch_data(b, &length);
+        uint16_t needed = empty && acked_delivery_ ? kSegmentHeaderBytes : 0;
+        PayloadText record;
+        if (binary_payload_) { // (escaped, each byte could take two)
+            needed += 2 * (kBinaryFieldBytes + (alarm_code ? kBinaryAlarmBytes : 0) + (empty ? kBinaryFrameHeaderBytes : 0));
+        }
+        else {
+            append_text_payload(record, field_name(field), value, decimals, alarm_code, email_interval, max_emails);
+            needed += record.length() + (empty ? 0 : 1);
+        }
+        if (batch_length() + needed > kMaxLoRaPayloadBytes) {
+            flush_batch();
+        }
+        if (binary_payload_) {
+            batch_frame_[b].add(field, value, alarm_code, email_interval, max_emails);
+            return;
+        }
+        if (batch_text_[b].length()) {
+            batch_text_[b].append(kBatchSeparator);
+        }
+        batch_text_[b].append(record.c_str(), record.length());
+    }
+
+    // Sends the values collected so far, and empties the batch.
+    void flush_batch() {
+        if (acked_delivery_) {
+            send_acked_batch();
+        }
+        else {
+            if (!batch_frame_[0].empty()) {
+                send_binary_payload(batch_frame_[0]);
+            }
+            if (batch_text_[0].length()) {
+                send_text_payload(batch_text_[0].c_str());
+            }
+        }
+        for (uint8_t b = 0; b < 2; b++) {
+            batch_frame_[b].clear();
+            batch_text_[b].clear();
+        }
+    }
+
+    /**
+     * @brief Sends the battery voltage, and any alarm it raised or cleared
+     */
+
+    void send_voltage_data(float value) {
+        uint8_t decimals = 2; // makes voltage always have two decimal places
+        send_value(PayloadField::kVoltage, value, decimals, alarm_rules_.evaluate(PayloadField::kVoltage, value));
     }
 
     /**
@@ -230,14 +770,8 @@ public:
      */
 
     void send_pH_data(float value) {
-        String value_str = String(value, 1); // makes pH always have one decimal place
-        uint16_t alarm_code = 0;
-        uint16_t email_interval = (uint16_t)PH_ALARM_EMAIL_INTERVAL;
-        uint16_t max_emails = (uint16_t)PH_MAX_EMAILS;
-        if (value < LOW_PH_ALARM_VALUE || value > HIGH_PH_ALARM_VALUE) {
-            alarm_code = (uint16_t)PH_ALARM_CODE;            
-        }
-        generate_and_send_payload("pH", value_str, alarm_code, email_interval, max_emails);
+        uint8_t decimals = 1; // makes pH always have one decimal place
+        send_value(PayloadField::kpH, value, decimals, alarm_rules_.evaluate(PayloadField::kpH, value));
     }
 
     /**
@@ -245,42 +779,33 @@ public:
      */
 
     void send_water_volume_data(float value) {
-        String value_str = String(value, 1); // makes water volume always have one decimal place
-        uint16_t alarm_code = 0;
-        uint16_t email_interval = 1;
-        uint16_t max_emails = 1;
-        if (value < LOW_WATER_ALARM_VALUE) {
-            alarm_code = (uint16_t)LOW_WATER_ALARM_CODE;
-            email_interval = (uint16_t)LOW_WATER_EMAIL_INTERVAL;
-            max_emails = (uint16_t)LOW_WATER_MAX_EMAILS;
-        }
-        else if (value > HIGH_WATER_ALARM_VALUE) {
-            alarm_code = (uint16_t)HIGH_WATER_ALARM_CODE;
-            email_interval = (uint16_t)HIGH_WATER_EMAIL_INTERVAL;
-            max_emails = (uint16_t)HIGH_WATER_MAX_EMAILS;
-        }
-        generate_and_send_payload("Wtr lvl", value_str, alarm_code, email_interval, max_emails);
+        uint8_t decimals = 1; // makes water volume always have one decimal place
+        send_value(PayloadField::kWaterVolume, value, decimals, alarm_rules_.evaluate(PayloadField::kWaterVolume, value));
     }
 
     /**
      * @brief Generate the data about the last auto-fill to send to the base station 
      */
 
-    void send_auto_fill_data(float value, String type) {
-        String value_str = String(value, 1); // makes water fill volume always have one decimal place
-        uint16_t alarm_code = (uint16_t)AUTO_FILL_ALARM_CODE;
-        uint16_t email_interval = (uint16_t)AUTO_FILL_EMAIL_INTERVAL;
-        uint16_t max_emails = (uint16_t)AUTO_FILL_MAX_EMAILS;
-        if (type != "Fill") {
-            alarm_code = (uint16_t)HIGH_WATER_ALARM_CODE;
-            email_interval = (uint16_t)HIGH_WATER_EMAIL_INTERVAL;
-            max_emails = (uint16_t)HIGH_WATER_MAX_EMAILS;
-        }
-        generate_and_send_payload(type, value_str, alarm_code, email_interval, max_emails);
+    void send_auto_fill_data(float value, const char* type) {
+        uint8_t decimals = 1; // makes water fill volume always have one decimal place
+        PayloadField field = PayloadField::kAutoFill;
+        if (strcmp(type, "FL-SW") == 0) field = PayloadField::kFloatSwitch;
+        else if (strcmp(type, "TIMER") == 0) field = PayloadField::kFillTimer;
+        send_value(field, value, decimals, alarm_rules_.event(field));
+    }
+
+    /**
+     * @brief Sends how sure the auto-fill volume just sent is: +/- this many gallons, with
+     * 95% confidence. No alarm - it goes with the auto-fill's.
+     */
+
+    void send_auto_fill_confidence(float value) {
+        send_value(PayloadField::kFillConfidence, value, 1, AlarmReport());
     }
 
     void turn_off() { // Used for transmitters that run on small batteries, where LoRa is turned off during sleep
-        digitalWrite(pin_, LOW);
+        hal::digital_write(pin_, LOW);
     }
 
 }; // class ReyaxLoRa
@@ -0,0 +1,236 @@
+#ifndef _RUNTIME_CONFIG_H_
+#define _RUNTIME_CONFIG_H_
+
+#include <stddef.h>
+#include <string.h>
+#include "hal.h"
+#include "config.h"
+
+/**
+ * @brief The settings the base station can change at run time, with a downlink command
+ * (see downlink.h). They start out as the values in config.h; once a command has changed
+ * them they're saved in NVS, so they survive power-off, resets and new firmware (as long
+ * as this struct doesn't change).
+ */
+
+struct RuntimeConfig {
+  uint32_t version;                      // of the last downlink command applied; 0 = config.h
+  uint16_t sleep_seconds;                // TIME_TO_SLEEP
+  uint16_t sleep_min_seconds;            // SLEEP_MIN_SECONDS
+  uint16_t sleep_max_seconds;            // SLEEP_MAX_SECONDS
+  uint16_t circ_pump_seconds;            // CIRC_PUMP_RUN_SECONDS
+  uint16_t circ_pump_max_off_seconds;    // CIRC_PUMP_MAX_OFF_SECONDS
+  float refill_start_volume;             // REFILL_START_VOLUME
+  float refill_stop_volume;              // REFILL_STOP_VOLUME
+  uint16_t low_voltage_email_interval;   // the *_EMAIL_INTERVALs, in minutes
+  uint16_t high_voltage_email_interval;
+  uint16_t ph_email_interval;
+  uint16_t low_water_email_interval;
+  uint16_t high_water_email_interval;
+  uint16_t auto_fill_email_interval;
+  uint8_t spread_factor;                 // the AT+PARAMETER settings
+  uint8_t bandwidth;
+  uint8_t coding_rate;
+  uint8_t preamble;
+};
+
+inline RuntimeConfig default_runtime_config() {
+  RuntimeConfig config;
+  memset(&config, 0, sizeof(config));
+  config.version = 0;
+  config.sleep_seconds = TIME_TO_SLEEP;
+  config.sleep_min_seconds = SLEEP_MIN_SECONDS;
+  config.sleep_max_seconds = SLEEP_MAX_SECONDS;
+  config.circ_pump_seconds = CIRC_PUMP_RUN_SECONDS;
+  config.circ_pump_max_off_seconds = CIRC_PUMP_MAX_OFF_SECONDS;
+  config.refill_start_volume = REFILL_START_VOLUME;
+  config.refill_stop_volume = REFILL_STOP_VOLUME;
+  config.low_voltage_email_interval = LOW_VOLTAGE_EMAIL_INTERVAL;
+  config.high_voltage_email_interval = HIGH_VOLTAGE_EMAIL_INTERVAL;
+  config.ph_email_interval = PH_ALARM_EMAIL_INTERVAL;
+  config.low_water_email_interval = LOW_WATER_EMAIL_INTERVAL;
+  config.high_water_email_interval = HIGH_WATER_EMAIL_INTERVAL;
+  config.auto_fill_email_interval = AUTO_FILL_EMAIL_INTERVAL;
+  config.spread_factor = LORA_SPREAD_FACTOR;
+  config.bandwidth = LORA_BANDWIDTH;
+  config.coding_rate = LORA_CODING_RATE;
+  config.preamble = LORA_PREAMBLE;
+  return config;
+}
+
+enum class SettingType : uint8_t {
+  kUint8,
+  kUint16,
+  kFloat
+};
+
+/**
+ * @brief One setting a downlink command can change: its name in the command, where it is
+ * in RuntimeConfig, and the range it's allowed. Whole-number settings take whole numbers only.
+ */
+
+struct RuntimeSetting {
+  const char* name;
+  SettingType type;
+  uint8_t offset;
+  float min;
+  float max;
+};
+
+const RuntimeSetting kRuntimeSettings[] = {
+  {"sleep", SettingType::kUint16, offsetof(RuntimeConfig, sleep_seconds), 60, 7200},
+  {"sleep_min", SettingType::kUint16, offsetof(RuntimeConfig, sleep_min_seconds), 60, 7200},
+  {"sleep_max", SettingType::kUint16, offsetof(RuntimeConfig, sleep_max_seconds), 60, 7200},
+  {"circ", SettingType::kUint16, offsetof(RuntimeConfig, circ_pump_seconds), 10, 3600},
+  {"circ_off", SettingType::kUint16, offsetof(RuntimeConfig, circ_pump_max_off_seconds), 60, 3600},
+  {"refill_start", SettingType::kFloat, offsetof(RuntimeConfig, refill_start_volume), 5.5, HIGH_WATER_ALARM_VALUE},
+  {"refill_stop", SettingType::kFloat, offsetof(RuntimeConfig, refill_stop_volume), 5.5, HIGH_WATER_ALARM_VALUE},
+  {"lv_email", SettingType::kUint16, offsetof(RuntimeConfig, low_voltage_email_interval), 1, 1440},
+  {"hv_email", SettingType::kUint16, offsetof(RuntimeConfig, high_voltage_email_interval), 1, 1440},
+  {"ph_email", SettingType::kUint16, offsetof(RuntimeConfig, ph_email_interval), 1, 1440},
+  {"lw_email", SettingType::kUint16, offsetof(RuntimeConfig, low_water_email_interval), 1, 1440},
+  {"hw_email", SettingType::kUint16, offsetof(RuntimeConfig, high_water_email_interval), 1, 1440},
+  {"fill_email", SettingType::kUint16, offsetof(RuntimeConfig, auto_fill_email_interval), 1, 1440},
+  {"sf", SettingType::kUint8, offsetof(RuntimeConfig, spread_factor), 7, 12},
+  {"bw", SettingType::kUint8, offsetof(RuntimeConfig, bandwidth), 0, 9},
+  {"cr", SettingType::kUint8, offsetof(RuntimeConfig, coding_rate), 1, 4},
+  {"preamble", SettingType::kUint8, offsetof(RuntimeConfig, preamble), 4, 7},
+};
+
+const uint8_t kRuntimeSettingCount = sizeof(kRuntimeSettings) / sizeof(kRuntimeSettings[0]);
+
+// The setting called name (name_length characters, not terminated), or nullptr
+inline const RuntimeSetting* find_runtime_setting(const char* name, size_t name_length) {
+  for (uint8_t i = 0; i < kRuntimeSettingCount; i++) {
+    if (strlen(kRuntimeSettings[i].name) == name_length && memcmp(kRuntimeSettings[i].name, name, name_length) == 0) {
+      return &kRuntimeSettings[i];
+    }
+  }
+  return nullptr;
+}
+
+inline float get_runtime_setting(const RuntimeConfig& config, const RuntimeSetting& setting) {
+  const uint8_t* field = (const uint8_t*)&config + setting.offset;
+  switch (setting.type) {
+    case SettingType::kUint8: return *field;
+    case SettingType::kUint16: { uint16_t v; memcpy(&v, field, sizeof(v)); return v; }
+    case SettingType::kFloat: { float v; memcpy(&v, field, sizeof(v)); return v; }
+  }
+  return 0;
+}
+
+/**
+ * @brief Sets one setting of config.
+ *
+ * @return false (and config isn't changed) if value is out of the setting's range, or
+ * isn't a whole number for a whole-number setting
+ */
+
+inline bool set_runtime_setting(RuntimeConfig& config, const RuntimeSetting& setting, float value) {
+  if (!(value >= setting.min && value <= setting.max)) { // also catches NaN
+    return false;
+  }
+  uint8_t* field = (uint8_t*)&config + setting.offset;
+  switch (setting.type) {
+    case SettingType::kUint8:
+      if (value != (uint8_t)value) return false;
+      *field = (uint8_t)value;
+      return true;
+    case SettingType::kUint16: {
+      if (value != (uint16_t)value) return false;
+      uint16_t v = (uint16_t)value;
+      memcpy(field, &v, sizeof(v));
+      return true;
+    }
+    case SettingType::kFloat:
+      memcpy(field, &value, sizeof(value));
+      return true;
+  }
+  return false;
+}
+
+// True if the two configs put the radio on the same AT+PARAMETER settings
+inline bool same_radio_settings(const RuntimeConfig& a, const RuntimeConfig& b) {
+  return a.spread_factor == b.spread_factor && a.bandwidth == b.bandwidth && a.coding_rate == b.coding_rate
+         && a.preamble == b.preamble;
+}
+
+// True if every setting is in its range, and the settings make sense together
+inline bool runtime_config_valid(const RuntimeConfig& config) {
+  for (uint8_t i = 0; i < kRuntimeSettingCount; i++) {
+    RuntimeConfig copy = config;
+    if (!set_runtime_setting(copy, kRuntimeSettings[i], get_runtime_setting(config, kRuntimeSettings[i]))) {
+      return false;
+    }
+  }
+  return config.refill_start_volume < config.refill_stop_volume
+         && config.sleep_min_seconds <= config.sleep_seconds && config.sleep_seconds <= config.sleep_max_seconds;
+}
+
+// FNV-1a of the config, to check that the copy in RTC memory is intact
+inline uint32_t runtime_config_hash(const RuntimeConfig& config) {
+  const uint8_t* bytes = (const uint8_t*)&config;
+  uint32_t h = 2166136261UL;
+  for (size_t i = 0; i < sizeof(config); i++) {
+    h = (h ^ bytes[i]) * 16777619UL;
+  }
+  return h ? h : 1;
+}
+
+// The NVS key the settings are saved under
+const char* const kRuntimeConfigNvsKey = "config";
+
+/**
+ * @brief The settings in use, kept in RTC memory so NVS is only read on the first wake
+ * after a power-on or reset. hash == 0 means "not loaded yet".
+ */
+
+struct RuntimeConfigCache {
+  RuntimeConfig config;
+  uint32_t hash;
+};
+
+// One copy for the whole program (a function-local static, like log_sink())
+inline RuntimeConfigCache& runtime_config_cache() {
+  RTC_DATA_ATTR static RuntimeConfigCache cache;
+  return cache;
+}
+
+/**
+ * @brief The settings in use: the ones saved in NVS by the last downlink command, or the
+ * config.h values if there aren't any (or they don't pass runtime_config_valid()).
+ */
+
+inline const RuntimeConfig& runtime_config() {
+  RuntimeConfigCache& cache = runtime_config_cache();
+  if (cache.hash == 0 || cache.hash != runtime_config_hash(cache.config)) {
+    RuntimeConfig saved;
+    if (hal::nvs_read(kRuntimeConfigNvsKey, &saved, sizeof(saved)) && runtime_config_valid(saved)) {
+      cache.config = saved;
+    }
+    else {
+      cache.config = default_runtime_config();
+    }
+    cache.hash = runtime_config_hash(cache.config);
+  }
+  return cache.config;
+}
+
+/**
+ * @brief Makes config the settings in use, and saves it in NVS.
+ *
+ * @return false if config isn't valid (nothing changes), or it couldn't be saved (it's
+ * still used until the next power-on or reset)
+ */
+
+inline bool save_runtime_config(const RuntimeConfig& config) {
+  if (!runtime_config_valid(config)) {
+    return false;
+  }
+  RuntimeConfigCache& cache = runtime_config_cache();
+  cache.config = config;
+  cache.hash = runtime_config_hash(config);
+  return hal::nvs_write(kRuntimeConfigNvsKey, &config, sizeof(config));
+}
+
+#endif // _RUNTIME_CONFIG_H_
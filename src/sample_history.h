@@ -0,0 +1,314 @@
+#ifndef _SAMPLE_HISTORY_H_
+#define _SAMPLE_HISTORY_H_
+
+#include <stddef.h>
+#include <string.h>
+#include "hal.h"
+#include "config.h"
+#include "binary_payload.h"
+
+/**
+ * @brief The frame SampleHistory uploads: a series of water volume and pH readings,
+ * delta-encoded, in one AT+SEND.
+ *
+ *   byte 0     kHistoryFrameMarker
+ *   byte 1     Node ID: LORA_NODE_ADDRESS - LORA_BASE_STATION_ADDRESS
+ *   byte 2     number of samples
+ *   varint     age of the first (oldest) sample when the frame was built, in seconds
+ *   zig-zag    first sample's water volume, in 1/kHistoryWaterScale gallons
+ *   zig-zag    first sample's pH, in 1/kHistorypHScale
+ *   then for each sample after the first:
+ *     zig-zag  seconds since the sample before, minus the same for the sample before that
+ *              (the first interval is against 0), so a steady sample rate costs a byte
+ *     zig-zag  change in water volume since the sample before
+ *     zig-zag  change in pH
+ *
+ * A varint is 7 bits per byte, least significant first, with the high bit set on every
+ * byte but the last. A zig-zag is a signed number as a varint: 0, -1, 1, -2... go to 0,
+ * 1, 2, 3... so small changes either way take one byte. A steady tub is about 3 bytes per
+ * sample, against 8 for a raw timestamp and two int16s.
+ */
+
+const uint8_t kHistoryFrameMarker = 0xA1; // 0xA0 | format version 1
+const uint8_t kHistoryHeaderBytes = 3;
+const float kHistoryWaterScale = 100;
+const float kHistorypHScale = 100;
+const uint8_t kMaxHistorySampleBytes = 15; // three varints of up to 5 bytes
+
+inline uint32_t zigzag_encode(int32_t n) {
+  return ((uint32_t)n << 1) ^ (uint32_t)(n >> 31);
+}
+
+inline int32_t zigzag_decode(uint32_t z) {
+  return (int32_t)(z >> 1) ^ -(int32_t)(z & 1);
+}
+
+// Writes value as a varint at out; returns the number of bytes (1 - 5)
+inline uint8_t put_varint(uint8_t* out, uint32_t value) {
+  uint8_t length = 0;
+  while (value >= 0x80) {
+    out[length++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  out[length++] = (uint8_t)value;
+  return length;
+}
+
+// Reads a varint at data[*pos], and moves *pos past it. Returns false if it runs off the end.
+inline bool get_varint(const uint8_t* data, size_t length, size_t* pos, uint32_t* value) {
+  *value = 0;
+  for (uint8_t shift = 0; shift < 35 && *pos < length; shift += 7) {
+    uint8_t b = data[(*pos)++];
+    *value |= (uint32_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// A reading, quantized the way it's sent
+struct HistorySample {
+  uint32_t time_s;  // hal::rtc_seconds() when it was read
+  int16_t water;    // 1/kHistoryWaterScale gallons
+  int16_t pH;       // 1/kHistorypHScale
+};
+
+inline int16_t quantize_history_value(float value, float scale) {
+  float scaled = value * scale;
+  if (!(scaled > -32767)) return -32767; // (and NaN)
+  if (scaled > 32767) return 32767;
+  return (int16_t)(scaled < 0 ? scaled - 0.5f : scaled + 0.5f);
+}
+
+/**
+ * @brief Encodes count samples (oldest first) into a frame, as many as fit in max_length
+ * once it's escaped for the air (see escape_payload()).
+ *
+ * @param now_s hal::rtc_seconds() now, for the age of the first sample
+ * @param encoded Gets how many of the samples went in
+ * @return The frame's length, or 0 if not even one sample fits
+ */
+
+template <typename SampleAt>
+uint8_t encode_history_frame(SampleAt sample_at, uint8_t count, uint32_t now_s, uint8_t* frame,
+                             uint8_t max_length, uint8_t* encoded) {
+  *encoded = 0;
+  if (!count || max_length < 2 * (kHistoryHeaderBytes + kMaxHistorySampleBytes)) { // the first sample, all escaped
+    return 0;
+  }
+  frame[0] = kHistoryFrameMarker;
+  frame[1] = LORA_NODE_ADDRESS - LORA_BASE_STATION_ADDRESS;
+  frame[2] = 1;
+  uint8_t length = kHistoryHeaderBytes;
+  const HistorySample& first = sample_at(0);
+  length += put_varint(frame + length, now_s - first.time_s);
+  length += put_varint(frame + length, zigzag_encode(first.water));
+  length += put_varint(frame + length, zigzag_encode(first.pH));
+  size_t escaped = escaped_payload_length(frame, length); // (the final count might take 1 more)
+  uint8_t n = 1;
+  int32_t last_interval = 0;
+  for (; n < count; n++) {
+    const HistorySample& previous = sample_at(n - 1);
+    const HistorySample& sample = sample_at(n);
+    int32_t interval = (int32_t)(sample.time_s - previous.time_s);
+    uint8_t bytes[kMaxHistorySampleBytes];
+    uint8_t size = put_varint(bytes, zigzag_encode(interval - last_interval));
+    size += put_varint(bytes + size, zigzag_encode(sample.water - previous.water));
+    size += put_varint(bytes + size, zigzag_encode(sample.pH - previous.pH));
+    size_t escaped_size = escaped_payload_length(bytes, size);
+    if (escaped + escaped_size + 1 > max_length) {
+      break;
+    }
+    memcpy(frame + length, bytes, size);
+    length += size;
+    escaped += escaped_size;
+    last_interval = interval;
+  }
+  frame[2] = n;
+  *encoded = n;
+  return length;
+}
+
+/**
+ * @brief One sample of a decoded history frame.
+ */
+
+struct DecodedHistorySample {
+  uint32_t age_s;  // seconds before the frame was built
+  float water_volume;
+  float pH;
+};
+
+/**
+ * @brief Decodes a history frame (for the base station, or the host tools).
+ *
+ * @param node_address Gets the sender's LoRa address.
+ * @return The number of samples written to samples[], or -1 if the frame is malformed.
+ */
+
+inline int decode_history_frame(const uint8_t* data, size_t length, uint16_t base_station_address,
+                                uint16_t* node_address, DecodedHistorySample* samples, size_t max_samples) {
+  if (length < kHistoryHeaderBytes || data[0] != kHistoryFrameMarker || data[2] == 0 || data[2] > max_samples) {
+    return -1;
+  }
+  *node_address = base_station_address + data[1];
+  size_t pos = kHistoryHeaderBytes;
+  uint32_t age_s, interval_z, water_z, pH_z;
+  if (!get_varint(data, length, &pos, &age_s) || !get_varint(data, length, &pos, &water_z)
+      || !get_varint(data, length, &pos, &pH_z)) {
+    return -1;
+  }
+  int32_t water = zigzag_decode(water_z);
+  int32_t pH = zigzag_decode(pH_z);
+  int32_t interval = 0;
+  for (uint8_t i = 0; i < data[2]; i++) {
+    if (i > 0) {
+      if (!get_varint(data, length, &pos, &interval_z) || !get_varint(data, length, &pos, &water_z)
+          || !get_varint(data, length, &pos, &pH_z)) {
+        return -1;
+      }
+      interval += zigzag_decode(interval_z);
+      age_s -= interval;
+      water += zigzag_decode(water_z);
+      pH += zigzag_decode(pH_z);
+    }
+    samples[i].age_s = age_s;
+    samples[i].water_volume = water / kHistoryWaterScale;
+    samples[i].pH = pH / kHistorypHScale;
+  }
+  return pos == length ? data[2] : -1;
+}
+
+static_assert(HISTORY_MAX_SAMPLES >= 1 && HISTORY_MAX_SAMPLES <= 255, "HISTORY_MAX_SAMPLES must fit in the frame's count byte");
+
+struct SampleHistoryState {
+  HistorySample samples[HISTORY_MAX_SAMPLES];
+  uint8_t first;           // the oldest sample
+  uint8_t count;
+  uint32_t sleep_left_s;   // of the sleep between full wakes, after the current sample wake's
+  uint32_t dropped;        // samples overwritten before they were uploaded, since power on
+};
+
+/**
+ * @brief The samples not uploaded yet, kept in RTC memory so they survive deep sleep.
+ * A power-on or reset loses them.
+ */
+
+RTC_DATA_ATTR static SampleHistoryState sample_history_state;
+
+/**
+ * @brief SampleHistory keeps a series of water volume and pH readings, taken more often
+ * than the node talks to the base station, and uploads them in one frame (see
+ * kHistoryFrameMarker).
+ *
+ * The sleep between two full wakes is cut into sample wakes HISTORY_SAMPLE_SECONDS apart
+ * (and closer, where the caller needs a wake sooner: for the circulation pump, in main.cpp).
+ * A sample wake only reads the two ADC1 sensors, adds them here and goes back to sleep -
+ * it never turns the radio on. The full wakes add their own readings too. Once the oldest
+ * sample is HISTORY_UPLOAD_SECONDS old, or HISTORY_MAX_SAMPLES are kept, upload_due() says
+ * it's time to build_frame() and send it; then remove_oldest() the ones it took.
+ *
+ *   hal::deep_sleep(history.begin_sleep(sleep_s, max_s) * uS_TO_S_FACTOR);  // instead of sleep_s
+ *   ...
+ *   if (history.sample_wake()) {                                            // at the next wake
+ *     history.add(water_volume, pH);
+ *     hal::deep_sleep(history.next_sleep_s(max_s) * uS_TO_S_FACTOR);
+ *   }
+ */
+
+class SampleHistory {
+private:
+    SampleHistoryState& state_;
+
+public:
+    SampleHistory(SampleHistoryState& state = sample_history_state) : state_(state) {}
+
+    uint8_t count() const { return state_.count; }
+    uint32_t dropped() const { return state_.dropped; }
+
+    // i = 0 is the oldest sample
+    const HistorySample& sample(uint8_t i) const {
+        return state_.samples[(state_.first + i) % HISTORY_MAX_SAMPLES];
+    }
+
+    // Adds a reading, overwriting the oldest if the history is full
+    void add(float water_volume, float pH) {
+        if (state_.count == HISTORY_MAX_SAMPLES) {
+            state_.first = (state_.first + 1) % HISTORY_MAX_SAMPLES;
+            state_.count--;
+            state_.dropped++;
+        }
+        HistorySample& sample = state_.samples[(state_.first + state_.count) % HISTORY_MAX_SAMPLES];
+        sample.time_s = hal::rtc_seconds();
+        sample.water = quantize_history_value(water_volume, kHistoryWaterScale);
+        sample.pH = quantize_history_value(pH, kHistorypHScale);
+        state_.count++;
+    }
+
+    /**
+     * @brief Starts the sleep between two full wakes, of sleep_s in all.
+     *
+     * @param max_s The longest to sleep before the next wake, whatever the sample interval
+     * @return How long to sleep until the first sample wake (all of sleep_s, if
+     * HISTORY_SAMPLE_SECONDS is 0 and max_s is longer)
+     */
+
+    uint32_t begin_sleep(uint32_t sleep_s, uint32_t max_s = UINT32_MAX) {
+        state_.sleep_left_s = sleep_s;
+        return next_sleep_s(max_s);
+    }
+
+    // How long to sleep after this sample wake: until the next one, max_s, or the rest of the sleep
+    uint32_t next_sleep_s(uint32_t max_s = UINT32_MAX) {
+        uint32_t sleep_s = state_.sleep_left_s;
+        if (HISTORY_SAMPLE_SECONDS > 0 && sleep_s > HISTORY_SAMPLE_SECONDS) {
+            sleep_s = HISTORY_SAMPLE_SECONDS;
+        }
+        if (sleep_s > max_s) {
+            sleep_s = max_s;
+        }
+        state_.sleep_left_s -= sleep_s;
+        return sleep_s;
+    }
+
+    // Counts slept_s of the sleep as gone, for a sleep that isn't up to the history (a circulation pump run)
+    void count_sleep_s(uint32_t slept_s) {
+        state_.sleep_left_s = slept_s < state_.sleep_left_s ? state_.sleep_left_s - slept_s : 0;
+    }
+
+    // What's left of the sleep between two full wakes
+    uint32_t sleep_left_s() const { return state_.sleep_left_s; }
+
+    // True if this wake is a sample wake: there's more of the sleep to come
+    bool sample_wake() const { return state_.sleep_left_s > 0; }
+
+    // Gives up the rest of the sleep (the ULP woke the node early, say)
+    void end_sleep() { state_.sleep_left_s = 0; }
+
+    bool upload_due() const {
+        return state_.count == HISTORY_MAX_SAMPLES
+               || (state_.count && hal::rtc_seconds() - sample(0).time_s >= HISTORY_UPLOAD_SECONDS);
+    }
+
+    /**
+     * @brief Builds the frame described above kHistoryFrameMarker, with as many of the
+     * oldest samples as fit in max_length.
+     *
+     * @param encoded Gets how many samples went in: remove_oldest() them once it's sent
+     * @return Its length, or 0 if there are no samples
+     */
+
+    uint8_t build_frame(uint8_t* frame, uint8_t max_length, uint8_t* encoded) const {
+        return encode_history_frame([this](uint8_t i) -> const HistorySample& { return sample(i); },
+                                    state_.count, hal::rtc_seconds(), frame, max_length, encoded);
+    }
+
+    void remove_oldest(uint8_t n) {
+        if (n > state_.count) n = state_.count;
+        state_.first = (state_.first + n) % HISTORY_MAX_SAMPLES;
+        state_.count -= n;
+    }
+};
+
+#endif // _SAMPLE_HISTORY_H_
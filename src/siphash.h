@@ -0,0 +1,61 @@
+#ifndef _SIPHASH_H_
+#define _SIPHASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief SipHash-2-4 (Aumasson & Bernstein): a keyed 64-bit hash, made for authenticating
+ * short messages. Used as the tag on downlink commands (see downlink.h). It's a few
+ * dozen adds, rotates and xors per 8 bytes, so it costs nothing next to the radio.
+ *
+ * @param key 16 bytes
+ */
+
+inline uint64_t siphash24(const uint8_t* key, const uint8_t* data, size_t length) {
+  struct Local {
+    static uint64_t read64(const uint8_t* p) {
+      uint64_t v = 0;
+      for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+      return v;
+    }
+    static uint64_t rotl(uint64_t x, int b) { return (x << b) | (x >> (64 - b)); }
+    static void round(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3) {
+      v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+      v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+      v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+      v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+    }
+  };
+  uint64_t k0 = Local::read64(key);
+  uint64_t k1 = Local::read64(key + 8);
+  uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+  uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+  uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+  uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+  size_t whole = length - length % 8;
+  for (size_t i = 0; i < whole; i += 8) {
+    uint64_t m = Local::read64(data + i);
+    v3 ^= m;
+    Local::round(v0, v1, v2, v3);
+    Local::round(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+  uint64_t last = (uint64_t)(length & 0xFF) << 56;
+  for (size_t i = whole; i < length; i++) {
+    last |= (uint64_t)data[i] << (8 * (i - whole));
+  }
+  v3 ^= last;
+  Local::round(v0, v1, v2, v3);
+  Local::round(v0, v1, v2, v3);
+  v0 ^= last;
+
+  v2 ^= 0xFF;
+  for (int i = 0; i < 4; i++) {
+    Local::round(v0, v1, v2, v3);
+  }
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#endif // _SIPHASH_H_
@@ -0,0 +1,173 @@
+#ifndef _SLEEP_SCHEDULER_H_
+#define _SLEEP_SCHEDULER_H_
+
+#include <math.h>
+#include "hal.h"
+#include "config.h"
+#include "runtime_config.h"
+#include "report_policy.h"
+
+/**
+ * @brief The least-squares slope, per hour, of the readings in history taken at or after
+ * since_s (hal::rtc_seconds()).
+ *
+ * @return false if there aren't two such readings at least a minute apart
+ */
+
+inline bool reading_rate_per_hour(const ReadingHistory& history, uint32_t since_s, float* rate) {
+  if (history.count < 2) {
+    return false;
+  }
+  uint32_t newest_s = history.newest_time_s(0);
+  float sum_t = 0, sum_v = 0, sum_tt = 0, sum_tv = 0, oldest_t = 0;
+  uint8_t n = 0;
+  for (uint8_t i = 0; i < history.count && (int32_t)(history.newest_time_s(i) - since_s) >= 0; i++) {
+    float t = -(float)(newest_s - history.newest_time_s(i)) / 3600; // hours before the newest reading
+    float v = history.newest(i);
+    sum_t += t;
+    sum_v += v;
+    sum_tt += t * t;
+    sum_tv += t * v;
+    oldest_t = t;
+    n++;
+  }
+  if (n < 2 || oldest_t > -1.0f / 60) {
+    return false;
+  }
+  *rate = (n * sum_tv - sum_t * sum_v) / (n * sum_tt - sum_t * sum_t);
+  return true;
+}
+
+// What plan_sleep() decides from
+struct SleepInputs {
+  bool have_rates;        // false until there are enough readings to fit rates to
+  float water_volume;     // gallons, the latest reading
+  float water_rate;       // gallons per hour
+  float pH_rate;          // pH per hour
+  float battery_volts;    // the latest reading
+  bool fill_possible;     // an auto-fill would run if the water got down to refill_start
+};
+
+struct SleepPlan {
+  uint16_t sleep_s;
+  float activity;  // 0 = steady, 1 = changing fast; after the battery weight
+  bool fill_due;   // shortened so a reading catches the water reaching refill_start
+};
+
+// 0 at or below steady, 1 at or above fast, in a straight line in between
+inline float sleep_activity(float rate, float steady, float fast) {
+  float a = (fabsf(rate) - steady) / (fast - steady);
+  return a < 0 ? 0 : a > 1 ? 1 : a;
+}
+
+/**
+ * @brief Picks the sleep after each circulation pump run (the sleep TIME_TO_SLEEP used to
+ * be), between config's sleep_min_seconds and sleep_max_seconds. See the SLEEP_* settings
+ * in config.h for how.
+ *
+ * Readings are taken every other wake, so the one after this is two cycles (each a
+ * circulation pump run and a sleep) away: for a fill that's due, the sleep is cut to
+ * have that reading land before the water gets to refill_start.
+ */
+
+inline SleepPlan plan_sleep(const SleepInputs& in, const RuntimeConfig& config) {
+  SleepPlan plan = {config.sleep_seconds, 0, false};
+  if (!in.have_rates) {
+    return plan;
+  }
+  float activity = sleep_activity(in.water_rate, SLEEP_WATER_STEADY_GALLONS_PER_HOUR, SLEEP_WATER_FAST_GALLONS_PER_HOUR);
+  float pH_activity = sleep_activity(in.pH_rate, SLEEP_PH_STEADY_PER_HOUR, SLEEP_PH_FAST_PER_HOUR);
+  if (pH_activity > activity) activity = pH_activity;
+  float battery = (in.battery_volts - LOW_VOLTAGE_ALARM_VALUE) / (SLEEP_BATTERY_OK_VOLTS - LOW_VOLTAGE_ALARM_VALUE);
+  battery = battery < 0 ? 0 : battery > 1 ? 1 : battery;
+  plan.activity = activity * (SLEEP_LOW_BATTERY_WEIGHT + (1 - SLEEP_LOW_BATTERY_WEIGHT) * battery);
+
+  float sleep_s = config.sleep_max_seconds - (config.sleep_max_seconds - config.sleep_min_seconds) * plan.activity;
+  if (in.fill_possible && in.water_rate < 0 && in.water_volume > config.refill_start_volume) {
+    float refill_in_s = (in.water_volume - config.refill_start_volume) / -in.water_rate * 3600;
+    float latest_s = refill_in_s / 2 - config.circ_pump_seconds;
+    if (latest_s < sleep_s) {
+      sleep_s = latest_s;
+      plan.fill_due = true;
+    }
+  }
+  if (sleep_s < config.sleep_min_seconds) sleep_s = config.sleep_min_seconds;
+  if (sleep_s > config.sleep_max_seconds) sleep_s = config.sleep_max_seconds;
+  plan.sleep_s = (uint16_t)(sleep_s + 0.5f);
+  return plan;
+}
+
+struct SleepSchedulerState {
+  uint16_t sleep_s;     // from the last plan; 0 = no plan yet
+  uint32_t fill_end_s;  // when the last auto-fill ended (hal::rtc_seconds())
+};
+
+/**
+ * @brief The plan, kept in RTC memory so it's used until the next reading. A power-on or
+ * reset clears it, and the readings it was made from.
+ */
+
+RTC_DATA_ATTR static SleepSchedulerState sleep_scheduler_state;
+
+/**
+ * @brief SleepScheduler makes a plan_sleep() from the readings ReportPolicy keeps, at each
+ * wake that takes them, and says how long to sleep until the next plan.
+ *
+ *   SleepPlan plan = sleep_scheduler.plan(report_policy, fill_possible); // after the readings
+ *   ...
+ *   hal::deep_sleep(sleep_scheduler.sleep_seconds() * uS_TO_S_FACTOR);   // after the circ pump run
+ */
+
+class SleepScheduler {
+private:
+    SleepSchedulerState& state_;
+
+public:
+    SleepScheduler(SleepSchedulerState& state = sleep_scheduler_state) : state_(state) {}
+
+    // The sleep after a circulation pump run: the last plan's, or runtime_config().sleep_seconds before there is one
+    uint32_t sleep_seconds() const {
+        const RuntimeConfig& config = runtime_config();
+        if (!state_.sleep_s) {
+            return config.sleep_seconds;
+        }
+        // (the bounds may have been changed by a downlink command since)
+        if (state_.sleep_s < config.sleep_min_seconds) return config.sleep_min_seconds;
+        if (state_.sleep_s > config.sleep_max_seconds) return config.sleep_max_seconds;
+        return state_.sleep_s;
+    }
+
+    // Call when an auto-fill ends: the water volume readings from before it don't say how fast it's changing now
+    void fill_ended() {
+        state_.fill_end_s = hal::rtc_seconds();
+    }
+
+    /**
+     * @brief Plans the sleep from the readings in policy's history: the rates over the last
+     * SLEEP_RATE_WINDOW_SECONDS (since the last fill, for the water volume), and the latest
+     * water volume and battery voltage.
+     *
+     * @param fill_possible An auto-fill would run if the water got down to refill_start
+     */
+
+    SleepPlan plan(const ReportPolicy& policy, bool fill_possible) {
+        uint32_t now_s = hal::rtc_seconds();
+        uint32_t since_s = now_s > SLEEP_RATE_WINDOW_SECONDS ? now_s - SLEEP_RATE_WINDOW_SECONDS : 0;
+        uint32_t water_since_s = (int32_t)(state_.fill_end_s - since_s) > 0 ? state_.fill_end_s : since_s;
+        const ReadingHistory& water = policy.history(PayloadField::kWaterVolume);
+        const ReadingHistory& voltage = policy.history(PayloadField::kVoltage);
+        SleepInputs in;
+        in.water_rate = 0;
+        in.pH_rate = 0;
+        in.have_rates = reading_rate_per_hour(water, water_since_s, &in.water_rate);
+        reading_rate_per_hour(policy.history(PayloadField::kpH), since_s, &in.pH_rate);
+        in.water_volume = water.count ? water.newest(0) : 0;
+        in.battery_volts = voltage.count ? voltage.newest(0) : SLEEP_BATTERY_OK_VOLTS;
+        in.fill_possible = fill_possible;
+        SleepPlan plan = plan_sleep(in, runtime_config());
+        state_.sleep_s = in.have_rates ? plan.sleep_s : 0;
+        return plan;
+    }
+};
+
+#endif // _SLEEP_SCHEDULER_H_
@@ -0,0 +1,107 @@
+#ifndef _ULP_WATCHDOG_H_
+#define _ULP_WATCHDOG_H_
+
+#include "hal.h"
+#include "config.h"
+#include "fixed_string.h"
+#include "log.h"
+#include "water_volume_sensor.h"
+
+// The ULP's wake and clear levels, in mV at the eTape pin (worked out at compile time)
+constexpr float kUlpHighWater_mV = kWaterVolumeCurve.invert(ULP_WAKE_HIGH_WATER_GALLONS);
+constexpr float kUlpHighWaterClear_mV = kWaterVolumeCurve.invert(ULP_WAKE_HIGH_WATER_GALLONS - ULP_WAKE_HYSTERESIS_GALLONS);
+constexpr float kUlpLowWater_mV = kWaterVolumeCurve.invert(ULP_WAKE_LOW_WATER_GALLONS);
+constexpr float kUlpLowWaterClear_mV = kWaterVolumeCurve.invert(ULP_WAKE_LOW_WATER_GALLONS + ULP_WAKE_HYSTERESIS_GALLONS);
+static_assert(ULP_WAKE_LOW_WATER_GALLONS + ULP_WAKE_HYSTERESIS_GALLONS
+              < ULP_WAKE_HIGH_WATER_GALLONS - ULP_WAKE_HYSTERESIS_GALLONS,
+              "the ULP's low and high water levels overlap");
+
+// Name of one of the hal::kUlp* conditions
+inline const char* ulp_condition_name(uint16_t condition) {
+  switch (condition) {
+    case hal::kUlpFloatSwitch: return "FL-SW";
+    case hal::kUlpHighWater: return "high water";
+    case hal::kUlpLowWater: return "low water";
+  }
+  return "?";
+}
+
+/**
+ * @brief UlpWatchdog keeps an eye on the tub while the ESP32 is in deep sleep. The ULP
+ * coprocessor samples the float switch and the water level every ULP_WATCHDOG_PERIOD_MS,
+ * and wakes the main cores only if the float switch comes up, or the water goes above
+ * ULP_WAKE_HIGH_WATER_GALLONS or below ULP_WAKE_LOW_WATER_GALLONS (for
+ * ULP_WATCHDOG_DEBOUNCE_SAMPLES samples in a row). An overflow is then measured and
+ * reported within seconds, instead of at the next timer wake. Once a level has woken the
+ * chip, it has to come back by ULP_WAKE_HYSTERESIS_GALLONS before it can do it again.
+ *
+ * Call begin() first thing in setup(): it stops the ULP, gives the float switch pin back,
+ * and works out whether the ULP woke the chip. Call arm() just before every deep sleep.
+ */
+
+class UlpWatchdog {
+private:
+    hal::UlpWatchConfig config_;
+    hal::UlpWatchState state_ = {};
+    bool woke_ = false;
+
+public:
+    /**
+     * @param float_switch_pin An RTC GPIO
+     * @param water_volume_pin An ADC1 pin (GPIO 32 - 39)
+     */
+
+    UlpWatchdog(uint8_t float_switch_pin, uint8_t water_volume_pin) {
+        config_.float_switch_pin = float_switch_pin;
+        // A pin that isn't on ADC1 is left as an invalid channel, and arm() fails
+        config_.adc1_channel = (uint8_t)hal::adc1_channel(water_volume_pin); // -1 -> 0xFF
+        config_.high_raw = 0; // set by arm()
+        config_.high_clear_raw = 0;
+        config_.low_raw = 0;
+        config_.low_clear_raw = 0;
+        config_.debounce_samples = ULP_WATCHDOG_DEBOUNCE_SAMPLES;
+        config_.period_ms = ULP_WATCHDOG_PERIOD_MS;
+    }
+
+    void begin() {
+        state_ = hal::ulp_watch_stop(config_);
+        woke_ = (hal::wake_cause() == hal::WakeCause::kUlp);
+        if (LOG_ENABLED(LOG_LEVEL_INFO) && woke_) {
+            FixedString<64> line("Woken by the ULP:");
+            for (uint16_t condition = 1; condition <= hal::kUlpAllConditions; condition <<= 1) {
+                if (state_.reason & condition) line.append(' ').append(ulp_condition_name(condition));
+            }
+            line.append(" (raw water level ").append_uint(state_.last_raw).append(')');
+            LOG_INFO(line.c_str());
+        }
+    }
+
+    // True if the ULP ended the last deep sleep
+    bool woke() const { return woke_; }
+
+    // The hal::kUlp* conditions that woke the chip
+    uint16_t reason() const { return woke_ ? state_.reason : 0; }
+
+    /**
+     * @brief Starts the ULP for the coming deep sleep. A condition that's already true
+     * (a float switch that's up, and has been reported) only wakes the chip once it has
+     * cleared and come back.
+     *
+     * @param circ_pump_running The circulation pump will run during this sleep. Some of the
+     * water is up in the tower then, so low water isn't watched for.
+     */
+
+    bool arm(bool circ_pump_running) {
+        config_.high_raw = hal::adc1_raw_for_mV((uint32_t)kUlpHighWater_mV);
+        config_.high_clear_raw = hal::adc1_raw_for_mV((uint32_t)kUlpHighWaterClear_mV);
+        config_.low_raw = circ_pump_running ? 0 : hal::adc1_raw_for_mV((uint32_t)kUlpLowWater_mV);
+        config_.low_clear_raw = circ_pump_running ? 0 : hal::adc1_raw_for_mV((uint32_t)kUlpLowWaterClear_mV);
+        if (!hal::ulp_watch_start(config_)) {
+            LOG_ERROR("ULP watchdog could not be started");
+            return false;
+        }
+        return true;
+    }
+};
+
+#endif // _ULP_WATCHDOG_H_
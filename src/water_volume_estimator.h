@@ -0,0 +1,163 @@
+#ifndef _WATER_VOLUME_ESTIMATOR_H_
+#define _WATER_VOLUME_ESTIMATOR_H_
+
+#include <math.h>
+#include <string.h>
+#include "hal.h"
+#include "config.h"
+#include "water_volume_sensor.h"
+
+/**
+ * @brief The estimate and its covariance, kept in RTC memory so each wake starts from what
+ * the last one knew. The state is [volume (gallons), use rate (gallons per hour, + =
+ * filling), fill pump flow (gallons per minute)]. A power-on or reset clears it (valid =
+ * false), and the next reading starts it again.
+ */
+
+struct WaterVolumeEstimatorState {
+  float x[3];
+  float P[3][3];
+  uint32_t time_s;  // hal::rtc_seconds() the estimate is for
+  bool valid;
+};
+
+RTC_DATA_ATTR static WaterVolumeEstimatorState water_volume_estimator_state;
+
+/**
+ * @brief WaterVolumeEstimator is a Kalman filter for the water in the tub. It predicts the
+ * volume from the time since the last reading, at the use rate it has learned, plus the
+ * fill pump's on-time at the flow it has learned, and corrects that with each eTape reading,
+ * weighted by how noisy the reading was. So:
+ *
+ * - a reading doesn't have to be as precise on its own: sample_tolerance_mV() says how
+ *   loose it can be, given how well the volume is already known
+ * - the fill decision and the reported volume follow the estimate, not one noisy reading,
+ *   so they don't flap when the water is close to REFILL_START_VOLUME
+ * - the volume a fill added comes with a standard deviation
+ *
+ * A reading more than WATER_VOLUME_OUTLIER_SIGMAS off the prediction is something the
+ * model can't know about - a hand fill, a harvest, a leak - and restarts the volume from
+ * that reading.
+ *
+ *   water_volume_estimator.predict(0);
+ *   water_volume_estimator.update(sensor.reported_water_volume(water_volume_estimator.sample_tolerance_mV()),
+ *                                 sensor.last_reading_variance());
+ *   float gallons = water_volume_estimator.volume();
+ */
+
+class WaterVolumeEstimator {
+private:
+    WaterVolumeEstimatorState& state_;
+
+    // The estimate before any reading has corrected the rates
+    void start(float reading, float variance) {
+        memset(&state_, 0, sizeof(state_));
+        state_.x[0] = reading;
+        state_.x[1] = 0;
+        state_.x[2] = FILL_PUMP_GALLONS_PER_MINUTE;
+        state_.P[0][0] = variance;
+        state_.P[1][1] = WATER_VOLUME_START_RATE_SIGMA_GPH * WATER_VOLUME_START_RATE_SIGMA_GPH;
+        state_.P[2][2] = FILL_PUMP_START_SIGMA_GPM * FILL_PUMP_START_SIGMA_GPM;
+        state_.time_s = hal::rtc_seconds();
+        state_.valid = true;
+    }
+
+public:
+    WaterVolumeEstimator(WaterVolumeEstimatorState& state = water_volume_estimator_state) : state_(state) {}
+
+    bool valid() const { return state_.valid; }
+    float volume() const { return state_.x[0]; }
+    float volume_sigma() const { return sqrtf(state_.P[0][0]); }
+    float use_rate_gph() const { return state_.x[1]; }
+    float fill_rate_gpm() const { return state_.x[2]; }
+
+    /**
+     * @brief Moves the estimate on to now: the use rate for the time since the last
+     * predict() or update(), and the fill pump's flow for pump_seconds. The uncertainty
+     * grows with both.
+     */
+
+    void predict(float pump_seconds) {
+        if (!state_.valid) {
+            return;
+        }
+        uint32_t now_s = hal::rtc_seconds();
+        float dt_h = (now_s - state_.time_s) / 3600.0f;
+        float pump_min = pump_seconds / 60;
+        state_.time_s = now_s;
+        // x = F x, with F = [1 dt_h pump_min; 0 1 0; 0 0 1]
+        float (&P)[3][3] = state_.P;
+        state_.x[0] += state_.x[1] * dt_h + state_.x[2] * pump_min;
+        // P = F P F' + Q: only row and column 0 change
+        float FP[3];
+        for (uint8_t j = 0; j < 3; j++) {
+            FP[j] = P[0][j] + dt_h * P[1][j] + pump_min * P[2][j];
+        }
+        P[0][0] = FP[0] + dt_h * FP[1] + pump_min * FP[2];
+        P[0][1] = P[1][0] = FP[1];
+        P[0][2] = P[2][0] = FP[2];
+        const float kVolumeQ = WATER_VOLUME_PROCESS_SIGMA_GALLONS * WATER_VOLUME_PROCESS_SIGMA_GALLONS;
+        const float kRateQ = WATER_VOLUME_RATE_SIGMA_GPH * WATER_VOLUME_RATE_SIGMA_GPH;
+        const float kFlowQ = FILL_PUMP_FLOW_SIGMA_GPM * FILL_PUMP_FLOW_SIGMA_GPM;
+        P[0][0] += kVolumeQ * dt_h;
+        P[1][1] += kRateQ * dt_h;
+        P[2][2] += kFlowQ * pump_min;
+    }
+
+    /**
+     * @brief Corrects the estimate with a reading (predict() it to now first).
+     *
+     * @param variance The reading's, in gallons^2 (WaterVolumeSensor::last_reading_variance())
+     * @return false if the reading was an outlier, and the volume was restarted from it
+     */
+
+    bool update(float reading, float variance) {
+        if (!state_.valid) {
+            start(reading, variance);
+            return true;
+        }
+        float (&P)[3][3] = state_.P;
+        float innovation = reading - state_.x[0];
+        float S = P[0][0] + variance;
+        if (innovation * innovation > WATER_VOLUME_OUTLIER_SIGMAS * WATER_VOLUME_OUTLIER_SIGMAS * S) {
+            // The volume jumped; the rates it has learned still hold
+            state_.x[0] = reading;
+            P[0][0] = variance;
+            P[0][1] = P[1][0] = P[0][2] = P[2][0] = 0;
+            return false;
+        }
+        float K[3] = {P[0][0] / S, P[1][0] / S, P[2][0] / S};
+        float P0[3] = {P[0][0], P[0][1], P[0][2]};
+        for (uint8_t i = 0; i < 3; i++) {
+            state_.x[i] += K[i] * innovation;
+            for (uint8_t j = 0; j < 3; j++) {
+                P[i][j] -= K[i] * P0[j];
+            }
+        }
+        if (state_.x[2] < 0) { // a fill that timed out with a dry reservoir says nothing about the pump
+            state_.x[2] = 0;
+        }
+        return true;
+    }
+
+    /**
+     * @brief How far from the mean the next reading's samples may be left (95% confidence,
+     * see SamplingPolicy): the volume is already known to volume_sigma(), so a reading much
+     * more precise than that adds little. Between WATER_VOLUME_SAMPLE_TOLERANCE_MV and
+     * WATER_VOLUME_MAX_TOLERANCE_MV.
+     */
+
+    float sample_tolerance_mV() const {
+        if (!state_.valid) {
+            return WATER_VOLUME_SAMPLE_TOLERANCE_MV;
+        }
+        float mV = kWaterVolumeCurve.invert(state_.x[0]);
+        float gallons_per_mV = kWaterVolumeCurve.convert(mV + 0.5f) - kWaterVolumeCurve.convert(mV - 0.5f);
+        float tolerance_mV = 1.96f * volume_sigma() / gallons_per_mV;
+        if (tolerance_mV < WATER_VOLUME_SAMPLE_TOLERANCE_MV) return WATER_VOLUME_SAMPLE_TOLERANCE_MV;
+        if (tolerance_mV > WATER_VOLUME_MAX_TOLERANCE_MV) return WATER_VOLUME_MAX_TOLERANCE_MV;
+        return tolerance_mV;
+    }
+};
+
+#endif // _WATER_VOLUME_ESTIMATOR_H_
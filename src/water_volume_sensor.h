@@ -1,19 +1,26 @@
 #ifndef _WATER_LEVEL_SENSOR_H_
 #define _WATER_LEVEL_SENSOR_H_
 
-#include "Arduino.h"
+#include "hal.h"
 #include "config.h"
 #include "analog_reader.h"
+#include "calibration_curve.h"
+
+constexpr CalibrationPoint kWaterVolumeCalibration[] = {WATER_VOLUME_CALIBRATION_POINTS};
+static_assert(calibration_is_valid(kWaterVolumeCalibration),
+              "WATER_VOLUME_CALIBRATION_POINTS must be in increasing mV order, with gallons increasing too");
+constexpr CalibrationCurve<sizeof(kWaterVolumeCalibration) / sizeof(CalibrationPoint)>
+    kWaterVolumeCurve(kWaterVolumeCalibration);
 
 class WaterVolumeSensor {
 private:
-    uint8_t data_pin_;
     ESP32AnalogReader analog_reader_;
+    ReadingStats last_reading_;
 
 public:
-    // Constructor for the water volume sensor instance. 
-    WaterVolumeSensor(uint8_t pin) : data_pin_{pin}, analog_reader_(data_pin_) 
-    {}
+    // Constructor for the water volume sensor instance. Give it an AdcSampler to sample it together with other ADC1 pins.
+    template <uint8_t kPin>
+    explicit WaterVolumeSensor(AdcPin<kPin> pin, AdcSampler* sampler = nullptr) : analog_reader_(pin, sampler) {}
 
     /**
      * @brief Gets an averaged mV reading from the sensor, then converts
@@ -25,12 +32,33 @@ public:
      * can be converted to the water volume.
      * 
      * However, it's just as simple to convert the measured voltage to gallons, w/o converting to ohms,
-     * then inches, then gallons, so this function takes the simpler approach.
+     * then inches, then gallons, so this function takes the simpler approach: it looks the mV
+     * up in WATER_VOLUME_CALIBRATION_POINTS (config.h).
+     *
+     * @param tolerance_mV How precise the mean of the samples has to be (see SamplingPolicy):
+     * WaterVolumeEstimator::sample_tolerance_mV() lets it be looser when the volume is
+     * already well known. (With an AdcSampler, the number of samples is fixed.)
+     */
+    float reported_water_volume(float tolerance_mV = WATER_VOLUME_SAMPLE_TOLERANCE_MV) {
+        const SamplingPolicy kPolicy = {5, 20, 50, tolerance_mV, SampleEstimator::kMean};
+        float measured_mV = analog_reader_.read_adaptive_mV(kPolicy, &last_reading_);
+        return kWaterVolumeCurve.convert(measured_mV);
+    }
+
+    // Samples and variance of the last reported_water_volume()
+    const ReadingStats& last_reading_stats() const { return last_reading_; }
+
+    /**
+     * @brief The variance of the last reported_water_volume(), in gallons^2: the mean's, from
+     * the spread of its samples, plus WATER_VOLUME_READING_SIGMA_GALLONS for the noise that
+     * averaging doesn't take out.
      */
-    float reported_water_volume() {
-        float measured_voltage = analog_reader_.read_avg_mV(20, 50) / 1000;
-        float calculated_gallons = ((measured_voltage - LOWEST_MEASURED_VOLTAGE) / VOLTS_PER_GALLON) + LOWEST_MEASURED_GALLONS;
-        return calculated_gallons;
+    float last_reading_variance() const {
+        float mV = last_reading_.value_mV;
+        float gallons_per_mV = kWaterVolumeCurve.convert(mV + 0.5f) - kWaterVolumeCurve.convert(mV - 0.5f);
+        float mean_variance_mV2 = last_reading_.samples ? last_reading_.variance_mV2 / last_reading_.samples : 0;
+        return mean_variance_mV2 * gallons_per_mV * gallons_per_mV
+               + WATER_VOLUME_READING_SIGMA_GALLONS * WATER_VOLUME_READING_SIGMA_GALLONS;
     }
 };
 